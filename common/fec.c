@@ -0,0 +1,154 @@
+#include "fec.h"
+
+#include <string.h>
+
+/* GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, generator 2 */
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+void fec_init(void) {
+  unsigned int x = 1;
+  for (unsigned int i = 0; i < 255; ++i) {
+    gf_exp[i] = (uint8_t)x;
+    gf_exp[i + 255] = (uint8_t)x;
+    gf_log[x] = (uint8_t)i;
+    x <<= 1;
+    if (x & 0x100u) {
+      x ^= 0x11du;
+    }
+  }
+  gf_exp[510] = gf_exp[0];
+  gf_exp[511] = gf_exp[1];
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_div(uint8_t a, uint8_t b) {
+  if (a == 0) {
+    return 0;
+  }
+  return gf_exp[gf_log[a] + 255u - gf_log[b]];
+}
+
+uint32_t fec_group_count(uint32_t chunk_count, uint32_t group_size) {
+  if (group_size == 0) {
+    return 0;
+  }
+  return (chunk_count + group_size - 1) / group_size;
+}
+
+uint32_t fec_group_members(uint32_t chunk_count, uint32_t group_count,
+                           uint32_t group) {
+  if (group >= chunk_count) {
+    return 0;
+  }
+  return (chunk_count - group + group_count - 1) / group_count;
+}
+
+uint8_t fec_coef(uint32_t row, uint32_t pos) {
+  /* Cauchy matrix 1 / (x_pos + y_row) with x_pos = pos, y_row = 255 - row,
+   * columns scaled so row 0 is all ones. Scaling keeps every square
+   * submatrix invertible, so any parity rows can stand in for any lost
+   * chunks. */
+  uint8_t x = (uint8_t)pos;
+  return gf_div((uint8_t)(x ^ 255u), (uint8_t)(x ^ (255u - row)));
+}
+
+void fec_accumulate(uint8_t *parity, const uint8_t *data, size_t len,
+                    uint8_t coef) {
+  if (coef == 0) {
+    return;
+  }
+
+  size_t i = 0;
+  if (coef == 1) {
+    for (; i + 8 <= len; i += 8) {
+      uint64_t a;
+      uint64_t b;
+      memcpy(&a, parity + i, sizeof(a));
+      memcpy(&b, data + i, sizeof(b));
+      a ^= b;
+      memcpy(parity + i, &a, sizeof(a));
+    }
+    for (; i < len; ++i) {
+      parity[i] ^= data[i];
+    }
+    return;
+  }
+
+  uint8_t table[256];
+  for (unsigned int v = 0; v < 256; ++v) {
+    table[v] = gf_mul(coef, (uint8_t)v);
+  }
+  for (; i < len; ++i) {
+    parity[i] ^= table[data[i]];
+  }
+}
+
+int fec_solve(uint8_t *const *syndromes, const uint32_t *rows,
+              const uint32_t *positions, uint32_t count, size_t len,
+              uint8_t *const *out) {
+  if (count == 0 || count > FEC_MAX_PARITY) {
+    return -1;
+  }
+
+  /* Invert the count x count matrix of coefficients by Gauss-Jordan */
+  uint8_t m[FEC_MAX_PARITY][FEC_MAX_PARITY];
+  uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+  for (uint32_t r = 0; r < count; ++r) {
+    for (uint32_t c = 0; c < count; ++c) {
+      m[r][c] = fec_coef(rows[r], positions[c]);
+      inv[r][c] = r == c ? 1 : 0;
+    }
+  }
+
+  for (uint32_t col = 0; col < count; ++col) {
+    uint32_t pivot = col;
+    while (pivot < count && m[pivot][col] == 0) {
+      pivot++;
+    }
+    if (pivot == count) {
+      return -1;
+    }
+    if (pivot != col) {
+      for (uint32_t c = 0; c < count; ++c) {
+        uint8_t t = m[col][c];
+        m[col][c] = m[pivot][c];
+        m[pivot][c] = t;
+        t = inv[col][c];
+        inv[col][c] = inv[pivot][c];
+        inv[pivot][c] = t;
+      }
+    }
+
+    uint8_t scale = gf_div(1, m[col][col]);
+    for (uint32_t c = 0; c < count; ++c) {
+      m[col][c] = gf_mul(m[col][c], scale);
+      inv[col][c] = gf_mul(inv[col][c], scale);
+    }
+
+    for (uint32_t r = 0; r < count; ++r) {
+      uint8_t f = m[r][col];
+      if (r == col || f == 0) {
+        continue;
+      }
+      for (uint32_t c = 0; c < count; ++c) {
+        m[r][c] ^= gf_mul(f, m[col][c]);
+        inv[r][c] ^= gf_mul(f, inv[col][c]);
+      }
+    }
+  }
+
+  for (uint32_t k = 0; k < count; ++k) {
+    memset(out[k], 0, len);
+    for (uint32_t r = 0; r < count; ++r) {
+      fec_accumulate(out[k], syndromes[r], len, inv[k][r]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef WLCAST_FEC_H
+#define WLCAST_FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Limits of the code: group + parity must stay below the 256 field elements */
+#define FEC_MAX_GROUP 64
+#define FEC_MAX_PARITY 4
+
+/**
+ * Erasure code over the chunks of one frame.
+ *
+ * Data chunk i belongs to group i % group_count at position i / group_count,
+ * so a burst of consecutive losses is spread over several groups. Each group
+ * gets parity_count parity chunks; parity row j is the sum over the group of
+ * fec_coef(j, pos) * chunk in GF(2^8). Row 0 has every coefficient equal to
+ * 1, i.e. plain XOR parity; further rows make it a Reed-Solomon (Cauchy)
+ * code, which can rebuild as many lost chunks per group as parity chunks
+ * arrived. Chunks shorter than the parity are treated as zero-padded.
+ */
+
+/* Build the field tables. Call once before any other fec_* function. */
+void fec_init(void);
+
+/* Number of groups for chunk_count data chunks and groups of up to
+ * group_size chunks */
+uint32_t fec_group_count(uint32_t chunk_count, uint32_t group_size);
+
+/* Number of data chunks in group of group_count */
+uint32_t fec_group_members(uint32_t chunk_count, uint32_t group_count,
+                           uint32_t group);
+
+/* Coefficient of the chunk at pos in parity row */
+uint8_t fec_coef(uint32_t row, uint32_t pos);
+
+/* parity ^= coef * data over len bytes */
+void fec_accumulate(uint8_t *parity, const uint8_t *data, size_t len,
+                    uint8_t coef);
+
+/* Rebuild count lost chunks of one group. syndromes[k] holds parity row
+ * rows[k] with the contribution of every received chunk already removed
+ * (fec_accumulate with the same coefficients); the chunk at positions[k]
+ * is written to out[k]. All buffers are len bytes. Returns 0 or -1. */
+int fec_solve(uint8_t *const *syndromes, const uint32_t *rows,
+              const uint32_t *positions, uint32_t count, size_t len,
+              uint8_t *const *out);
+
+#endif
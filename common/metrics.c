@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define METRICS_INTERVAL_MS 1000
+
+enum metric_type {
+  METRIC_COUNTER,
+  METRIC_GAUGE,
+  METRIC_HISTOGRAM,
+};
+
+struct metric {
+  const char *name;
+  const char *help;
+  enum metric_type type;
+  /* Counter value, or the bits of a gauge's double */
+  atomic_uint_least64_t value;
+  /* Histogram */
+  const double *bounds;
+  int bound_count;
+  atomic_uint_least64_t buckets[METRICS_MAX_BUCKETS + 1]; /* Last is +Inf */
+  atomic_uint_least64_t sum_bits;
+};
+
+struct metrics_state {
+  pthread_mutex_t lock; /* Registration */
+  struct metric metrics[METRICS_MAX];
+  atomic_int count;
+
+  char *path;
+  char *tmp_path;
+  int listen_fd; /* -1 when writing a file */
+  pthread_t thread;
+  atomic_int running;
+};
+
+static struct metrics_state g_metrics = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .listen_fd = -1,
+};
+
+static uint64_t double_bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static double bits_double(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static struct metric *register_metric(const char *name, const char *help,
+                                      enum metric_type type,
+                                      const double *bounds, int bound_count) {
+  pthread_mutex_lock(&g_metrics.lock);
+  int count = atomic_load(&g_metrics.count);
+  for (int i = 0; i < count; ++i) {
+    struct metric *m = &g_metrics.metrics[i];
+    if (strcmp(m->name, name) == 0) {
+      pthread_mutex_unlock(&g_metrics.lock);
+      return m->type == type ? m : NULL;
+    }
+  }
+  if (count == METRICS_MAX) {
+    pthread_mutex_unlock(&g_metrics.lock);
+    fprintf(stderr, "metrics: table full, not exporting %s\n", name);
+    return NULL;
+  }
+  struct metric *m = &g_metrics.metrics[count];
+  m->name = name;
+  m->help = help;
+  m->type = type;
+  m->bounds = bounds;
+  m->bound_count = bound_count;
+  /* Publish only once filled in; the exporter reads without the lock */
+  atomic_store_explicit(&g_metrics.count, count + 1, memory_order_release);
+  pthread_mutex_unlock(&g_metrics.lock);
+  return m;
+}
+
+struct metric *metrics_counter(const char *name, const char *help) {
+  return register_metric(name, help, METRIC_COUNTER, NULL, 0);
+}
+
+struct metric *metrics_gauge(const char *name, const char *help) {
+  return register_metric(name, help, METRIC_GAUGE, NULL, 0);
+}
+
+struct metric *metrics_histogram(const char *name, const char *help,
+                                 const double *bounds, int bound_count) {
+  if (bound_count < 0 || bound_count > METRICS_MAX_BUCKETS) {
+    fprintf(stderr, "metrics: %s has too many buckets\n", name);
+    return NULL;
+  }
+  return register_metric(name, help, METRIC_HISTOGRAM, bounds, bound_count);
+}
+
+void metric_add(struct metric *m, uint64_t n) {
+  if (m) {
+    atomic_fetch_add_explicit(&m->value, n, memory_order_relaxed);
+  }
+}
+
+void metric_set(struct metric *m, double value) {
+  if (m) {
+    atomic_store_explicit(&m->value, double_bits(value), memory_order_relaxed);
+  }
+}
+
+void metric_observe(struct metric *m, double value) {
+  if (!m) {
+    return;
+  }
+  int i = 0;
+  while (i < m->bound_count && value > m->bounds[i]) {
+    ++i;
+  }
+  atomic_fetch_add_explicit(&m->buckets[i], 1u, memory_order_relaxed);
+
+  uint64_t old = atomic_load_explicit(&m->sum_bits, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(
+      &m->sum_bits, &old, double_bits(bits_double(old) + value),
+      memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+/* === Export === */
+
+static void write_metric(FILE *out, struct metric *m) {
+  static const char *const type_names[] = {"counter", "gauge", "histogram"};
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name,
+          type_names[m->type]);
+
+  switch (m->type) {
+    case METRIC_COUNTER:
+      fprintf(out, "%s %llu\n", m->name,
+              (unsigned long long)atomic_load(&m->value));
+      break;
+    case METRIC_GAUGE:
+      fprintf(out, "%s %.17g\n", m->name, bits_double(atomic_load(&m->value)));
+      break;
+    case METRIC_HISTOGRAM: {
+      /* Buckets are stored individually; Prometheus wants them cumulative.
+       * Concurrent observations can make _count and _sum differ by one
+       * sample, which scrapers tolerate. */
+      unsigned long long cumulative = 0;
+      for (int i = 0; i <= m->bound_count; ++i) {
+        cumulative += atomic_load(&m->buckets[i]);
+        if (i < m->bound_count) {
+          fprintf(out, "%s_bucket{le=\"%.15g\"} %llu\n", m->name, m->bounds[i],
+                  cumulative);
+        } else {
+          fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", m->name, cumulative);
+        }
+      }
+      fprintf(out, "%s_sum %.17g\n%s_count %llu\n", m->name,
+              bits_double(atomic_load(&m->sum_bits)), m->name, cumulative);
+      break;
+    }
+  }
+}
+
+/* Render every metric into a malloc'd buffer */
+static char *render(size_t *size) {
+  char *buf = NULL;
+  FILE *out = open_memstream(&buf, size);
+  if (!out) {
+    return NULL;
+  }
+  int count = atomic_load_explicit(&g_metrics.count, memory_order_acquire);
+  for (int i = 0; i < count; ++i) {
+    write_metric(out, &g_metrics.metrics[i]);
+  }
+  if (fclose(out) != 0) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    size -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Replace the file in one rename so scrapers never read half of it */
+static void write_file(void) {
+  size_t size;
+  char *text = render(&size);
+  if (!text) {
+    return;
+  }
+  FILE *f = fopen(g_metrics.tmp_path, "w");
+  if (!f) {
+    perror(g_metrics.tmp_path);
+    free(text);
+    return;
+  }
+  int ok = fwrite(text, 1, size, f) == size;
+  ok = fclose(f) == 0 && ok;
+  free(text);
+  if (!ok || rename(g_metrics.tmp_path, g_metrics.path) != 0) {
+    perror(g_metrics.path);
+    unlink(g_metrics.tmp_path);
+  }
+}
+
+static void serve_client(void) {
+  int fd = accept4(g_metrics.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  size_t size;
+  char *text = render(&size);
+  if (text) {
+    write_all(fd, text, size);
+    free(text);
+  }
+  close(fd);
+}
+
+static void *export_thread_main(void *arg) {
+  (void)arg;
+  while (atomic_load(&g_metrics.running)) {
+    if (g_metrics.listen_fd < 0) {
+      write_file();
+      struct timespec ts = {METRICS_INTERVAL_MS / 1000, 0};
+      nanosleep(&ts, NULL);
+      continue;
+    }
+    /* Wake now and then to notice metrics_stop */
+    struct pollfd pfd = {.fd = g_metrics.listen_fd, .events = POLLIN};
+    if (poll(&pfd, 1, METRICS_INTERVAL_MS) > 0) {
+      serve_client();
+    }
+  }
+  return NULL;
+}
+
+static int ends_with(const char *s, const char *suffix) {
+  size_t len = strlen(s);
+  size_t suffix_len = strlen(suffix);
+  return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+static int open_socket(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "metrics: socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  /* A stale socket from an earlier run would make bind fail */
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 8) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int metrics_start(const char *path) {
+  if (atomic_load(&g_metrics.running)) {
+    fprintf(stderr, "metrics: already running\n");
+    return -1;
+  }
+
+  g_metrics.listen_fd = -1;
+  if (ends_with(path, ".sock")) {
+    g_metrics.listen_fd = open_socket(path);
+    if (g_metrics.listen_fd < 0) {
+      return -1;
+    }
+  }
+  g_metrics.path = strdup(path);
+  if (!g_metrics.path ||
+      asprintf(&g_metrics.tmp_path, "%s.tmp", path) < 0) {
+    g_metrics.tmp_path = NULL;
+    metrics_stop();
+    return -1;
+  }
+
+  atomic_store(&g_metrics.running, 1);
+  if (pthread_create(&g_metrics.thread, NULL, export_thread_main, NULL) != 0) {
+    perror("pthread_create");
+    atomic_store(&g_metrics.running, 0);
+    metrics_stop();
+    return -1;
+  }
+  pthread_setname_np(g_metrics.thread, "metrics");
+  return 0;
+}
+
+void metrics_stop(void) {
+  if (atomic_exchange(&g_metrics.running, 0)) {
+    pthread_join(g_metrics.thread, NULL);
+    if (g_metrics.listen_fd < 0) {
+      write_file();
+    }
+  }
+  if (g_metrics.listen_fd >= 0) {
+    close(g_metrics.listen_fd);
+    if (g_metrics.path) {
+      unlink(g_metrics.path);
+    }
+    g_metrics.listen_fd = -1;
+  }
+  free(g_metrics.path);
+  free(g_metrics.tmp_path);
+  g_metrics.path = NULL;
+  g_metrics.tmp_path = NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef WLCAST_METRICS_H
+#define WLCAST_METRICS_H
+
+#include <stdint.h>
+
+/**
+ * Live counters, gauges and histograms for fleet monitoring.
+ *
+ * Metrics are registered once (usually at init) and then updated with
+ * atomic operations from any thread. metrics_start exports all of them in
+ * Prometheus text format, either by rewriting a file once a second (written
+ * to a temporary file and renamed, so a reader never sees a partial one) or,
+ * when the path ends in ".sock", by answering every connection to a UNIX
+ * stream socket with the current values.
+ *
+ * Updates are cheap and work whether or not an exporter is running. All
+ * update functions accept NULL, which is what registration returns when the
+ * table is full, so callers need no checks.
+ */
+
+#define METRICS_MAX 64
+#define METRICS_MAX_BUCKETS 16
+
+struct metric;
+
+/* Monotonically increasing count, e.g. frames sent */
+struct metric *metrics_counter(const char *name, const char *help);
+
+/* Value that can go up and down, e.g. current quality */
+struct metric *metrics_gauge(const char *name, const char *help);
+
+/* Distribution of observed values. bounds are the bucket upper limits in
+ * ascending order (at most METRICS_MAX_BUCKETS; +Inf is implicit) and must
+ * outlive the metric. */
+struct metric *metrics_histogram(const char *name, const char *help,
+                                 const double *bounds, int bound_count);
+
+void metric_add(struct metric *m, uint64_t n);
+void metric_set(struct metric *m, double value);
+void metric_observe(struct metric *m, double value);
+
+static inline void metric_inc(struct metric *m) { metric_add(m, 1); }
+
+/* Start exporting to path. Returns 0 on success, -1 on failure. */
+int metrics_start(const char *path);
+
+/* Write the final values (file) or remove the socket, and stop exporting */
+void metrics_stop(void);
+
+#endif
@@ -6,11 +6,29 @@
 #define WLCAST_UDP_MAGIC 0x574c4350u /* "WLCP" - video frame packet */
 #define WLCAST_ACK_MAGIC 0x574c4341u /* "WLCA" - ACK packet */
 #define WLCAST_AUDIO_MAGIC 0x574c4155u /* "WLAU" - audio packet */
+#define WLCAST_TILE_MAGIC 0x574c4354u /* "WLCT" - tiled frame payload */
+#define WLCAST_FEC_MAGIC 0x574c4346u /* "WLCF" - FEC parity packet */
+#define WLCAST_NACK_MAGIC 0x574c434eu /* "WLCN" - missing chunks request */
+#define WLCAST_CLOCK_MAGIC 0x574c434bu /* "WLCK" - clock offset probe */
+#define WLCAST_TIMING_MAGIC 0x574c434du /* "WLCM" - frame timing header */
+#define WLCAST_REPORT_MAGIC 0x574c4352u /* "WLCR" - frame receive report */
 #define WLCAST_UDP_CHUNK_SIZE 8000u  /* Large chunks - kernel handles IP fragmentation */
+#define WLCAST_UDP_MTU_CHUNK_SIZE 1400u /* Fits a 1500-byte MTU with headers */
 #define WLCAST_MAX_FRAME_SIZE (8u * 1024u * 1024u)
 #define WLCAST_UDP_HEADER_SIZE 20u
 #define WLCAST_ACK_SIZE 12u
 #define WLCAST_AUDIO_HEADER_SIZE 16u
+#define WLCAST_TILE_FRAME_HEADER_SIZE 16u
+#define WLCAST_TILE_HEADER_SIZE 12u
+#define WLCAST_FEC_HEADER_SIZE 24u
+#define WLCAST_NACK_HEADER_SIZE 12u
+#define WLCAST_NACK_MAX_BITS 1024u /* Chunks one NACK packet can name */
+#define WLCAST_CLOCK_SIZE 28u
+#define WLCAST_FRAME_TIMING_SIZE 28u
+#define WLCAST_RECEIVE_REPORT_SIZE 24u
+
+/* Tiled frame flags */
+#define WLCAST_TILE_FLAG_KEYFRAME 0x0001u /* Every tile present */
 
 /* Audio constants */
 #define WLCAST_AUDIO_SAMPLE_RATE 48000u
@@ -26,7 +44,27 @@ struct wlcast_udp_header {
   uint16_t chunk_index;
   uint16_t chunk_count;
   uint16_t payload_size;
-  uint16_t reserved;
+  uint16_t chunk_size;   /* Payload bytes of every chunk but the last;
+                          * 0 means WLCAST_UDP_CHUNK_SIZE (legacy senders) */
+};
+
+/* FEC parity packet header - parity bytes follow (see common/fec.h).
+ *
+ * Sent after the data chunks of a frame. Repeats the frame geometry so a
+ * parity packet can start assembly on its own. Parity is computed over the
+ * data chunks zero-padded to chunk_size and is sent truncated to the longest
+ * chunk of its group. */
+struct wlcast_fec_header {
+  uint32_t magic;        /* WLCAST_FEC_MAGIC */
+  uint32_t frame_id;
+  uint32_t total_size;
+  uint16_t chunk_count;  /* Data chunks in the frame */
+  uint16_t chunk_size;   /* As in wlcast_udp_header */
+  uint16_t group_count;  /* Data chunk i is in group i % group_count */
+  uint16_t group;        /* Group this parity protects */
+  uint16_t payload_size;
+  uint8_t parity_index;  /* Parity row; 0 is XOR of the group */
+  uint8_t parity_count;  /* Parity chunks sent per group */
 };
 
 /* ACK packet sent from viewer to streamer */
@@ -36,6 +74,66 @@ struct wlcast_ack_packet {
   uint32_t viewer_fps; /* Viewer's current display FPS (for info) */
 };
 
+/* NACK packet sent from viewer to streamer while a frame is incomplete.
+ * Followed by (bit_count + 7) / 8 bytes of bitmap; bit k (LSB first) set
+ * means chunk first_chunk + k is missing. The streamer resends those
+ * chunks as ordinary frame packets if the frame is still recent enough. */
+struct wlcast_nack_header {
+  uint32_t magic;        /* WLCAST_NACK_MAGIC */
+  uint32_t frame_id;
+  uint16_t first_chunk;
+  uint16_t bit_count;    /* At most WLCAST_NACK_MAX_BITS */
+};
+
+/* Clock offset probe, sent by the viewer next to its ACKs and echoed by the
+ * streamer with its receive and send times filled in, NTP style. Times are
+ * the sending host's CLOCK_MONOTONIC in microseconds, split into high and
+ * low 32-bit halves. */
+struct wlcast_clock_packet {
+  uint32_t magic;            /* WLCAST_CLOCK_MAGIC */
+  uint32_t viewer_send_hi;
+  uint32_t viewer_send_lo;
+  uint32_t streamer_recv_hi; /* 0 in the probe */
+  uint32_t streamer_recv_lo;
+  uint32_t streamer_send_hi;
+  uint32_t streamer_send_lo;
+};
+
+/* Receive report, sent by the viewer for every frame it completes. The
+ * streamer compares the spacing of arrivals with the spacing of its sends
+ * to see queues building on the path, and the spread of one frame's
+ * arrivals to estimate the path's bandwidth.
+ *
+ * Arrival times are the kernel's receive timestamps (CLOCK_REALTIME) in
+ * microseconds, truncated to 32 bits; only differences between reports of
+ * one viewer mean anything. */
+struct wlcast_receive_report {
+  uint32_t magic;            /* WLCAST_REPORT_MAGIC */
+  uint32_t frame_id;
+  uint32_t first_arrival_us; /* First packet of the frame */
+  uint32_t last_arrival_us;  /* Packet that completed it */
+  uint32_t bytes;            /* Datagram bytes received for the frame */
+  uint16_t chunks_received;  /* Data chunks that arrived, not FEC-rebuilt */
+  uint16_t chunk_count;
+};
+
+/* Frame timing header.
+ *
+ * Once a streamer has received a clock probe, every frame payload (JPEG or
+ * tiled) starts with this header; viewers that never probe never see it.
+ * capture_time is on the streamer's clock, in microseconds, split like the
+ * clock probe times. The frame was handed to the socket at capture_time
+ * plus the four durations, all in microseconds. */
+struct wlcast_frame_timing {
+  uint32_t magic;            /* WLCAST_TIMING_MAGIC */
+  uint32_t capture_time_hi;  /* Compositor timestamp of the frame */
+  uint32_t capture_time_lo;
+  uint32_t capture_us;       /* Until the pixels were the streamer's */
+  uint32_t convert_us;
+  uint32_t encode_us;
+  uint32_t queue_us;         /* Waiting between stages and to be sent */
+};
+
 /* Audio packet header - Opus encoded audio data follows */
 struct wlcast_audio_header {
   uint32_t magic;        /* WLCAST_AUDIO_MAGIC */
@@ -45,13 +143,54 @@ struct wlcast_audio_header {
   uint16_t reserved;
 };
 
+/* Tiled frame payload.
+ *
+ * Travels through the same chunked frame packets as a full-screen JPEG, but
+ * the reassembled payload starts with this header instead of a JPEG SOI
+ * marker. It is followed by tile_count tiles, each a wlcast_tile_header and
+ * jpeg_size bytes of JPEG. The viewer patches each tile into its persistent
+ * frame at (x, y); tiles not present are unchanged. */
+struct wlcast_tile_frame_header {
+  uint32_t magic;        /* WLCAST_TILE_MAGIC */
+  uint16_t frame_width;  /* Full frame dimensions */
+  uint16_t frame_height;
+  uint16_t tile_size;    /* Nominal tile edge, multiple of 16 */
+  uint16_t tile_count;   /* Tiles following this header */
+  uint16_t flags;        /* WLCAST_TILE_FLAG_* */
+  uint16_t reserved;
+};
+
+struct wlcast_tile_header {
+  uint16_t x;            /* Position in the frame, in pixels */
+  uint16_t y;
+  uint16_t width;        /* Edge tiles may be smaller than tile_size */
+  uint16_t height;
+  uint32_t jpeg_size;    /* JPEG bytes following this header */
+};
+
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
 _Static_assert(sizeof(struct wlcast_udp_header) == WLCAST_UDP_HEADER_SIZE,
                "wlcast_udp_header size mismatch");
+_Static_assert(sizeof(struct wlcast_fec_header) == WLCAST_FEC_HEADER_SIZE,
+               "wlcast_fec_header size mismatch");
 _Static_assert(sizeof(struct wlcast_ack_packet) == WLCAST_ACK_SIZE,
                "wlcast_ack_packet size mismatch");
+_Static_assert(sizeof(struct wlcast_nack_header) == WLCAST_NACK_HEADER_SIZE,
+               "wlcast_nack_header size mismatch");
+_Static_assert(sizeof(struct wlcast_clock_packet) == WLCAST_CLOCK_SIZE,
+               "wlcast_clock_packet size mismatch");
+_Static_assert(sizeof(struct wlcast_frame_timing) == WLCAST_FRAME_TIMING_SIZE,
+               "wlcast_frame_timing size mismatch");
+_Static_assert(sizeof(struct wlcast_receive_report) ==
+                   WLCAST_RECEIVE_REPORT_SIZE,
+               "wlcast_receive_report size mismatch");
 _Static_assert(sizeof(struct wlcast_audio_header) == WLCAST_AUDIO_HEADER_SIZE,
                "wlcast_audio_header size mismatch");
+_Static_assert(sizeof(struct wlcast_tile_frame_header) ==
+                   WLCAST_TILE_FRAME_HEADER_SIZE,
+               "wlcast_tile_frame_header size mismatch");
+_Static_assert(sizeof(struct wlcast_tile_header) == WLCAST_TILE_HEADER_SIZE,
+               "wlcast_tile_header size mismatch");
 #endif
 
 #endif
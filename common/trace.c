@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Events per thread between drains; a power of two */
+#define TRACE_RING_SIZE 16384u
+#define TRACE_DRAIN_MS 10
+#define TRACE_MAX_NAMES 256
+
+struct trace_event {
+  uint64_t ts_ns;
+  int64_t arg;
+  const char *name;
+  uint8_t kind;
+};
+
+/* Single producer (the owning thread), single consumer (the drain thread) */
+struct trace_ring {
+  struct trace_ring *next;
+  uint32_t tid;
+  int named; /* Thread name written to the file */
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  struct trace_event events[TRACE_RING_SIZE];
+};
+
+struct trace_state {
+  pthread_mutex_t lock; /* Ring list and file */
+  struct trace_ring *rings;
+  FILE *file;
+  int json;
+  int first_event;
+  uint32_t pid;
+  pthread_t thread;
+  atomic_int running;
+  atomic_uint generation;
+  atomic_ulong dropped;
+  const char *names[TRACE_MAX_NAMES]; /* Binary name ids */
+  int name_count;
+};
+
+atomic_int trace_enabled;
+
+static struct trace_state g_trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread struct trace_ring *tls_ring;
+static __thread unsigned int tls_generation;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static struct trace_ring *register_ring(void) {
+  struct trace_ring *ring = calloc(1, sizeof(*ring));
+  if (!ring) {
+    return NULL;
+  }
+  ring->tid = (uint32_t)syscall(SYS_gettid);
+  atomic_init(&ring->head, 0u);
+  atomic_init(&ring->tail, 0u);
+
+  pthread_mutex_lock(&g_trace.lock);
+  ring->next = g_trace.rings;
+  g_trace.rings = ring;
+  pthread_mutex_unlock(&g_trace.lock);
+  return ring;
+}
+
+void trace_record(uint8_t kind, const char *name, int64_t arg) {
+  uint64_t ts = now_ns();
+  unsigned int generation =
+      atomic_load_explicit(&g_trace.generation, memory_order_acquire);
+  struct trace_ring *ring = tls_ring;
+  if (!ring || tls_generation != generation) {
+    ring = register_ring();
+    if (!ring) {
+      atomic_fetch_add_explicit(&g_trace.dropped, 1ul, memory_order_relaxed);
+      return;
+    }
+    tls_ring = ring;
+    tls_generation = generation;
+  }
+
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail >= TRACE_RING_SIZE) {
+    atomic_fetch_add_explicit(&g_trace.dropped, 1ul, memory_order_relaxed);
+    return;
+  }
+
+  struct trace_event *e = &ring->events[head & (TRACE_RING_SIZE - 1u)];
+  e->ts_ns = ts;
+  e->arg = arg;
+  e->name = name;
+  e->kind = kind;
+  atomic_store_explicit(&ring->head, head + 1u, memory_order_release);
+}
+
+/* === Output (drain thread, g_trace.lock held) === */
+
+static void write_json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; ++s) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\') {
+      fputc('\\', out);
+      fputc(c, out);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void json_separator(void) {
+  fputs(g_trace.first_event ? "\n" : ",\n", g_trace.file);
+  g_trace.first_event = 0;
+}
+
+static void write_binary_string(uint8_t kind, uint32_t tid, uint16_t id,
+                                const char *s) {
+  struct trace_file_record rec;
+  memset(&rec, 0, sizeof(rec));
+  size_t len = strlen(s);
+  rec.kind = kind;
+  rec.tid = tid;
+  rec.name_id = id;
+  rec.arg = (int64_t)len;
+  fwrite(&rec, sizeof(rec), 1, g_trace.file);
+  fwrite(s, 1, len, g_trace.file);
+}
+
+static int name_id(const char *name) {
+  for (int i = 0; i < g_trace.name_count; ++i) {
+    if (g_trace.names[i] == name) {
+      return i;
+    }
+  }
+  if (g_trace.name_count == TRACE_MAX_NAMES) {
+    return -1;
+  }
+  int id = g_trace.name_count++;
+  g_trace.names[id] = name;
+  write_binary_string(TRACE_RECORD_NAME, 0, (uint16_t)id, name);
+  return id;
+}
+
+static void write_thread_name(struct trace_ring *ring) {
+  char name[32];
+  char path[64];
+  snprintf(name, sizeof(name), "thread %u", ring->tid);
+  snprintf(path, sizeof(path), "/proc/self/task/%u/comm", ring->tid);
+  FILE *comm = fopen(path, "r");
+  if (comm) {
+    if (fgets(name, sizeof(name), comm)) {
+      name[strcspn(name, "\n")] = '\0';
+    }
+    fclose(comm);
+  }
+
+  if (g_trace.json) {
+    json_separator();
+    fprintf(g_trace.file,
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+            "\"args\":{\"name\":",
+            g_trace.pid, ring->tid);
+    write_json_string(g_trace.file, name);
+    fputs("}}", g_trace.file);
+  } else {
+    write_binary_string(TRACE_RECORD_THREAD, ring->tid, 0, name);
+  }
+}
+
+static void write_event(const struct trace_ring *ring,
+                        const struct trace_event *e) {
+  if (!g_trace.json) {
+    int id = name_id(e->name);
+    if (id < 0) {
+      atomic_fetch_add_explicit(&g_trace.dropped, 1ul, memory_order_relaxed);
+      return;
+    }
+    struct trace_file_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns = e->ts_ns;
+    rec.arg = e->arg;
+    rec.tid = ring->tid;
+    rec.name_id = (uint16_t)id;
+    rec.kind = e->kind;
+    fwrite(&rec, sizeof(rec), 1, g_trace.file);
+    return;
+  }
+
+  json_separator();
+  fputs("{\"name\":", g_trace.file);
+  write_json_string(g_trace.file, e->name);
+  fprintf(g_trace.file, ",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%u,\"tid\":%u",
+          e->kind, (unsigned long long)(e->ts_ns / 1000u),
+          (unsigned int)(e->ts_ns % 1000u), g_trace.pid, ring->tid);
+  if (e->kind == TRACE_INSTANT) {
+    fprintf(g_trace.file, ",\"s\":\"t\",\"args\":{\"value\":%lld}",
+            (long long)e->arg);
+  } else if (e->kind == TRACE_COUNTER) {
+    fprintf(g_trace.file, ",\"args\":{\"value\":%lld}", (long long)e->arg);
+  }
+  fputc('}', g_trace.file);
+}
+
+static void drain_ring(struct trace_ring *ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail == head) {
+    return;
+  }
+  /* By the first drain the thread has usually been given its name */
+  if (!ring->named) {
+    write_thread_name(ring);
+    ring->named = 1;
+  }
+  for (; tail != head; ++tail) {
+    write_event(ring, &ring->events[tail & (TRACE_RING_SIZE - 1u)]);
+  }
+  atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+static void drain_all(void) {
+  pthread_mutex_lock(&g_trace.lock);
+  for (struct trace_ring *ring = g_trace.rings; ring; ring = ring->next) {
+    drain_ring(ring);
+  }
+  fflush(g_trace.file);
+  pthread_mutex_unlock(&g_trace.lock);
+}
+
+static void *drain_thread_main(void *arg) {
+  (void)arg;
+  struct timespec ts = {0, TRACE_DRAIN_MS * 1000000L};
+  while (atomic_load(&g_trace.running)) {
+    nanosleep(&ts, NULL);
+    drain_all();
+  }
+  return NULL;
+}
+
+int trace_start(const char *path) {
+  if (atomic_load(&g_trace.running)) {
+    fprintf(stderr, "trace: already running\n");
+    return -1;
+  }
+
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    return -1;
+  }
+
+  size_t len = strlen(path);
+  g_trace.file = file;
+  g_trace.json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+  g_trace.first_event = 1;
+  g_trace.pid = (uint32_t)getpid();
+  g_trace.name_count = 0;
+  atomic_store(&g_trace.dropped, 0ul);
+  /* Rings from an earlier trace are gone; threads register new ones */
+  atomic_fetch_add(&g_trace.generation, 1u);
+
+  if (g_trace.json) {
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+  } else {
+    struct trace_file_header header = {TRACE_FILE_MAGIC, TRACE_FILE_VERSION,
+                                       g_trace.pid, 0};
+    fwrite(&header, sizeof(header), 1, file);
+  }
+
+  atomic_store(&g_trace.running, 1);
+  if (pthread_create(&g_trace.thread, NULL, drain_thread_main, NULL) != 0) {
+    perror("pthread_create");
+    atomic_store(&g_trace.running, 0);
+    fclose(file);
+    g_trace.file = NULL;
+    return -1;
+  }
+  pthread_setname_np(g_trace.thread, "trace");
+  atomic_store(&trace_enabled, 1);
+  return 0;
+}
+
+void trace_stop(void) {
+  if (!atomic_load(&g_trace.running)) {
+    return;
+  }
+  atomic_store(&trace_enabled, 0);
+  atomic_store(&g_trace.running, 0);
+  pthread_join(g_trace.thread, NULL);
+  drain_all();
+
+  pthread_mutex_lock(&g_trace.lock);
+  if (g_trace.json) {
+    fputs("\n]}\n", g_trace.file);
+  }
+  if (fclose(g_trace.file) != 0) {
+    perror("trace: close");
+  }
+  g_trace.file = NULL;
+  while (g_trace.rings) {
+    struct trace_ring *next = g_trace.rings->next;
+    free(g_trace.rings);
+    g_trace.rings = next;
+  }
+  pthread_mutex_unlock(&g_trace.lock);
+
+  unsigned long dropped = atomic_load(&g_trace.dropped);
+  if (dropped > 0) {
+    fprintf(stderr, "trace: dropped %lu events (ring full)\n", dropped);
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef WLCAST_TRACE_H
+#define WLCAST_TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Lightweight span tracing.
+ *
+ * Each thread writes CLOCK_MONOTONIC nanosecond timestamps into its own
+ * lock-free ring; a background thread drains the rings to a file. Recording
+ * an event is a couple of stores, and nothing at all while tracing is off.
+ * A full ring drops events rather than blocking (counted and reported by
+ * trace_stop).
+ *
+ * Names must be string literals or otherwise outlive the trace: only the
+ * pointer is recorded.
+ *
+ * Output is Chrome trace-event JSON (chrome://tracing, Perfetto) when the
+ * path ends in ".json", else the binary format below.
+ */
+
+/* Binary trace: a struct trace_file_header followed by records. A
+ * TRACE_RECORD_NAME record defines name_id and is followed by arg bytes of
+ * name (not NUL-terminated); TRACE_RECORD_THREAD names thread tid the same
+ * way. Other records are events whose kind is the Chrome phase character.
+ * All fields are in host byte order. */
+#define TRACE_FILE_MAGIC 0x57545243u /* "WTRC" */
+#define TRACE_FILE_VERSION 1u
+
+#define TRACE_RECORD_NAME 'N'
+#define TRACE_RECORD_THREAD 'T'
+#define TRACE_BEGIN 'B'
+#define TRACE_END 'E'
+#define TRACE_INSTANT 'i'
+#define TRACE_COUNTER 'C'
+
+struct trace_file_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t reserved;
+};
+
+struct trace_file_record {
+  uint64_t ts_ns;
+  int64_t arg; /* Counter value / instant argument / name length */
+  uint32_t tid;
+  uint16_t name_id;
+  uint8_t kind;
+  uint8_t reserved;
+};
+
+extern atomic_int trace_enabled;
+
+/* Start tracing to path. Returns 0 on success, -1 on failure. */
+int trace_start(const char *path);
+
+/* Stop tracing, drain every ring and close the file. Threads that recorded
+ * events must not record more until the next trace_start. */
+void trace_stop(void);
+
+void trace_record(uint8_t kind, const char *name, int64_t arg);
+
+static inline void trace_begin(const char *name) {
+  if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+    trace_record(TRACE_BEGIN, name, 0);
+  }
+}
+
+static inline void trace_end(const char *name) {
+  if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+    trace_record(TRACE_END, name, 0);
+  }
+}
+
+/* Point event, e.g. a frame completing; arg is shown with it */
+static inline void trace_instant(const char *name, int64_t arg) {
+  if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+    trace_record(TRACE_INSTANT, name, arg);
+  }
+}
+
+/* Value plotted over time, e.g. bytes per frame */
+static inline void trace_counter(const char *name, int64_t value) {
+  if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+    trace_record(TRACE_COUNTER, name, value);
+  }
+}
+
+#endif
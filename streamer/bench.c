@@ -0,0 +1,571 @@
+/* Loopback benchmark.
+ *
+ * Runs the streamer pipeline on the synthetic capture source and sends to
+ * the viewer's receive and decode path over 127.0.0.1, all in one process
+ * so every timestamp comes from the same clock. Reports per-stage latency
+ * percentiles, throughput and frame sizes, and writes them as JSON for
+ * comparing builds. */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common/protocol.h"
+#include "../common/trace.h"
+#include "capture_synthetic.h"
+#include "decode.h"
+#include "network.h"
+#include "pipeline.h"
+#include "udp.h"
+
+#define BENCH_INFLIGHT 256
+#define BENCH_DRAIN_MS 500
+
+enum bench_stage {
+  STAGE_CAPTURE,
+  STAGE_ENCODE,
+  STAGE_PACKETIZE,
+  STAGE_SEND,
+  STAGE_REASSEMBLE,
+  STAGE_DECODE,
+  STAGE_END_TO_END,
+  STAGE_COUNT,
+};
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "capture", "encode",     "packetize", "send",
+    "reassemble", "decode", "end_to_end",
+};
+
+struct samples {
+  uint64_t *values;
+  size_t count;
+  size_t capacity;
+};
+
+/* Sent frame awaiting the receiver, keyed by frame_id */
+struct inflight {
+  uint32_t frame_id; /* 0 = empty */
+  int measure;       /* Past warmup */
+  uint64_t capture_start_us;
+  uint64_t send_start_us;
+};
+
+struct bench {
+  /* Sender side (main thread) */
+  struct samples stages[STAGE_COUNT];
+  struct samples frame_bytes;
+  unsigned int sent;
+  uint64_t first_send_us;
+
+  /* Receiver side (receive thread); the stage arrays above are split
+   * between the threads, so neither touches the other's */
+  struct udp_receiver *receiver;
+  struct jpeg_decoder decoder;
+  unsigned int received;
+  unsigned int decode_failed;
+  unsigned int unmatched;
+  uint64_t received_bytes;
+  uint64_t last_decode_us;
+
+  pthread_mutex_t lock;
+  struct inflight inflight[BENCH_INFLIGHT];
+
+  atomic_int running;
+};
+
+static volatile sig_atomic_t g_running = 1;
+
+static void handle_sigint(int sig) {
+  (void)sig;
+  g_running = 0;
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void samples_add(struct samples *s, uint64_t value) {
+  if (s->count == s->capacity) {
+    size_t capacity = s->capacity ? s->capacity * 2 : 1024;
+    uint64_t *values = realloc(s->values, capacity * sizeof(*values));
+    if (!values) {
+      return;
+    }
+    s->values = values;
+    s->capacity = capacity;
+  }
+  s->values[s->count++] = value;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples */
+static uint64_t percentile(const struct samples *s, unsigned int pct) {
+  size_t rank = (s->count * pct + 99u) / 100u;
+  return s->values[rank > 0 ? rank - 1 : 0];
+}
+
+static double mean(const struct samples *s) {
+  double sum = 0.0;
+  for (size_t i = 0; i < s->count; ++i) {
+    sum += (double)s->values[i];
+  }
+  return s->count ? sum / (double)s->count : 0.0;
+}
+
+static void track_frame(struct bench *b, uint32_t frame_id, int measure,
+                        uint64_t capture_start_us, uint64_t send_start_us) {
+  pthread_mutex_lock(&b->lock);
+  struct inflight *e = &b->inflight[frame_id % BENCH_INFLIGHT];
+  e->frame_id = frame_id;
+  e->measure = measure;
+  e->capture_start_us = capture_start_us;
+  e->send_start_us = send_start_us;
+  pthread_mutex_unlock(&b->lock);
+}
+
+static int take_frame(struct bench *b, uint32_t frame_id,
+                      struct inflight *out) {
+  pthread_mutex_lock(&b->lock);
+  struct inflight *e = &b->inflight[frame_id % BENCH_INFLIGHT];
+  int found = e->frame_id == frame_id;
+  if (found) {
+    *out = *e;
+    e->frame_id = 0;
+  }
+  pthread_mutex_unlock(&b->lock);
+  return found;
+}
+
+/* Decode a whole-frame JPEG or every tile of a tiled payload */
+static int decode_payload(struct bench *b, const uint8_t *data, size_t size) {
+  struct decoded_frame out;
+  uint32_t magic = 0;
+  if (size >= sizeof(magic)) {
+    memcpy(&magic, data, sizeof(magic));
+  }
+  if (ntohl(magic) != WLCAST_TILE_MAGIC) {
+    return jpeg_decode_frame(&b->decoder, data, size, &out);
+  }
+
+  struct wlcast_tile_frame_header fh;
+  if (size < sizeof(fh)) {
+    return -1;
+  }
+  memcpy(&fh, data, sizeof(fh));
+  size_t offset = sizeof(fh);
+  for (uint16_t i = 0; i < ntohs(fh.tile_count); ++i) {
+    struct wlcast_tile_header th;
+    if (size - offset < sizeof(th)) {
+      return -1;
+    }
+    memcpy(&th, data + offset, sizeof(th));
+    offset += sizeof(th);
+    size_t jpeg_size = ntohl(th.jpeg_size);
+    if (size - offset < jpeg_size ||
+        jpeg_decode_frame(&b->decoder, data + offset, jpeg_size, &out) != 0) {
+      return -1;
+    }
+    offset += jpeg_size;
+  }
+  return 0;
+}
+
+static void *receive_thread_main(void *arg) {
+  struct bench *b = arg;
+
+  while (atomic_load(&b->running)) {
+    if (udp_receiver_wait(b->receiver, 10) <= 0) {
+      continue;
+    }
+
+    struct frame_buffer frame;
+    while (udp_receiver_poll(b->receiver, &frame) == 1) {
+      uint64_t complete_us = now_us();
+      trace_begin("decode");
+      int ok = decode_payload(b, frame.data, frame.size) == 0;
+      trace_end("decode");
+      uint64_t decoded_us = now_us();
+      udp_receiver_release(b->receiver, &frame);
+      udp_receiver_send_ack(b->receiver, frame.frame_id, 0);
+
+      struct inflight sent;
+      if (!take_frame(b, frame.frame_id, &sent)) {
+        ++b->unmatched;
+        continue;
+      }
+      if (!sent.measure) {
+        continue;
+      }
+      ++b->received;
+      b->received_bytes += frame.size;
+      if (!ok) {
+        ++b->decode_failed;
+        continue;
+      }
+      samples_add(&b->stages[STAGE_REASSEMBLE],
+                  complete_us - sent.send_start_us);
+      samples_add(&b->stages[STAGE_DECODE], decoded_us - complete_us);
+      samples_add(&b->stages[STAGE_END_TO_END],
+                  decoded_us - sent.capture_start_us);
+      b->last_decode_us = decoded_us;
+    }
+  }
+  return NULL;
+}
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--synthetic WxH[@fps]] [--synthetic-damage <kind>] [--replay <file>] "
+          "[--frames <n>] [--warmup <n>] [--quality <1-100>] [--tiles <size>] [--hw-jpeg] "
+          "[--mtu] [--fec <n>[:<m>]] [--port <port>] [--json <file>] [--trace <file>]\n"
+          "  --frames <n>   Frames to measure (default 300)\n"
+          "  --warmup <n>   Frames sent before measuring (default 30)\n"
+          "  --json <file>  Where to write the results (default bench.json, '-' = stdout)\n"
+          "  --trace <file> Also record timing spans (Chrome trace JSON if <file> ends in .json)\n"
+          "Other options as for wlcast-stream. Default source: 1280x720, unpaced, full damage.\n",
+          prog);
+}
+
+static void write_json(FILE *out, struct bench *b,
+                       const struct synthetic_config *source,
+                       const struct pipeline_config *pipe_cfg, int mtu,
+                       int fec_group, int fec_parity, double seconds) {
+  static const char *const damage_names[] = {"full", "box", "tiles", "none"};
+  double fps = seconds > 0 ? b->received / seconds : 0.0;
+  double mbps = seconds > 0 ? (double)b->received_bytes * 8.0 / seconds / 1e6
+                            : 0.0;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"config\": {\"width\": %u, \"height\": %u, \"fps\": %d, "
+               "\"damage\": \"%s\", \"replay\": %s, \"quality\": %d, "
+               "\"tiles\": %d, \"hw_jpeg\": %s, \"mtu\": %s, "
+               "\"fec_group\": %d, \"fec_parity\": %d},\n",
+          source->width, source->height, source->fps,
+          damage_names[source->damage], source->replay_path ? "true" : "false",
+          pipe_cfg->quality, pipe_cfg->tile_size,
+          pipe_cfg->use_hw_jpeg ? "true" : "false", mtu ? "true" : "false",
+          fec_group, fec_group > 0 ? fec_parity : 0);
+  fprintf(out, "  \"frames\": {\"sent\": %u, \"received\": %u, "
+               "\"decode_failed\": %u},\n",
+          b->sent, b->received, b->decode_failed);
+  fprintf(out, "  \"seconds\": %.3f,\n", seconds);
+  fprintf(out, "  \"throughput\": {\"fps\": %.2f, \"mbps\": %.2f},\n", fps,
+          mbps);
+
+  const struct samples *bytes = &b->frame_bytes;
+  if (bytes->count > 0) {
+    fprintf(out, "  \"bytes_per_frame\": {\"mean\": %.0f, \"p50\": %llu, "
+                 "\"p95\": %llu, \"p99\": %llu, \"max\": %llu},\n",
+            mean(bytes), (unsigned long long)percentile(bytes, 50),
+            (unsigned long long)percentile(bytes, 95),
+            (unsigned long long)percentile(bytes, 99),
+            (unsigned long long)bytes->values[bytes->count - 1]);
+  } else {
+    fprintf(out, "  \"bytes_per_frame\": null,\n");
+  }
+
+  fprintf(out, "  \"stages_us\": {\n");
+  for (int i = 0; i < STAGE_COUNT; ++i) {
+    const struct samples *s = &b->stages[i];
+    const char *sep = i + 1 < STAGE_COUNT ? "," : "";
+    if (s->count == 0) {
+      fprintf(out, "    \"%s\": {\"count\": 0}%s\n", stage_names[i], sep);
+      continue;
+    }
+    fprintf(out, "    \"%s\": {\"count\": %zu, \"mean\": %.1f, \"p50\": %llu, "
+                 "\"p95\": %llu, \"p99\": %llu, \"max\": %llu}%s\n",
+            stage_names[i], s->count, mean(s),
+            (unsigned long long)percentile(s, 50),
+            (unsigned long long)percentile(s, 95),
+            (unsigned long long)percentile(s, 99),
+            (unsigned long long)s->values[s->count - 1], sep);
+  }
+  fprintf(out, "  }\n}\n");
+}
+
+static void print_summary(FILE *out, struct bench *b, double seconds) {
+  fprintf(out, "%-12s %8s %9s %9s %9s %9s\n", "stage", "count", "p50 us",
+          "p95 us", "p99 us", "max us");
+  for (int i = 0; i < STAGE_COUNT; ++i) {
+    const struct samples *s = &b->stages[i];
+    if (s->count == 0) {
+      fprintf(out, "%-12s %8d %9s %9s %9s %9s\n", stage_names[i], 0, "-", "-",
+              "-", "-");
+      continue;
+    }
+    fprintf(out, "%-12s %8zu %9llu %9llu %9llu %9llu\n", stage_names[i],
+            s->count, (unsigned long long)percentile(s, 50),
+            (unsigned long long)percentile(s, 95),
+            (unsigned long long)percentile(s, 99),
+            (unsigned long long)s->values[s->count - 1]);
+  }
+  fprintf(out, "%u sent, %u received, %u decode failures in %.2f s: %.1f fps, "
+               "%.1f Mbit/s, %.0f bytes/frame\n",
+          b->sent, b->received, b->decode_failed, seconds,
+          seconds > 0 ? b->received / seconds : 0.0,
+          seconds > 0 ? (double)b->received_bytes * 8.0 / seconds / 1e6 : 0.0,
+          mean(&b->frame_bytes));
+}
+
+int main(int argc, char **argv) {
+  struct synthetic_config source = {.width = 1280, .height = 720};
+  uint16_t port = 47723;
+  int frames = 300;
+  int warmup = 30;
+  int quality = 80;
+  int tile_size = 0;
+  int use_hw_jpeg = 0;
+  int mtu_chunks = 0;
+  int fec_group = 0;
+  int fec_parity = 1;
+  const char *json_path = "bench.json";
+  const char *trace_path = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--synthetic") == 0 && i + 1 < argc) {
+      if (synthetic_parse_size(argv[++i], &source) != 0) {
+        fprintf(stderr, "Invalid --synthetic size: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--synthetic-damage") == 0 && i + 1 < argc) {
+      if (synthetic_parse_damage(argv[++i], &source.damage) != 0) {
+        fprintf(stderr, "Unknown --synthetic-damage: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      source.replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--quality") == 0 && i + 1 < argc) {
+      quality = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) {
+      tile_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--hw-jpeg") == 0) {
+      use_hw_jpeg = 1;
+    } else if (strcmp(argv[i], "--mtu") == 0) {
+      mtu_chunks = 1;
+    } else if (strcmp(argv[i], "--fec") == 0 && i + 1 < argc) {
+      const char *arg = argv[++i];
+      fec_group = atoi(arg);
+      const char *colon = strchr(arg, ':');
+      if (colon) {
+        fec_parity = atoi(colon + 1);
+      }
+    } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      port = (uint16_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--help") == 0) {
+      print_usage(argv[0]);
+      return 0;
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (frames < 1 || warmup < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (quality < 1) {
+    quality = 1;
+  } else if (quality > 100) {
+    quality = 100;
+  }
+  if (tile_size > 0 && use_hw_jpeg) {
+    fprintf(stderr, "--tiles uses the software encoder, disabling --hw-jpeg\n");
+    use_hw_jpeg = 0;
+  }
+
+  signal(SIGINT, handle_sigint);
+  signal(SIGTERM, handle_sigint);
+
+  struct bench *b = calloc(1, sizeof(*b));
+  if (!b) {
+    return 1;
+  }
+  pthread_mutex_init(&b->lock, NULL);
+  atomic_init(&b->running, 1);
+
+  struct capture_context *capture = NULL;
+  if (synthetic_capture_init(&capture, &source) != 0) {
+    fprintf(stderr, "Failed to initialize synthetic capture\n");
+    return 1;
+  }
+
+  struct udp_sender sender;
+  if (udp_receiver_init(&b->receiver, port) != 0 ||
+      jpeg_decoder_init(&b->decoder) != 0 ||
+      udp_sender_init(&sender, "127.0.0.1", port) != 0) {
+    fprintf(stderr, "Failed to set up loopback sender and receiver\n");
+    return 1;
+  }
+  if (mtu_chunks) {
+    udp_sender_set_mtu_mode(&sender);
+  }
+  if (fec_group > 0 && udp_sender_set_fec(&sender, fec_group, fec_parity) != 0) {
+    return 1;
+  }
+  uint64_t frame_interval_ms =
+      source.fps > 0 ? 1000u / (uint64_t)source.fps : 0;
+  udp_sender_set_frame_interval(&sender, frame_interval_ms);
+
+  if (trace_path && trace_start(trace_path) != 0) {
+    return 1;
+  }
+
+  pthread_t receive_thread;
+  if (pthread_create(&receive_thread, NULL, receive_thread_main, b) != 0) {
+    fprintf(stderr, "Failed to start receive thread\n");
+    return 1;
+  }
+
+  struct pipeline_config pipe_cfg = {
+    .use_hw_jpeg = use_hw_jpeg,
+    .use_damage = 1,
+    .use_hash = 1,
+    .tile_size = tile_size,
+    .quality = quality,
+    .capture = capture,
+  };
+  struct pipeline *pipeline = NULL;
+  int failed = pipeline_start(&pipeline, &pipe_cfg) != 0;
+  if (failed) {
+    fprintf(stderr, "Failed to start capture pipeline\n");
+  }
+
+  /* Keep stdout parseable when the JSON goes there */
+  FILE *report = strcmp(json_path, "-") == 0 ? stderr : stdout;
+  fprintf(report, "Benchmarking %ux%u %s, %d + %d warmup frames\n",
+          source.width, source.height,
+          source.replay_path ? source.replay_path : "test pattern", frames,
+          warmup);
+
+  unsigned int total = (unsigned int)frames + (unsigned int)warmup;
+  unsigned int count = 0;
+  int frames_lost_seen = 0;
+  while (!failed && g_running && count < total) {
+    struct pipeline_frame pf;
+    int rc = pipeline_next_encoded(pipeline, &pf, sender.fd, 100);
+    if (rc < 0) {
+      failed = 1;
+      break;
+    }
+    if (rc == 0) {
+      udp_sender_poll_acks(&sender);
+      continue;
+    }
+
+    int measure = count >= (unsigned int)warmup;
+    uint64_t send_start_us = now_us();
+    track_frame(b, sender.frame_id, measure, pf.capture_start_us,
+                send_start_us);
+    struct frame_times times = {
+      .capture_time_us = pf.capture_time_us,
+      .capture_us = pf.capture_start_us + pf.capture_us - pf.capture_time_us,
+      .convert_us = pf.convert_us,
+      .encode_us = pf.encode_us,
+    };
+    atomic_int *jpeg_hold = pf.jpeg_hold;
+    pf.jpeg_hold = NULL;
+    if (udp_sender_send_timed_frame(&sender, pf.jpeg, pf.jpeg_size, &times,
+                                    jpeg_hold) != 0) {
+      fprintf(stderr, "UDP send failed\n");
+      pipeline_frame_release(&pf);
+      failed = 1;
+      break;
+    }
+
+    if (measure) {
+      if (b->sent == 0) {
+        b->first_send_us = send_start_us;
+      }
+      ++b->sent;
+      samples_add(&b->stages[STAGE_CAPTURE], pf.capture_us);
+      samples_add(&b->stages[STAGE_ENCODE], pf.encode_us);
+      samples_add(&b->stages[STAGE_PACKETIZE], sender.last_packetize_us);
+      samples_add(&b->stages[STAGE_SEND], sender.last_send_us);
+      samples_add(&b->frame_bytes, pf.jpeg_size);
+    }
+    pipeline_frame_release(&pf);
+    ++count;
+
+    udp_sender_poll_acks(&sender);
+    const struct network_stats *stats = udp_sender_get_stats(&sender);
+    if (stats->frames_lost > frames_lost_seen) {
+      pipeline_request_keyframe(pipeline);
+    }
+    frames_lost_seen = stats->frames_lost;
+  }
+
+  /* Let the last frames arrive, answering NACKs meanwhile */
+  uint64_t drain_end = now_us() + BENCH_DRAIN_MS * 1000u;
+  while (now_us() < drain_end) {
+    udp_sender_poll_acks(&sender);
+    struct timespec ts = {0, 1000000};
+    nanosleep(&ts, NULL);
+  }
+  atomic_store(&b->running, 0);
+  pthread_join(receive_thread, NULL);
+  udp_sender_drop_cache(&sender);
+  if (pipeline) {
+    pipeline_stop(pipeline);
+  }
+  trace_stop();
+
+  for (int i = 0; i < STAGE_COUNT; ++i) {
+    struct samples *s = &b->stages[i];
+    qsort(s->values, s->count, sizeof(s->values[0]), compare_u64);
+  }
+  qsort(b->frame_bytes.values, b->frame_bytes.count,
+        sizeof(b->frame_bytes.values[0]), compare_u64);
+
+  double seconds = b->last_decode_us > b->first_send_us
+                       ? (double)(b->last_decode_us - b->first_send_us) / 1e6
+                       : 0.0;
+  print_summary(report, b, seconds);
+
+  FILE *out = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+  if (!out) {
+    perror(json_path);
+    failed = 1;
+  } else {
+    write_json(out, b, &source, &pipe_cfg, mtu_chunks, fec_group, fec_parity,
+               seconds);
+    if (out != stdout) {
+      fclose(out);
+      fprintf(report, "Wrote %s\n", json_path);
+    }
+  }
+
+  udp_sender_close(&sender);
+  udp_receiver_destroy(b->receiver);
+  jpeg_decoder_destroy(&b->decoder);
+  capture_shutdown(capture);
+  for (int i = 0; i < STAGE_COUNT; ++i) {
+    free(b->stages[i].values);
+  }
+  free(b->frame_bytes.values);
+  pthread_mutex_destroy(&b->lock);
+  free(b);
+  return failed ? 1 : 0;
+}
@@ -4,12 +4,15 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <wayland-client.h>
@@ -26,15 +29,19 @@ struct capture_buffer {
   uint32_t width;
   uint32_t height;
   uint32_t stride;
+  atomic_int in_use; /* Set while a returned frame still references it */
 };
 
-struct capture_context {
+struct screencopy_context {
+  struct capture_context base;
   struct wl_display *display;
   struct wl_registry *registry;
   struct wl_shm *shm;
   struct wl_output *output;
   struct zwlr_screencopy_manager_v1 *manager;
-  struct capture_buffer buffer;
+  uint32_t manager_version;
+  struct capture_buffer buffers[CAPTURE_BUFFER_COUNT];
+  int next_buffer;
   int overlay_cursor;
   int has_region;
   int region_x;
@@ -44,7 +51,8 @@ struct capture_context {
 };
 
 struct frame_state {
-  struct capture_context *ctx;
+  struct screencopy_context *ctx;
+  struct capture_buffer *buffer;
   struct zwlr_screencopy_frame_v1 *frame;
   int done;
   int failed;
@@ -52,6 +60,10 @@ struct frame_state {
   int shm_ready;
   int dmabuf_ready;
   int copy_sent;
+  int with_damage;
+  int damage_count;
+  struct capture_rect damage[CAPTURE_MAX_DAMAGE_RECTS];
+  uint64_t timestamp_ns;
   uint32_t format;
   uint32_t width;
   uint32_t height;
@@ -92,11 +104,7 @@ static const struct wl_buffer_listener buffer_listener = {
     .release = buffer_release,
 };
 
-static int recreate_buffer(struct capture_context *ctx, uint32_t format,
-                           uint32_t width, uint32_t height, uint32_t stride) {
-  struct capture_buffer *buf = &ctx->buffer;
-  size_t size = (size_t)stride * height;
-
+static void destroy_buffer(struct capture_buffer *buf) {
   if (buf->buffer) {
     wl_buffer_destroy(buf->buffer);
     buf->buffer = NULL;
@@ -113,6 +121,14 @@ static int recreate_buffer(struct capture_context *ctx, uint32_t format,
     close(buf->fd);
     buf->fd = -1;
   }
+}
+
+static int recreate_buffer(struct screencopy_context *ctx,
+                           struct capture_buffer *buf, uint32_t format,
+                           uint32_t width, uint32_t height, uint32_t stride) {
+  size_t size = (size_t)stride * height;
+
+  destroy_buffer(buf);
 
   buf->fd = create_shm_file(size);
   if (buf->fd < 0) {
@@ -162,13 +178,23 @@ static int recreate_buffer(struct capture_context *ctx, uint32_t format,
   return 0;
 }
 
+static void send_copy(struct frame_state *state, struct capture_buffer *buf) {
+  state->copy_sent = 1;
+  if (state->with_damage) {
+    zwlr_screencopy_frame_v1_copy_with_damage(state->frame, buf->buffer);
+  } else {
+    zwlr_screencopy_frame_v1_copy(state->frame, buf->buffer);
+  }
+  wl_display_flush(state->ctx->display);
+}
+
 static void frame_handle_buffer(void *data,
                                 struct zwlr_screencopy_frame_v1 *frame,
                                 uint32_t format, uint32_t width,
                                 uint32_t height, uint32_t stride) {
   (void)frame;
   struct frame_state *state = data;
-  struct capture_context *ctx = state->ctx;
+  struct screencopy_context *ctx = state->ctx;
 
   state->format = format;
   state->width = width;
@@ -185,19 +211,17 @@ static void frame_handle_buffer(void *data,
     return;
   }
 
-  if (!ctx->buffer.buffer || ctx->buffer.format != format ||
-      ctx->buffer.width != width || ctx->buffer.height != height ||
-      ctx->buffer.stride != stride) {
-    if (recreate_buffer(ctx, format, width, height, stride) != 0) {
+  struct capture_buffer *buf = state->buffer;
+  if (!buf->buffer || buf->format != format || buf->width != width ||
+      buf->height != height || buf->stride != stride) {
+    if (recreate_buffer(ctx, buf, format, width, height, stride) != 0) {
       state->failed = 1;
       state->done = 1;
       return;
     }
   }
 
-  state->copy_sent = 1;
-  zwlr_screencopy_frame_v1_copy(state->frame, ctx->buffer.buffer);
-  wl_display_flush(ctx->display);
+  send_copy(state, buf);
 }
 
 static void frame_handle_flags(void *data,
@@ -225,7 +249,7 @@ static void frame_handle_buffer_done(void *data,
                                      struct zwlr_screencopy_frame_v1 *frame) {
   (void)frame;
   struct frame_state *state = data;
-  struct capture_context *ctx = state->ctx;
+  struct screencopy_context *ctx = state->ctx;
 
   if (state->copy_sent) {
     return;
@@ -239,10 +263,11 @@ static void frame_handle_buffer_done(void *data,
     return;
   }
 
-  if (!ctx->buffer.buffer || ctx->buffer.format != state->format ||
-      ctx->buffer.width != state->width || ctx->buffer.height != state->height ||
-      ctx->buffer.stride != state->stride) {
-    if (recreate_buffer(ctx, state->format, state->width, state->height,
+  struct capture_buffer *buf = state->buffer;
+  if (!buf->buffer || buf->format != state->format ||
+      buf->width != state->width || buf->height != state->height ||
+      buf->stride != state->stride) {
+    if (recreate_buffer(ctx, buf, state->format, state->width, state->height,
                         state->stride) != 0) {
       state->failed = 1;
       state->done = 1;
@@ -250,9 +275,7 @@ static void frame_handle_buffer_done(void *data,
     }
   }
 
-  state->copy_sent = 1;
-  zwlr_screencopy_frame_v1_copy(state->frame, ctx->buffer.buffer);
-  wl_display_flush(ctx->display);
+  send_copy(state, buf);
 }
 
 static void frame_handle_ready(void *data,
@@ -260,10 +283,9 @@ static void frame_handle_ready(void *data,
                                uint32_t tv_sec_hi, uint32_t tv_sec_lo,
                                uint32_t tv_nsec) {
   (void)frame;
-  (void)tv_sec_hi;
-  (void)tv_sec_lo;
-  (void)tv_nsec;
   struct frame_state *state = data;
+  state->timestamp_ns =
+      (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000u + tv_nsec;
   state->done = 1;
 }
 
@@ -275,16 +297,43 @@ static void frame_handle_failed(void *data,
   state->done = 1;
 }
 
+/* Append a rect, collapsing everything into one bounding box once the list
+ * is full */
+static void add_damage_rect(struct capture_rect *rects, int *count,
+                            const struct capture_rect *rect) {
+  if (rect->width == 0 || rect->height == 0) {
+    return;
+  }
+
+  if (*count < CAPTURE_MAX_DAMAGE_RECTS) {
+    rects[(*count)++] = *rect;
+    return;
+  }
+
+  uint32_t x0 = rect->x, y0 = rect->y;
+  uint32_t x1 = rect->x + rect->width, y1 = rect->y + rect->height;
+  for (int i = 0; i < *count; ++i) {
+    const struct capture_rect *r = &rects[i];
+    if (r->x < x0) x0 = r->x;
+    if (r->y < y0) y0 = r->y;
+    if (r->x + r->width > x1) x1 = r->x + r->width;
+    if (r->y + r->height > y1) y1 = r->y + r->height;
+  }
+  rects[0].x = x0;
+  rects[0].y = y0;
+  rects[0].width = x1 - x0;
+  rects[0].height = y1 - y0;
+  *count = 1;
+}
+
 static void frame_handle_damage(void *data,
                                 struct zwlr_screencopy_frame_v1 *frame,
                                 uint32_t x, uint32_t y, uint32_t width,
                                 uint32_t height) {
-  (void)data;
   (void)frame;
-  (void)x;
-  (void)y;
-  (void)width;
-  (void)height;
+  struct frame_state *state = data;
+  struct capture_rect rect = {x, y, width, height};
+  add_damage_rect(state->damage, &state->damage_count, &rect);
 }
 
 static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
@@ -300,7 +349,7 @@ static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
 static void registry_handle_global(void *data, struct wl_registry *registry,
                                    uint32_t name, const char *interface,
                                    uint32_t version) {
-  struct capture_context *ctx = data;
+  struct screencopy_context *ctx = data;
   if (strcmp(interface, wl_shm_interface.name) == 0) {
     ctx->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
   } else if (strcmp(interface, wl_output_interface.name) == 0) {
@@ -309,6 +358,7 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
     }
   } else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
     uint32_t bind_version = version < 3 ? version : 3;
+    ctx->manager_version = bind_version;
     ctx->manager = wl_registry_bind(registry, name,
                                     &zwlr_screencopy_manager_v1_interface,
                                     bind_version);
@@ -328,12 +378,18 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = registry_handle_global_remove,
 };
 
+static const struct capture_backend screencopy_backend;
+
 int capture_init(struct capture_context **out_ctx, int overlay_cursor) {
-  struct capture_context *ctx = calloc(1, sizeof(*ctx));
+  struct screencopy_context *ctx = calloc(1, sizeof(*ctx));
   if (!ctx) {
     return -1;
   }
-  ctx->buffer.fd = -1;
+  ctx->base.backend = &screencopy_backend;
+  for (int i = 0; i < CAPTURE_BUFFER_COUNT; ++i) {
+    ctx->buffers[i].fd = -1;
+    atomic_init(&ctx->buffers[i].in_use, 0);
+  }
   ctx->overlay_cursor = overlay_cursor;
 
   ctx->display = wl_display_connect(NULL);
@@ -358,19 +414,17 @@ int capture_init(struct capture_context **out_ctx, int overlay_cursor) {
   if (!ctx->shm || !ctx->manager || !ctx->output) {
     fprintf(stderr, "Missing Wayland globals (shm=%p manager=%p output=%p)\n",
             (void *)ctx->shm, (void *)ctx->manager, (void *)ctx->output);
-    capture_shutdown(ctx);
+    capture_shutdown(&ctx->base);
     return -1;
   }
 
-  *out_ctx = ctx;
+  *out_ctx = &ctx->base;
   return 0;
 }
 
-void capture_set_region(struct capture_context *ctx, int x, int y, int width,
-                        int height) {
-  if (!ctx) {
-    return;
-  }
+static void screencopy_set_region(struct capture_context *base, int x,
+                                  int y, int width, int height) {
+  struct screencopy_context *ctx = (struct screencopy_context *)base;
   if (width <= 0 || height <= 0) {
     ctx->has_region = 0;
     return;
@@ -382,10 +436,86 @@ void capture_set_region(struct capture_context *ctx, int x, int y, int width,
   ctx->region_height = height;
 }
 
-int capture_next_frame(struct capture_context *ctx, struct capture_frame *out) {
+int capture_claim_buffer(atomic_int *in_use, size_t stride, int count,
+                         int *next) {
+  for (int attempt = 0; attempt < CAPTURE_CLAIM_WAIT_MS; ++attempt) {
+    for (int i = 0; i < count; ++i) {
+      int idx = (*next + i) % count;
+      atomic_int *flag =
+          (atomic_int *)((unsigned char *)in_use + (size_t)idx * stride);
+      int expected = 0;
+      if (atomic_compare_exchange_strong(flag, &expected, 1)) {
+        *next = (idx + 1) % count;
+        return idx;
+      }
+    }
+    struct timespec ts = {0, 1000000};
+    nanosleep(&ts, NULL);
+  }
+  return -1;
+}
+
+/* Pick the next shm buffer that no outstanding frame references. Waits for
+ * downstream stages to release one rather than overwriting pixels that are
+ * still being encoded. */
+static struct capture_buffer *acquire_buffer(struct screencopy_context *ctx) {
+  int idx = capture_claim_buffer(&ctx->buffers[0].in_use,
+                                 sizeof(ctx->buffers[0]), CAPTURE_BUFFER_COUNT,
+                                 &ctx->next_buffer);
+  return idx < 0 ? NULL : &ctx->buffers[idx];
+}
+
+/* Block until the frame is done. With a timeout, stop waiting once the
+ * copy is queued and nothing has arrived for timeout_ms. Returns 0 when done,
+ * 1 on timeout, -1 on failure. */
+static int wait_frame(struct frame_state *state, int timeout_ms) {
+  struct wl_display *display = state->ctx->display;
+
+  while (!state->done) {
+    if (timeout_ms < 0 || !state->copy_sent) {
+      if (wl_display_dispatch(display) < 0) {
+        fprintf(stderr, "wl_display_dispatch failed\n");
+        return -1;
+      }
+      continue;
+    }
+
+    if (wl_display_prepare_read(display) != 0) {
+      wl_display_dispatch_pending(display);
+      continue;
+    }
+    wl_display_flush(display);
+
+    struct pollfd pfd = {wl_display_get_fd(display), POLLIN, 0};
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc <= 0) {
+      wl_display_cancel_read(display);
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      return rc == 0 ? 1 : -1;
+    }
+    if (wl_display_read_events(display) < 0 ||
+        wl_display_dispatch_pending(display) < 0) {
+      fprintf(stderr, "wl_display_read_events failed\n");
+      return -1;
+    }
+  }
+
+  return state->failed ? -1 : 0;
+}
+
+static int capture_frame_common(struct screencopy_context *ctx,
+                                struct capture_frame *out, int with_damage,
+                                int timeout_ms) {
   struct frame_state state;
   memset(&state, 0, sizeof(state));
   state.ctx = ctx;
+  state.with_damage = with_damage;
+  state.buffer = acquire_buffer(ctx);
+  if (!state.buffer) {
+    return CAPTURE_BUSY;
+  }
 
   if (ctx->has_region) {
     state.frame = zwlr_screencopy_manager_v1_capture_output_region(
@@ -397,57 +527,79 @@ int capture_next_frame(struct capture_context *ctx, struct capture_frame *out) {
   }
   if (!state.frame) {
     fprintf(stderr, "capture_output failed\n");
+    atomic_store(&state.buffer->in_use, 0);
     return -1;
   }
 
   zwlr_screencopy_frame_v1_add_listener(state.frame, &frame_listener, &state);
   wl_display_flush(ctx->display);
 
-  while (!state.done) {
-    if (wl_display_dispatch(ctx->display) < 0) {
-      fprintf(stderr, "wl_display_dispatch failed\n");
-      state.failed = 1;
-      break;
-    }
-  }
+  int rc = wait_frame(&state, timeout_ms);
 
+  /* Destroying a pending copy_with_damage request cancels it; the compositor
+   * keeps accumulating damage for the next one. */
   zwlr_screencopy_frame_v1_destroy(state.frame);
 
-  if (state.failed) {
-    return -1;
+  struct capture_buffer *buf = state.buffer;
+  if (rc != 0) {
+    atomic_store(&buf->in_use, 0);
+    return rc;
   }
 
-  if (!ctx->buffer.data) {
+  if (!buf->data) {
     fprintf(stderr, "No buffer data available\n");
+    atomic_store(&buf->in_use, 0);
     return -1;
   }
 
-  out->format = ctx->buffer.format;
-  out->width = ctx->buffer.width;
-  out->height = ctx->buffer.height;
-  out->stride = ctx->buffer.stride;
-  out->data = ctx->buffer.data;
+  out->format = buf->format;
+  out->width = buf->width;
+  out->height = buf->height;
+  out->stride = buf->stride;
+  out->data = buf->data;
   out->y_invert = state.y_invert;
+  out->buffer_index = (int)(buf - ctx->buffers);
+  out->timestamp_ns = state.timestamp_ns;
+
+  if (with_damage && state.damage_count > 0) {
+    out->damage_count = state.damage_count;
+    memcpy(out->damage, state.damage,
+           (size_t)state.damage_count * sizeof(state.damage[0]));
+  } else {
+    out->damage_count = 1;
+    out->damage[0].x = 0;
+    out->damage[0].y = 0;
+    out->damage[0].width = buf->width;
+    out->damage[0].height = buf->height;
+  }
 
   return 0;
 }
 
-void capture_shutdown(struct capture_context *ctx) {
-  if (!ctx) {
-    return;
+static int screencopy_next_frame(struct capture_context *base,
+                                 struct capture_frame *out, int with_damage,
+                                 int timeout_ms) {
+  struct screencopy_context *ctx = (struct screencopy_context *)base;
+  if (with_damage && ctx->manager_version < 2) {
+    return capture_frame_common(ctx, out, 0, -1);
   }
+  return capture_frame_common(ctx, out, with_damage, timeout_ms);
+}
 
-  if (ctx->buffer.buffer) {
-    wl_buffer_destroy(ctx->buffer.buffer);
-  }
-  if (ctx->buffer.pool) {
-    wl_shm_pool_destroy(ctx->buffer.pool);
-  }
-  if (ctx->buffer.data) {
-    munmap(ctx->buffer.data, ctx->buffer.size);
+static void screencopy_release_frame(struct capture_context *base,
+                                     const struct capture_frame *frame) {
+  struct screencopy_context *ctx = (struct screencopy_context *)base;
+  if (frame->buffer_index < 0 || frame->buffer_index >= CAPTURE_BUFFER_COUNT) {
+    return;
   }
-  if (ctx->buffer.fd >= 0) {
-    close(ctx->buffer.fd);
+  atomic_store(&ctx->buffers[frame->buffer_index].in_use, 0);
+}
+
+static void screencopy_shutdown(struct capture_context *base) {
+  struct screencopy_context *ctx = (struct screencopy_context *)base;
+
+  for (int i = 0; i < CAPTURE_BUFFER_COUNT; ++i) {
+    destroy_buffer(&ctx->buffers[i]);
   }
 
   if (ctx->manager) {
@@ -468,3 +620,54 @@ void capture_shutdown(struct capture_context *ctx) {
 
   free(ctx);
 }
+
+static const struct capture_backend screencopy_backend = {
+    .name = "screencopy",
+    .set_region = screencopy_set_region,
+    .next_frame = screencopy_next_frame,
+    .release_frame = screencopy_release_frame,
+    .shutdown = screencopy_shutdown,
+};
+
+const char *capture_backend_name(const struct capture_context *ctx) {
+  return ctx ? ctx->backend->name : "none";
+}
+
+void capture_set_region(struct capture_context *ctx, int x, int y, int width,
+                        int height) {
+  if (!ctx || !ctx->backend->set_region) {
+    return;
+  }
+  ctx->backend->set_region(ctx, x, y, width, height);
+}
+
+int capture_next_frame(struct capture_context *ctx, struct capture_frame *out) {
+  return ctx->backend->next_frame(ctx, out, 0, -1);
+}
+
+int capture_next_damaged_frame(struct capture_context *ctx,
+                               struct capture_frame *out, int timeout_ms) {
+  return ctx->backend->next_frame(ctx, out, 1, timeout_ms);
+}
+
+void capture_frame_add_damage(struct capture_frame *frame,
+                              const struct capture_frame *other) {
+  for (int i = 0; i < other->damage_count; ++i) {
+    add_damage_rect(frame->damage, &frame->damage_count, &other->damage[i]);
+  }
+}
+
+void capture_release_frame(struct capture_context *ctx,
+                           const struct capture_frame *frame) {
+  if (!ctx || !frame) {
+    return;
+  }
+  ctx->backend->release_frame(ctx, frame);
+}
+
+void capture_shutdown(struct capture_context *ctx) {
+  if (!ctx) {
+    return;
+  }
+  ctx->backend->shutdown(ctx);
+}
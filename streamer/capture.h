@@ -1,9 +1,32 @@
 #ifndef WLCAST_CAPTURE_H
 #define WLCAST_CAPTURE_H
 
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 
-struct capture_context;
+/* Number of shm buffers rotated by the screencopy backend, so a frame can be
+ * encoded while the next one is being captured. */
+#define CAPTURE_BUFFER_COUNT 3
+
+/* How long a backend waits for downstream stages to hand back a buffer
+ * before giving up on the frame with CAPTURE_BUSY */
+#define CAPTURE_CLAIM_WAIT_MS 100
+
+/* Returned instead of a frame when every buffer is still held downstream
+ * (a stalled encoder or network): nothing was captured, try again. */
+#define CAPTURE_BUSY 2
+
+/* Damage rectangles kept per frame. Anything beyond this is merged into a
+ * single bounding box. */
+#define CAPTURE_MAX_DAMAGE_RECTS 16
+
+struct capture_rect {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+};
 
 struct capture_frame {
   uint32_t format;
@@ -12,12 +35,64 @@ struct capture_frame {
   uint32_t stride;
   void *data;
   int y_invert;
+  int buffer_index; /* Screencopy buffer backing data, -1 if not owned */
+  /* When the compositor presented this content, CLOCK_MONOTONIC (the
+   * wlroots presentation clock); 0 if the backend doesn't say */
+  uint64_t timestamp_ns;
+  /* Regions changed since the previous captured frame, in buffer
+   * coordinates. A full-frame copy reports a single rect covering it all. */
+  int damage_count;
+  struct capture_rect damage[CAPTURE_MAX_DAMAGE_RECTS];
+};
+
+struct capture_context;
+
+/* A frame source behind the capture_* calls below. Backends embed a
+ * struct capture_context as the first member of their own context and point
+ * it at their ops table. */
+struct capture_backend {
+  const char *name;
+  /* Optional; backends that can't crop ignore the region */
+  void (*set_region)(struct capture_context *ctx, int x, int y, int width,
+                     int height);
+  /* Same contract as capture_next_damaged_frame when with_damage is set,
+   * capture_next_frame otherwise (timeout_ms is then -1). */
+  int (*next_frame)(struct capture_context *ctx, struct capture_frame *out,
+                    int with_damage, int timeout_ms);
+  void (*release_frame)(struct capture_context *ctx,
+                        const struct capture_frame *frame);
+  void (*shutdown)(struct capture_context *ctx);
+};
+
+struct capture_context {
+  const struct capture_backend *backend;
 };
 
+/* wlr-screencopy backend */
 int capture_init(struct capture_context **out_ctx, int overlay_cursor);
+const char *capture_backend_name(const struct capture_context *ctx);
 void capture_set_region(struct capture_context *ctx, int x, int y, int width,
                         int height);
 int capture_next_frame(struct capture_context *ctx, struct capture_frame *out);
+/* Like capture_next_frame, but only completes once the compositor reports
+ * damage (copy_with_damage). Returns 0 with a frame, 1 if nothing changed
+ * within timeout_ms, CAPTURE_BUSY (both calls) if no buffer is free, -1 on
+ * failure. Falls back to a plain copy on compositors without screencopy
+ * v2. */
+int capture_next_damaged_frame(struct capture_context *ctx,
+                               struct capture_frame *out, int timeout_ms);
+/* For backends: claim the first free of count buffers, starting at *next,
+ * whose in_use flags are stride bytes apart from in_use. Waits up to
+ * CAPTURE_CLAIM_WAIT_MS for one to be released. Returns its index (and
+ * moves *next past it), or -1 if all stayed busy. */
+int capture_claim_buffer(atomic_int *in_use, size_t stride, int count,
+                         int *next);
+/* Add other's damage to frame, e.g. when other is dropped unencoded. */
+void capture_frame_add_damage(struct capture_frame *frame,
+                              const struct capture_frame *other);
+/* Hand a frame's buffer back for reuse. Safe to call from another thread. */
+void capture_release_frame(struct capture_context *ctx,
+                           const struct capture_frame *frame);
 void capture_shutdown(struct capture_context *ctx);
 
 #endif
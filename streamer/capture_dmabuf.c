@@ -47,13 +47,13 @@ static void frame_handle_frame(void *data,
                                uint32_t format, uint32_t mod_high,
                                uint32_t mod_low, uint32_t num_objects) {
   (void)frame;
-  (void)offset_x;
-  (void)offset_y;
   (void)buffer_flags;
   struct frame_state *state = data;
 
   state->out->width = width;
   state->out->height = height;
+  state->out->offset_x = offset_x;
+  state->out->offset_y = offset_y;
   state->out->format = format;
   state->out->modifier = ((uint64_t)mod_high << 32) | mod_low;
   state->out->flags = (int)flags;
@@ -98,10 +98,9 @@ static void frame_handle_ready(void *data,
                                uint32_t tv_sec_hi, uint32_t tv_sec_lo,
                                uint32_t tv_nsec) {
   (void)frame;
-  (void)tv_sec_hi;
-  (void)tv_sec_lo;
-  (void)tv_nsec;
   struct frame_state *state = data;
+  state->out->timestamp_ns =
+      (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000u + tv_nsec;
   state->done = 1;
 }
 
@@ -272,8 +271,10 @@ int dmabuf_frame_map(struct dmabuf_frame *frame) {
 
   size_t size = frame->objects[0].size;
   if (size == 0) {
-    /* Estimate size from stride and height */
-    size = (size_t)frame->objects[0].stride * frame->height;
+    /* Estimate size from stride and height, including the crop */
+    size = frame->objects[0].offset +
+           (size_t)frame->objects[0].stride *
+               (frame->offset_y + frame->height);
   }
 
   void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
@@ -287,6 +288,15 @@ int dmabuf_frame_map(struct dmabuf_frame *frame) {
   return 0;
 }
 
+void *dmabuf_frame_pixels(const struct dmabuf_frame *frame) {
+  if (!frame->mapped_data) {
+    return NULL;
+  }
+  return (char *)frame->mapped_data + frame->objects[0].offset +
+         (size_t)frame->offset_y * frame->objects[0].stride +
+         (size_t)frame->offset_x * 4u;
+}
+
 void dmabuf_frame_release(struct dmabuf_frame *frame) {
   if (!frame) {
     return;
@@ -11,6 +11,8 @@ struct dmabuf_pending_frame;
 struct dmabuf_frame {
   uint32_t width;
   uint32_t height;
+  uint32_t offset_x;    /* Crop: where the width x height frame starts */
+  uint32_t offset_y;    /* within the buffer, in pixels */
   uint32_t format;      /* DRM format (e.g., DRM_FORMAT_XRGB8888) */
   uint64_t modifier;    /* DRM format modifier */
   int num_objects;      /* Number of DMA buffer objects (planes) */
@@ -22,6 +24,7 @@ struct dmabuf_frame {
     uint32_t plane_idx; /* Which plane this object represents */
   } objects[4];
   int flags;            /* Frame flags (transient, etc.) */
+  uint64_t timestamp_ns; /* Presentation time, CLOCK_MONOTONIC */
   void *mapped_data;    /* Mapped memory (set by dmabuf_frame_map) */
   size_t mapped_size;   /* Size of mapped region */
 };
@@ -42,6 +45,11 @@ int dmabuf_capture_next_frame(struct dmabuf_capture_context *ctx,
  * Returns 0 on success, -1 on failure. */
 int dmabuf_frame_map(struct dmabuf_frame *frame);
 
+/* First pixel of the frame in a mapped XRGB8888/ARGB8888 frame, i.e. the
+ * mapping moved past the object offset and the crop. Rows are
+ * objects[0].stride apart. NULL if not mapped. */
+void *dmabuf_frame_pixels(const struct dmabuf_frame *frame);
+
 /* Release a captured frame (unmap memory and close FDs) */
 void dmabuf_frame_release(struct dmabuf_frame *frame);
 
@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+
+#include "capture_synthetic.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+
+#define SYNTHETIC_TILE 64
+#define SYNTHETIC_TILES_PER_FRAME 8
+
+struct synthetic_buffer {
+  unsigned char *data;
+  atomic_int in_use; /* Set while a returned frame still references it */
+};
+
+struct synthetic_context {
+  struct capture_context base;
+  struct synthetic_config cfg;
+  uint32_t stride;
+  size_t frame_size;
+  uint64_t frame_number;
+  uint64_t interval_ns;
+  uint64_t next_deadline_ns;
+
+  /* Generated pattern, updated in place by each frame's damage and copied
+   * out whole, the way screencopy copies the full output every time */
+  unsigned char *scene;
+  struct synthetic_buffer buffers[CAPTURE_BUFFER_COUNT];
+  int next_buffer;
+  struct capture_rect box;
+  int box_dx;
+  int box_dy;
+  uint32_t rng;
+
+  /* Replay */
+  int replay_fd;
+  unsigned char *replay; /* Mapped file, NULL when streaming from a pipe */
+  size_t replay_size;
+  size_t replay_frames;
+  size_t replay_pos;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)(deadline / 1000000000u);
+  ts.tv_nsec = (long)(deadline % 1000000000u);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+/* Hold frames to the configured rate. A consumer that falls behind gets the
+ * next frame immediately rather than a burst of catch-up frames. */
+static void pace(struct synthetic_context *ctx) {
+  if (ctx->interval_ns == 0) {
+    return;
+  }
+  uint64_t now = now_ns();
+  if (ctx->next_deadline_ns > now) {
+    sleep_until_ns(ctx->next_deadline_ns);
+  } else {
+    ctx->next_deadline_ns = now;
+  }
+  ctx->next_deadline_ns += ctx->interval_ns;
+}
+
+static uint32_t next_random(struct synthetic_context *ctx) {
+  /* xorshift32 */
+  uint32_t x = ctx->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  ctx->rng = x;
+  return x;
+}
+
+/* Gradients with some high-frequency detail so the encoder has real work,
+ * shifted by phase */
+static uint32_t pattern_pixel(uint32_t x, uint32_t y, uint32_t phase) {
+  uint32_t r = (x + phase) & 0xffu;
+  uint32_t g = (y + phase / 2u) & 0xffu;
+  uint32_t b = ((x ^ y) + phase) & 0xffu;
+  if (((x + phase) / SYNTHETIC_TILE) % 4u == 0) {
+    r = 255u - r;
+    b = 255u - b;
+  }
+  return (r << 16) | (g << 8) | b;
+}
+
+static void paint_rect(struct synthetic_context *ctx,
+                       const struct capture_rect *rect, uint32_t phase) {
+  for (uint32_t y = rect->y; y < rect->y + rect->height; ++y) {
+    uint32_t *row = (uint32_t *)(ctx->scene + (size_t)y * ctx->stride);
+    for (uint32_t x = rect->x; x < rect->x + rect->width; ++x) {
+      row[x] = pattern_pixel(x, y, phase);
+    }
+  }
+}
+
+static void fill_rect(struct synthetic_context *ctx,
+                      const struct capture_rect *rect, uint32_t color) {
+  for (uint32_t y = rect->y; y < rect->y + rect->height; ++y) {
+    uint32_t *row = (uint32_t *)(ctx->scene + (size_t)y * ctx->stride);
+    for (uint32_t x = rect->x; x < rect->x + rect->width; ++x) {
+      row[x] = color;
+    }
+  }
+}
+
+static void clip_rect(const struct synthetic_context *ctx,
+                      struct capture_rect *rect) {
+  if (rect->x >= ctx->cfg.width || rect->y >= ctx->cfg.height) {
+    rect->width = 0;
+    rect->height = 0;
+    return;
+  }
+  if (rect->width > ctx->cfg.width - rect->x) {
+    rect->width = ctx->cfg.width - rect->x;
+  }
+  if (rect->height > ctx->cfg.height - rect->y) {
+    rect->height = ctx->cfg.height - rect->y;
+  }
+}
+
+static void push_damage(struct capture_frame *out,
+                        const struct capture_rect *rect) {
+  struct capture_frame one;
+  one.damage_count = 1;
+  one.damage[0] = *rect;
+  capture_frame_add_damage(out, &one);
+}
+
+static void move_box(struct synthetic_context *ctx) {
+  struct capture_rect *box = &ctx->box;
+  int x = (int)box->x + ctx->box_dx;
+  int y = (int)box->y + ctx->box_dy;
+  int max_x = (int)(ctx->cfg.width - box->width);
+  int max_y = (int)(ctx->cfg.height - box->height);
+  if (x < 0 || x > max_x) {
+    ctx->box_dx = -ctx->box_dx;
+    x = x < 0 ? 0 : max_x;
+  }
+  if (y < 0 || y > max_y) {
+    ctx->box_dy = -ctx->box_dy;
+    y = y < 0 ? 0 : max_y;
+  }
+  box->x = (uint32_t)x;
+  box->y = (uint32_t)y;
+}
+
+/* Advance the scene by one frame and record what changed in out->damage */
+static void update_scene(struct synthetic_context *ctx,
+                         struct capture_frame *out) {
+  struct capture_rect full = {0, 0, ctx->cfg.width, ctx->cfg.height};
+  uint32_t phase = (uint32_t)ctx->frame_number * 4u;
+
+  out->damage_count = 0;
+  if (ctx->frame_number == 0) {
+    paint_rect(ctx, &full, 0);
+    if (ctx->cfg.damage == SYNTHETIC_DAMAGE_BOX) {
+      fill_rect(ctx, &ctx->box, 0x00ffffffu);
+    }
+    push_damage(out, &full);
+    return;
+  }
+
+  switch (ctx->cfg.damage) {
+    case SYNTHETIC_DAMAGE_FULL:
+      paint_rect(ctx, &full, phase);
+      push_damage(out, &full);
+      break;
+    case SYNTHETIC_DAMAGE_BOX: {
+      struct capture_rect old = ctx->box;
+      paint_rect(ctx, &old, 0);
+      move_box(ctx);
+      fill_rect(ctx, &ctx->box, pattern_pixel(phase, phase, phase));
+      push_damage(out, &old);
+      push_damage(out, &ctx->box);
+      break;
+    }
+    case SYNTHETIC_DAMAGE_TILES: {
+      uint32_t cols = (ctx->cfg.width + SYNTHETIC_TILE - 1) / SYNTHETIC_TILE;
+      uint32_t rows = (ctx->cfg.height + SYNTHETIC_TILE - 1) / SYNTHETIC_TILE;
+      for (int i = 0; i < SYNTHETIC_TILES_PER_FRAME; ++i) {
+        uint32_t n = next_random(ctx) % (cols * rows);
+        struct capture_rect tile = {(n % cols) * SYNTHETIC_TILE,
+                                    (n / cols) * SYNTHETIC_TILE,
+                                    SYNTHETIC_TILE, SYNTHETIC_TILE};
+        clip_rect(ctx, &tile);
+        paint_rect(ctx, &tile, next_random(ctx));
+        push_damage(out, &tile);
+      }
+      break;
+    }
+    case SYNTHETIC_DAMAGE_NONE:
+      break;
+  }
+}
+
+/* Pick the next buffer that no outstanding frame references, waiting for
+ * downstream stages to release one like the screencopy backend does */
+static struct synthetic_buffer *acquire_buffer(struct synthetic_context *ctx) {
+  int idx = capture_claim_buffer(&ctx->buffers[0].in_use,
+                                 sizeof(ctx->buffers[0]), CAPTURE_BUFFER_COUNT,
+                                 &ctx->next_buffer);
+  return idx < 0 ? NULL : &ctx->buffers[idx];
+}
+
+static int read_full(int fd, unsigned char *dst, size_t size) {
+  size_t got = 0;
+  while (got < size) {
+    ssize_t n = read(fd, dst + got, size - got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    got += (size_t)n;
+  }
+  return 0;
+}
+
+static void set_frame(struct synthetic_context *ctx, struct capture_frame *out,
+                      void *data, int buffer_index, uint64_t timestamp_ns) {
+  out->format = WL_SHM_FORMAT_XRGB8888;
+  out->width = ctx->cfg.width;
+  out->height = ctx->cfg.height;
+  out->stride = ctx->stride;
+  out->data = data;
+  out->y_invert = 0;
+  out->buffer_index = buffer_index;
+  out->timestamp_ns = timestamp_ns;
+}
+
+static int synthetic_next_replay(struct synthetic_context *ctx,
+                                 struct capture_frame *out) {
+  struct capture_rect full = {0, 0, ctx->cfg.width, ctx->cfg.height};
+
+  pace(ctx);
+  uint64_t shown_ns = now_ns();
+  if (ctx->replay) {
+    /* Straight out of the mapping; nothing to copy or release */
+    set_frame(ctx, out, ctx->replay + ctx->replay_pos * ctx->frame_size, -1,
+              shown_ns);
+    ctx->replay_pos = (ctx->replay_pos + 1) % ctx->replay_frames;
+  } else {
+    struct synthetic_buffer *buf = acquire_buffer(ctx);
+    if (!buf) {
+      return CAPTURE_BUSY;
+    }
+    if (read_full(ctx->replay_fd, buf->data, ctx->frame_size) != 0) {
+      fprintf(stderr, "Replay ended\n");
+      atomic_store(&buf->in_use, 0);
+      return -1;
+    }
+    set_frame(ctx, out, buf->data, (int)(buf - ctx->buffers), shown_ns);
+  }
+
+  /* Dumps carry no damage information */
+  out->damage_count = 1;
+  out->damage[0] = full;
+  ++ctx->frame_number;
+  return 0;
+}
+
+static int synthetic_next_frame(struct capture_context *base,
+                                struct capture_frame *out, int with_damage,
+                                int timeout_ms) {
+  struct synthetic_context *ctx = (struct synthetic_context *)base;
+
+  if (ctx->cfg.replay_path) {
+    return synthetic_next_replay(ctx, out);
+  }
+
+  if (with_damage && timeout_ms >= 0 && ctx->frame_number > 0 &&
+      ctx->cfg.damage == SYNTHETIC_DAMAGE_NONE) {
+    struct timespec ts = {timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+    return 1;
+  }
+
+  pace(ctx);
+  struct synthetic_buffer *buf = acquire_buffer(ctx);
+  if (!buf) {
+    return CAPTURE_BUSY;
+  }
+
+  /* The frame counts as on screen once generated; the copy out is the
+   * capture */
+  update_scene(ctx, out);
+  uint64_t shown_ns = now_ns();
+  ++ctx->frame_number;
+  memcpy(buf->data, ctx->scene, ctx->frame_size);
+  set_frame(ctx, out, buf->data, (int)(buf - ctx->buffers), shown_ns);
+
+  if (!with_damage || out->damage_count == 0) {
+    out->damage_count = 1;
+    out->damage[0].x = 0;
+    out->damage[0].y = 0;
+    out->damage[0].width = ctx->cfg.width;
+    out->damage[0].height = ctx->cfg.height;
+  }
+  return 0;
+}
+
+static void synthetic_release_frame(struct capture_context *base,
+                                    const struct capture_frame *frame) {
+  struct synthetic_context *ctx = (struct synthetic_context *)base;
+  if (frame->buffer_index < 0 || frame->buffer_index >= CAPTURE_BUFFER_COUNT) {
+    return;
+  }
+  atomic_store(&ctx->buffers[frame->buffer_index].in_use, 0);
+}
+
+static void synthetic_shutdown(struct capture_context *base) {
+  struct synthetic_context *ctx = (struct synthetic_context *)base;
+
+  for (int i = 0; i < CAPTURE_BUFFER_COUNT; ++i) {
+    free(ctx->buffers[i].data);
+  }
+  free(ctx->scene);
+  if (ctx->replay) {
+    munmap(ctx->replay, ctx->replay_size);
+  }
+  if (ctx->replay_fd >= 0) {
+    close(ctx->replay_fd);
+  }
+  free(ctx);
+}
+
+static const struct capture_backend synthetic_backend = {
+    .name = "synthetic",
+    .next_frame = synthetic_next_frame,
+    .release_frame = synthetic_release_frame,
+    .shutdown = synthetic_shutdown,
+};
+
+static int open_replay(struct synthetic_context *ctx) {
+  const char *path = ctx->cfg.replay_path;
+  ctx->replay_fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO)
+                                          : open(path, O_RDONLY | O_CLOEXEC);
+  if (ctx->replay_fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(ctx->replay_fd, &st) != 0) {
+    perror("fstat");
+    return -1;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    return 0; /* Stream it through the rotating buffers */
+  }
+
+  ctx->replay_size = (size_t)st.st_size;
+  ctx->replay_frames = ctx->replay_size / ctx->frame_size;
+  if (ctx->replay_frames == 0) {
+    fprintf(stderr, "%s: smaller than one %ux%u XRGB8888 frame\n", path,
+            ctx->cfg.width, ctx->cfg.height);
+    return -1;
+  }
+  if (ctx->replay_size % ctx->frame_size != 0) {
+    fprintf(stderr, "%s: ignoring %zu trailing bytes\n", path,
+            ctx->replay_size % ctx->frame_size);
+  }
+
+  void *map = mmap(NULL, ctx->replay_size, PROT_READ, MAP_PRIVATE,
+                   ctx->replay_fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(map, ctx->replay_size, MADV_SEQUENTIAL);
+  ctx->replay = map;
+  fprintf(stderr, "Replaying %zu frames from %s\n", ctx->replay_frames, path);
+  return 0;
+}
+
+int synthetic_capture_init(struct capture_context **out_ctx,
+                           const struct synthetic_config *cfg) {
+  if (cfg->width == 0 || cfg->height == 0 || cfg->width > 16384 ||
+      cfg->height > 16384) {
+    fprintf(stderr, "Invalid synthetic capture size %ux%u\n", cfg->width,
+            cfg->height);
+    return -1;
+  }
+
+  struct synthetic_context *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx) {
+    return -1;
+  }
+  ctx->base.backend = &synthetic_backend;
+  ctx->cfg = *cfg;
+  ctx->replay_fd = -1;
+  ctx->stride = cfg->width * 4u;
+  ctx->frame_size = (size_t)ctx->stride * cfg->height;
+  ctx->rng = 0x9e3779b9u;
+  if (cfg->fps > 0) {
+    ctx->interval_ns = 1000000000u / (uint64_t)cfg->fps;
+  }
+
+  ctx->box.width = cfg->width / 8u ? cfg->width / 8u : 1u;
+  ctx->box.height = cfg->height / 8u ? cfg->height / 8u : 1u;
+  ctx->box_dx = 7;
+  ctx->box_dy = 5;
+
+  for (int i = 0; i < CAPTURE_BUFFER_COUNT; ++i) {
+    atomic_init(&ctx->buffers[i].in_use, 0);
+  }
+
+  if (cfg->replay_path && open_replay(ctx) != 0) {
+    synthetic_shutdown(&ctx->base);
+    return -1;
+  }
+
+  /* A mapped replay hands out frames straight from the file */
+  if (!ctx->replay) {
+    for (int i = 0; i < CAPTURE_BUFFER_COUNT; ++i) {
+      ctx->buffers[i].data = malloc(ctx->frame_size);
+      if (!ctx->buffers[i].data) {
+        fprintf(stderr, "synthetic capture: alloc failed\n");
+        synthetic_shutdown(&ctx->base);
+        return -1;
+      }
+    }
+  }
+  if (!cfg->replay_path) {
+    ctx->scene = malloc(ctx->frame_size);
+    if (!ctx->scene) {
+      fprintf(stderr, "synthetic capture: alloc failed\n");
+      synthetic_shutdown(&ctx->base);
+      return -1;
+    }
+  }
+
+  *out_ctx = &ctx->base;
+  return 0;
+}
+
+int synthetic_parse_damage(const char *name, enum synthetic_damage *out) {
+  static const struct {
+    const char *name;
+    enum synthetic_damage damage;
+  } names[] = {
+      {"full", SYNTHETIC_DAMAGE_FULL},
+      {"box", SYNTHETIC_DAMAGE_BOX},
+      {"tiles", SYNTHETIC_DAMAGE_TILES},
+      {"none", SYNTHETIC_DAMAGE_NONE},
+  };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    if (strcmp(name, names[i].name) == 0) {
+      *out = names[i].damage;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int synthetic_parse_size(const char *spec, struct synthetic_config *cfg) {
+  unsigned int width = 0, height = 0;
+  int fps = 0;
+  int consumed = 0;
+  if (sscanf(spec, "%ux%u%n", &width, &height, &consumed) != 2) {
+    return -1;
+  }
+  if (spec[consumed] == '@') {
+    if (sscanf(spec + consumed + 1, "%d", &fps) != 1 || fps < 0) {
+      return -1;
+    }
+  } else if (spec[consumed] != '\0') {
+    return -1;
+  }
+  cfg->width = width;
+  cfg->height = height;
+  cfg->fps = fps;
+  return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef WLCAST_CAPTURE_SYNTHETIC_H
+#define WLCAST_CAPTURE_SYNTHETIC_H
+
+#include <stdint.h>
+
+#include "capture.h"
+
+/* What changes between frames of the generated test pattern */
+enum synthetic_damage {
+  SYNTHETIC_DAMAGE_FULL,  /* The whole pattern scrolls every frame */
+  SYNTHETIC_DAMAGE_BOX,   /* A box bounces over a static background */
+  SYNTHETIC_DAMAGE_TILES, /* A few scattered 64x64 blocks are repainted */
+  SYNTHETIC_DAMAGE_NONE,  /* Static after the first frame */
+};
+
+struct synthetic_config {
+  uint32_t width;
+  uint32_t height;
+  int fps; /* 0 = hand out frames as fast as they are asked for */
+  enum synthetic_damage damage;
+  /* Raw XRGB8888 frames of width x height, back to back (e.g. from
+   * ffmpeg -f rawvideo -pix_fmt bgr0). Regular files are memory-mapped and
+   * looped; pipes are read frame by frame until EOF. NULL = test pattern. */
+  const char *replay_path;
+};
+
+/* Capture backend that needs no compositor, for profiling the encode and
+ * send pipeline headless. Frames are XRGB8888 and report damage like
+ * screencopy does. Returns 0 on success, -1 on failure. */
+int synthetic_capture_init(struct capture_context **out_ctx,
+                           const struct synthetic_config *cfg);
+
+/* Parse "full", "box", "tiles" or "none". Returns 0 on success, -1 if the
+ * name is unknown. */
+int synthetic_parse_damage(const char *name, enum synthetic_damage *out);
+
+/* Parse "WxH[@fps]" into cfg->width, cfg->height and cfg->fps. Returns 0 on
+ * success, -1 if malformed. */
+int synthetic_parse_size(const char *spec, struct synthetic_config *cfg);
+
+#endif
@@ -46,9 +46,9 @@ int jpeg_encode_frame(struct jpeg_encoder *enc, const struct capture_frame *fram
     return -1;
   }
 
-  if (enc->width != (int)frame->width || enc->height != (int)frame->height ||
-      enc->buffer == NULL) {
-    unsigned long needed = tjBufSize(frame->width, frame->height, enc->subsamp);
+  /* Only grow the buffer: tiled encoding alternates between tile sizes */
+  unsigned long needed = tjBufSize(frame->width, frame->height, enc->subsamp);
+  if (needed > enc->buffer_size || enc->buffer == NULL) {
     unsigned char *new_buf = tjAlloc(needed);
     if (!new_buf) {
       fprintf(stderr, "tjAlloc failed\n");
@@ -0,0 +1,575 @@
+#include "congestion.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Trendline filter over the queueing delay, after WebRTC's GCC */
+#define TRENDLINE_WINDOW 20
+#define TRENDLINE_SMOOTHING 0.9
+#define TRENDLINE_GAIN 4.0
+#define TRENDLINE_MAX_DELTAS 60
+#define THRESHOLD_INITIAL_MS 12.5
+#define THRESHOLD_MIN_MS 6.0
+#define THRESHOLD_MAX_MS 600.0
+#define THRESHOLD_K_UP 0.0087
+#define THRESHOLD_K_DOWN 0.039
+#define OVERUSE_TIME_MS 10.0
+
+/* Reports kept for the receive rate and bottleneck estimates */
+#define SAMPLE_HISTORY 128
+#define RECEIVE_WINDOW_MS 500.0
+#define BOTTLENECK_WINDOW_MS 5000.0
+/* A burst is only spread by the path if it arrived noticeably slower than
+ * it was sent; otherwise the sender set the pace */
+#define BOTTLENECK_SPREAD_RATIO 1.25
+
+/* Target bitrate */
+#define MIN_TARGET_BPS 250e3
+#define INCREASE_PER_SECOND 0.08
+#define DECREASE_FACTOR 0.85
+#define BOTTLENECK_HEADROOM 0.9 /* Frames go out as bursts at path speed */
+/* No higher than UNDER_TARGET_RATIO: in between, the target would not grow
+ * and quality would not rise either */
+#define APP_LIMITED_RATIO 0.7
+#define LOSS_HIGH 0.10
+#define LOSS_LOW 0.02
+#define DECREASE_INTERVAL_MS 200.0 /* Plus one RTT */
+#define FEEDBACK_TIMEOUT_US 2000000u
+
+/* Quality and frame rate steering */
+#define DEFAULT_MIN_QUALITY 30
+#define DEFAULT_MAX_QUALITY 95
+#define DEFAULT_MIN_FPS 15
+#define FPS_STEP 5
+#define QUALITY_STEP_UP 2
+#define QUALITY_STEP_MAX 10
+#define QUALITY_COMFORT 60 /* Restore frame rate before quality above this */
+#define SCALE_QUALITY 50 /* Lower the resolution rather than quality below this */
+#define SCALE_UP_QUALITY 90 /* Restore resolution once quality is this high */
+#define UNDER_TARGET_RATIO 0.7
+#define FPS_SLACK 5 /* Frame rate shortfall that means the pipeline is behind */
+#define SETTLE_FRAMES 3 /* Frames at new settings before judging them */
+#define FRAME_BYTES_ALPHA 0.3
+#define SEND_FPS_ALPHA 0.3
+
+/* Without receive reports: the old once-a-second local check */
+#define LOCAL_INTERVAL_US 1000000u
+#define LOCAL_MIN_QUALITY 50
+#define LOCAL_QUALITY_STEP_DOWN 5
+
+enum usage {
+  USAGE_NORMAL,
+  USAGE_OVERUSE,
+  USAGE_UNDERUSE,
+};
+
+static const char *const usage_names[] = {"normal", "overuse", "underuse"};
+
+/* Resolutions to step through, full size first. Going up one step costs
+ * about twice the pixels, which quality SCALE_UP_QUALITY down to
+ * QUALITY_COMFORT roughly pays for. */
+static const struct {
+  int num;
+  int den;
+} scale_levels[] = {{1, 1}, {2, 3}, {1, 2}};
+#define SCALE_LEVELS ((int)(sizeof(scale_levels) / sizeof(scale_levels[0])))
+
+struct rate_sample {
+  double t_ms; /* Arrival time, viewer clock */
+  double value;
+};
+
+struct congestion {
+  struct congestion_config cfg;
+  int quality;
+  int fps;
+  int scale_level; /* Index into scale_levels */
+  int max_scale_level;
+
+  /* Delay gradient */
+  int have_prev;
+  struct congestion_sample prev;
+  double arrival_ms; /* Arrival time of the last report, from 0 */
+  double accumulated_delay_ms;
+  double smoothed_delay_ms;
+  double trend_x[TRENDLINE_WINDOW];
+  double trend_y[TRENDLINE_WINDOW];
+  int trend_count;
+  int trend_next;
+  int num_deltas;
+  double trend_ms;
+  double prev_slope;
+  double threshold_ms;
+  double threshold_updated_ms;
+  double overuse_ms; /* < 0: not overusing */
+  int overuse_count;
+  enum usage usage;
+
+  /* Receive rate and bottleneck bandwidth, indexed by report */
+  struct rate_sample received[SAMPLE_HISTORY]; /* value: bytes */
+  struct rate_sample bottleneck[SAMPLE_HISTORY]; /* value: bits/s */
+  int received_next;
+  int bottleneck_next;
+  double receive_bps;
+  double bottleneck_bps;
+
+  /* Loss since the last update */
+  uint32_t chunks_expected;
+  uint32_t chunks_lost;
+  double loss;
+
+  /* What we send */
+  double frame_bytes; /* Average frame, EWMA */
+  double send_fps;
+  unsigned int frames_window;
+  unsigned int frames_since_change;
+  int idle_window; /* The screen limited the frame rate since last update */
+
+  double target_bps;
+  uint64_t last_update_us;
+  uint64_t last_report_us;
+  uint64_t last_decrease_us;
+  /* Local mode */
+  uint64_t last_local_us;
+  unsigned int local_frames;
+  int local_idle;
+};
+
+static int clamp_int(int value, int lo, int hi) {
+  return value < lo ? lo : value > hi ? hi : value;
+}
+
+/* Forget everything learned from receive reports */
+static void reset_estimates(struct congestion *cc) {
+  cc->have_prev = 0;
+  cc->arrival_ms = 0;
+  cc->accumulated_delay_ms = 0;
+  cc->smoothed_delay_ms = 0;
+  cc->trend_count = 0;
+  cc->trend_next = 0;
+  cc->num_deltas = 0;
+  cc->trend_ms = 0;
+  cc->prev_slope = 0;
+  cc->threshold_ms = THRESHOLD_INITIAL_MS;
+  cc->threshold_updated_ms = -1.0;
+  cc->overuse_ms = -1.0;
+  cc->overuse_count = 0;
+  cc->usage = USAGE_NORMAL;
+  memset(cc->received, 0, sizeof(cc->received));
+  memset(cc->bottleneck, 0, sizeof(cc->bottleneck));
+  cc->received_next = 0;
+  cc->bottleneck_next = 0;
+  cc->receive_bps = 0;
+  cc->bottleneck_bps = 0;
+  cc->chunks_expected = 0;
+  cc->chunks_lost = 0;
+  cc->loss = 0;
+  cc->target_bps = 0;
+  cc->last_report_us = 0;
+}
+
+int congestion_init(struct congestion **out,
+                    const struct congestion_config *cfg) {
+  if (cfg->target_fps <= 0) {
+    return -1;
+  }
+  struct congestion *cc = calloc(1, sizeof(*cc));
+  if (!cc) {
+    return -1;
+  }
+  cc->cfg = *cfg;
+  if (cc->cfg.min_quality <= 0) {
+    cc->cfg.min_quality = DEFAULT_MIN_QUALITY;
+  }
+  if (cc->cfg.max_quality <= 0) {
+    cc->cfg.max_quality = DEFAULT_MAX_QUALITY;
+  }
+  if (cc->cfg.min_fps <= 0) {
+    cc->cfg.min_fps = DEFAULT_MIN_FPS;
+  }
+  if (cc->cfg.min_fps > cc->cfg.target_fps) {
+    cc->cfg.min_fps = cc->cfg.target_fps;
+  }
+  cc->quality = cfg->quality;
+  cc->fps = cfg->target_fps;
+  cc->max_scale_level = cfg->allow_scaling ? SCALE_LEVELS - 1 : 0;
+  reset_estimates(cc);
+  *out = cc;
+  return 0;
+}
+
+void congestion_destroy(struct congestion *cc) {
+  free(cc);
+}
+
+void congestion_on_sent(struct congestion *cc, size_t bytes, uint64_t now_us) {
+  (void)now_us;
+  if (cc->frame_bytes == 0) {
+    cc->frame_bytes = (double)bytes;
+  } else {
+    cc->frame_bytes += FRAME_BYTES_ALPHA * ((double)bytes - cc->frame_bytes);
+  }
+  cc->frames_window++;
+  cc->frames_since_change++;
+  cc->local_frames++;
+}
+
+void congestion_on_lost(struct congestion *cc, uint32_t chunks) {
+  cc->chunks_expected += chunks;
+  cc->chunks_lost += chunks;
+}
+
+/* === Delay gradient === */
+
+/* Least-squares slope of smoothed delay over arrival time */
+static double trendline_slope(const struct congestion *cc) {
+  double mean_x = 0;
+  double mean_y = 0;
+  for (int i = 0; i < cc->trend_count; ++i) {
+    mean_x += cc->trend_x[i];
+    mean_y += cc->trend_y[i];
+  }
+  mean_x /= cc->trend_count;
+  mean_y /= cc->trend_count;
+  double num = 0;
+  double den = 0;
+  for (int i = 0; i < cc->trend_count; ++i) {
+    double dx = cc->trend_x[i] - mean_x;
+    num += dx * (cc->trend_y[i] - mean_y);
+    den += dx * dx;
+  }
+  return den > 0 ? num / den : 0;
+}
+
+/* The threshold follows the trend slowly, so a path with steady jitter
+ * does not look congested, but jumps well past it are not absorbed */
+static void update_threshold(struct congestion *cc, double trend) {
+  double now = cc->arrival_ms;
+  if (cc->threshold_updated_ms < 0) {
+    cc->threshold_updated_ms = now;
+  }
+  double magnitude = fabs(trend);
+  if (magnitude > cc->threshold_ms + 15.0) {
+    cc->threshold_updated_ms = now;
+    return;
+  }
+  double k = magnitude < cc->threshold_ms ? THRESHOLD_K_DOWN : THRESHOLD_K_UP;
+  double dt = fmin(now - cc->threshold_updated_ms, 100.0);
+  cc->threshold_ms += k * (magnitude - cc->threshold_ms) * dt;
+  cc->threshold_ms = fmax(THRESHOLD_MIN_MS,
+                          fmin(cc->threshold_ms, THRESHOLD_MAX_MS));
+  cc->threshold_updated_ms = now;
+}
+
+static void detect(struct congestion *cc, double delta_ms, double delay_ms) {
+  cc->accumulated_delay_ms += delay_ms;
+  cc->smoothed_delay_ms = TRENDLINE_SMOOTHING * cc->smoothed_delay_ms +
+                          (1.0 - TRENDLINE_SMOOTHING) * cc->accumulated_delay_ms;
+  cc->trend_x[cc->trend_next] = cc->arrival_ms;
+  cc->trend_y[cc->trend_next] = cc->smoothed_delay_ms;
+  cc->trend_next = (cc->trend_next + 1) % TRENDLINE_WINDOW;
+  if (cc->trend_count < TRENDLINE_WINDOW) {
+    cc->trend_count++;
+    return;
+  }
+  if (cc->num_deltas < TRENDLINE_MAX_DELTAS) {
+    cc->num_deltas++;
+  }
+
+  double slope = trendline_slope(cc);
+  double trend = slope * cc->num_deltas * TRENDLINE_GAIN;
+  cc->trend_ms = trend;
+  if (trend > cc->threshold_ms) {
+    /* Only a sustained, still growing queue counts */
+    cc->overuse_ms = cc->overuse_ms < 0 ? delta_ms / 2 : cc->overuse_ms + delta_ms;
+    cc->overuse_count++;
+    if (cc->overuse_ms > OVERUSE_TIME_MS && cc->overuse_count > 1 &&
+        slope >= cc->prev_slope) {
+      cc->overuse_ms = 0;
+      cc->overuse_count = 0;
+      cc->usage = USAGE_OVERUSE;
+    }
+  } else if (trend < -cc->threshold_ms) {
+    cc->overuse_ms = -1.0;
+    cc->overuse_count = 0;
+    cc->usage = USAGE_UNDERUSE;
+  } else {
+    cc->overuse_ms = -1.0;
+    cc->overuse_count = 0;
+    cc->usage = USAGE_NORMAL;
+  }
+  cc->prev_slope = slope;
+  update_threshold(cc, trend);
+}
+
+static void add_sample(struct rate_sample *ring, int *next, double t_ms,
+                       double value) {
+  ring[*next].t_ms = t_ms;
+  ring[*next].value = value;
+  *next = (*next + 1) % SAMPLE_HISTORY;
+}
+
+void congestion_on_report(struct congestion *cc,
+                          const struct congestion_sample *sample,
+                          uint64_t now_us) {
+  uint32_t chunks = sample->chunks_received < sample->chunk_count
+                        ? sample->chunks_received
+                        : sample->chunk_count;
+  cc->chunks_expected += sample->chunk_count;
+  cc->chunks_lost += (uint32_t)(sample->chunk_count - chunks);
+  cc->last_report_us = now_us;
+
+  if (cc->have_prev) {
+    /* Reports of reordered frames would run time backwards */
+    if ((int32_t)(sample->frame_id - cc->prev.frame_id) <= 0) {
+      return;
+    }
+    int32_t arrival_delta =
+        (int32_t)(sample->last_arrival_us - cc->prev.last_arrival_us);
+    if (arrival_delta < 0 || sample->last_send_us < cc->prev.last_send_us) {
+      cc->prev = *sample;
+      return;
+    }
+    double send_delta = (double)(sample->last_send_us - cc->prev.last_send_us);
+    double delta_ms = arrival_delta / 1000.0;
+    cc->arrival_ms += delta_ms;
+    detect(cc, delta_ms, (arrival_delta - send_delta) / 1000.0);
+  }
+  cc->have_prev = 1;
+  cc->prev = *sample;
+
+  add_sample(cc->received, &cc->received_next, cc->arrival_ms,
+             sample->bytes_received);
+
+  uint32_t spread = sample->last_arrival_us - sample->first_arrival_us;
+  double send_spread = (double)(sample->last_send_us - sample->first_send_us);
+  if (chunks >= 3 && spread > 0 && spread < 1000000u &&
+      spread > send_spread * BOTTLENECK_SPREAD_RATIO) {
+    /* The first packet's bytes arrived before the spread started */
+    double bytes = (double)sample->bytes_received * (chunks - 1) / chunks;
+    add_sample(cc->bottleneck, &cc->bottleneck_next, cc->arrival_ms,
+               bytes * 8.0 * 1e6 / spread);
+  }
+}
+
+/* === Rate control === */
+
+static void estimate_rates(struct congestion *cc) {
+  double now = cc->arrival_ms;
+  double bytes = 0;
+  double oldest = now;
+  for (int i = 0; i < SAMPLE_HISTORY; ++i) {
+    const struct rate_sample *s = &cc->received[i];
+    if (s->value > 0 && now - s->t_ms < RECEIVE_WINDOW_MS) {
+      bytes += s->value;
+    }
+    if (s->value > 0 && s->t_ms < oldest) {
+      oldest = s->t_ms;
+    }
+  }
+  /* Until a full window has been seen the rate would be underestimated */
+  if (now - oldest >= RECEIVE_WINDOW_MS) {
+    cc->receive_bps = bytes * 8.0 * 1000.0 / RECEIVE_WINDOW_MS;
+  }
+
+  double best = 0;
+  for (int i = 0; i < SAMPLE_HISTORY; ++i) {
+    const struct rate_sample *s = &cc->bottleneck[i];
+    if (s->value > best && now - s->t_ms < BOTTLENECK_WINDOW_MS) {
+      best = s->value;
+    }
+  }
+  cc->bottleneck_bps = best;
+}
+
+static void update_target(struct congestion *cc, uint64_t now_us, double dt,
+                          double rtt_ms, double send_bps) {
+  if (cc->target_bps == 0) {
+    /* Start from what gets through now, or half the path if that is more */
+    cc->target_bps = fmax(cc->receive_bps, cc->bottleneck_bps / 2);
+    if (cc->target_bps == 0) {
+      return;
+    }
+  }
+
+  int may_decrease =
+      (double)(now_us - cc->last_decrease_us) >=
+      (DECREASE_INTERVAL_MS + rtt_ms) * 1000.0;
+  if (cc->usage == USAGE_OVERUSE && may_decrease) {
+    double cut = cc->receive_bps > 0 ? cc->receive_bps : cc->target_bps;
+    cc->target_bps = fmin(cc->target_bps, DECREASE_FACTOR * cut);
+    cc->last_decrease_us = now_us;
+  } else if (cc->loss > LOSS_HIGH && may_decrease) {
+    cc->target_bps *= 1.0 - 0.5 * cc->loss;
+    cc->last_decrease_us = now_us;
+  } else if (cc->usage == USAGE_NORMAL && cc->loss < LOSS_LOW &&
+             send_bps >= APP_LIMITED_RATIO * cc->target_bps) {
+    /* Grow only while we use what we have; an idle screen proves nothing */
+    cc->target_bps *= 1.0 + INCREASE_PER_SECOND * dt;
+  }
+
+  if (cc->bottleneck_bps > 0) {
+    cc->target_bps = fmin(cc->target_bps,
+                          BOTTLENECK_HEADROOM * cc->bottleneck_bps);
+  }
+  cc->target_bps = fmax(cc->target_bps, MIN_TARGET_BPS);
+}
+
+/* Bring what we send toward the target: quality first, then resolution,
+ * then the rest of quality, frame rate once quality is at its floor.
+ * Recovery restores frame rate first. */
+static void steer(struct congestion *cc, double send_bps, int source_idle) {
+  if (cc->target_bps == 0 || cc->frames_since_change < SETTLE_FRAMES) {
+    return;
+  }
+  int quality = cc->quality;
+  int fps = cc->fps;
+  int level = cc->scale_level;
+  if (send_bps > cc->target_bps) {
+    int floor = cc->cfg.min_quality;
+    if (level < cc->max_scale_level && floor < SCALE_QUALITY) {
+      floor = SCALE_QUALITY;
+    }
+    if (quality > floor) {
+      int step = (int)((send_bps / cc->target_bps - 1.0) * 20.0) + 1;
+      quality -= clamp_int(step, 1, QUALITY_STEP_MAX);
+      quality = clamp_int(quality, floor, quality);
+    } else if (level < cc->max_scale_level) {
+      level++;
+    } else if (quality > cc->cfg.min_quality) {
+      int step = (int)((send_bps / cc->target_bps - 1.0) * 20.0) + 1;
+      quality -= clamp_int(step, 1, QUALITY_STEP_MAX);
+      quality = clamp_int(quality, cc->cfg.min_quality, quality);
+    } else if (fps > cc->cfg.min_fps) {
+      fps = clamp_int(fps - FPS_STEP, cc->cfg.min_fps, cc->cfg.target_fps);
+    }
+  } else if (send_bps < UNDER_TARGET_RATIO * cc->target_bps &&
+             cc->usage != USAGE_OVERUSE &&
+             (source_idle || cc->send_fps >= cc->fps - FPS_SLACK)) {
+    /* Headroom on the link is no use if the encoder is what keeps us
+     * below the frame rate */
+    if (fps < cc->cfg.target_fps && quality >= QUALITY_COMFORT) {
+      fps = clamp_int(fps + FPS_STEP, cc->cfg.min_fps, cc->cfg.target_fps);
+    } else if (level > 0 && quality >= SCALE_UP_QUALITY) {
+      /* Trade the quality back for pixels */
+      level--;
+      quality = clamp_int(QUALITY_COMFORT, cc->cfg.min_quality, quality);
+    } else if (quality < cc->cfg.max_quality) {
+      quality = clamp_int(quality + QUALITY_STEP_UP, quality,
+                          cc->cfg.max_quality);
+    }
+  }
+  if (quality != cc->quality || fps != cc->fps || level != cc->scale_level) {
+    cc->quality = quality;
+    cc->fps = fps;
+    cc->scale_level = level;
+    cc->frames_since_change = 0;
+  }
+}
+
+/* No reports: only the pipeline's own frame rate tells us anything */
+static void steer_local(struct congestion *cc, uint64_t now_us,
+                        int source_idle) {
+  cc->local_idle |= source_idle;
+  if (cc->last_local_us == 0) {
+    cc->last_local_us = now_us;
+    cc->local_frames = 0;
+    return;
+  }
+  if (now_us - cc->last_local_us < LOCAL_INTERVAL_US) {
+    return;
+  }
+  double fps = cc->local_frames * 1e6 / (double)(now_us - cc->last_local_us);
+  if (fps < cc->fps - FPS_SLACK && !cc->local_idle) {
+    if (cc->quality > LOCAL_MIN_QUALITY) {
+      cc->quality = clamp_int(cc->quality - LOCAL_QUALITY_STEP_DOWN,
+                              LOCAL_MIN_QUALITY, cc->quality);
+    }
+  } else if (fps >= cc->fps) {
+    if (cc->fps < cc->cfg.target_fps && cc->quality >= QUALITY_COMFORT) {
+      cc->fps = clamp_int(cc->fps + FPS_STEP, cc->cfg.min_fps,
+                          cc->cfg.target_fps);
+    } else if (cc->quality < cc->cfg.max_quality) {
+      cc->quality = clamp_int(cc->quality + QUALITY_STEP_UP, cc->quality,
+                              cc->cfg.max_quality);
+    }
+  }
+  cc->last_local_us = now_us;
+  cc->local_frames = 0;
+  cc->local_idle = 0;
+}
+
+int congestion_update(struct congestion *cc, uint64_t now_us, double rtt_ms,
+                      int source_idle) {
+  if (cc->last_update_us == 0) {
+    cc->last_update_us = now_us;
+    cc->frames_window = 0;
+    return 0;
+  }
+  cc->idle_window |= source_idle;
+  if (now_us - cc->last_update_us < CONGESTION_UPDATE_MS * 1000u) {
+    return 0;
+  }
+  int idle = cc->idle_window;
+  cc->idle_window = 0;
+  double dt = (double)(now_us - cc->last_update_us) / 1e6;
+  cc->last_update_us = now_us;
+
+  double fps = cc->frames_window / dt;
+  cc->send_fps += SEND_FPS_ALPHA * (fps - cc->send_fps);
+  cc->frames_window = 0;
+  if (cc->chunks_expected > 0) {
+    double loss = (double)cc->chunks_lost / cc->chunks_expected;
+    cc->loss += 0.5 * (loss - cc->loss);
+    cc->chunks_expected = 0;
+    cc->chunks_lost = 0;
+  }
+
+  int old_quality = cc->quality;
+  int old_fps = cc->fps;
+  int old_level = cc->scale_level;
+  if (cc->last_report_us != 0 &&
+      now_us - cc->last_report_us < FEEDBACK_TIMEOUT_US) {
+    double send_bps = cc->frame_bytes * 8.0 * cc->send_fps;
+    estimate_rates(cc);
+    update_target(cc, now_us, dt, rtt_ms, send_bps);
+    steer(cc, send_bps, idle);
+    cc->last_local_us = 0;
+  } else {
+    if (cc->last_report_us != 0) {
+      /* The viewer went away; the next one starts from scratch */
+      reset_estimates(cc);
+    }
+    steer_local(cc, now_us, idle);
+  }
+  return cc->quality != old_quality || cc->fps != old_fps ||
+         cc->scale_level != old_level;
+}
+
+int congestion_quality(const struct congestion *cc) {
+  return cc->quality;
+}
+
+int congestion_fps(const struct congestion *cc) {
+  return cc->fps;
+}
+
+void congestion_scale(const struct congestion *cc, int *num, int *den) {
+  *num = scale_levels[cc->scale_level].num;
+  *den = scale_levels[cc->scale_level].den;
+}
+
+void congestion_get_stats(const struct congestion *cc,
+                          struct congestion_stats *out) {
+  memset(out, 0, sizeof(*out));
+  out->have_feedback = cc->last_report_us != 0;
+  out->state = usage_names[cc->usage];
+  out->target_bps = cc->target_bps;
+  out->receive_bps = cc->receive_bps;
+  out->bottleneck_bps = cc->bottleneck_bps;
+  out->send_bps = cc->frame_bytes * 8.0 * cc->send_fps;
+  out->trend_ms = cc->trend_ms;
+  out->threshold_ms = cc->threshold_ms;
+  out->loss = cc->loss;
+}
@@ -0,0 +1,103 @@
+#ifndef WLCAST_CONGESTION_H
+#define WLCAST_CONGESTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Delay-based congestion control for the video stream.
+ *
+ * The viewer reports when each frame's first and last packets arrived
+ * (struct wlcast_receive_report). Comparing the spacing of those arrivals
+ * with the spacing of our sends shows a queue building on the path before
+ * anything is lost; a trendline over the last frames (as in WebRTC's GCC)
+ * turns that into overuse, normal or underuse. The arrival spread of a
+ * single frame's burst measures the bottleneck's bandwidth, as BBR does.
+ *
+ * From those signals and the rate the viewer actually receives, a target
+ * bitrate is kept AIMD style: grow while the path is clear, cut to below
+ * the receive rate as soon as queueing or loss shows up. JPEG quality,
+ * then (if allowed) the resolution, then quality down to its floor and
+ * finally the frame rate are steered so the stream fits the target,
+ * re-evaluated every CONGESTION_UPDATE_MS. Fewer pixels look better than
+ * very low quality, so resolution goes first once quality is middling;
+ * it comes back once quality is high again at the lower resolution.
+ *
+ * A viewer that sends no reports (an older one) leaves only the local
+ * signal: quality is lowered while the pipeline falls short of the target
+ * frame rate, as the streamer always did.
+ *
+ * Not thread-safe; everything runs on the send thread.
+ */
+
+#define CONGESTION_UPDATE_MS 100
+
+struct congestion;
+
+struct congestion_config {
+  int target_fps;  /* Frame rate to aim for */
+  int min_fps;     /* Never throttle below this; 0 = default */
+  int quality;     /* Starting JPEG quality */
+  int min_quality; /* 0 = defaults */
+  int max_quality;
+  int allow_scaling; /* May lower the resolution, down to 1/2 */
+};
+
+/* What the controller currently believes, for logs and metrics */
+struct congestion_stats {
+  int have_feedback;      /* Receive reports are arriving */
+  const char *state;      /* "overuse", "normal" or "underuse" */
+  double target_bps;      /* 0 until the first estimate */
+  double receive_bps;     /* What the viewer received lately */
+  double bottleneck_bps;  /* Path bandwidth from burst spread; 0 = unknown */
+  double send_bps;        /* What we sent lately */
+  double trend_ms;        /* Queueing delay trend, compared to threshold */
+  double threshold_ms;
+  double loss;            /* Share of chunks lost lately */
+};
+
+/* One frame's send, matched with the viewer's report of it. Arrival times
+ * are on the viewer's clock and only meaningful relative to each other. */
+struct congestion_sample {
+  uint32_t frame_id;
+  uint64_t first_send_us; /* CLOCK_MONOTONIC */
+  uint64_t last_send_us;
+  uint32_t first_arrival_us;
+  uint32_t last_arrival_us;
+  uint32_t bytes_received;
+  uint16_t chunks_received;
+  uint16_t chunk_count;
+};
+
+int congestion_init(struct congestion **out,
+                    const struct congestion_config *cfg);
+void congestion_destroy(struct congestion *cc);
+
+/* A frame of size bytes (datagram bytes, headers and parity included) went
+ * out at now_us */
+void congestion_on_sent(struct congestion *cc, size_t bytes, uint64_t now_us);
+
+/* A receive report matched to its frame */
+void congestion_on_report(struct congestion *cc,
+                          const struct congestion_sample *sample,
+                          uint64_t now_us);
+
+/* Frames that were sent but will never be reported (lost or skipped) */
+void congestion_on_lost(struct congestion *cc, uint32_t chunks);
+
+/* Re-evaluate quality, resolution and frame rate; cheap to call on every
+ * loop. rtt_ms is the current round trip (0 if unknown), source_idle
+ * whether the screen rather than the pipeline limited the frame rate since
+ * the last call. Returns 1 if congestion_quality, congestion_scale or
+ * congestion_fps changed. */
+int congestion_update(struct congestion *cc, uint64_t now_us, double rtt_ms,
+                      int source_idle);
+
+int congestion_quality(const struct congestion *cc);
+int congestion_fps(const struct congestion *cc);
+/* Resolution to send at, as a fraction of the captured size */
+void congestion_scale(const struct congestion *cc, int *num, int *den);
+void congestion_get_stats(const struct congestion *cc,
+                          struct congestion_stats *out);
+
+#endif
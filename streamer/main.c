@@ -1,4 +1,3 @@
-#include <errno.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,20 +8,24 @@
 
 #include "capture.h"
 #include "capture_dmabuf.h"
-#include "compress.h"
-#include "v4l2_common.h"
-#include "v4l2_jpeg.h"
-#include "v4l2_rga.h"
+#include "capture_synthetic.h"
+#include "congestion.h"
+#include "../common/metrics.h"
+#include "../common/protocol.h"
+#include "../common/trace.h"
+#include "pipeline.h"
+#include "scale.h"
 #include "udp.h"
 
-#ifdef HAVE_OPENCL
-#include "opencl_convert.h"
-#endif
-
 #ifdef HAVE_AUDIO
 #include "audio.h"
 #endif
 
+_Static_assert(PIPELINE_JPEG_HEADROOM >= WLCAST_FRAME_TIMING_SIZE,
+               "no room for the frame timing header");
+_Static_assert(RETRANSMIT_CACHE_SIZE <= PIPELINE_SEND_HOLDS,
+               "retransmit cache would pin every JPEG slot");
+
 static volatile sig_atomic_t g_running = 1;
 
 static void handle_sigint(int sig) {
@@ -36,24 +39,156 @@ static uint64_t now_ms(void) {
   return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
 }
 
-static void sleep_ms(uint64_t ms) {
+static uint64_t now_us(void) {
   struct timespec ts;
-  ts.tv_sec = (time_t)(ms / 1000u);
-  ts.tv_nsec = (long)((ms % 1000u) * 1000000u);
-  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static const double latency_buckets_ms[] = {1, 2, 5, 10, 16, 33, 50, 100, 200, 500};
+static const double size_buckets_bytes[] = {4096, 16384, 65536, 131072, 262144, 524288, 1048576};
+
+/* Exported with --metrics */
+struct stream_metrics {
+  struct metric *frames;
+  struct metric *bytes;
+  struct metric *frame_bytes;
+  struct metric *encode_ms;
+  struct metric *capture_to_send_ms;
+  struct metric *fps;
+  struct metric *quality;
+  struct metric *rtt_ms;
+  struct metric *min_rtt_ms;
+  struct metric *loss;
+  struct metric *frames_lost;
+  struct metric *chunks_resent;
+  struct metric *viewer_connected;
+  struct metric *viewer_fps;
+  struct metric *pipeline_dropped;
+  struct metric *target_bitrate;
+  struct metric *fps_limit;
+  struct metric *scale;
+};
+
+#define COUNT_OF(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static void register_metrics(struct stream_metrics *m) {
+  m->frames = metrics_counter("wlcast_stream_frames_total", "Frames sent");
+  m->bytes = metrics_counter("wlcast_stream_bytes_total", "Encoded bytes sent");
+  m->frame_bytes = metrics_histogram("wlcast_stream_frame_bytes", "Encoded bytes per frame",
+                                     size_buckets_bytes, COUNT_OF(size_buckets_bytes));
+  m->encode_ms = metrics_histogram("wlcast_stream_encode_ms", "JPEG encode time",
+                                   latency_buckets_ms, COUNT_OF(latency_buckets_ms));
+  m->capture_to_send_ms = metrics_histogram("wlcast_stream_capture_to_send_ms",
+                                            "Capture start until the frame is sent",
+                                            latency_buckets_ms, COUNT_OF(latency_buckets_ms));
+  m->fps = metrics_gauge("wlcast_stream_fps", "Frames sent in the last second");
+  m->quality = metrics_gauge("wlcast_stream_quality", "Current JPEG quality");
+  m->rtt_ms = metrics_gauge("wlcast_stream_rtt_ms", "Smoothed round-trip time to the viewer");
+  m->min_rtt_ms = metrics_gauge("wlcast_stream_min_rtt_ms", "Lowest round-trip time seen");
+  m->loss = metrics_gauge("wlcast_stream_loss_ratio", "Share of frames lost in the last second");
+  m->frames_lost = metrics_counter("wlcast_stream_frames_lost_total",
+                                   "Frames never ACKed by the viewer");
+  m->chunks_resent = metrics_counter("wlcast_stream_chunks_resent_total",
+                                     "Chunks retransmitted on NACK");
+  m->viewer_connected = metrics_gauge("wlcast_stream_viewer_connected",
+                                      "1 while the viewer sends ACKs");
+  m->viewer_fps = metrics_gauge("wlcast_stream_viewer_fps", "Frame rate the viewer reports");
+  m->pipeline_dropped = metrics_counter("wlcast_stream_pipeline_dropped_total",
+                                        "Frames dropped between pipeline stages");
+  m->target_bitrate = metrics_gauge("wlcast_stream_target_bitrate",
+                                    "Congestion control target, bits per second");
+  m->fps_limit = metrics_gauge("wlcast_stream_fps_limit", "Frame rate congestion control allows");
+  m->scale = metrics_gauge("wlcast_stream_scale", "Sent resolution as a fraction of the capture");
+}
+
+/* Let the congestion controller re-evaluate, and apply its quality,
+ * resolution and frame rate. Cheap enough for every pass of the send loop. */
+static void update_congestion(struct congestion *cc, struct pipeline *pipeline,
+                              struct udp_sender *sender, int *quality,
+                              int target_fps, int fps_limit) {
+  if (!cc) {
+    return;
+  }
+  /* A static screen lowers the frame rate without any encoder or link
+   * pressure, so it must not count against quality. */
+  int source_idle = pipeline_take_idle(pipeline) > 0;
+  const struct network_stats *net = udp_sender_get_stats(sender);
+  int old_fps = congestion_fps(cc);
+  int old_num, old_den;
+  congestion_scale(cc, &old_num, &old_den);
+  int changed = congestion_update(cc, now_us(), net->smoothed_rtt_ms,
+                                  source_idle);
+  struct congestion_stats stats;
+  congestion_get_stats(cc, &stats);
+  udp_sender_set_bandwidth(sender, stats.target_bps);
+  if (!changed) {
+    return;
+  }
+
+  if (congestion_quality(cc) != *quality) {
+    *quality = congestion_quality(cc);
+    pipeline_set_quality(pipeline, *quality);
+  }
+  int num, den;
+  congestion_scale(cc, &num, &den);
+  if (num * old_den != old_num * den) {
+    pipeline_set_scale(pipeline, num, den);
+    fprintf(stderr, "  -> resolution %s to %d/%d\n",
+            num * old_den < old_num * den ? "reduced" : "increased", num, den);
+  }
+  int fps = congestion_fps(cc);
+  if (fps != old_fps) {
+    uint64_t interval_ms;
+    if (fps >= target_fps) {
+      interval_ms = fps_limit > 0 ? 1000u / (uint64_t)fps_limit : 0;
+    } else {
+      interval_ms = 1000u / (uint64_t)fps;
+    }
+    pipeline_set_frame_interval(pipeline, interval_ms);
+    udp_sender_set_frame_interval(sender, interval_ms);
+    fprintf(stderr, "  -> target fps %s to %d\n",
+            fps < old_fps ? "reduced" : "increased", fps);
   }
 }
 
 static void print_usage(const char *prog) {
   fprintf(stderr,
           "Usage: %s --dest <ip> [--port <port>] [--quality <1-100>] "
-          "[--fps <limit>] [--target-fps <fps>] [--region x y w h] [--hw-jpeg] [--dmabuf] [--rga] [--opencl] [--audio] [--no-cursor]\n"
-          "  --target-fps  Adaptive quality: auto-adjust quality to hit target FPS (default: 0=off)\n"
+          "[--fps <limit>] [--target-fps <fps>] [--region x y w h] [--scale <n/d>] "
+          "[--hw-jpeg] [--dmabuf] [--rga] [--opencl] [--audio] [--no-cursor] "
+          "[--no-damage] [--no-hash] [--tiles <size>] [--mtu] [--fec <n>[:<m>]] "
+          "[--pace <fraction>] [--no-nack] [--synthetic WxH[@fps]] "
+          "[--synthetic-damage <kind>] [--replay <file>] [--trace <file>] "
+          "[--metrics <file>]\n"
+          "  --target-fps  Congestion control: steer quality, resolution and frame rate\n"
+          "                to fit the network, up to this FPS (default: 0=off)\n"
+          "  --scale <n/d> Send at a fixed n/d (1/2 to 1) of the captured resolution,\n"
+          "                e.g. 2/3; the viewer scales it back up\n"
           "  --dmabuf      Use wlr-export-dmabuf (zero-copy capture, reduces compositor load)\n"
           "  --rga         Use RGA for hardware color conversion (requires --dmabuf --hw-jpeg)\n"
 #ifdef HAVE_OPENCL
           "  --opencl      Use OpenCL for GPU color conversion (requires --dmabuf --hw-jpeg, libmali)\n"
 #endif
+          "  --tiles <n>   Send only changed n x n tiles (multiple of 16, software JPEG)\n"
+          "  --no-damage   Send every frame even when the screen is static (screencopy only)\n"
+          "  --no-hash     Don't compare tile hashes to skip unchanged frames/tiles\n"
+          "  --mtu         Send 1400-byte chunks (UDP GSO) instead of fragmented 8 KB ones\n"
+          "  --fec <n>[:m] Add m parity chunks (default 1, XOR) per n data chunks;\n"
+          "                m>1 is Reed-Solomon\n"
+          "  --pace <f>    Spread each frame's packets over fraction f (0-1] of the\n"
+          "                frame interval instead of one burst\n"
+          "  --no-nack     Don't resend chunks the viewer reports missing\n"
+          "  --synthetic WxH[@fps]  Capture a generated test pattern instead of the\n"
+          "                screen (no compositor needed)\n"
+          "  --synthetic-damage <kind>  What changes per synthetic frame: full, box,\n"
+          "                tiles or none (default: full)\n"
+          "  --replay <file>  Play raw XRGB8888 WxH frames from a file or pipe\n"
+          "                ('-' = stdin) with --synthetic\n"
+          "  --trace <file>  Record per-stage timing spans (Chrome trace JSON if <file>\n"
+          "                ends in .json, else binary)\n"
+          "  --metrics <file>  Export Prometheus metrics: rewrite <file> every second,\n"
+          "                or serve them on a UNIX socket if it ends in .sock\n"
 #ifdef HAVE_AUDIO
           "  --audio       Enable audio streaming (PulseAudio capture + Opus encoding)\n"
 #endif
@@ -68,14 +203,28 @@ int main(int argc, char **argv) {
   int fps_limit = 0;
   int target_fps = 0;  /* 0 = adaptive quality disabled */
   int overlay_cursor = 1;
+  int use_damage = 1;
+  int use_hash = 1;
+  int tile_size = 0;   /* 0 = send full frames */
+  int mtu_chunks = 0;
+  int fec_group = 0;   /* 0 = no FEC */
+  int fec_parity = 1;
+  int use_nack = 1;
+  double pace_fraction = 0; /* 0 = send frames as one burst */
   int region_x = 0;
   int region_y = 0;
   int region_w = 0;
   int region_h = 0;
+  int scale_num = 0; /* 0 = full size, or chosen by congestion control */
+  int scale_den = 0;
   int use_hw_jpeg = 0;
   int use_dmabuf = 0;
   int use_rga = 0;
   int use_opencl = 0;
+  int use_synthetic = 0;
+  struct synthetic_config synthetic = {0};
+  const char *trace_path = NULL;
+  const char *metrics_path = NULL;
 #ifdef HAVE_AUDIO
   int use_audio = 0;
 #endif
@@ -96,6 +245,15 @@ int main(int argc, char **argv) {
       region_y = atoi(argv[++i]);
       region_w = atoi(argv[++i]);
       region_h = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      const char *arg = argv[++i];
+      const char *slash = strchr(arg, '/');
+      scale_num = atoi(arg);
+      scale_den = slash ? atoi(slash + 1) : 1;
+      if (!scale_supported(scale_num, scale_den) || scale_den > 255) {
+        fprintf(stderr, "Invalid --scale: %s (1/2 to 1, e.g. 2/3)\n", arg);
+        return 1;
+      }
     } else if (strcmp(argv[i], "--hw-jpeg") == 0) {
       use_hw_jpeg = 1;
     } else if (strcmp(argv[i], "--dmabuf") == 0) {
@@ -118,6 +276,42 @@ int main(int argc, char **argv) {
 #endif
     } else if (strcmp(argv[i], "--no-cursor") == 0) {
       overlay_cursor = 0;
+    } else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) {
+      tile_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--no-damage") == 0) {
+      use_damage = 0;
+    } else if (strcmp(argv[i], "--no-hash") == 0) {
+      use_hash = 0;
+    } else if (strcmp(argv[i], "--mtu") == 0) {
+      mtu_chunks = 1;
+    } else if (strcmp(argv[i], "--no-nack") == 0) {
+      use_nack = 0;
+    } else if (strcmp(argv[i], "--pace") == 0 && i + 1 < argc) {
+      pace_fraction = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--fec") == 0 && i + 1 < argc) {
+      const char *arg = argv[++i];
+      fec_group = atoi(arg);
+      const char *colon = strchr(arg, ':');
+      if (colon) {
+        fec_parity = atoi(colon + 1);
+      }
+    } else if (strcmp(argv[i], "--synthetic") == 0 && i + 1 < argc) {
+      if (synthetic_parse_size(argv[++i], &synthetic) != 0) {
+        fprintf(stderr, "Invalid --synthetic size: %s\n", argv[i]);
+        return 1;
+      }
+      use_synthetic = 1;
+    } else if (strcmp(argv[i], "--synthetic-damage") == 0 && i + 1 < argc) {
+      if (synthetic_parse_damage(argv[++i], &synthetic.damage) != 0) {
+        fprintf(stderr, "Unknown --synthetic-damage: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      synthetic.replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_path = argv[++i];
     } else if (strcmp(argv[i], "--help") == 0) {
       print_usage(argv[0]);
       return 0;
@@ -138,6 +332,19 @@ int main(int argc, char **argv) {
     quality = 100;
   }
 
+  if (synthetic.replay_path && !use_synthetic) {
+    fprintf(stderr, "--replay needs the frame size from --synthetic WxH\n");
+    return 1;
+  }
+
+  /* Synthetic frames live in memory; there is nothing to export as dmabuf */
+  if (use_synthetic && (use_dmabuf || use_rga || use_opencl)) {
+    fprintf(stderr, "--synthetic captures to memory, disabling --dmabuf/--rga/--opencl\n");
+    use_dmabuf = 0;
+    use_rga = 0;
+    use_opencl = 0;
+  }
+
   /* RGA requires both dmabuf and hw-jpeg */
   if (use_rga) {
     if (!use_dmabuf) {
@@ -166,6 +373,20 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (use_rga && scale_num != scale_den) {
+    fprintf(stderr, "--rga converts at full size, ignoring --scale\n");
+    scale_num = 0;
+    scale_den = 0;
+  }
+
+  /* Tiles are encoded with turbojpeg straight from the captured pixels */
+  if (tile_size > 0 && (use_hw_jpeg || use_rga || use_opencl)) {
+    fprintf(stderr, "--tiles uses the software encoder, disabling --hw-jpeg/--rga/--opencl\n");
+    use_hw_jpeg = 0;
+    use_rga = 0;
+    use_opencl = 0;
+  }
+
   signal(SIGINT, handle_sigint);
   signal(SIGTERM, handle_sigint);
 
@@ -181,7 +402,14 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (!use_dmabuf) {
+  if (use_synthetic) {
+    if (synthetic_capture_init(&capture, &synthetic) != 0) {
+      fprintf(stderr, "Failed to initialize synthetic capture\n");
+      return 1;
+    }
+    printf("Synthetic capture: %ux%u%s\n", synthetic.width, synthetic.height,
+           synthetic.replay_path ? " replay" : " test pattern");
+  } else if (!use_dmabuf) {
     if (capture_init(&capture, overlay_cursor) != 0) {
       fprintf(stderr, "Failed to initialize capture\n");
       return 1;
@@ -201,46 +429,81 @@ int main(int argc, char **argv) {
     }
     return 1;
   }
+  if (mtu_chunks) {
+    int gso = udp_sender_set_mtu_mode(&sender);
+    printf("Sending MTU-sized chunks (%s)\n",
+           gso ? "UDP GSO" : "GSO unavailable, one datagram per chunk");
+  }
+  if (fec_group > 0) {
+    if (udp_sender_set_fec(&sender, fec_group, fec_parity) != 0) {
+      udp_sender_close(&sender);
+      if (use_dmabuf) {
+        dmabuf_capture_shutdown(dmabuf_capture);
+      } else {
+        capture_shutdown(capture);
+      }
+      return 1;
+    }
+    printf("FEC: %d %s parity per %d chunks (%.1f%% overhead)\n", fec_parity,
+           fec_parity > 1 ? "Reed-Solomon" : "XOR", fec_group,
+           100.0 * fec_parity / fec_group);
+  }
 
-  struct jpeg_encoder encoder;
-  int sw_encoder_ready = 0;
-  struct v4l2_jpeg_encoder hw_encoder;
-  int hw_encoder_ready = 0;
-  struct v4l2_rga_converter rga_converter;
-  int rga_ready = 0;
-#ifdef HAVE_OPENCL
-  struct opencl_converter *opencl_conv = NULL;
-#endif
-#ifdef HAVE_AUDIO
-  struct audio_streamer *audio = NULL;
-#endif
-
-  if (!use_hw_jpeg) {
-    if (jpeg_encoder_init(&encoder, quality) != 0) {
-      fprintf(stderr, "Failed to initialize JPEG encoder\n");
+  if (pace_fraction > 0) {
+    if (udp_sender_set_pacing(&sender, pace_fraction) != 0) {
       udp_sender_close(&sender);
-      capture_shutdown(capture);
+      if (use_dmabuf) {
+        dmabuf_capture_shutdown(dmabuf_capture);
+      } else {
+        capture_shutdown(capture);
+      }
       return 1;
     }
-    sw_encoder_ready = 1;
+    printf("Pacing frames over %.0f%% of the frame interval\n",
+           100.0 * pace_fraction);
   }
 
+#ifdef HAVE_AUDIO
+  struct audio_streamer *audio = NULL;
+#endif
+
   uint64_t frame_interval_ms = 0;
   if (fps_limit > 0) {
     frame_interval_ms = 1000u / (uint64_t)fps_limit;
   }
+  udp_sender_set_retransmit(&sender, use_nack);
+  udp_sender_set_frame_interval(&sender, frame_interval_ms);
+
+  struct congestion *congestion = NULL;
+  if (target_fps > 0) {
+    struct congestion_config cc_cfg = {
+      .target_fps = target_fps,
+      .quality = quality,
+      /* A fixed --scale stays; RGA can't scale */
+      .allow_scaling = scale_num == 0 && !use_rga,
+    };
+    if (congestion_init(&congestion, &cc_cfg) != 0) {
+      fprintf(stderr, "Warning: Failed to set up congestion control, quality stays fixed\n");
+      congestion = NULL;
+    }
+    udp_sender_set_congestion(&sender, congestion);
+  }
 
   uint64_t last_fps_ts = now_ms();
   unsigned int frame_counter = 0;
+  unsigned long total_jpeg_bytes = 0;
+  int frames_lost_seen = 0;
 
-  /* Pipelining state for OpenCL path */
-  struct dmabuf_pending_frame *pending_capture = NULL;
-  int pipeline_active = 0;
+  if (trace_path && trace_start(trace_path) == 0) {
+    printf("Tracing to %s\n", trace_path);
+  }
 
-  /* Timing debug (enable with SM_TIMING_DEBUG=1) */
-  int timing_debug = (getenv("SM_TIMING_DEBUG") != NULL);
-  uint64_t t0 = 0, t1 = 0, t2 = 0, t3 = 0, t4 = 0;
-  (void)t0; (void)t1; (void)t2; (void)t3; (void)t4; /* Suppress unused warnings */
+  struct stream_metrics metrics;
+  register_metrics(&metrics);
+  metric_set(metrics.quality, quality);
+  if (metrics_path && metrics_start(metrics_path) == 0) {
+    printf("Exporting metrics to %s\n", metrics_path);
+  }
 
 #ifdef HAVE_AUDIO
   /* Initialize and start audio streaming */
@@ -257,440 +520,169 @@ int main(int argc, char **argv) {
   }
 #endif
 
-  while (g_running) {
-    uint64_t frame_start = now_ms();
-    struct capture_frame frame;
-    struct dmabuf_frame dma_frame;
-    int capture_ok = 0;
-
-    if (timing_debug) t0 = now_ms();
+  /* Capture, convert and encode run on their own threads; this thread is
+   * the send stage. */
+  struct pipeline_config pipe_cfg = {
+    .use_dmabuf = use_dmabuf,
+    .use_rga = use_rga,
+    .use_opencl = use_opencl,
+    .use_hw_jpeg = use_hw_jpeg,
+    .use_damage = use_damage,
+    .use_hash = use_hash,
+    .tile_size = tile_size,
+    .quality = quality,
+    .scale_num = scale_num,
+    .scale_den = scale_den,
+    .frame_interval_ms = frame_interval_ms,
+    .capture = capture,
+    .dmabuf_capture = dmabuf_capture,
+  };
+  struct pipeline *pipeline = NULL;
+  if (pipeline_start(&pipeline, &pipe_cfg) != 0) {
+    fprintf(stderr, "Failed to start capture pipeline\n");
+    g_running = 0;
+  }
 
-    if (use_dmabuf) {
-#ifdef HAVE_OPENCL
-      if (use_opencl && pipeline_active && pending_capture) {
-        /* Pipelined path: wait for previously requested frame */
-        if (dmabuf_capture_finish(dmabuf_capture, pending_capture, &dma_frame) == 0) {
-          capture_ok = 1;
-          if (timing_debug) t1 = now_ms();
-          /* Immediately request next frame to maintain pipeline */
-          pending_capture = dmabuf_capture_request(dmabuf_capture);
-          if (timing_debug) fprintf(stderr, "[PIPE] wait=%lums ", (unsigned long)(t1 - t0));
-        } else {
-          fprintf(stderr, "dmabuf pipelined capture failed\n");
-          pending_capture = NULL;
-        }
-      } else
-#endif
-      if (dmabuf_capture_next_frame(dmabuf_capture, &dma_frame) == 0) {
-        if (timing_debug) t1 = now_ms();
-        if (use_rga) {
-          /* RGA path: map the dmabuf for potential USERPTR fallback */
-          if (dmabuf_frame_map(&dma_frame) == 0) {
-            capture_ok = 1;
-          } else {
-            fprintf(stderr, "dmabuf map failed for RGA\n");
-            dmabuf_frame_release(&dma_frame);
-          }
-#ifdef HAVE_OPENCL
-        } else if (use_opencl) {
-          /* OpenCL path: only need the dmabuf FD, skip CPU mapping */
-          capture_ok = 1;
-          /* Request next frame NOW so capture overlaps with convert+encode */
-          if (pipeline_active) {
-            pending_capture = dmabuf_capture_request(dmabuf_capture);
-          }
-          pipeline_active = 1; /* Enable pipelining after first frame */
-          if (timing_debug) fprintf(stderr, "[SYNC] cap=%lums ", (unsigned long)(t1 - t0));
-#endif
-        } else if (dmabuf_frame_map(&dma_frame) == 0) {
-          frame.format = dma_frame.format;
-          frame.width = dma_frame.width;
-          frame.height = dma_frame.height;
-          frame.stride = dma_frame.objects[0].stride;
-          frame.data = (char *)dma_frame.mapped_data + dma_frame.objects[0].offset;
-          frame.y_invert = 0;
-          capture_ok = 1;
-        } else {
-          fprintf(stderr, "dmabuf map failed\n");
-          dmabuf_frame_release(&dma_frame);
-        }
-      } else {
-        fprintf(stderr, "dmabuf capture failed\n");
-      }
-    } else {
-      if (capture_next_frame(capture, &frame) == 0) {
-        capture_ok = 1;
-      } else {
-        fprintf(stderr, "Capture failed\n");
-        break;
-      }
+  while (g_running) {
+    struct pipeline_frame pf;
+    /* Wake for viewer feedback too, so NACKs are answered while the next
+     * frame is still being encoded */
+    int rc = pipeline_next_encoded(pipeline, &pf, sender.fd, 100);
+    if (rc < 0) {
+      break;
     }
-
-    if (!capture_ok) {
+    if (rc == 0) {
+      /* Nothing encoded yet; keep RTT/loss stats fresh */
+      udp_sender_poll_acks(&sender);
+      update_congestion(congestion, pipeline, &sender, &quality, target_fps,
+                        fps_limit);
       continue;
     }
 
-    unsigned char *jpeg_data = NULL;
-    unsigned long jpeg_size = 0;
-
-#ifdef HAVE_OPENCL
-    if (use_opencl) {
-      /* OpenCL zero-copy path: dmabuf → GPU kernel → YUYV dmabuf → JPEG encoder */
-      int w = (int)dma_frame.width;
-      int h = (int)dma_frame.height;
-
-      /* Initialize OpenCL converter on first frame */
-      if (!opencl_conv) {
-        opencl_conv = opencl_convert_init(w, h);
-        if (!opencl_conv) {
-          fprintf(stderr, "Failed to initialize OpenCL converter\n");
-          dmabuf_frame_release(&dma_frame);
-          break;
-        }
-      }
-
-      /* Initialize HW JPEG encoder on first frame (YUYV format) */
-      if (!hw_encoder_ready) {
-        if (v4l2_jpeg_init(&hw_encoder, w, h, quality) != 0) {
-          fprintf(stderr, "Failed to initialize HW JPEG encoder for OpenCL\n");
-          dmabuf_frame_release(&dma_frame);
-          break;
-        }
-        hw_encoder_ready = 1;
-      }
-
-      /* Convert XRGB → YUYV using OpenCL (zero-copy dmabuf import) */
-      if (timing_debug) t2 = now_ms();
-      int output_fd;
-      size_t output_size;
-      size_t input_size = (size_t)w * h * 4;
-      if (opencl_convert(opencl_conv, dma_frame.objects[0].fd, input_size,
-                         &output_fd, &output_size) != 0) {
-        fprintf(stderr, "OpenCL conversion failed\n");
-        dmabuf_frame_release(&dma_frame);
-        continue;
-      }
-      if (timing_debug) t3 = now_ms();
-
-      /* Get mapped YUYV data for JPEG encoder */
-      void *yuyv_data;
-      opencl_convert_get_output(opencl_conv, NULL, &yuyv_data, NULL);
-
-      /* Create a frame struct for the JPEG encoder */
-      struct capture_frame yuyv_frame;
-      yuyv_frame.format = FOURCC_YUYV;
-      yuyv_frame.width = (uint32_t)w;
-      yuyv_frame.height = (uint32_t)h;
-      yuyv_frame.stride = (uint32_t)(w * 2);
-      yuyv_frame.data = yuyv_data;
-      yuyv_frame.y_invert = 0;
-
-      /* Encode YUYV to JPEG */
-      if (v4l2_jpeg_encode_frame(&hw_encoder, &yuyv_frame, &jpeg_data,
-                                  &jpeg_size) != 0) {
-        fprintf(stderr, "HW JPEG encode (OpenCL) failed\n");
-        dmabuf_frame_release(&dma_frame);
-        continue;
-      }
-      if (timing_debug) {
-        t4 = now_ms();
-        fprintf(stderr, "ocl=%lums enc=%lums ", (unsigned long)(t3 - t2), (unsigned long)(t4 - t3));
-      }
-    } else
-#endif
-    if (use_rga) {
-      /* RGA + HW JPEG path */
-      int w = (int)dma_frame.width;
-      int h = (int)dma_frame.height;
-
-      /* Initialize RGA and JPEG encoder on first frame */
-      if (!rga_ready) {
-        if (v4l2_rga_init(&rga_converter, w, h) != 0) {
-          fprintf(stderr, "Failed to initialize RGA\n");
-          dmabuf_frame_release(&dma_frame);
-          break;
-        }
-        rga_ready = 1;
-        fprintf(stderr, "RGA initialized for %dx%d\n", w, h);
-      }
-      if (!hw_encoder_ready) {
-        /* Use NV12-specific init for RGA path */
-        if (v4l2_jpeg_init_nv12(&hw_encoder, w, h, quality) != 0) {
-          fprintf(stderr, "Failed to initialize HW JPEG encoder for NV12\n");
-          dmabuf_frame_release(&dma_frame);
-          break;
-        }
-        hw_encoder_ready = 1;
-      }
-
-      /* Convert XRGB8888 -> NV12 using RGA */
-      void *y_plane = NULL, *uv_plane = NULL;
-      unsigned int y_stride = 0, uv_stride = 0;
-      void *mapped_ptr = (char *)dma_frame.mapped_data + dma_frame.objects[0].offset;
-      if (v4l2_rga_convert_dmabuf(&rga_converter, dma_frame.objects[0].fd,
-                                   mapped_ptr,
-                                   &y_plane, &y_stride,
-                                   &uv_plane, &uv_stride) != 0) {
-        fprintf(stderr, "RGA conversion failed\n");
-        dmabuf_frame_release(&dma_frame);
-        continue;
-      }
-
-      /* Encode NV12 to JPEG */
-      if (v4l2_jpeg_encode_nv12(&hw_encoder, y_plane, y_stride,
-                                 uv_plane, uv_stride,
-                                 &jpeg_data, &jpeg_size) != 0) {
-        fprintf(stderr, "HW JPEG encode (NV12) failed\n");
-        dmabuf_frame_release(&dma_frame);
-        continue;
-      }
-    } else if (use_hw_jpeg) {
-      if (!hw_encoder_ready) {
-        if (v4l2_jpeg_init(&hw_encoder, (int)frame.width, (int)frame.height,
-                           quality) != 0) {
-          fprintf(stderr, "Failed to initialize HW JPEG encoder\n");
-          if (use_dmabuf) {
-            dmabuf_frame_release(&dma_frame);
-          }
-          break;
-        }
-        hw_encoder_ready = 1;
-      }
-      if (v4l2_jpeg_encode_frame(&hw_encoder, &frame, &jpeg_data,
-                                &jpeg_size) != 0) {
-        fprintf(stderr, "HW JPEG encode failed\n");
-        if (use_dmabuf) {
-          dmabuf_frame_release(&dma_frame);
-        }
-        continue;
-      }
-    } else {
-      if (jpeg_encode_frame(&encoder, &frame, &jpeg_data, &jpeg_size) != 0) {
-        fprintf(stderr, "JPEG encode failed\n");
-        if (use_dmabuf) {
-          dmabuf_frame_release(&dma_frame);
-        }
-        continue;
-      }
-    }
-
-    /* Release dmabuf after encoding (all error paths above handle their own release) */
-    uint64_t t5 = 0, t6 = 0;
-    if (timing_debug) t5 = now_ms();
-    if (use_dmabuf) {
-      dmabuf_frame_release(&dma_frame);
-    }
-    if (timing_debug) t6 = now_ms();
-
-    if (udp_sender_send_frame(&sender, jpeg_data, jpeg_size) != 0) {
+    unsigned long jpeg_size = pf.jpeg_size;
+    struct frame_times times = {
+      .capture_time_us = pf.capture_time_us,
+      .capture_us = pf.capture_start_us + pf.capture_us - pf.capture_time_us,
+      .convert_us = pf.convert_us,
+      .encode_us = pf.encode_us,
+    };
+    /* The sender keeps the JPEG slot for retransmission */
+    atomic_int *jpeg_hold = pf.jpeg_hold;
+    pf.jpeg_hold = NULL;
+    if (udp_sender_send_timed_frame(&sender, pf.jpeg, jpeg_size, &times,
+                                    jpeg_hold) != 0) {
       fprintf(stderr, "UDP send failed\n");
+      pipeline_frame_release(&pf);
       break;
     }
+    pipeline_frame_release(&pf);
 
     /* Poll for ACKs from viewer */
     udp_sender_poll_acks(&sender);
 
-    if (timing_debug) {
-      uint64_t t7 = now_ms();
-      fprintf(stderr, "rel=%lums udp=%lums ", (unsigned long)(t6 - t5), (unsigned long)(t7 - t6));
+    /* A lost tiled frame leaves stale tiles on the viewer; resend them all */
+    const struct network_stats *loss_stats = udp_sender_get_stats(&sender);
+    if (loss_stats->frames_lost > frames_lost_seen) {
+      pipeline_request_keyframe(pipeline);
     }
+    frames_lost_seen = loss_stats->frames_lost;
+
+    uint64_t capture_to_send_us = now_us() - pf.capture_start_us;
+    trace_counter("capture_to_send_ms", (int64_t)(capture_to_send_us / 1000u));
+    metric_inc(metrics.frames);
+    metric_add(metrics.bytes, jpeg_size);
+    metric_observe(metrics.frame_bytes, (double)jpeg_size);
+    metric_observe(metrics.encode_ms, (double)pf.encode_us / 1000.0);
+    metric_observe(metrics.capture_to_send_ms, (double)capture_to_send_us / 1000.0);
 
     frame_counter++;
-    uint64_t now = now_ms();
-    static unsigned long total_jpeg_bytes = 0;
     total_jpeg_bytes += jpeg_size;
+    update_congestion(congestion, pipeline, &sender, &quality, target_fps,
+                      fps_limit);
+
+    uint64_t now = now_ms();
     if (now - last_fps_ts >= 1000u) {
       unsigned long avg_kb = frame_counter > 0 ? (total_jpeg_bytes / 1024) / frame_counter : 0;
       const struct network_stats *net = udp_sender_get_stats(&sender);
-      int old_quality = quality;
-
-      /* Adaptive target FPS: lower target when quality stuck at floor */
-      static int effective_target_fps = 0;
-      static int quality_floor_seconds = 0;
-      static int quality_recovered_seconds = 0;
-      if (effective_target_fps == 0) {
-        effective_target_fps = target_fps;  /* Initialize on first run */
+      fprintf(stderr, "fps=%u avg_kb=%lu total_kb=%lu q=%d", frame_counter,
+              avg_kb, total_jpeg_bytes / 1024, quality);
+      if (net->viewer_connected) {
+        int loss_pct = net->frames_sent > 0 ? (net->frames_lost * 100) / net->frames_sent : 0;
+        double base_rtt = net->min_rtt_ms > 0 ? net->min_rtt_ms : net->smoothed_rtt_ms;
+        fprintf(stderr, " [net: rtt=%.0f/%.0fms loss=%d%% acked=%d/%d]",
+                net->smoothed_rtt_ms, base_rtt, loss_pct, net->frames_acked,
+                net->frames_sent);
+        if (net->chunks_resent > 0 || net->nacks_expired > 0) {
+          fprintf(stderr, " rtx=%d late=%d", net->chunks_resent,
+                  net->nacks_expired);
+        }
       }
-
-      /* Adaptive quality: use network feedback if viewer connected, else local FPS */
-      if (target_fps > 0) {
-        if (net->viewer_connected) {
-          /* Network-based adaptation: use packet loss and RTT */
-          int loss_pct = 0;
-          if (net->frames_sent > 0) {
-            loss_pct = (net->frames_lost * 100) / net->frames_sent;
-          }
-          double rtt = net->smoothed_rtt_ms;
-          double base_rtt = net->min_rtt_ms > 0 ? net->min_rtt_ms : rtt;
-
-          /* RTT thresholds relative to baseline */
-          double rtt_reduce = base_rtt * 3.0;   /* 3x baseline: reduce quality */
-          double rtt_hold = base_rtt * 2.0;     /* 2x baseline: hold steady */
-
-          if (loss_pct > 10) {
-            /* High packet loss: reduce quality aggressively */
-            quality -= 10;
-            if (quality < 30) quality = 30;
-          } else if (loss_pct > 3) {
-            /* Moderate loss: reduce quality */
-            quality -= 5;
-            if (quality < 50) quality = 50;
-          } else if (rtt > rtt_reduce) {
-            /* RTT too high: proactively reduce quality before loss occurs */
-            quality -= 3;
-            if (quality < 50) quality = 50;
-          } else if (rtt > rtt_hold) {
-            /* RTT elevated: hold quality steady, don't increase */
-            /* (do nothing) */
-          } else if (loss_pct == 0 && net->frames_acked > 5 && quality < 95) {
-            /* Low RTT, no loss, getting ACKs: can increase quality */
-            quality += 2;
-            if (quality > 95) quality = 95;
-          }
-
-          /* Print with network stats */
-          if (quality != old_quality) {
-            fprintf(stderr, "fps=%u avg_kb=%lu total_kb=%lu q=%d->%d [net: rtt=%.0f/%.0fms loss=%d%% acked=%d/%d]",
-                    frame_counter, avg_kb, total_jpeg_bytes / 1024, old_quality, quality,
-                    rtt, base_rtt, loss_pct, net->frames_acked, net->frames_sent);
-          } else {
-            fprintf(stderr, "fps=%u avg_kb=%lu total_kb=%lu q=%d [net: rtt=%.0f/%.0fms loss=%d%% acked=%d/%d]",
-                    frame_counter, avg_kb, total_jpeg_bytes / 1024, quality,
-                    rtt, base_rtt, loss_pct, net->frames_acked, net->frames_sent);
-          }
-          if (effective_target_fps != target_fps) {
-            fprintf(stderr, " target=%d", effective_target_fps);
-          }
-          fprintf(stderr, "\n");
-        } else {
-          /* No viewer: use local FPS-based adaptation */
-          int fps_diff = (int)frame_counter - effective_target_fps;
-
-          if (fps_diff < -5) {
-            quality -= 5;
-            if (quality < 50) quality = 50;
-          } else if (fps_diff >= 0 && quality < 95) {
-            quality += 2;
-            if (quality > 95) quality = 95;
-          }
-
-          if (effective_target_fps != target_fps) {
-            fprintf(stderr, "fps=%u avg_kb=%lu total_kb=%lu q=%d target=%d\n",
-                    frame_counter, avg_kb, total_jpeg_bytes / 1024, quality, effective_target_fps);
-          } else if (quality != old_quality) {
-            fprintf(stderr, "fps=%u avg_kb=%lu total_kb=%lu q=%d->%d\n",
-                    frame_counter, avg_kb, total_jpeg_bytes / 1024, old_quality, quality);
-          } else {
-            fprintf(stderr, "fps=%u avg_kb=%lu total_kb=%lu q=%d\n",
-                    frame_counter, avg_kb, total_jpeg_bytes / 1024, quality);
-          }
+      if (congestion) {
+        struct congestion_stats cc;
+        congestion_get_stats(congestion, &cc);
+        if (cc.have_feedback) {
+          fprintf(stderr, " [cc: %s target=%.1f recv=%.1f path=%.1f Mbit/s]",
+                  cc.state, cc.target_bps / 1e6, cc.receive_bps / 1e6,
+                  cc.bottleneck_bps / 1e6);
         }
-
-        /* Update encoder quality if changed */
-        if (quality != old_quality) {
-          if (hw_encoder_ready) {
-            v4l2_jpeg_set_quality(&hw_encoder, quality);
-          }
-          if (sw_encoder_ready) {
-            jpeg_encoder_set_quality(&encoder, quality);
-          }
+        if (congestion_fps(congestion) != target_fps) {
+          fprintf(stderr, " target=%d", congestion_fps(congestion));
         }
+        metric_set(metrics.target_bitrate, cc.target_bps);
+        metric_set(metrics.fps_limit, congestion_fps(congestion));
+      }
+      int sent_num = scale_num > 0 ? scale_num : 1;
+      int sent_den = scale_num > 0 ? scale_den : 1;
+      if (congestion && scale_num == 0) {
+        congestion_scale(congestion, &sent_num, &sent_den);
+      }
+      if (sent_num != sent_den) {
+        fprintf(stderr, " scale=%d/%d", sent_num, sent_den);
+      }
+      metric_set(metrics.scale, (double)sent_num / sent_den);
+      fputc('\n', stderr);
 
-        /* Adaptive target FPS: adjust when quality stuck at floor or recovered */
-        if (quality <= 35) {
-          /* Quality at or near floor */
-          quality_floor_seconds++;
-          quality_recovered_seconds = 0;
-          if (quality_floor_seconds >= 5 && effective_target_fps > 15) {
-            /* Stuck at floor for 5+ seconds: reduce target FPS */
-            effective_target_fps -= 10;
-            if (effective_target_fps < 15) effective_target_fps = 15;
-            quality_floor_seconds = 0;
-            /* Also throttle actual frame rate */
-            frame_interval_ms = 1000u / (uint64_t)effective_target_fps;
-            fprintf(stderr, "  -> target fps reduced to %d, throttling to %lums/frame\n",
-                    effective_target_fps, (unsigned long)frame_interval_ms);
-          }
-        } else if (quality >= 60 && effective_target_fps < target_fps) {
-          /* Quality recovered above 60 */
-          quality_floor_seconds = 0;
-          quality_recovered_seconds++;
-          if (quality_recovered_seconds >= 10) {
-            /* Stable for 10+ seconds: try increasing target FPS */
-            effective_target_fps += 5;
-            if (effective_target_fps > target_fps) effective_target_fps = target_fps;
-            quality_recovered_seconds = 0;
-            /* Update frame rate throttle */
-            if (effective_target_fps >= target_fps) {
-              frame_interval_ms = fps_limit > 0 ? 1000u / (uint64_t)fps_limit : 0;
-            } else {
-              frame_interval_ms = 1000u / (uint64_t)effective_target_fps;
-            }
-            fprintf(stderr, "  -> target fps increased to %d\n", effective_target_fps);
-          }
-        } else {
-          /* Quality in middle range - reset counters */
-          quality_floor_seconds = 0;
-          quality_recovered_seconds = 0;
-        }
-      } else {
-        /* No target FPS: just print stats */
-        if (net->viewer_connected) {
-          int loss_pct = net->frames_sent > 0 ? (net->frames_lost * 100) / net->frames_sent : 0;
-          double base_rtt = net->min_rtt_ms > 0 ? net->min_rtt_ms : net->smoothed_rtt_ms;
-          fprintf(stderr, "fps=%u avg_kb=%lu total_kb=%lu q=%d [net: rtt=%.0f/%.0fms loss=%d%% acked=%d/%d]\n",
-                  frame_counter, avg_kb, total_jpeg_bytes / 1024, quality,
-                  net->smoothed_rtt_ms, base_rtt, loss_pct, net->frames_acked, net->frames_sent);
-        } else {
-          fprintf(stderr, "fps=%u avg_kb=%lu total_kb=%lu q=%d\n",
-                  frame_counter, avg_kb, total_jpeg_bytes / 1024, quality);
-        }
+      unsigned int dropped = pipeline_take_dropped(pipeline);
+      if (dropped > 0) {
+        fprintf(stderr, "  -> %u frames dropped between pipeline stages\n", dropped);
+      }
+
+      metric_set(metrics.fps, frame_counter);
+      metric_set(metrics.quality, quality);
+      metric_set(metrics.viewer_connected, net->viewer_connected);
+      if (net->viewer_connected) {
+        metric_set(metrics.rtt_ms, net->smoothed_rtt_ms);
+        metric_set(metrics.min_rtt_ms, net->min_rtt_ms);
+        metric_set(metrics.viewer_fps, net->viewer_fps);
+        metric_set(metrics.loss, net->frames_sent > 0
+                                     ? (double)net->frames_lost / net->frames_sent
+                                     : 0.0);
       }
+      metric_add(metrics.frames_lost, (uint64_t)net->frames_lost);
+      metric_add(metrics.chunks_resent, (uint64_t)net->chunks_resent);
+      metric_add(metrics.pipeline_dropped, dropped);
 
       /* Reset stats for next window */
       udp_sender_reset_stats(&sender);
+      frames_lost_seen = 0;
       frame_counter = 0;
       total_jpeg_bytes = 0;
       last_fps_ts = now;
     }
 
-    if (timing_debug) {
-      uint64_t loop_end = now_ms();
-      fprintf(stderr, "total=%lums\n", (unsigned long)(loop_end - frame_start));
-    }
-
-    if (frame_interval_ms > 0) {
-      uint64_t elapsed = now_ms() - frame_start;
-      if (elapsed < frame_interval_ms) {
-        sleep_ms(frame_interval_ms - elapsed);
-      }
-    }
   }
 
-  if (sw_encoder_ready) {
-    jpeg_encoder_destroy(&encoder);
-  }
-  if (hw_encoder_ready) {
-    v4l2_jpeg_destroy(&hw_encoder);
-  }
-  if (rga_ready) {
-    v4l2_rga_destroy(&rga_converter);
-  }
-#ifdef HAVE_OPENCL
-  if (pending_capture) {
-    dmabuf_capture_cancel(pending_capture);
-    pending_capture = NULL;
-  }
-  if (opencl_conv) {
-    opencl_convert_destroy(opencl_conv);
-  }
-#endif
+  udp_sender_drop_cache(&sender);
+  pipeline_stop(pipeline);
 #ifdef HAVE_AUDIO
   if (audio) {
     audio_streamer_destroy(audio);
   }
 #endif
+  trace_stop();
+  metrics_stop();
   udp_sender_close(&sender);
+  congestion_destroy(congestion);
   if (use_dmabuf) {
     dmabuf_capture_shutdown(dmabuf_capture);
   } else {
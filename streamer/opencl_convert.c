@@ -9,8 +9,13 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/dma-heap.h>
 
+/* Imported capture buffers kept around. The compositor cycles through 2-3
+ * swapchain buffers, so this covers all of them with room for a resize. */
+#define INPUT_CACHE_SIZE 4
+
 /* ARM import memory extension */
 typedef intptr_t cl_import_properties_arm;
 #define CL_IMPORT_TYPE_ARM           0x40B2
@@ -67,9 +72,133 @@ static const char *xrgb_to_yuyv_kernel_src =
 "    output[y * (width/2) + x] = out;\n"
 "}\n";
 
+/* XRGB to NV12 (4:2:0) conversion kernel
+ * Input: XRGB8888 (BGRX in memory) - 4 bytes per pixel
+ * Output: Y plane (width bytes per row), then interleaved CbCr at half
+ *         resolution (width bytes per row) - 1.5 bytes per pixel
+ *
+ * Each work item converts one 2x2 block: four Y samples and one Cb/Cr pair
+ * from the block's average colour. Same JFIF full-range coefficients as
+ * the YUYV kernel, in 8-bit fixed point (x256) so no float is involved;
+ * offsets keep every intermediate non-negative before the shift.
+ */
+static const char *xrgb_to_nv12_kernel_src =
+"__kernel void xrgb_to_nv12(__global const uchar4 *input,\n"
+"                           __global uchar *output,\n"
+"                           int width, int height) {\n"
+"    int x = get_global_id(0);  /* 2x2 block column */\n"
+"    int y = get_global_id(1);  /* 2x2 block row */\n"
+"    \n"
+"    if (x >= width/2 || y >= height/2) return;\n"
+"    \n"
+"    int idx = (y * 2) * width + x * 2;\n"
+"    int4 p0 = convert_int4(input[idx]);\n"
+"    int4 p1 = convert_int4(input[idx + 1]);\n"
+"    int4 p2 = convert_int4(input[idx + width]);\n"
+"    int4 p3 = convert_int4(input[idx + width + 1]);\n"
+"    \n"
+"    /* Y = (77 R + 150 G + 29 B) / 256, rounded (BGRX: B=x, G=y, R=z) */\n"
+"    __global uchar *y_row = output + (y * 2) * width + x * 2;\n"
+"    y_row[0] = (uchar)((77 * p0.z + 150 * p0.y + 29 * p0.x + 128) >> 8);\n"
+"    y_row[1] = (uchar)((77 * p1.z + 150 * p1.y + 29 * p1.x + 128) >> 8);\n"
+"    y_row[width] = (uchar)((77 * p2.z + 150 * p2.y + 29 * p2.x + 128) >> 8);\n"
+"    y_row[width + 1] = (uchar)((77 * p3.z + 150 * p3.y + 29 * p3.x + 128) >> 8);\n"
+"    \n"
+"    /* Chroma of the block average: the sums are 4x, so shift by 10 */\n"
+"    int4 sum = p0 + p1 + p2 + p3;\n"
+"    int u = (-43 * sum.z - 85 * sum.y + 128 * sum.x + (128 << 10) + 512) >> 10;\n"
+"    int v = (128 * sum.z - 107 * sum.y - 21 * sum.x + (128 << 10) + 512) >> 10;\n"
+"    \n"
+"    __global uchar *uv = output + width * height + y * width + x * 2;\n"
+"    uv[0] = (uchar)min(u, 255);\n"
+"    uv[1] = (uchar)min(v, 255);\n"
+"}\n";
+
+/* Scaled variants of the kernels above, for sending fewer pixels than
+ * the screen has. Each output pixel is a bilinear sample at its centre
+ * (exactly a 2x2 box at half size), computed in 8-bit fixed point like the
+ * streamer's CPU scaler, then converted as in xrgb_to_nv12. step_x/step_y
+ * are source pixels per output pixel in 16.16 fixed point.
+ */
+static const char *scaled_kernel_src =
+"int2 scale_tap(int i, int step, int size) {\n"
+"    int pos = max(((i * step + step / 2) >> 8) - 128, 0);\n"
+"    int2 tap = (int2)(pos >> 8, pos & 255);  /* pixel, weight of next */\n"
+"    if (tap.x >= size - 1) tap = (int2)(size - 1, 0);\n"
+"    return tap;\n"
+"}\n"
+"\n"
+"int4 sample_xrgb(__global const uchar4 *input, int src_width, int src_height,\n"
+"                 int x, int y, int step_x, int step_y) {\n"
+"    int2 tx = scale_tap(x, step_x, src_width);\n"
+"    int2 ty = scale_tap(y, step_y, src_height);\n"
+"    int x1 = tx.x + (tx.y ? 1 : 0);\n"
+"    __global const uchar4 *row0 = input + ty.x * src_width;\n"
+"    __global const uchar4 *row1 = input + (ty.x + (ty.y ? 1 : 0)) * src_width;\n"
+"    int4 top = convert_int4(row0[tx.x]) * (256 - tx.y) + convert_int4(row0[x1]) * tx.y;\n"
+"    int4 bottom = convert_int4(row1[tx.x]) * (256 - tx.y) + convert_int4(row1[x1]) * tx.y;\n"
+"    return (top * (256 - ty.y) + bottom * ty.y + 32768) >> 16;\n"
+"}\n"
+"\n"
+"uchar luma(int4 p) {\n"
+"    return (uchar)((77 * p.z + 150 * p.y + 29 * p.x + 128) >> 8);\n"
+"}\n"
+"\n"
+"/* Cb/Cr of a sum of 1 << shift pixels */\n"
+"uchar2 chroma(int4 sum, int shift) {\n"
+"    int offset = (128 << shift) + (1 << (shift - 1));\n"
+"    int u = (-43 * sum.z - 85 * sum.y + 128 * sum.x + (offset << 8)) >> (shift + 8);\n"
+"    int v = (128 * sum.z - 107 * sum.y - 21 * sum.x + (offset << 8)) >> (shift + 8);\n"
+"    return (uchar2)((uchar)min(u, 255), (uchar)min(v, 255));\n"
+"}\n"
+"\n"
+"__kernel void xrgb_to_yuyv_scaled(__global const uchar4 *input,\n"
+"                                  __global uchar4 *output,\n"
+"                                  int width, int height,\n"
+"                                  int src_width, int src_height,\n"
+"                                  int step_x, int step_y) {\n"
+"    int x = get_global_id(0);  /* output pixel pair */\n"
+"    int y = get_global_id(1);\n"
+"    if (x >= width/2 || y >= height) return;\n"
+"    \n"
+"    int4 p0 = sample_xrgb(input, src_width, src_height, x * 2, y, step_x, step_y);\n"
+"    int4 p1 = sample_xrgb(input, src_width, src_height, x * 2 + 1, y, step_x, step_y);\n"
+"    uchar2 uv = chroma(p0 + p1, 1);\n"
+"    output[y * (width/2) + x] = (uchar4)(luma(p0), uv.x, luma(p1), uv.y);\n"
+"}\n"
+"\n"
+"__kernel void xrgb_to_nv12_scaled(__global const uchar4 *input,\n"
+"                                  __global uchar *output,\n"
+"                                  int width, int height,\n"
+"                                  int src_width, int src_height,\n"
+"                                  int step_x, int step_y) {\n"
+"    int x = get_global_id(0);  /* output 2x2 block */\n"
+"    int y = get_global_id(1);\n"
+"    if (x >= width/2 || y >= height/2) return;\n"
+"    \n"
+"    int4 p0 = sample_xrgb(input, src_width, src_height, x * 2, y * 2, step_x, step_y);\n"
+"    int4 p1 = sample_xrgb(input, src_width, src_height, x * 2 + 1, y * 2, step_x, step_y);\n"
+"    int4 p2 = sample_xrgb(input, src_width, src_height, x * 2, y * 2 + 1, step_x, step_y);\n"
+"    int4 p3 = sample_xrgb(input, src_width, src_height, x * 2 + 1, y * 2 + 1, step_x, step_y);\n"
+"    \n"
+"    __global uchar *y_row = output + (y * 2) * width + x * 2;\n"
+"    y_row[0] = luma(p0);\n"
+"    y_row[1] = luma(p1);\n"
+"    y_row[width] = luma(p2);\n"
+"    y_row[width + 1] = luma(p3);\n"
+"    \n"
+"    uchar2 uv = chroma(p0 + p1 + p2 + p3, 2);\n"
+"    __global uchar *out_uv = output + width * height + y * width + x * 2;\n"
+"    out_uv[0] = uv.x;\n"
+"    out_uv[1] = uv.y;\n"
+"}\n";
+
 struct opencl_converter {
     int width;
     int height;
+    int out_width;             /* Scaled output size; width x height if not */
+    int out_height;
+    enum opencl_convert_format format;
     size_t input_size;
     size_t output_size;
 
@@ -80,18 +209,33 @@ struct opencl_converter {
     cl_command_queue queue;
     cl_program program;
     cl_kernel kernel;
+    cl_kernel scaled_kernel;
+    cl_kernel active;          /* kernel or scaled_kernel */
 
     /* ARM import function */
     clImportMemoryARM_fn clImportMemoryARM;
 
-    /* Output dmabuf (reused between frames) */
-    int output_dmabuf_fd;
-    void *output_map;
-    cl_mem output_cl_mem;
-
-    /* Cached input (to avoid reimporting same dmabuf) */
-    int last_input_fd;
-    cl_mem input_cl_mem;
+    /* Output dmabufs, written in turn so the encoder can read one while
+     * the GPU fills the other */
+    struct {
+        int dmabuf_fd;
+        void *map;
+        cl_mem mem;
+    } outputs[OPENCL_CONVERT_BUFFERS];
+
+    /* Imported inputs, keyed by buffer identity rather than fd number:
+     * every captured frame arrives with a fresh dup'd fd, but the buffer
+     * behind it (st_dev/st_ino of the dmabuf) is one of a few. */
+    struct {
+        dev_t dev;
+        ino_t ino;
+        size_t size;
+        uint64_t modifier;
+        cl_mem mem;            /* NULL = free slot */
+        uint64_t last_used;
+    } inputs[INPUT_CACHE_SIZE];
+    uint64_t use_counter;
+    cl_mem bound_input;        /* Current kernel arg 0 */
 };
 
 static int allocate_dmabuf(size_t size, int *fd_out) {
@@ -117,16 +261,35 @@ static int allocate_dmabuf(size_t size, int *fd_out) {
     return 0;
 }
 
-struct opencl_converter *opencl_convert_init(int width, int height) {
+size_t opencl_convert_output_size(int width, int height,
+                                  enum opencl_convert_format format) {
+    if (format == OPENCL_CONVERT_NV12) {
+        return (size_t)width * height * 3 / 2;  /* NV12: 1.5 bytes/pixel */
+    }
+    return (size_t)width * height * 2;  /* YUYV: 2 bytes/pixel */
+}
+
+struct opencl_converter *opencl_convert_init(int width, int height,
+                                             enum opencl_convert_format format) {
+    if (width % 2 != 0 || (format == OPENCL_CONVERT_NV12 && height % 2 != 0)) {
+        fprintf(stderr, "opencl: %dx%d is not a multiple of the chroma block\n",
+                width, height);
+        return NULL;
+    }
+
     struct opencl_converter *conv = calloc(1, sizeof(*conv));
     if (!conv) return NULL;
 
     conv->width = width;
     conv->height = height;
+    conv->out_width = width;
+    conv->out_height = height;
+    conv->format = format;
     conv->input_size = (size_t)width * height * 4;   /* XRGB: 4 bytes/pixel */
-    conv->output_size = (size_t)width * height * 2;  /* YUYV: 2 bytes/pixel */
-    conv->output_dmabuf_fd = -1;
-    conv->last_input_fd = -1;
+    conv->output_size = opencl_convert_output_size(width, height, format);
+    for (int i = 0; i < OPENCL_CONVERT_BUFFERS; i++) {
+        conv->outputs[i].dmabuf_fd = -1;
+    }
 
     cl_int err;
 
@@ -172,9 +335,17 @@ struct opencl_converter *opencl_convert_init(int width, int height) {
         goto fail;
     }
 
-    /* Build kernel */
-    conv->program = clCreateProgramWithSource(conv->context, 1,
-                                               &xrgb_to_yuyv_kernel_src, NULL, &err);
+    /* Build kernels */
+    const char *kernel_src[2] = {
+        format == OPENCL_CONVERT_NV12 ? xrgb_to_nv12_kernel_src : xrgb_to_yuyv_kernel_src,
+        scaled_kernel_src,
+    };
+    const char *kernel_name = format == OPENCL_CONVERT_NV12 ? "xrgb_to_nv12"
+                                                            : "xrgb_to_yuyv";
+    const char *scaled_name = format == OPENCL_CONVERT_NV12 ? "xrgb_to_nv12_scaled"
+                                                            : "xrgb_to_yuyv_scaled";
+    conv->program = clCreateProgramWithSource(conv->context, 2,
+                                               kernel_src, NULL, &err);
     if (err != CL_SUCCESS) {
         fprintf(stderr, "opencl: clCreateProgramWithSource failed: %d\n", err);
         goto fail;
@@ -189,47 +360,56 @@ struct opencl_converter *opencl_convert_init(int width, int height) {
         goto fail;
     }
 
-    conv->kernel = clCreateKernel(conv->program, "xrgb_to_yuyv", &err);
+    conv->kernel = clCreateKernel(conv->program, kernel_name, &err);
     if (err != CL_SUCCESS) {
         fprintf(stderr, "opencl: clCreateKernel failed: %d\n", err);
         goto fail;
     }
-
-    /* Allocate output dmabuf */
-    if (allocate_dmabuf(conv->output_size, &conv->output_dmabuf_fd) != 0) {
-        goto fail;
-    }
-
-    /* Map output for CPU access (JPEG encoder may need this) */
-    conv->output_map = mmap(NULL, conv->output_size, PROT_READ | PROT_WRITE,
-                            MAP_SHARED, conv->output_dmabuf_fd, 0);
-    if (conv->output_map == MAP_FAILED) {
-        perror("opencl: mmap output");
-        conv->output_map = NULL;
+    conv->scaled_kernel = clCreateKernel(conv->program, scaled_name, &err);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "opencl: clCreateKernel (scaled) failed: %d\n", err);
         goto fail;
     }
+    conv->active = conv->kernel;
 
-    /* Import output dmabuf into OpenCL */
+    /* Allocate, map (the JPEG encoder may read it) and import each output
+     * dmabuf */
     cl_import_properties_arm props[] = {
         CL_IMPORT_TYPE_ARM, CL_IMPORT_TYPE_DMA_BUF_ARM,
         0
     };
-    conv->output_cl_mem = conv->clImportMemoryARM(conv->context, CL_MEM_WRITE_ONLY,
-                                                   props, &conv->output_dmabuf_fd,
-                                                   conv->output_size, &err);
-    if (err != CL_SUCCESS || !conv->output_cl_mem) {
-        fprintf(stderr, "opencl: import output dmabuf failed: %d\n", err);
-        goto fail;
+    for (int i = 0; i < OPENCL_CONVERT_BUFFERS; i++) {
+        if (allocate_dmabuf(conv->output_size, &conv->outputs[i].dmabuf_fd) != 0) {
+            goto fail;
+        }
+
+        conv->outputs[i].map = mmap(NULL, conv->output_size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, conv->outputs[i].dmabuf_fd, 0);
+        if (conv->outputs[i].map == MAP_FAILED) {
+            perror("opencl: mmap output");
+            conv->outputs[i].map = NULL;
+            goto fail;
+        }
+
+        conv->outputs[i].mem = conv->clImportMemoryARM(conv->context, CL_MEM_WRITE_ONLY,
+                                                       props, &conv->outputs[i].dmabuf_fd,
+                                                       conv->output_size, &err);
+        if (err != CL_SUCCESS || !conv->outputs[i].mem) {
+            fprintf(stderr, "opencl: import output dmabuf failed: %d\n", err);
+            conv->outputs[i].mem = NULL;
+            goto fail;
+        }
     }
 
-    /* Set static kernel args */
-    clSetKernelArg(conv->kernel, 1, sizeof(cl_mem), &conv->output_cl_mem);
+    /* Set static kernel args; input and output are set per conversion,
+     * the scaled kernel's sizes by opencl_convert_set_output_size */
     clSetKernelArg(conv->kernel, 2, sizeof(int), &width);
     clSetKernelArg(conv->kernel, 3, sizeof(int), &height);
 
     char device_name[256];
     clGetDeviceInfo(conv->device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
-    fprintf(stderr, "OpenCL converter initialized: %s, %dx%d\n", device_name, width, height);
+    fprintf(stderr, "OpenCL converter initialized: %s, %dx%d -> %s\n", device_name,
+            width, height, format == OPENCL_CONVERT_NV12 ? "NV12" : "YUYV");
 
     return conv;
 
@@ -238,64 +418,177 @@ fail:
     return NULL;
 }
 
-int opencl_convert(struct opencl_converter *conv,
-                   int input_dmabuf_fd, size_t input_size,
-                   int *output_dmabuf_fd, size_t *output_size) {
+int opencl_convert_set_output_size(struct opencl_converter *conv,
+                                   int out_width, int out_height) {
     if (!conv) return -1;
+    if (out_width == conv->out_width && out_height == conv->out_height) return 0;
+
+    /* Same limits as the CPU scaler: down to half size, even for chroma */
+    int full = out_width == conv->width && out_height == conv->height;
+    if (!full && (out_width % 2 != 0 || out_height % 2 != 0 ||
+                  out_width > conv->width || out_height > conv->height ||
+                  2 * out_width + 2 < conv->width ||
+                  2 * out_height + 2 < conv->height)) {
+        fprintf(stderr, "opencl: can't scale %dx%d to %dx%d\n",
+                conv->width, conv->height, out_width, out_height);
+        return -1;
+    }
 
-    cl_int err;
+    cl_kernel kernel = conv->kernel;
+    if (!full) {
+        kernel = conv->scaled_kernel;
+        cl_int step_x = (cl_int)(((int64_t)conv->width << 16) / out_width);
+        cl_int step_y = (cl_int)(((int64_t)conv->height << 16) / out_height);
+        clSetKernelArg(kernel, 2, sizeof(int), &out_width);
+        clSetKernelArg(kernel, 3, sizeof(int), &out_height);
+        clSetKernelArg(kernel, 4, sizeof(int), &conv->width);
+        clSetKernelArg(kernel, 5, sizeof(int), &conv->height);
+        clSetKernelArg(kernel, 6, sizeof(cl_int), &step_x);
+        clSetKernelArg(kernel, 7, sizeof(cl_int), &step_y);
+    }
+    if (kernel != conv->active) {
+        conv->active = kernel;
+        conv->bound_input = NULL;
+    }
+    conv->out_width = out_width;
+    conv->out_height = out_height;
+    fprintf(stderr, "OpenCL converter output: %dx%d\n", out_width, out_height);
+    return 0;
+}
+
+/* Find the imported cl_mem for a dmabuf, importing it into the least
+ * recently used slot on a miss. An entry for the same buffer with another
+ * size or modifier is stale (the buffer was reallocated) and replaced. */
+static cl_mem lookup_input(struct opencl_converter *conv, int fd, size_t size,
+                           uint64_t modifier) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("opencl: fstat input dmabuf");
+        return NULL;
+    }
 
-    /* Check if we need to reimport the input dmabuf */
-    if (input_dmabuf_fd != conv->last_input_fd) {
-        /* Release previous input if any */
-        if (conv->input_cl_mem) {
-            clReleaseMemObject(conv->input_cl_mem);
-            conv->input_cl_mem = NULL;
+    int slot = 0;
+    for (int i = 0; i < INPUT_CACHE_SIZE; i++) {
+        if (conv->inputs[i].mem && conv->inputs[i].dev == st.st_dev &&
+            conv->inputs[i].ino == st.st_ino) {
+            if (conv->inputs[i].size == size &&
+                conv->inputs[i].modifier == modifier) {
+                conv->inputs[i].last_used = ++conv->use_counter;
+                return conv->inputs[i].mem;
+            }
+            slot = i;
+            break;
         }
+        if (!conv->inputs[i].mem) {
+            slot = i;
+        } else if (conv->inputs[slot].mem &&
+                   conv->inputs[i].last_used < conv->inputs[slot].last_used) {
+            slot = i;
+        }
+    }
 
-        /* Import new input dmabuf */
-        cl_import_properties_arm props[] = {
-            CL_IMPORT_TYPE_ARM, CL_IMPORT_TYPE_DMA_BUF_ARM,
-            0
-        };
-        conv->input_cl_mem = conv->clImportMemoryARM(conv->context, CL_MEM_READ_ONLY,
-                                                      props, &input_dmabuf_fd,
-                                                      input_size, &err);
-        if (err != CL_SUCCESS || !conv->input_cl_mem) {
-            fprintf(stderr, "opencl: import input dmabuf failed: %d\n", err);
-            return -1;
+    if (conv->inputs[slot].mem) {
+        if (conv->inputs[slot].mem == conv->bound_input) {
+            conv->bound_input = NULL;
         }
+        clReleaseMemObject(conv->inputs[slot].mem);
+        conv->inputs[slot].mem = NULL;
+    }
 
-        conv->last_input_fd = input_dmabuf_fd;
-        clSetKernelArg(conv->kernel, 0, sizeof(cl_mem), &conv->input_cl_mem);
+    cl_import_properties_arm props[] = {
+        CL_IMPORT_TYPE_ARM, CL_IMPORT_TYPE_DMA_BUF_ARM,
+        0
+    };
+    cl_int err;
+    cl_mem mem = conv->clImportMemoryARM(conv->context, CL_MEM_READ_ONLY,
+                                         props, &fd, size, &err);
+    if (err != CL_SUCCESS || !mem) {
+        fprintf(stderr, "opencl: import input dmabuf failed: %d\n", err);
+        return NULL;
     }
 
-    /* Run kernel */
-    size_t global_size[2] = { (size_t)(conv->width / 2), (size_t)conv->height };
+    conv->inputs[slot].dev = st.st_dev;
+    conv->inputs[slot].ino = st.st_ino;
+    conv->inputs[slot].size = size;
+    conv->inputs[slot].modifier = modifier;
+    conv->inputs[slot].mem = mem;
+    conv->inputs[slot].last_used = ++conv->use_counter;
+    return mem;
+}
+
+int opencl_convert_start(struct opencl_converter *conv, int output_index,
+                         int input_dmabuf_fd, size_t input_size, uint64_t modifier,
+                         cl_event *done) {
+    if (!conv || output_index < 0 || output_index >= OPENCL_CONVERT_BUFFERS) return -1;
+
+    cl_int err;
+
+    cl_mem input = lookup_input(conv, input_dmabuf_fd, input_size, modifier);
+    if (!input) {
+        return -1;
+    }
+    if (input != conv->bound_input) {
+        clSetKernelArg(conv->active, 0, sizeof(cl_mem), &input);
+        conv->bound_input = input;
+    }
+    /* Arguments are captured at enqueue, so changing them while an earlier
+     * launch is still running is fine */
+    clSetKernelArg(conv->active, 1, sizeof(cl_mem), &conv->outputs[output_index].mem);
+
+    /* Run kernel: one work item per pixel pair (YUYV) or 2x2 block (NV12).
+     * The global size must be a multiple of the work-group size; the kernels
+     * skip the items past the edge. */
     size_t local_size[2] = { 16, 16 };
+    size_t items_y = conv->format == OPENCL_CONVERT_NV12 ? (size_t)conv->out_height / 2
+                                                          : (size_t)conv->out_height;
+    size_t global_size[2] = {
+        ((size_t)conv->out_width / 2 + local_size[0] - 1) / local_size[0] * local_size[0],
+        (items_y + local_size[1] - 1) / local_size[1] * local_size[1],
+    };
 
-    err = clEnqueueNDRangeKernel(conv->queue, conv->kernel, 2, NULL,
-                                  global_size, local_size, 0, NULL, NULL);
+    err = clEnqueueNDRangeKernel(conv->queue, conv->active, 2, NULL,
+                                  global_size, local_size, 0, NULL, done);
     if (err != CL_SUCCESS) {
         fprintf(stderr, "opencl: kernel execution failed: %d\n", err);
         return -1;
     }
 
-    /* Wait for completion */
-    clFinish(conv->queue);
-
-    *output_dmabuf_fd = conv->output_dmabuf_fd;
-    *output_size = conv->output_size;
+    /* Submit now rather than when someone first waits */
+    clFlush(conv->queue);
+    return 0;
+}
 
+int opencl_convert_wait(cl_event done) {
+    cl_int err = clWaitForEvents(1, &done);
+    cl_int status = CL_COMPLETE;
+    if (err == CL_SUCCESS) {
+        clGetEventInfo(done, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                       sizeof(status), &status, NULL);
+    }
+    clReleaseEvent(done);
+    if (err != CL_SUCCESS || status < 0) {
+        fprintf(stderr, "opencl: conversion failed: %d\n", err != CL_SUCCESS ? err : status);
+        return -1;
+    }
     return 0;
 }
 
-int opencl_convert_get_output(struct opencl_converter *conv,
+int opencl_convert(struct opencl_converter *conv, int output_index,
+                   int input_dmabuf_fd, size_t input_size, uint64_t modifier) {
+    cl_event done;
+    if (opencl_convert_start(conv, output_index, input_dmabuf_fd, input_size,
+                             modifier, &done) != 0) {
+        return -1;
+    }
+    return opencl_convert_wait(done);
+}
+
+int opencl_convert_get_output(struct opencl_converter *conv, int output_index,
                               int *dmabuf_fd, void **mapped_ptr, size_t *size) {
-    if (!conv) return -1;
+    if (!conv || output_index < 0 || output_index >= OPENCL_CONVERT_BUFFERS) return -1;
 
-    if (dmabuf_fd) *dmabuf_fd = conv->output_dmabuf_fd;
-    if (mapped_ptr) *mapped_ptr = conv->output_map;
+    if (dmabuf_fd) *dmabuf_fd = conv->outputs[output_index].dmabuf_fd;
+    if (mapped_ptr) *mapped_ptr = conv->outputs[output_index].map;
     if (size) *size = conv->output_size;
 
     return 0;
@@ -304,18 +597,28 @@ int opencl_convert_get_output(struct opencl_converter *conv,
 void opencl_convert_destroy(struct opencl_converter *conv) {
     if (!conv) return;
 
-    if (conv->input_cl_mem) clReleaseMemObject(conv->input_cl_mem);
-    if (conv->output_cl_mem) clReleaseMemObject(conv->output_cl_mem);
+    /* Let queued conversions finish before their buffers go away */
+    if (conv->queue) clFinish(conv->queue);
+
+    for (int i = 0; i < INPUT_CACHE_SIZE; i++) {
+        if (conv->inputs[i].mem) clReleaseMemObject(conv->inputs[i].mem);
+    }
+    for (int i = 0; i < OPENCL_CONVERT_BUFFERS; i++) {
+        if (conv->outputs[i].mem) clReleaseMemObject(conv->outputs[i].mem);
+    }
     if (conv->kernel) clReleaseKernel(conv->kernel);
+    if (conv->scaled_kernel) clReleaseKernel(conv->scaled_kernel);
     if (conv->program) clReleaseProgram(conv->program);
     if (conv->queue) clReleaseCommandQueue(conv->queue);
     if (conv->context) clReleaseContext(conv->context);
 
-    if (conv->output_map && conv->output_map != MAP_FAILED) {
-        munmap(conv->output_map, conv->output_size);
-    }
-    if (conv->output_dmabuf_fd >= 0) {
-        close(conv->output_dmabuf_fd);
+    for (int i = 0; i < OPENCL_CONVERT_BUFFERS; i++) {
+        if (conv->outputs[i].map) {
+            munmap(conv->outputs[i].map, conv->output_size);
+        }
+        if (conv->outputs[i].dmabuf_fd >= 0) {
+            close(conv->outputs[i].dmabuf_fd);
+        }
     }
 
     free(conv);
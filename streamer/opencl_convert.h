@@ -4,42 +4,99 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
+#include "CL/cl.h"
+
+/* Output buffers per converter: one can be read by the JPEG encoder while
+ * the GPU writes the next frame into the other */
+#define OPENCL_CONVERT_BUFFERS 2
+
 struct opencl_converter;
 
+/* Output layouts, to match what the V4L2 JPEG encoder accepts */
+enum opencl_convert_format {
+    OPENCL_CONVERT_YUYV, /* Packed 4:2:2, width * 2 bytes per row */
+    OPENCL_CONVERT_NV12, /* 4:2:0: Y plane (width bytes per row), then
+                          * interleaved CbCr at offset width * height */
+};
+
 /*
- * Initialize OpenCL converter for XRGB->YUYV conversion.
+ * Initialize OpenCL converter for XRGB->YUYV or XRGB->NV12 conversion.
  * Uses cl_arm_import_memory_dma_buf for zero-copy dmabuf import.
+ * width (and for NV12 height) must be even.
  *
  * Returns: converter handle on success, NULL on failure
  */
-struct opencl_converter *opencl_convert_init(int width, int height);
+struct opencl_converter *opencl_convert_init(int width, int height,
+                                             enum opencl_convert_format format);
 
 /*
- * Convert XRGB dmabuf to YUYV dmabuf using GPU.
+ * Size of each output buffer of a converter created with these arguments,
+ * e.g. to set up a consumer of the dmabufs before the converter exists.
+ */
+size_t opencl_convert_output_size(int width, int height,
+                                  enum opencl_convert_format format);
+
+/*
+ * Scale to out_width x out_height as part of the conversion, from the next
+ * opencl_convert_start on; the input size restores 1:1. Both must be even,
+ * at most the input size and at least half of it (rounded down to even).
+ * The output buffers are sized for the input, so nothing is reallocated
+ * and conversions already started are unaffected. Output layouts use the
+ * scaled size.
+ *
+ * Returns: 0 on success, -1 if the size is not supported
+ */
+int opencl_convert_set_output_size(struct opencl_converter *conv,
+                                   int out_width, int out_height);
+
+/*
+ * Start converting an XRGB dmabuf into output buffer output_index
+ * (0 to OPENCL_CONVERT_BUFFERS-1) without waiting for the GPU.
  *
  * input_dmabuf_fd: dmabuf containing XRGB8888 data (e.g., from wlr-export-dmabuf)
  * input_size: size of input dmabuf in bytes
- * output_dmabuf_fd: pointer to receive output YUYV dmabuf fd
- * output_size: pointer to receive output size
+ * modifier: DRM format modifier of the input
+ * done: receives an event that completes with the conversion; pass it to
+ *       opencl_convert_wait exactly once
  *
- * The output dmabuf is owned by the converter and reused between calls.
- * It remains valid until the next call to opencl_convert() or opencl_convert_destroy().
+ * The input dmabuf and the output buffer are in use until the event
+ * completes. Imported input buffers are cached by dmabuf identity (not fd
+ * number), so a compositor's swapchain buffers are imported once each; the
+ * fd itself may be closed once the conversion is done.
  *
  * Returns: 0 on success, -1 on failure
  */
-int opencl_convert(struct opencl_converter *conv,
-                   int input_dmabuf_fd, size_t input_size,
-                   int *output_dmabuf_fd, size_t *output_size);
+int opencl_convert_start(struct opencl_converter *conv, int output_index,
+                         int input_dmabuf_fd, size_t input_size, uint64_t modifier,
+                         cl_event *done);
+
+/*
+ * Block until a conversion started with opencl_convert_start has finished,
+ * and release its event.
+ *
+ * Returns: 0 on success, -1 if the conversion failed
+ */
+int opencl_convert_wait(cl_event done);
+
+/*
+ * opencl_convert_start followed by opencl_convert_wait.
+ */
+int opencl_convert(struct opencl_converter *conv, int output_index,
+                   int input_dmabuf_fd, size_t input_size, uint64_t modifier);
 
 /*
- * Get the output dmabuf fd and mapped pointer for direct access.
- * Useful for passing to JPEG encoder.
+ * Get an output buffer's dmabuf fd and mapped pointer for direct access.
+ * Useful for passing to JPEG encoder. The buffers are owned by the
+ * converter and reused between calls.
  */
-int opencl_convert_get_output(struct opencl_converter *conv,
+int opencl_convert_get_output(struct opencl_converter *conv, int output_index,
                               int *dmabuf_fd, void **mapped_ptr, size_t *size);
 
 /*
- * Destroy converter and free resources.
+ * Destroy converter and free resources. Waits for queued conversions.
  */
 void opencl_convert_destroy(struct opencl_converter *conv);
 
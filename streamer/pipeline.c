@@ -0,0 +1,1143 @@
+#define _GNU_SOURCE
+
+#include "pipeline.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common/trace.h"
+#include "compress.h"
+#include "scale.h"
+#include "spsc_queue.h"
+#include "tile_hash.h"
+#include "tiles.h"
+#include "v4l2_common.h"
+#include "v4l2_jpeg.h"
+#include "v4l2_rga.h"
+
+#ifdef HAVE_OPENCL
+#include "opencl_convert.h"
+#endif
+
+/* How long a stage blocks on its input queue before re-checking for
+ * shutdown */
+#define STAGE_WAIT_MS 100
+
+/* Wait between failed dmabuf captures, doubling up to the maximum */
+#define CAPTURE_RETRY_MIN_MS 10
+#define CAPTURE_RETRY_MAX_MS 1000
+
+#define PIPELINE_CONVERT_BUFFERS 2
+#ifdef HAVE_OPENCL
+_Static_assert(OPENCL_CONVERT_BUFFERS <= PIPELINE_CONVERT_BUFFERS,
+               "not enough converter output flags");
+#endif
+
+struct jpeg_slot {
+  unsigned char *data;
+  size_t capacity;
+  atomic_int in_use;
+};
+
+struct pipeline {
+  struct pipeline_config cfg;
+  atomic_int running;
+  atomic_int failed;
+  atomic_int quality;
+  atomic_int scale; /* num << 8 | den */
+  _Atomic uint64_t frame_interval_ms;
+  atomic_uint dropped;
+  atomic_uint idle;
+
+  /* capture -> convert -> encode -> send. When there is no separate
+   * conversion step (CPU paths), capture feeds convert_q directly. */
+  struct spsc_queue capture_q;
+  struct spsc_queue convert_q;
+  struct spsc_queue encode_q;
+  int has_convert_stage;
+
+  pthread_t capture_thread;
+  pthread_t convert_thread;
+  pthread_t encode_thread;
+  int capture_started;
+  int convert_started;
+  int encode_started;
+
+  /* Stage-owned resources, only touched by their stage thread until
+   * pipeline_stop has joined it */
+  struct jpeg_encoder sw_encoder;
+  int sw_encoder_ready;
+  struct tile_encoder tile_encoder;
+  int tile_encoder_ready;
+  atomic_int keyframe_requested;
+  /* Content hashes of the last encoded frame (second one: NV12 chroma) */
+  struct tile_hasher hasher;
+  struct tile_hasher hasher_uv;
+  int hasher_ready;
+  struct frame_scaler scaler; /* CPU paths */
+  uint64_t last_encoded_ms;
+  struct v4l2_jpeg_encoder hw_encoder;
+  int hw_encoder_ready;
+  /* OpenCL output buffers the encoder imports as dmabufs instead of
+   * copying them; 0 if it copies */
+  unsigned int hw_encoder_import;
+  struct v4l2_rga_converter rga;
+  int rga_ready;
+#ifdef HAVE_OPENCL
+  struct opencl_converter *opencl_conv;
+  enum opencl_convert_format opencl_format;
+#endif
+
+  /* Converter output buffers, each pinned until the encoder is done with
+   * it. RGA has one; OpenCL alternates between OPENCL_CONVERT_BUFFERS so it
+   * can convert the next frame while the encoder reads the last. */
+  atomic_int convert_out_busy[PIPELINE_CONVERT_BUFFERS];
+
+  struct jpeg_slot jpeg_slots[PIPELINE_JPEG_SLOTS];
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void sleep_ms(uint64_t ms) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)(ms / 1000u);
+  ts.tv_nsec = (long)((ms % 1000u) * 1000000u);
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+  }
+}
+
+static void backoff(void) {
+  struct timespec ts = {0, 200000};
+  nanosleep(&ts, NULL);
+}
+
+static int is_running(struct pipeline *p) {
+  return atomic_load_explicit(&p->running, memory_order_acquire);
+}
+
+static void pipeline_fail(struct pipeline *p) {
+  atomic_store(&p->failed, 1);
+  atomic_store(&p->running, 0);
+  spsc_queue_wake(&p->capture_q);
+  spsc_queue_wake(&p->convert_q);
+  spsc_queue_wake(&p->encode_q);
+}
+
+static void init_frame(struct pipeline_frame *f) {
+  memset(f, 0, sizeof(*f));
+  for (int i = 0; i < 4; i++) {
+    f->dma.objects[i].fd = -1;
+  }
+  f->frame.buffer_index = -1;
+  f->out_dmabuf_fd = -1;
+}
+
+/* Presentation time of captured content. Timestamps from another clock or
+ * from before the capture request (a static screen copied again) fall back
+ * to the start of the capture. */
+static uint64_t capture_time(uint64_t start_us, uint64_t timestamp_ns) {
+  uint64_t ts_us = timestamp_ns / 1000u;
+  if (ts_us < start_us || ts_us > now_us()) {
+    return start_us;
+  }
+  return ts_us;
+}
+
+/* export-dmabuf reports no damage: treat every frame as fully changed */
+static void set_full_damage(struct capture_frame *frame) {
+  frame->damage_count = 1;
+  frame->damage[0].x = 0;
+  frame->damage[0].y = 0;
+  frame->damage[0].width = frame->width;
+  frame->damage[0].height = frame->height;
+}
+
+static int pack_scale(int num, int den) {
+  return num << 8 | den;
+}
+
+static int scale_allowed(const struct pipeline *p, int num, int den) {
+  if (!scale_supported(num, den) || den > 0xff) {
+    return 0;
+  }
+  /* RGA converts at the captured size */
+  return num == den || !p->cfg.use_rga;
+}
+
+/* Size a width x height capture is encoded at */
+static void scaled_size(struct pipeline *p, uint32_t *width,
+                        uint32_t *height) {
+  int scale = atomic_load(&p->scale);
+  int num = scale >> 8;
+  int den = scale & 0xff;
+  if (num != den) {
+    *width = scale_dimension(*width, num, den);
+    *height = scale_dimension(*height, num, den);
+  }
+}
+
+/* Wait for a GPU conversion still writing the frame's pixels. Returns 0,
+ * or -1 if it failed. */
+static int finish_conversion(struct pipeline_frame *f) {
+  int rc = 0;
+#ifdef HAVE_OPENCL
+  if (f->convert_fence) {
+    rc = opencl_convert_wait((cl_event)f->convert_fence);
+    f->convert_fence = NULL;
+  }
+#else
+  (void)f;
+#endif
+  return rc;
+}
+
+/* Release everything upstream of the JPEG output */
+static void release_inputs(struct pipeline_frame *f) {
+  /* The GPU may still be reading the dmabuf */
+  finish_conversion(f);
+  if (f->has_dmabuf) {
+    dmabuf_frame_release(&f->dma);
+    f->has_dmabuf = 0;
+  }
+  if (f->capture) {
+    capture_release_frame(f->capture, &f->frame);
+    f->capture = NULL;
+  }
+  for (int i = 0; i < PIPELINE_MAX_HOLDS; i++) {
+    if (f->holds[i]) {
+      atomic_store(f->holds[i], 0);
+      f->holds[i] = NULL;
+    }
+  }
+}
+
+void pipeline_frame_release(struct pipeline_frame *frame) {
+  if (!frame) {
+    return;
+  }
+  release_inputs(frame);
+  if (frame->jpeg_hold) {
+    atomic_store(frame->jpeg_hold, 0);
+    frame->jpeg_hold = NULL;
+  }
+  frame->jpeg = NULL;
+  frame->jpeg_size = 0;
+}
+
+/* Queue f, dropping the oldest queued frame if the consumer has fallen a
+ * whole ring behind (drop-oldest: the newest frame always gets through). */
+static void push_or_drop(struct pipeline *p, struct spsc_queue *q,
+                         struct pipeline_frame *f) {
+  struct pipeline_frame oldest;
+  /* Only this thread pushes, so once there is room the push succeeds; the
+   * consumer may take the oldest first, in which case nothing is dropped */
+  while (spsc_queue_count(q) >= q->capacity && spsc_queue_pop(q, &oldest)) {
+    /* Whatever changed in the dropped frame still has to be encoded */
+    capture_frame_add_damage(&f->frame, &oldest.frame);
+    if (oldest.jpeg && p->cfg.tile_size > 0) {
+      /* Its tiles were encoded as sent, so they must be resent in full */
+      atomic_store(&p->keyframe_requested, 1);
+    }
+    pipeline_frame_release(&oldest);
+    atomic_fetch_add(&p->dropped, 1u);
+  }
+  if (spsc_queue_push(q, f) != 0) {
+    pipeline_frame_release(f);
+    atomic_fetch_add(&p->dropped, 1u);
+  }
+}
+
+/* Pop the newest queued frame, releasing any older ones (drop-oldest).
+ * Returns 1 if *out was filled. */
+static int pop_latest(struct pipeline *p, struct spsc_queue *q,
+                      struct pipeline_frame *out, int wake_fd,
+                      int timeout_ms) {
+  if (!spsc_queue_wait_fd(q, wake_fd, timeout_ms)) {
+    return 0;
+  }
+  if (!spsc_queue_pop(q, out)) {
+    return 0;
+  }
+  struct pipeline_frame newer;
+  while (spsc_queue_pop(q, &newer)) {
+    /* Whatever changed in the skipped frame still has to be encoded */
+    capture_frame_add_damage(&newer.frame, &out->frame);
+    pipeline_frame_release(out);
+    atomic_fetch_add(&p->dropped, 1u);
+    *out = newer;
+  }
+  return 1;
+}
+
+static void drain_queue(struct spsc_queue *q) {
+  struct pipeline_frame f;
+  while (spsc_queue_pop(q, &f)) {
+    pipeline_frame_release(&f);
+  }
+}
+
+/* Wait until the frame holding a stage output buffer has been released */
+static int wait_for_release(struct pipeline *p, atomic_int *flag) {
+  while (atomic_load(flag)) {
+    if (!is_running(p)) {
+      return -1;
+    }
+    backoff();
+  }
+  return 0;
+}
+
+static struct jpeg_slot *acquire_jpeg_slot(struct pipeline *p) {
+  while (is_running(p)) {
+    for (int i = 0; i < PIPELINE_JPEG_SLOTS; i++) {
+      int expected = 0;
+      if (atomic_compare_exchange_strong(&p->jpeg_slots[i].in_use, &expected,
+                                         1)) {
+        return &p->jpeg_slots[i];
+      }
+    }
+    backoff();
+  }
+  return NULL;
+}
+
+/* === Capture stage === */
+
+static void *capture_thread_main(void *arg) {
+  struct pipeline *p = arg;
+  struct dmabuf_pending_frame *pending = NULL;
+  struct spsc_queue *out_q =
+      p->has_convert_stage ? &p->capture_q : &p->convert_q;
+  uint64_t seq = 0;
+  uint64_t last_frame_ms = 0;
+  uint64_t retry_ms = 0;
+  int crop_warned = 0;
+
+  while (is_running(p)) {
+    uint64_t start_us = now_us();
+    uint64_t start = start_us / 1000u;
+    struct pipeline_frame f;
+    init_frame(&f);
+    f.seq = ++seq;
+    f.capture_start_us = start_us;
+
+    if (p->cfg.use_dmabuf) {
+      int rc;
+      trace_begin("capture");
+      if (pending) {
+        rc = dmabuf_capture_finish(p->cfg.dmabuf_capture, pending, &f.dma);
+        pending = NULL;
+      } else {
+        rc = dmabuf_capture_next_frame(p->cfg.dmabuf_capture, &f.dma);
+      }
+      trace_end("capture");
+      if (rc != 0) {
+        fprintf(stderr, "dmabuf capture failed\n");
+        /* Back off instead of spinning on a compositor that keeps
+         * cancelling, e.g. while the output is off */
+        retry_ms = retry_ms ? retry_ms * 2 : CAPTURE_RETRY_MIN_MS;
+        if (retry_ms > CAPTURE_RETRY_MAX_MS) {
+          retry_ms = CAPTURE_RETRY_MAX_MS;
+        }
+        sleep_ms(retry_ms);
+        --seq;
+        continue;
+      }
+      retry_ms = 0;
+      f.has_dmabuf = 1;
+      if ((f.dma.offset_x || f.dma.offset_y) &&
+          (p->cfg.use_opencl || p->cfg.use_rga) && !crop_warned) {
+        fprintf(stderr, "dmabuf frames are cropped at %u,%u, but OpenCL and "
+                        "RGA convert from the buffer origin\n",
+                f.dma.offset_x, f.dma.offset_y);
+        crop_warned = 1;
+      }
+
+      if (p->cfg.use_opencl) {
+        /* Only the fd is needed. Request the next frame now so the
+         * compositor round trip overlaps convert + encode. */
+        pending = dmabuf_capture_request(p->cfg.dmabuf_capture);
+      } else if (dmabuf_frame_map(&f.dma) != 0) {
+        fprintf(stderr, "dmabuf map failed\n");
+        pipeline_frame_release(&f);
+        continue;
+      } else if (!p->cfg.use_rga) {
+        f.frame.format = f.dma.format;
+        f.frame.width = f.dma.width;
+        f.frame.height = f.dma.height;
+        f.frame.stride = f.dma.objects[0].stride;
+        /* Hashing, tiles and damage all start at the crop origin */
+        f.frame.data = dmabuf_frame_pixels(&f.dma);
+        f.frame.y_invert = 0;
+        set_full_damage(&f.frame);
+      }
+    } else {
+      int rc;
+      trace_begin("capture");
+      if (p->cfg.use_damage && start - last_frame_ms < PIPELINE_KEEPALIVE_MS) {
+        rc = capture_next_damaged_frame(p->cfg.capture, &f.frame,
+                                        STAGE_WAIT_MS);
+      } else {
+        rc = capture_next_frame(p->cfg.capture, &f.frame);
+      }
+      trace_end("capture");
+      if (rc == 1) {
+        /* Nothing changed: skip encode and send entirely */
+        atomic_fetch_add(&p->idle, 1u);
+        --seq;
+        continue;
+      }
+      if (rc == CAPTURE_BUSY) {
+        /* Every buffer is still held downstream; keep waiting for one */
+        --seq;
+        continue;
+      }
+      if (rc != 0) {
+        fprintf(stderr, "Capture failed\n");
+        pipeline_fail(p);
+        break;
+      }
+      f.capture = p->cfg.capture;
+      last_frame_ms = start;
+    }
+    f.capture_time_us = capture_time(
+        start_us, f.has_dmabuf ? f.dma.timestamp_ns : f.frame.timestamp_ns);
+
+    f.capture_us = now_us() - start_us;
+    push_or_drop(p, out_q, &f);
+
+    uint64_t interval = atomic_load(&p->frame_interval_ms);
+    if (interval > 0) {
+      uint64_t elapsed = now_ms() - start;
+      if (elapsed < interval) {
+        sleep_ms(interval - elapsed);
+      }
+    }
+  }
+
+  if (pending) {
+    dmabuf_capture_cancel(pending);
+  }
+  return NULL;
+}
+
+/* === Convert stage (OpenCL / RGA only) === */
+
+#ifdef HAVE_OPENCL
+/* Wait until one of count stage output buffers is free and claim it.
+ * Returns its index, or -1 on shutdown. */
+static int acquire_convert_buffer(struct pipeline *p, int count) {
+  while (is_running(p)) {
+    for (int i = 0; i < count; i++) {
+      int expected = 0;
+      if (atomic_compare_exchange_strong(&p->convert_out_busy[i], &expected,
+                                         1)) {
+        return i;
+      }
+    }
+    backoff();
+  }
+  return -1;
+}
+
+static int convert_opencl(struct pipeline *p, struct pipeline_frame *f) {
+  uint32_t out_w = f->dma.width;
+  uint32_t out_h = f->dma.height;
+  scaled_size(p, &out_w, &out_h);
+  int w = (int)out_w;
+  int h = (int)out_h;
+
+  if (!p->opencl_conv) {
+    enum opencl_convert_format format = OPENCL_CONVERT_YUYV;
+    if (p->cfg.use_hw_jpeg) {
+      /* Set up the encoder first and convert straight into the layout it
+       * negotiated: NV12 (half the chroma of YUYV) where it takes it, with
+       * the converter's dmabufs queued to it as they are where it can read
+       * them, so no frame is copied. The encode thread only touches it
+       * after the first frame is queued. */
+      int quality = atomic_load(&p->quality);
+      int dw = (int)f->dma.width;
+      int dh = (int)f->dma.height;
+      if (v4l2_jpeg_init_dmabuf(&p->hw_encoder, w, h, quality, FOURCC_NV12,
+                                OPENCL_CONVERT_BUFFERS,
+                                opencl_convert_output_size(
+                                    dw, dh, OPENCL_CONVERT_NV12)) == 0) {
+        format = OPENCL_CONVERT_NV12;
+        p->hw_encoder_import = OPENCL_CONVERT_BUFFERS;
+      } else if (v4l2_jpeg_init_nv12(&p->hw_encoder, w, h, quality) == 0) {
+        format = OPENCL_CONVERT_NV12;
+      } else if (v4l2_jpeg_init_dmabuf(&p->hw_encoder, w, h, quality,
+                                       FOURCC_YUYV, OPENCL_CONVERT_BUFFERS,
+                                       opencl_convert_output_size(
+                                           dw, dh, OPENCL_CONVERT_YUYV)) == 0) {
+        p->hw_encoder_import = OPENCL_CONVERT_BUFFERS;
+      } else if (v4l2_jpeg_init(&p->hw_encoder, w, h, quality) != 0) {
+        fprintf(stderr, "Failed to initialize HW JPEG encoder\n");
+        pipeline_fail(p);
+        return -1;
+      } else if (p->hw_encoder.out_format != FOURCC_YUYV) {
+        fprintf(stderr, "HW JPEG encoder wants %s; OpenCL produces NV12 or YUYV\n",
+                fourcc_to_str(p->hw_encoder.out_format));
+        v4l2_jpeg_destroy(&p->hw_encoder);
+        pipeline_fail(p);
+        return -1;
+      }
+      p->hw_encoder_ready = 1;
+    }
+    p->opencl_conv = opencl_convert_init((int)f->dma.width,
+                                         (int)f->dma.height, format);
+    p->opencl_format = format;
+    if (!p->opencl_conv) {
+      fprintf(stderr, "Failed to initialize OpenCL converter\n");
+      pipeline_fail(p);
+      return -1;
+    }
+  }
+  /* Scaling is fused into the conversion kernel */
+  if (opencl_convert_set_output_size(p->opencl_conv, w, h) != 0) {
+    /* Fall back to 1:1 rather than failing every frame */
+    fprintf(stderr, "OpenCL can't scale %ux%u to %dx%d; encoding at the "
+                    "captured size\n",
+            f->dma.width, f->dma.height, w, h);
+    atomic_store(&p->scale, pack_scale(1, 1));
+    w = (int)f->dma.width;
+    h = (int)f->dma.height;
+    if (opencl_convert_set_output_size(p->opencl_conv, w, h) != 0) {
+      pipeline_fail(p);
+      return -1;
+    }
+  }
+
+  int index = acquire_convert_buffer(p, OPENCL_CONVERT_BUFFERS);
+  if (index < 0) {
+    return -1;
+  }
+  f->holds[0] = &p->convert_out_busy[index];
+
+  /* Queue XRGB → YUYV/NV12 on the GPU (zero-copy dmabuf import). The frame goes
+   * on to the encoder right away, which waits for the event; the capture
+   * dmabuf stays with the frame until then. */
+  cl_event done;
+  size_t input_size = (size_t)f->dma.width * (size_t)f->dma.height * 4;
+  trace_begin("opencl_convert_start");
+  int rc = opencl_convert_start(p->opencl_conv, index, f->dma.objects[0].fd,
+                                input_size, f->dma.modifier, &done);
+  trace_end("opencl_convert_start");
+  if (rc != 0) {
+    fprintf(stderr, "OpenCL conversion failed\n");
+    return -1;
+  }
+  f->convert_fence = done;
+
+  void *data;
+  opencl_convert_get_output(p->opencl_conv, index, &f->out_dmabuf_fd, &data,
+                            &f->out_dmabuf_size);
+  f->out_dmabuf_index = index;
+
+  f->frame.width = (uint32_t)w;
+  f->frame.height = (uint32_t)h;
+  f->frame.y_invert = 0;
+  set_full_damage(&f->frame);
+  if (p->opencl_format == OPENCL_CONVERT_NV12) {
+    f->is_nv12 = 1;
+    f->y_plane = data;
+    f->y_stride = (unsigned int)w;
+    f->uv_plane = (const uint8_t *)data + (size_t)w * (size_t)h;
+    f->uv_stride = (unsigned int)w;
+  } else {
+    f->frame.format = FOURCC_YUYV;
+    f->frame.stride = (uint32_t)(w * 2);
+    f->frame.data = data;
+  }
+  return 0;
+}
+#endif
+
+static int convert_rga(struct pipeline *p, struct pipeline_frame *f) {
+  int w = (int)f->dma.width;
+  int h = (int)f->dma.height;
+
+  if (!p->rga_ready) {
+    if (v4l2_rga_init(&p->rga, w, h) != 0) {
+      fprintf(stderr, "Failed to initialize RGA\n");
+      pipeline_fail(p);
+      return -1;
+    }
+    p->rga_ready = 1;
+    fprintf(stderr, "RGA initialized for %dx%d\n", w, h);
+  }
+
+  if (wait_for_release(p, &p->convert_out_busy[0]) != 0) {
+    return -1;
+  }
+
+  /* Convert XRGB8888 -> NV12 using RGA */
+  void *y_plane = NULL, *uv_plane = NULL;
+  unsigned int y_stride = 0, uv_stride = 0;
+  void *mapped_ptr = (char *)f->dma.mapped_data + f->dma.objects[0].offset;
+  trace_begin("v4l2_rga_convert_dmabuf");
+  int rc = v4l2_rga_convert_dmabuf(&p->rga, f->dma.objects[0].fd, mapped_ptr,
+                                   &y_plane, &y_stride, &uv_plane, &uv_stride);
+  trace_end("v4l2_rga_convert_dmabuf");
+  if (rc != 0) {
+    fprintf(stderr, "RGA conversion failed\n");
+    return -1;
+  }
+
+  dmabuf_frame_release(&f->dma);
+  f->has_dmabuf = 0;
+
+  f->is_nv12 = 1;
+  f->frame.width = (uint32_t)w;
+  f->frame.height = (uint32_t)h;
+  f->y_plane = y_plane;
+  f->y_stride = y_stride;
+  f->uv_plane = uv_plane;
+  f->uv_stride = uv_stride;
+
+  atomic_store(&p->convert_out_busy[0], 1);
+  f->holds[0] = &p->convert_out_busy[0];
+  return 0;
+}
+
+static void *convert_thread_main(void *arg) {
+  struct pipeline *p = arg;
+
+  while (is_running(p)) {
+    struct pipeline_frame f;
+    if (!pop_latest(p, &p->capture_q, &f, -1, STAGE_WAIT_MS)) {
+      continue;
+    }
+
+    uint64_t start_us = now_us();
+    int rc;
+#ifdef HAVE_OPENCL
+    if (p->cfg.use_opencl) {
+      rc = convert_opencl(p, &f);
+    } else
+#endif
+    {
+      rc = convert_rga(p, &f);
+    }
+    if (rc != 0) {
+      pipeline_frame_release(&f);
+      continue;
+    }
+
+    f.convert_us = now_us() - start_us;
+    push_or_drop(p, &p->convert_q, &f);
+  }
+
+  return NULL;
+}
+
+/* === Encode stage === */
+
+/* Hash the encoder input and compare with the previous frame. Returns the
+ * number of changed tiles, or -1 if the frame could not be hashed. */
+static int hash_frame(struct pipeline *p, const struct pipeline_frame *f,
+                      int force) {
+  if (f->is_nv12) {
+    int y = tile_hasher_update(&p->hasher, f->y_plane, f->y_stride,
+                               f->frame.width, f->frame.height, 1, force);
+    int uv = tile_hasher_update(&p->hasher_uv, f->uv_plane, f->uv_stride,
+                                f->frame.width, f->frame.height / 2, 1, force);
+    return (y < 0 || uv < 0) ? -1 : y + uv;
+  }
+  return tile_hasher_update(&p->hasher, f->frame.data, f->frame.stride,
+                            f->frame.width, f->frame.height,
+                            tile_bytes_per_pixel(f->frame.format), force);
+}
+
+/* Set up the HW encoder for the frame's size and layout. OpenCL has it set
+ * up by the convert stage for the first frame; a new output scale needs a
+ * new one, importing the converter's dmabufs again if the first one did and
+ * the encoder takes them at this size. */
+static int ensure_hw_encoder(struct pipeline *p, const struct pipeline_frame *f,
+                             int quality) {
+  int width = (int)f->frame.width;
+  int height = (int)f->frame.height;
+  if (p->hw_encoder_ready) {
+    if (p->hw_encoder.width == width && p->hw_encoder.height == height) {
+      return 0;
+    }
+    v4l2_jpeg_destroy(&p->hw_encoder);
+    p->hw_encoder_ready = 0;
+  }
+  if (p->hw_encoder_import > 0 && f->out_dmabuf_fd >= 0 &&
+      v4l2_jpeg_init_dmabuf(&p->hw_encoder, width, height, quality,
+                            f->is_nv12 ? FOURCC_NV12 : FOURCC_YUYV,
+                            p->hw_encoder_import, f->out_dmabuf_size) == 0) {
+    /* Nothing to copy */
+  } else if (f->is_nv12) {
+    /* Use NV12-specific init for RGA/OpenCL output */
+    if (v4l2_jpeg_init_nv12(&p->hw_encoder, width, height, quality) != 0) {
+      fprintf(stderr, "Failed to initialize HW JPEG encoder for NV12\n");
+      pipeline_fail(p);
+      return -1;
+    }
+  } else if (v4l2_jpeg_init(&p->hw_encoder, width, height, quality) != 0) {
+    fprintf(stderr, "Failed to initialize HW JPEG encoder\n");
+    pipeline_fail(p);
+    return -1;
+  }
+  p->hw_encoder_ready = 1;
+  return 0;
+}
+
+static int encode_frame(struct pipeline *p, struct pipeline_frame *f,
+                        int keyframe, const uint8_t *changed,
+                        unsigned char **jpeg_data, unsigned long *jpeg_size) {
+  int quality = atomic_load(&p->quality);
+
+  int rc;
+  if (p->tile_encoder_ready) {
+    trace_begin("tile_encode_frame");
+    rc = tile_encode_frame(&p->tile_encoder, &f->frame, keyframe, changed,
+                           jpeg_data, jpeg_size);
+    trace_end("tile_encode_frame");
+    if (rc != 0) {
+      fprintf(stderr, "Tiled JPEG encode failed\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  if (f->out_dmabuf_fd >= 0 && p->cfg.use_hw_jpeg) {
+    if (ensure_hw_encoder(p, f, quality) != 0) {
+      return -1;
+    }
+    if (p->hw_encoder.out_import) {
+      trace_begin("v4l2_jpeg_encode_dmabuf");
+      rc = v4l2_jpeg_encode_dmabuf(&p->hw_encoder,
+                                   (unsigned int)f->out_dmabuf_index,
+                                   f->out_dmabuf_fd, jpeg_data, jpeg_size);
+      trace_end("v4l2_jpeg_encode_dmabuf");
+      if (rc != 0) {
+        fprintf(stderr, "HW JPEG encode (dmabuf) failed\n");
+        return -1;
+      }
+      return 0;
+    }
+  }
+
+  if (f->is_nv12) {
+    if (ensure_hw_encoder(p, f, quality) != 0) {
+      return -1;
+    }
+    trace_begin("v4l2_jpeg_encode_nv12");
+    rc = v4l2_jpeg_encode_nv12(&p->hw_encoder, f->y_plane, f->y_stride,
+                               f->uv_plane, f->uv_stride, jpeg_data,
+                               jpeg_size);
+    trace_end("v4l2_jpeg_encode_nv12");
+    if (rc != 0) {
+      fprintf(stderr, "HW JPEG encode (NV12) failed\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  if (p->cfg.use_hw_jpeg) {
+    if (ensure_hw_encoder(p, f, quality) != 0) {
+      return -1;
+    }
+    trace_begin("v4l2_jpeg_encode_frame");
+    rc = v4l2_jpeg_encode_frame(&p->hw_encoder, &f->frame, jpeg_data,
+                                jpeg_size);
+    trace_end("v4l2_jpeg_encode_frame");
+    if (rc != 0) {
+      fprintf(stderr, "HW JPEG encode failed\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  trace_begin("jpeg_encode_frame");
+  rc = jpeg_encode_frame(&p->sw_encoder, &f->frame, jpeg_data, jpeg_size);
+  trace_end("jpeg_encode_frame");
+  if (rc != 0) {
+    fprintf(stderr, "JPEG encode failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void *encode_thread_main(void *arg) {
+  struct pipeline *p = arg;
+  int applied_quality = atomic_load(&p->quality);
+  int applied_scale = atomic_load(&p->scale);
+
+  while (is_running(p)) {
+    struct pipeline_frame f;
+    if (!pop_latest(p, &p->convert_q, &f, -1, STAGE_WAIT_MS)) {
+      continue;
+    }
+
+    if (f.convert_fence) {
+      uint64_t wait_start_us = now_us();
+      trace_begin("opencl_convert_wait");
+      int rc = finish_conversion(&f);
+      trace_end("opencl_convert_wait");
+      f.convert_us += now_us() - wait_start_us;
+      if (rc != 0) {
+        pipeline_frame_release(&f);
+        continue;
+      }
+      /* Done with the capture buffer; hand it back early */
+      dmabuf_frame_release(&f.dma);
+      f.has_dmabuf = 0;
+    }
+
+    uint64_t start_us = now_us();
+    uint64_t start = start_us / 1000u;
+
+    int quality = atomic_load(&p->quality);
+    if (quality != applied_quality) {
+      if (p->hw_encoder_ready) {
+        v4l2_jpeg_set_quality(&p->hw_encoder, quality);
+      }
+      if (p->sw_encoder_ready) {
+        jpeg_encoder_set_quality(&p->sw_encoder, quality);
+      }
+      if (p->tile_encoder_ready) {
+        tile_encoder_set_quality(&p->tile_encoder, quality);
+      }
+      applied_quality = quality;
+    }
+
+    /* Decide on a full frame before hashing so it is never skipped */
+    int keyframe = atomic_exchange(&p->keyframe_requested, 0) ||
+                   start - p->last_encoded_ms >= PIPELINE_KEEPALIVE_MS;
+    int scale = atomic_load(&p->scale);
+    if (scale != applied_scale) {
+      keyframe = 1;
+      applied_scale = scale;
+    }
+
+    /* The CPU paths scale here; converted frames already are */
+    if (!p->has_convert_stage) {
+      uint32_t w = f.frame.width;
+      uint32_t h = f.frame.height;
+      scaled_size(p, &w, &h);
+      if (w != f.frame.width || h != f.frame.height) {
+        struct capture_frame scaled;
+        trace_begin("frame_scale");
+        int rc = frame_scaler_scale(&p->scaler, &f.frame, w, h, keyframe,
+                                    &scaled);
+        trace_end("frame_scale");
+        if (rc != 0) {
+          pipeline_frame_release(&f);
+          continue;
+        }
+        f.frame = scaled;
+      } else {
+        frame_scaler_invalidate(&p->scaler);
+      }
+    }
+
+    const uint8_t *changed = NULL;
+    if (p->hasher_ready) {
+      trace_begin("tile_hash");
+      int n = hash_frame(p, &f, keyframe);
+      trace_end("tile_hash");
+      if (n == 0) {
+        /* Identical to the last encoded frame */
+        pipeline_frame_release(&f);
+        atomic_fetch_add(&p->idle, 1u);
+        continue;
+      }
+      /* Hash tiles are in buffer rows; only usable for upright frames */
+      if (n > 0 && !f.frame.y_invert) {
+        changed = p->hasher.changed;
+      }
+    }
+
+    unsigned char *jpeg_data = NULL;
+    unsigned long jpeg_size = 0;
+    if (encode_frame(p, &f, keyframe, changed, &jpeg_data, &jpeg_size) != 0) {
+      /* The hashes already describe this frame; make sure it is resent */
+      atomic_store(&p->keyframe_requested, 1);
+      pipeline_frame_release(&f);
+      continue;
+    }
+    if (jpeg_size == 0) {
+      /* Tiled mode and no tile touched */
+      pipeline_frame_release(&f);
+      continue;
+    }
+    p->last_encoded_ms = start;
+
+    /* Source pixels are no longer needed; let capture/convert reuse them */
+    release_inputs(&f);
+
+    /* The encoder reuses its output buffer, so hand the send stage a copy */
+    struct jpeg_slot *slot = acquire_jpeg_slot(p);
+    if (!slot) {
+      break;
+    }
+    if (PIPELINE_JPEG_HEADROOM + jpeg_size > slot->capacity) {
+      unsigned char *new_data =
+          realloc(slot->data, PIPELINE_JPEG_HEADROOM + jpeg_size);
+      if (!new_data) {
+        fprintf(stderr, "realloc JPEG slot failed\n");
+        atomic_store(&slot->in_use, 0);
+        continue;
+      }
+      slot->data = new_data;
+      slot->capacity = PIPELINE_JPEG_HEADROOM + jpeg_size;
+    }
+    memcpy(slot->data + PIPELINE_JPEG_HEADROOM, jpeg_data, jpeg_size);
+
+    f.jpeg = slot->data + PIPELINE_JPEG_HEADROOM;
+    f.jpeg_size = jpeg_size;
+    f.jpeg_hold = &slot->in_use;
+    f.encode_us = now_us() - start_us;
+    push_or_drop(p, &p->encode_q, &f);
+  }
+
+  return NULL;
+}
+
+/* === Public API === */
+
+static int start_thread(pthread_t *thread, const char *name,
+                        void *(*fn)(void *), struct pipeline *p) {
+  if (pthread_create(thread, NULL, fn, p) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  pthread_setname_np(*thread, name);
+  return 0;
+}
+
+int pipeline_start(struct pipeline **out, const struct pipeline_config *cfg) {
+  struct pipeline *p = calloc(1, sizeof(*p));
+  if (!p) {
+    return -1;
+  }
+
+  p->cfg = *cfg;
+  p->has_convert_stage = cfg->use_opencl || cfg->use_rga;
+  p->hw_encoder.fd = -1;
+  p->rga.fd = -1;
+  atomic_init(&p->running, 1);
+  atomic_init(&p->failed, 0);
+  atomic_init(&p->quality, cfg->quality);
+  atomic_init(&p->scale, cfg->scale_num > 0 ? pack_scale(cfg->scale_num,
+                                                         cfg->scale_den)
+                                            : pack_scale(1, 1));
+  atomic_init(&p->frame_interval_ms, cfg->frame_interval_ms);
+  atomic_init(&p->dropped, 0u);
+  atomic_init(&p->idle, 0u);
+  for (int i = 0; i < PIPELINE_CONVERT_BUFFERS; i++) {
+    atomic_init(&p->convert_out_busy[i], 0);
+  }
+  atomic_init(&p->keyframe_requested, 1);
+  for (int i = 0; i < PIPELINE_JPEG_SLOTS; i++) {
+    atomic_init(&p->jpeg_slots[i].in_use, 0);
+  }
+
+  frame_scaler_init(&p->scaler);
+  if (cfg->scale_num > 0 &&
+      !scale_allowed(p, cfg->scale_num, cfg->scale_den)) {
+    fprintf(stderr, "Unsupported output scale %d/%d\n", cfg->scale_num,
+            cfg->scale_den);
+    pipeline_stop(p);
+    return -1;
+  }
+  if (cfg->scale_num != cfg->scale_den) {
+    fprintf(stderr, "Encoding at %d/%d of the captured size (%s)\n",
+            cfg->scale_num, cfg->scale_den,
+            cfg->use_opencl ? "OpenCL" : frame_scaler_impl());
+  }
+
+  if (spsc_queue_init(&p->capture_q, PIPELINE_QUEUE_DEPTH,
+                      sizeof(struct pipeline_frame)) != 0 ||
+      spsc_queue_init(&p->convert_q, PIPELINE_QUEUE_DEPTH,
+                      sizeof(struct pipeline_frame)) != 0 ||
+      spsc_queue_init(&p->encode_q, PIPELINE_QUEUE_DEPTH,
+                      sizeof(struct pipeline_frame)) != 0) {
+    fprintf(stderr, "Failed to create pipeline queues\n");
+    pipeline_stop(p);
+    return -1;
+  }
+
+  if (cfg->use_hash) {
+    /* Share the tile grid so changed tiles map 1:1 onto encoded tiles */
+    int hash_tile = cfg->tile_size > 0 ? cfg->tile_size : TILE_HASH_DEFAULT_SIZE;
+    if (tile_hasher_init(&p->hasher, hash_tile) != 0 ||
+        tile_hasher_init(&p->hasher_uv, hash_tile) != 0) {
+      fprintf(stderr, "Failed to initialize tile hasher\n");
+      pipeline_stop(p);
+      return -1;
+    }
+    p->hasher_ready = 1;
+    fprintf(stderr, "Static frame detection enabled (%s, %dpx tiles)\n",
+            tile_hasher_impl(), hash_tile);
+  }
+
+  if (cfg->tile_size > 0) {
+    if (tile_encoder_init(&p->tile_encoder, cfg->tile_size, cfg->quality) !=
+        0) {
+      fprintf(stderr, "Failed to initialize tile encoder\n");
+      pipeline_stop(p);
+      return -1;
+    }
+    p->tile_encoder_ready = 1;
+  } else if (!cfg->use_hw_jpeg) {
+    if (jpeg_encoder_init(&p->sw_encoder, cfg->quality) != 0) {
+      fprintf(stderr, "Failed to initialize JPEG encoder\n");
+      pipeline_stop(p);
+      return -1;
+    }
+    p->sw_encoder_ready = 1;
+  }
+
+  if (start_thread(&p->encode_thread, "wlcast-encode", encode_thread_main,
+                   p) != 0) {
+    pipeline_stop(p);
+    return -1;
+  }
+  p->encode_started = 1;
+
+  if (p->has_convert_stage) {
+    if (start_thread(&p->convert_thread, "wlcast-convert",
+                     convert_thread_main, p) != 0) {
+      pipeline_stop(p);
+      return -1;
+    }
+    p->convert_started = 1;
+  }
+
+  if (start_thread(&p->capture_thread, "wlcast-capture", capture_thread_main,
+                   p) != 0) {
+    pipeline_stop(p);
+    return -1;
+  }
+  p->capture_started = 1;
+
+  *out = p;
+  return 0;
+}
+
+int pipeline_next_encoded(struct pipeline *p, struct pipeline_frame *out,
+                          int wake_fd, int timeout_ms) {
+  if (atomic_load(&p->failed)) {
+    return -1;
+  }
+  /* Tiled frames are deltas: every one must be sent, so the send stage
+   * takes them in order instead of skipping to the newest. */
+  if (p->cfg.tile_size > 0) {
+    if (spsc_queue_wait_fd(&p->encode_q, wake_fd, timeout_ms) &&
+        spsc_queue_pop(&p->encode_q, out)) {
+      return 1;
+    }
+  } else if (pop_latest(p, &p->encode_q, out, wake_fd, timeout_ms)) {
+    return 1;
+  }
+  return atomic_load(&p->failed) ? -1 : 0;
+}
+
+void pipeline_set_quality(struct pipeline *p, int quality) {
+  atomic_store(&p->quality, quality);
+}
+
+int pipeline_set_scale(struct pipeline *p, int num, int den) {
+  if (!scale_allowed(p, num, den)) {
+    return -1;
+  }
+  atomic_store(&p->scale, pack_scale(num, den));
+  return 0;
+}
+
+void pipeline_set_frame_interval(struct pipeline *p, uint64_t interval_ms) {
+  atomic_store(&p->frame_interval_ms, interval_ms);
+}
+
+unsigned int pipeline_take_dropped(struct pipeline *p) {
+  return atomic_exchange(&p->dropped, 0u);
+}
+
+void pipeline_request_keyframe(struct pipeline *p) {
+  atomic_store(&p->keyframe_requested, 1);
+}
+
+unsigned int pipeline_take_idle(struct pipeline *p) {
+  return atomic_exchange(&p->idle, 0u);
+}
+
+void pipeline_stop(struct pipeline *p) {
+  if (!p) {
+    return;
+  }
+
+  atomic_store(&p->running, 0);
+  if (p->capture_q.entries) {
+    spsc_queue_wake(&p->capture_q);
+  }
+  if (p->convert_q.entries) {
+    spsc_queue_wake(&p->convert_q);
+  }
+
+  /* Join consumers first, then drain their inputs so a capture thread
+   * waiting for a free buffer can finish its iteration and exit. */
+  if (p->encode_started) {
+    pthread_join(p->encode_thread, NULL);
+  }
+  if (p->convert_started) {
+    pthread_join(p->convert_thread, NULL);
+  }
+  drain_queue(&p->capture_q);
+  drain_queue(&p->convert_q);
+  if (p->capture_started) {
+    pthread_join(p->capture_thread, NULL);
+  }
+  drain_queue(&p->capture_q);
+  drain_queue(&p->convert_q);
+  drain_queue(&p->encode_q);
+
+  if (p->sw_encoder_ready) {
+    jpeg_encoder_destroy(&p->sw_encoder);
+  }
+  if (p->tile_encoder_ready) {
+    tile_encoder_destroy(&p->tile_encoder);
+  }
+  if (p->hasher_ready) {
+    tile_hasher_destroy(&p->hasher);
+    tile_hasher_destroy(&p->hasher_uv);
+  }
+  frame_scaler_destroy(&p->scaler);
+  if (p->hw_encoder_ready) {
+    v4l2_jpeg_destroy(&p->hw_encoder);
+  }
+  if (p->rga_ready) {
+    v4l2_rga_destroy(&p->rga);
+  }
+#ifdef HAVE_OPENCL
+  if (p->opencl_conv) {
+    opencl_convert_destroy(p->opencl_conv);
+  }
+#endif
+
+  for (int i = 0; i < PIPELINE_JPEG_SLOTS; i++) {
+    free(p->jpeg_slots[i].data);
+  }
+  spsc_queue_destroy(&p->capture_q);
+  spsc_queue_destroy(&p->convert_q);
+  spsc_queue_destroy(&p->encode_q);
+  free(p);
+}
@@ -0,0 +1,146 @@
+#ifndef WLCAST_PIPELINE_H
+#define WLCAST_PIPELINE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capture.h"
+#include "capture_dmabuf.h"
+
+/**
+ * Staged streaming pipeline.
+ *
+ * Capture, colour conversion and JPEG encoding each run on their own thread,
+ * joined by bounded SPSC queues of frame descriptors. The send stage runs on
+ * the caller's thread via pipeline_next_encoded(), so per-frame throughput is
+ * bounded by the slowest stage instead of the sum of all of them.
+ *
+ * Every queue is drop-oldest: a consumer always takes the newest queued
+ * frame and releases anything older, so a slow stage never makes us fall
+ * behind the compositor.
+ */
+
+#define PIPELINE_QUEUE_DEPTH 4
+/* JPEG slots the send stage may keep pinned after releasing the frame
+ * (for retransmission), on top of those the queue and stages need */
+#define PIPELINE_SEND_HOLDS 4
+#define PIPELINE_JPEG_SLOTS (PIPELINE_QUEUE_DEPTH + 2 + PIPELINE_SEND_HOLDS)
+#define PIPELINE_MAX_HOLDS 2
+/* Writable bytes in front of every encoded frame, room for a header the
+ * send stage may prepend without copying the JPEG */
+#define PIPELINE_JPEG_HEADROOM 32
+
+/* With damage tracking, a static screen produces no frames at all. Send a
+ * full frame at least this often so a late-joining or lossy viewer
+ * recovers. */
+#define PIPELINE_KEEPALIVE_MS 1000
+
+struct pipeline;
+
+struct pipeline_config {
+  int use_dmabuf;
+  int use_rga;
+  int use_opencl;
+  int use_hw_jpeg;
+  int use_damage; /* screencopy only: skip frames without damage */
+  int use_hash;   /* skip frames whose content hash did not change */
+  int tile_size;  /* >0: send only changed tiles of this size (sw JPEG) */
+  int quality;
+  /* Encode at scale_num/scale_den of the captured size (1/2 to 1, not with
+   * RGA); 0 = full size */
+  int scale_num;
+  int scale_den;
+  uint64_t frame_interval_ms; /* 0 = capture as fast as possible */
+  struct capture_context *capture;               /* screencopy backend */
+  struct dmabuf_capture_context *dmabuf_capture; /* export-dmabuf backend */
+};
+
+/* Frame descriptor passed between stages by value. */
+struct pipeline_frame {
+  uint64_t seq;
+  uint64_t capture_start_us; /* CLOCK_MONOTONIC */
+  /* When the captured content was presented: the compositor's timestamp,
+   * or capture_start_us for content already on screen before capture
+   * started (or with no timestamp) */
+  uint64_t capture_time_us;
+  /* Per-stage durations, filled in as the frame moves down the pipeline */
+  uint64_t capture_us;
+  uint64_t convert_us;
+  uint64_t encode_us;
+
+  /* Source: either a dmabuf (fds owned by this frame) or a screencopy
+   * buffer (returned with capture_release_frame) */
+  int has_dmabuf;
+  struct dmabuf_frame dma;
+  struct capture_context *capture;
+
+  /* Pixels handed to the encoder (after optional conversion) */
+  struct capture_frame frame;
+  int is_nv12; /* RGA output: planes below instead of frame */
+  const void *y_plane;
+  const void *uv_plane;
+  unsigned int y_stride;
+  unsigned int uv_stride;
+  /* OpenCL output: the converter's dmabuf holding the pixels above and its
+   * buffer index, for an encoder that reads it directly; fd -1 otherwise.
+   * Owned by the converter. */
+  int out_dmabuf_fd;
+  int out_dmabuf_index;
+  size_t out_dmabuf_size;
+
+  /* Stage output buffers pinned by this frame; cleared on release */
+  atomic_int *holds[PIPELINE_MAX_HOLDS];
+  /* OpenCL event of a conversion still running on the GPU: frame.data
+   * (and the dmabuf it reads) are only usable once it has completed */
+  void *convert_fence;
+
+  /* Encoded output, owned by a pipeline JPEG slot, preceded by
+   * PIPELINE_JPEG_HEADROOM bytes the send stage may use */
+  unsigned char *jpeg;
+  unsigned long jpeg_size;
+  atomic_int *jpeg_hold;
+};
+
+/* Start the capture, convert and encode threads.
+ * Returns 0 on success, -1 on failure. */
+int pipeline_start(struct pipeline **out, const struct pipeline_config *cfg);
+
+/* Wait for the next encoded frame. Returns 1 with *out filled (caller must
+ * pipeline_frame_release it), 0 on timeout or when wake_fd (-1 for none)
+ * becomes readable first, -1 if the pipeline failed. */
+int pipeline_next_encoded(struct pipeline *p, struct pipeline_frame *out,
+                          int wake_fd, int timeout_ms);
+
+/* Release everything a frame descriptor still holds (dmabuf fds, capture
+ * buffer, conversion output, JPEG slot). Safe on any thread. */
+void pipeline_frame_release(struct pipeline_frame *frame);
+
+/* Request a new JPEG quality; applied by the encode thread before the next
+ * frame. */
+void pipeline_set_quality(struct pipeline *p, int quality);
+
+/* Request a new output scale, num/den of the captured size. Applied from
+ * the next captured frame; OpenCL scales while converting, the CPU paths
+ * before encoding. Returns -1 if the scale is outside 1/2 to 1 or the
+ * pipeline converts with RGA, which can't scale. */
+int pipeline_set_scale(struct pipeline *p, int num, int den);
+
+/* Make the next tiled frame carry every tile, e.g. after the viewer lost
+ * a frame. No effect outside tiled mode. */
+void pipeline_request_keyframe(struct pipeline *p);
+
+/* Change the capture throttle interval (0 = unlimited). */
+void pipeline_set_frame_interval(struct pipeline *p, uint64_t interval_ms);
+
+/* Frames dropped by drop-oldest queues since the last call. */
+unsigned int pipeline_take_dropped(struct pipeline *p);
+
+/* Capture waits that ended without damage since the last call. Non-zero
+ * means the source, not the pipeline, limited the frame rate. */
+unsigned int pipeline_take_idle(struct pipeline *p);
+
+/* Stop all stage threads, release queued frames and free the pipeline. */
+void pipeline_stop(struct pipeline *p);
+
+#endif
@@ -0,0 +1,322 @@
+#include "scale.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tiles.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCALE_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#ifdef __SSE2__
+#define SCALE_SSE2 1
+#endif
+#endif
+
+#define BPP 4u
+
+int scale_supported(int num, int den) {
+  return num > 0 && den > 0 && num <= den && 2 * num >= den;
+}
+
+uint32_t scale_dimension(uint32_t size, int num, int den) {
+  uint32_t scaled = (uint32_t)((uint64_t)size * (uint64_t)num / (uint64_t)den);
+  scaled &= ~1u;
+  return scaled < 2 ? 2 : scaled;
+}
+
+/* Source pixel left of (or above) each output pixel's centre, and how far
+ * towards the next one the centre lies, in 1/256 */
+static void compute_taps(uint32_t src, uint32_t dst, uint32_t *index,
+                         uint16_t *weight) {
+  for (uint32_t i = 0; i < dst; ++i) {
+    uint64_t centre = ((2 * (uint64_t)i + 1) * src * 256) / (2 * (uint64_t)dst);
+    uint64_t pos = centre > 128 ? centre - 128 : 0;
+    uint32_t idx = (uint32_t)(pos >> 8);
+    uint16_t w = (uint16_t)(pos & 255u);
+    if (idx >= src - 1) {
+      idx = src - 1;
+      w = 0;
+    }
+    index[i] = idx;
+    weight[i] = w;
+  }
+}
+
+/* dst = a + (b - a) * w / 256, rounded, for n bytes; w in 1..255 */
+static void blend_rows(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                       size_t n, unsigned w) {
+  size_t i = 0;
+#if defined(SCALE_NEON)
+  if (w == 128) {
+    for (; i + 16 <= n; i += 16) {
+      vst1q_u8(dst + i, vrhaddq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+    }
+  } else {
+    uint8x8_t wa = vdup_n_u8((uint8_t)(256 - w));
+    uint8x8_t wb = vdup_n_u8((uint8_t)w);
+    for (; i + 16 <= n; i += 16) {
+      uint8x16_t va = vld1q_u8(a + i);
+      uint8x16_t vb = vld1q_u8(b + i);
+      uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa), vget_low_u8(vb), wb);
+      uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa), vget_high_u8(vb), wb);
+      vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+  }
+#elif defined(SCALE_SSE2)
+  if (w == 128) {
+    for (; i + 16 <= n; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_avg_epu8(va, vb));
+    }
+  } else {
+    /* 255 * 256 + 128 still fits an unsigned 16-bit lane */
+    __m128i wa = _mm_set1_epi16((short)(256 - w));
+    __m128i wb = _mm_set1_epi16((short)w);
+    __m128i round = _mm_set1_epi16(128);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                                 _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+      __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                                 _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+      lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+      hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[i] = (uint8_t)((a[i] * (256 - w) + b[i] * w + 128) >> 8);
+  }
+}
+
+/* Output pixels x0..x1 of a row at exactly half the source width: the
+ * average of source pixels 2x and 2x+1 */
+static void halve_columns(uint8_t *dst, const uint8_t *src, uint32_t x0,
+                          uint32_t x1) {
+  uint32_t x = x0;
+#if defined(SCALE_NEON)
+  for (; x + 4 <= x1; x += 4) {
+    uint32x4x2_t px = vld2q_u32((const uint32_t *)(const void *)(src + x * 2 * BPP));
+    uint8x16_t avg = vrhaddq_u8(vreinterpretq_u8_u32(px.val[0]),
+                                vreinterpretq_u8_u32(px.val[1]));
+    vst1q_u8(dst + x * BPP, avg);
+  }
+#elif defined(SCALE_SSE2)
+  for (; x + 4 <= x1; x += 4) {
+    __m128 a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(src + x * 2 * BPP)));
+    __m128 b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(src + x * 2 * BPP + 16)));
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    _mm_storeu_si128((__m128i *)(dst + x * BPP), _mm_avg_epu8(even, odd));
+  }
+#endif
+  for (; x < x1; ++x) {
+    const uint8_t *p = src + x * 2 * BPP;
+    for (uint32_t c = 0; c < BPP; ++c) {
+      dst[x * BPP + c] = (uint8_t)((p[c] + p[BPP + c] + 1) >> 1);
+    }
+  }
+}
+
+/* Output pixels x0..x1 of a row, any supported scale. Two channels per
+ * 32-bit multiply: each 8.8 product stays within its 16-bit half. */
+static void scale_columns(const struct frame_scaler *s, uint8_t *dst,
+                          const uint8_t *src, uint32_t x0, uint32_t x1) {
+  for (uint32_t x = x0; x < x1; ++x) {
+    const uint8_t *a = src + s->x_index[x] * BPP;
+    uint32_t w = s->x_weight[x];
+    if (w == 0) {
+      memcpy(dst + x * BPP, a, BPP);
+      continue;
+    }
+    uint32_t pa;
+    uint32_t pb;
+    memcpy(&pa, a, BPP);
+    memcpy(&pb, a + BPP, BPP);
+    uint32_t even = (((pa & 0x00ff00ffu) * (256 - w) +
+                      (pb & 0x00ff00ffu) * w + 0x00800080u) >> 8) & 0x00ff00ffu;
+    uint32_t odd = (((pa >> 8) & 0x00ff00ffu) * (256 - w) +
+                    ((pb >> 8) & 0x00ff00ffu) * w + 0x00800080u) & 0xff00ff00u;
+    uint32_t px = even | odd;
+    memcpy(dst + x * BPP, &px, BPP);
+  }
+}
+
+/* Rescale output rows y0..y1, columns x0..x1 */
+static void scale_region(struct frame_scaler *s, const struct capture_frame *in,
+                         uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+  const uint8_t *base = in->data;
+  int half = s->src_width == 2 * s->width;
+  /* Source columns the output columns read */
+  uint32_t sx0 = s->x_index[x0];
+  uint32_t sx1 = s->x_index[x1 - 1] + 2;
+  if (sx1 > s->src_width) {
+    sx1 = s->src_width;
+  }
+  size_t offset = sx0 * BPP;
+  size_t span = (sx1 - sx0) * BPP;
+
+  for (uint32_t y = y0; y < y1; ++y) {
+    const uint8_t *a = base + (size_t)s->y_index[y] * in->stride;
+    unsigned w = s->y_weight[y];
+    const uint8_t *row = a;
+    if (w != 0) {
+      blend_rows(s->row + offset, a + offset, a + in->stride + offset, span, w);
+      row = s->row;
+    }
+    uint8_t *dst = s->data + (size_t)y * s->width * BPP;
+    if (half) {
+      halve_columns(dst, row, x0, x1);
+    } else {
+      scale_columns(s, dst, row, x0, x1);
+    }
+  }
+}
+
+/* Output range touched by source range [lo, hi), one pixel of slack on
+ * each side for the filter's reach */
+static void map_range(uint32_t lo, uint32_t hi, uint32_t src, uint32_t dst,
+                      uint32_t *out_lo, uint32_t *out_hi) {
+  uint64_t a = (uint64_t)lo * dst / src;
+  uint64_t b = ((uint64_t)hi * dst + src - 1) / src + 1;
+  *out_lo = a > 0 ? (uint32_t)a - 1 : 0;
+  *out_hi = b < dst ? (uint32_t)b : dst;
+}
+
+static int resize(struct frame_scaler *s, const struct capture_frame *in,
+                  uint32_t width, uint32_t height) {
+  size_t needed = (size_t)width * height * BPP;
+  if (needed > s->capacity) {
+    uint8_t *data = realloc(s->data, needed);
+    if (!data) {
+      return -1;
+    }
+    s->data = data;
+    s->capacity = needed;
+  }
+  size_t row_needed = (size_t)in->width * BPP;
+  if (row_needed > s->row_capacity) {
+    uint8_t *row = realloc(s->row, row_needed);
+    if (!row) {
+      return -1;
+    }
+    s->row = row;
+    s->row_capacity = row_needed;
+  }
+  uint32_t *x_index = realloc(s->x_index, width * sizeof(*x_index));
+  if (x_index) {
+    s->x_index = x_index;
+  }
+  uint16_t *x_weight = realloc(s->x_weight, width * sizeof(*x_weight));
+  if (x_weight) {
+    s->x_weight = x_weight;
+  }
+  uint32_t *y_index = realloc(s->y_index, height * sizeof(*y_index));
+  if (y_index) {
+    s->y_index = y_index;
+  }
+  uint16_t *y_weight = realloc(s->y_weight, height * sizeof(*y_weight));
+  if (y_weight) {
+    s->y_weight = y_weight;
+  }
+  if (!x_index || !x_weight || !y_index || !y_weight) {
+    return -1;
+  }
+  compute_taps(in->width, width, s->x_index, s->x_weight);
+  compute_taps(in->height, height, s->y_index, s->y_weight);
+  s->src_width = in->width;
+  s->src_height = in->height;
+  s->width = width;
+  s->height = height;
+  s->format = in->format;
+  return 0;
+}
+
+void frame_scaler_init(struct frame_scaler *s) {
+  memset(s, 0, sizeof(*s));
+}
+
+int frame_scaler_scale(struct frame_scaler *s, const struct capture_frame *in,
+                       uint32_t width, uint32_t height, int full,
+                       struct capture_frame *out) {
+  if (tile_bytes_per_pixel(in->format) != BPP || width < 2 || height < 2 ||
+      width > in->width || height > in->height ||
+      2 * width + 2 < in->width || 2 * height + 2 < in->height) {
+    fprintf(stderr, "scale: can't scale %ux%u to %ux%u\n", in->width,
+            in->height, width, height);
+    return -1;
+  }
+
+  if (!s->valid || s->src_width != in->width ||
+      s->src_height != in->height || s->width != width ||
+      s->height != height || s->format != in->format) {
+    s->valid = 0;
+    if (resize(s, in, width, height) != 0) {
+      fprintf(stderr, "scale: out of memory\n");
+      return -1;
+    }
+    full = 1;
+  }
+
+  *out = *in;
+  out->width = width;
+  out->height = height;
+  out->stride = width * BPP;
+  out->data = s->data;
+
+  if (full || in->damage_count <= 0) {
+    scale_region(s, in, 0, 0, width, height);
+    out->damage_count = 1;
+    out->damage[0] = (struct capture_rect){0, 0, width, height};
+  } else {
+    out->damage_count = 0;
+    for (int i = 0; i < in->damage_count; ++i) {
+      const struct capture_rect *r = &in->damage[i];
+      uint32_t x1 = r->x + r->width < in->width ? r->x + r->width : in->width;
+      uint32_t y1 = r->y + r->height < in->height ? r->y + r->height : in->height;
+      uint32_t ox0, ox1, oy0, oy1;
+      map_range(r->x, x1, in->width, width, &ox0, &ox1);
+      map_range(r->y, y1, in->height, height, &oy0, &oy1);
+      if (r->x >= x1 || r->y >= y1 || ox0 >= ox1 || oy0 >= oy1) {
+        continue;
+      }
+      scale_region(s, in, ox0, oy0, ox1, oy1);
+      out->damage[out->damage_count++] =
+          (struct capture_rect){ox0, oy0, ox1 - ox0, oy1 - oy0};
+    }
+  }
+  s->valid = 1;
+  return 0;
+}
+
+void frame_scaler_invalidate(struct frame_scaler *s) {
+  s->valid = 0;
+}
+
+void frame_scaler_destroy(struct frame_scaler *s) {
+  free(s->data);
+  free(s->row);
+  free(s->x_index);
+  free(s->x_weight);
+  free(s->y_index);
+  free(s->y_weight);
+  memset(s, 0, sizeof(*s));
+}
+
+const char *frame_scaler_impl(void) {
+#if defined(SCALE_NEON)
+  return "NEON";
+#elif defined(SCALE_SSE2)
+  return "SSE2";
+#else
+  return "scalar";
+#endif
+}
@@ -0,0 +1,68 @@
+#ifndef WLCAST_SCALE_H
+#define WLCAST_SCALE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capture.h"
+
+/**
+ * Downscaling of captured frames before encoding.
+ *
+ * Sending fewer pixels is the cheapest way to cut bitrate without the
+ * blockiness of low JPEG quality; the viewer scales back up to its window.
+ * Scales from 1/2 to 1 are supported. Each output pixel is a bilinear
+ * sample at its centre, which at exactly 1/2 is a 2x2 box filter. The row
+ * blend uses NEON or SSE2 where available, as does the column step at 1/2.
+ *
+ * Only the damaged parts of a frame are rescaled; the rest of the output
+ * is kept from the previous frame.
+ */
+struct frame_scaler {
+  uint32_t src_width;
+  uint32_t src_height;
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  uint8_t *data; /* Output, width * 4 bytes per row */
+  size_t capacity;
+  uint8_t *row; /* One source row after the vertical blend */
+  size_t row_capacity;
+  /* Per output column and row: first source pixel and the weight (of
+   * 256) of the one after it */
+  uint32_t *x_index;
+  uint16_t *x_weight;
+  uint32_t *y_index;
+  uint16_t *y_weight;
+  int valid; /* data holds the previous frame at this geometry */
+};
+
+/* Whether num/den is a supported scale (1/2 to 1) */
+int scale_supported(int num, int den);
+
+/* A frame dimension scaled by num/den, rounded down to even so chroma
+ * subsampling stays aligned; at least 2 */
+uint32_t scale_dimension(uint32_t size, int num, int den);
+
+void frame_scaler_init(struct frame_scaler *s);
+
+/* Scale a 4 bytes per pixel frame to width x height (at most the input
+ * size, at least scale_dimension's half of it in each direction). out
+ * describes the scaler's buffer, valid until the next call, with the
+ * input's damage scaled to match; it keeps in's buffer_index so it can be
+ * released in its place. Everything is rescaled on the first call, after a
+ * size change or when full is set. Returns 0 on success, -1 on failure. */
+int frame_scaler_scale(struct frame_scaler *s, const struct capture_frame *in,
+                       uint32_t width, uint32_t height, int full,
+                       struct capture_frame *out);
+
+/* Forget the previous frame so the next call rescales everything, e.g.
+ * after frames went out unscaled. */
+void frame_scaler_invalidate(struct frame_scaler *s);
+
+void frame_scaler_destroy(struct frame_scaler *s);
+
+/* Name of the scaling implementation in use, for logging */
+const char *frame_scaler_impl(void);
+
+#endif
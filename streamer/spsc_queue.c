@@ -0,0 +1,134 @@
+#include "spsc_queue.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+int spsc_queue_init(struct spsc_queue *q, uint32_t capacity, size_t entry_size) {
+  memset(q, 0, sizeof(*q));
+  q->event_fd = -1;
+
+  if (capacity == 0 || entry_size == 0) {
+    return -1;
+  }
+
+  uint32_t cap = 1;
+  while (cap < capacity) {
+    cap <<= 1;
+  }
+
+  q->entries = calloc(cap, entry_size);
+  if (!q->entries) {
+    fprintf(stderr, "spsc_queue: alloc failed\n");
+    return -1;
+  }
+
+  q->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (q->event_fd < 0) {
+    perror("eventfd");
+    free(q->entries);
+    q->entries = NULL;
+    return -1;
+  }
+
+  q->entry_size = entry_size;
+  q->capacity = cap;
+  q->mask = cap - 1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  return 0;
+}
+
+void spsc_queue_destroy(struct spsc_queue *q) {
+  if (!q) {
+    return;
+  }
+  if (q->event_fd >= 0) {
+    close(q->event_fd);
+  }
+  free(q->entries);
+  memset(q, 0, sizeof(*q));
+  q->event_fd = -1;
+}
+
+int spsc_queue_push(struct spsc_queue *q, const void *entry) {
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (tail - head >= q->capacity) {
+    return -1;
+  }
+
+  memcpy(q->entries + (size_t)(tail & q->mask) * q->entry_size, entry,
+         q->entry_size);
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+  spsc_queue_wake(q);
+  return 0;
+}
+
+int spsc_queue_pop(struct spsc_queue *q, void *out) {
+  for (;;) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head == tail) {
+      return 0;
+    }
+
+    /* If the producer evicts this entry meanwhile it may already be
+     * overwriting it with a new one, so the copy can be torn. The CAS then
+     * fails and the copy is thrown away before anyone looks at it; this is
+     * why entries must be plain data (see spsc_queue.h). The copy cannot
+     * move after the CAS: once head moves the slot is the producer's. */
+    memcpy(out, q->entries + (size_t)(head & q->mask) * q->entry_size,
+           q->entry_size);
+    if (atomic_compare_exchange_strong_explicit(&q->head, &head, head + 1,
+                                                memory_order_acq_rel,
+                                                memory_order_acquire)) {
+      return 1;
+    }
+  }
+}
+
+uint32_t spsc_queue_count(struct spsc_queue *q) {
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  return tail - head;
+}
+
+int spsc_queue_wait(struct spsc_queue *q, int timeout_ms) {
+  return spsc_queue_wait_fd(q, -1, timeout_ms);
+}
+
+int spsc_queue_wait_fd(struct spsc_queue *q, int fd, int timeout_ms) {
+  if (spsc_queue_count(q) > 0) {
+    return 1;
+  }
+
+  /* The eventfd counter survives until read, so a push that lands between
+   * the check above and poll() still wakes us. poll() ignores fd < 0. */
+  struct pollfd pfd[2] = {{q->event_fd, POLLIN, 0}, {fd, POLLIN, 0}};
+  int rc;
+  do {
+    rc = poll(pfd, 2, timeout_ms);
+  } while (rc < 0 && errno == EINTR);
+
+  if (rc > 0 && (pfd[0].revents & POLLIN)) {
+    uint64_t value;
+    ssize_t n = read(q->event_fd, &value, sizeof(value));
+    (void)n;
+  }
+
+  return spsc_queue_count(q) > 0 ? 1 : 0;
+}
+
+void spsc_queue_wake(struct spsc_queue *q) {
+  uint64_t one = 1;
+  ssize_t n = write(q->event_fd, &one, sizeof(one));
+  (void)n;
+}
@@ -0,0 +1,59 @@
+#ifndef WLCAST_SPSC_QUEUE_H
+#define WLCAST_SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bounded single-producer/single-consumer ring of fixed-size entries.
+ *
+ * Lock-free: only the producer writes tail. One thread pushes and one
+ * consumes, but the producer may also pop: when the ring is full it can
+ * evict the oldest entry to make room (see spsc_queue_pop). head is
+ * therefore advanced with a compare-and-swap, so each entry is taken by
+ * exactly one of the two threads.
+ *
+ * Entries are copied in and out by value, so they should be small
+ * descriptors rather than pixel data, and must be plain data (no pointers
+ * into the entry itself, nothing that needs a copy constructor). A pop that
+ * loses the race to an eviction may copy a slot the producer is rewriting;
+ * that copy is discarded, never used. An eventfd lets the consumer sleep
+ * until the producer pushes something. */
+struct spsc_queue {
+  unsigned char *entries;
+  size_t entry_size;
+  uint32_t capacity; /* Power of two */
+  uint32_t mask;
+  _Atomic uint32_t head; /* Next entry to pop */
+  _Atomic uint32_t tail; /* Next entry to push (producer owned) */
+  int event_fd;
+};
+
+/* Initialize a queue holding up to capacity entries (rounded up to a power
+ * of two). Returns 0 on success, -1 on failure. */
+int spsc_queue_init(struct spsc_queue *q, uint32_t capacity, size_t entry_size);
+
+void spsc_queue_destroy(struct spsc_queue *q);
+
+/* Producer side. Returns 0 on success, -1 if the queue is full. */
+int spsc_queue_push(struct spsc_queue *q, const void *entry);
+
+/* Consumer side, or the producer evicting the oldest entry of a full
+ * queue. Returns 1 if an entry was copied to out, 0 if empty. */
+int spsc_queue_pop(struct spsc_queue *q, void *out);
+
+/* Number of entries currently queued (approximate from either side). */
+uint32_t spsc_queue_count(struct spsc_queue *q);
+
+/* Consumer side: block until the queue is non-empty, the timeout expires
+ * or spsc_queue_wake is called. Returns 1 if entries are available. */
+int spsc_queue_wait(struct spsc_queue *q, int timeout_ms);
+
+/* Like spsc_queue_wait, but also returns early once fd is readable, so the
+ * consumer can service a socket while it waits. fd may be -1. */
+int spsc_queue_wait_fd(struct spsc_queue *q, int fd, int timeout_ms);
+
+/* Wake a consumer blocked in spsc_queue_wait (e.g. on shutdown). */
+void spsc_queue_wake(struct spsc_queue *q);
+
+#endif
@@ -0,0 +1,165 @@
+/* Self-check of the congestion controller in streamer/congestion.c: stream
+ * over a simulated bottleneck link and check that the controller backs off
+ * until the link's queue drains, and recovers once the link is fast again.
+ * Time is simulated, so the run takes milliseconds.
+ *
+ * Build and run: make -C streamer check */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "congestion.h"
+
+#define CHUNK_BYTES 1400u
+#define ONE_WAY_US 5000u
+#define REPORTS 64
+#define PHASE_US 30000000u
+
+static unsigned int failures;
+
+/* A frame the viewer has reassembled; its report reaches us one way later */
+struct pending_report {
+    struct congestion_sample sample;
+    uint64_t due_us;
+};
+
+struct link {
+    double rate_bps;
+    uint64_t free_us; /* When the bottleneck has sent everything queued */
+    struct pending_report reports[REPORTS];
+    unsigned int head;
+    unsigned int count;
+};
+
+/* JPEG size falls with quality and scale: about 1.6 bits per pixel of a
+ * 1280x720 frame at quality 80 */
+static size_t frame_bytes(int quality, int num, int den) {
+    double pixels = 1280.0 * 720.0 * num * num / ((double)den * den);
+    return (size_t)(pixels * 0.02 * quality / 8.0) + 1000u;
+}
+
+/* Push a frame through the bottleneck. Returns its queueing delay. */
+static double send_through(struct link *link, uint32_t frame_id,
+                           size_t bytes, uint64_t now_us) {
+    uint64_t start = now_us + ONE_WAY_US;
+    if (link->free_us > start) {
+        start = link->free_us;
+    }
+    uint64_t chunk_us = (uint64_t)(CHUNK_BYTES * 8e6 / link->rate_bps);
+    uint64_t burst_us = (uint64_t)((double)bytes * 8e6 / link->rate_bps);
+    link->free_us = start + burst_us;
+
+    if (link->count < REPORTS) {
+        struct pending_report *r =
+            &link->reports[(link->head + link->count) % REPORTS];
+        memset(r, 0, sizeof(*r));
+        r->sample.frame_id = frame_id;
+        r->sample.first_send_us = now_us;
+        r->sample.last_send_us = now_us;
+        r->sample.first_arrival_us = (uint32_t)(start + chunk_us);
+        r->sample.last_arrival_us = (uint32_t)link->free_us;
+        r->sample.bytes_received = (uint32_t)bytes;
+        r->sample.chunk_count = (uint16_t)(bytes / CHUNK_BYTES + 1);
+        r->sample.chunks_received = r->sample.chunk_count;
+        r->due_us = link->free_us + ONE_WAY_US;
+        link->count++;
+    }
+    return (double)(start - now_us - ONE_WAY_US) / 1000.0;
+}
+
+static void deliver_reports(struct link *link, struct congestion *cc,
+                            uint64_t now_us) {
+    while (link->count > 0 && link->reports[link->head].due_us <= now_us) {
+        congestion_on_report(cc, &link->reports[link->head].sample, now_us);
+        link->head = (link->head + 1) % REPORTS;
+        link->count--;
+    }
+}
+
+struct phase_result {
+    double queue_ms;     /* Worst queueing delay over the last 5 s */
+    double send_bps;     /* Average over the last 5 s */
+    int quality;
+};
+
+static struct phase_result run_phase(struct congestion *cc, struct link *link,
+                                     uint64_t *now_us, uint32_t *frame_id) {
+    struct phase_result result = {0};
+    uint64_t end = *now_us + PHASE_US;
+    uint64_t tail = end - 5000000u;
+    double tail_bytes = 0;
+
+    while (*now_us < end) {
+        int num;
+        int den;
+        congestion_scale(cc, &num, &den);
+        size_t bytes = frame_bytes(congestion_quality(cc), num, den);
+        congestion_on_sent(cc, bytes, *now_us);
+        double queue_ms = send_through(link, (*frame_id)++, bytes, *now_us);
+        if (*now_us >= tail) {
+            tail_bytes += (double)bytes;
+            if (queue_ms > result.queue_ms) {
+                result.queue_ms = queue_ms;
+            }
+        }
+
+        *now_us += 1000000u / (uint64_t)congestion_fps(cc);
+        deliver_reports(link, cc, *now_us);
+        congestion_update(cc, *now_us, 2.0 * ONE_WAY_US / 1000.0, 0);
+    }
+    result.send_bps = tail_bytes * 8.0 / 5.0;
+    result.quality = congestion_quality(cc);
+    return result;
+}
+
+static void expect(int ok, const char *what, double value) {
+    printf("  %-40s %10.1f  %s\n", what, value, ok ? "ok" : "FAIL");
+    if (!ok) {
+        failures++;
+    }
+}
+
+int main(void) {
+    struct congestion_config cfg = {
+        .target_fps = 30,
+        .quality = 80,
+        .allow_scaling = 1,
+    };
+    struct congestion *cc;
+    if (congestion_init(&cc, &cfg) != 0) {
+        fprintf(stderr, "congestion_init failed\n");
+        return 1;
+    }
+
+    struct link link = {.rate_bps = 8e6};
+    uint64_t now_us = 1000000u;
+    uint32_t frame_id = 1;
+
+    /* Quality 80 needs about 44 Mbit/s: the controller must fit 8 */
+    printf("8 Mbit/s link:\n");
+    struct phase_result slow = run_phase(cc, &link, &now_us, &frame_id);
+    expect(slow.send_bps <= link.rate_bps, "send rate, last 5 s (kbit/s)",
+           slow.send_bps / 1000.0);
+    expect(slow.queue_ms < 100.0, "worst queueing delay, last 5 s (ms)",
+           slow.queue_ms);
+    expect(slow.quality < cfg.quality, "quality", slow.quality);
+
+    /* Plenty of room again: quality must come back up */
+    printf("100 Mbit/s link:\n");
+    link.rate_bps = 100e6;
+    struct phase_result fast = run_phase(cc, &link, &now_us, &frame_id);
+    expect(fast.queue_ms < 20.0, "worst queueing delay, last 5 s (ms)",
+           fast.queue_ms);
+    expect(fast.quality > slow.quality, "quality", fast.quality);
+    expect(congestion_fps(cc) == cfg.target_fps, "frame rate",
+           congestion_fps(cc));
+
+    congestion_destroy(cc);
+    if (failures) {
+        printf("Congestion test FAILED: %u checks\n", failures);
+        return 1;
+    }
+    printf("Congestion test PASSED\n");
+    return 0;
+}
@@ -0,0 +1,169 @@
+/* Self-check of the erasure code in common/fec.c: encode a group the way
+ * the streamer does, erase chunks, and rebuild them the way the viewer
+ * does. Every pattern of up to parity_count lost chunks is tried, with
+ * parity rows lost as well.
+ *
+ * Build and run: make -C streamer check */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fec.h"
+
+#define CHUNK_LEN 64
+
+static unsigned int failures;
+static unsigned int cases;
+
+/* Deterministic data, so a failure can be reproduced */
+static uint32_t rng_state = 12345;
+static uint8_t rng_byte(void) {
+    rng_state = rng_state * 1103515245u + 12345u;
+    return (uint8_t)(rng_state >> 16);
+}
+
+/* Chunk pos is len_of(pos) bytes; the last one of a frame is shorter */
+static size_t len_of(uint32_t pos, uint32_t members) {
+    return pos + 1 == members ? CHUNK_LEN / 2 + 3 : CHUNK_LEN;
+}
+
+/* Lose the chunks in lost (bitmask over positions), recover them from the
+ * parity rows in rows and compare */
+static void check(uint8_t data[][CHUNK_LEN], uint32_t members,
+                  uint8_t parity[][CHUNK_LEN], uint64_t lost,
+                  const uint32_t *rows, uint32_t count) {
+    uint8_t syndromes[FEC_MAX_PARITY][CHUNK_LEN];
+    uint8_t rebuilt[FEC_MAX_PARITY][CHUNK_LEN];
+    uint8_t *syndrome_ptrs[FEC_MAX_PARITY];
+    uint8_t *out_ptrs[FEC_MAX_PARITY];
+    uint32_t positions[FEC_MAX_PARITY];
+
+    uint32_t k = 0;
+    for (uint32_t pos = 0; pos < members; pos++) {
+        if (lost & (1ull << pos)) {
+            positions[k++] = pos;
+        }
+    }
+    for (uint32_t j = 0; j < count; j++) {
+        memcpy(syndromes[j], parity[rows[j]], CHUNK_LEN);
+        for (uint32_t pos = 0; pos < members; pos++) {
+            if (!(lost & (1ull << pos))) {
+                fec_accumulate(syndromes[j], data[pos], len_of(pos, members),
+                               fec_coef(rows[j], pos));
+            }
+        }
+        syndrome_ptrs[j] = syndromes[j];
+        out_ptrs[j] = rebuilt[j];
+    }
+
+    cases++;
+    if (fec_solve(syndrome_ptrs, rows, positions, count, CHUNK_LEN,
+                  out_ptrs) != 0) {
+        fprintf(stderr, "FAIL: members=%u lost=%#llx: fec_solve failed\n",
+                members, (unsigned long long)lost);
+        failures++;
+        return;
+    }
+    for (uint32_t j = 0; j < count; j++) {
+        uint32_t pos = positions[j];
+        if (memcmp(rebuilt[j], data[pos], len_of(pos, members)) != 0) {
+            fprintf(stderr, "FAIL: members=%u lost=%#llx: chunk %u differs\n",
+                    members, (unsigned long long)lost, pos);
+            failures++;
+            return;
+        }
+    }
+}
+
+/* Next k-element subset of n as a bitmask (Gosper's hack), 0 when done */
+static uint64_t next_subset(uint64_t set, uint32_t n) {
+    uint64_t c = set & -set;
+    uint64_t r = set + c;
+    uint64_t next = (((r ^ set) >> 2) / c) | r;
+    return n < 64 && next >> n ? 0 : next;
+}
+
+static void test_group(uint32_t members, uint32_t parity_count) {
+    uint8_t data[FEC_MAX_GROUP][CHUNK_LEN];
+    uint8_t parity[FEC_MAX_PARITY][CHUNK_LEN];
+
+    /* Encode: bytes past a short chunk's end count as zero */
+    memset(data, 0, sizeof(data));
+    memset(parity, 0, sizeof(parity));
+    for (uint32_t pos = 0; pos < members; pos++) {
+        for (size_t i = 0; i < len_of(pos, members); i++) {
+            data[pos][i] = rng_byte();
+        }
+        for (uint32_t row = 0; row < parity_count; row++) {
+            fec_accumulate(parity[row], data[pos], len_of(pos, members),
+                           fec_coef(row, pos));
+        }
+    }
+
+    /* Any count surviving parity rows must rebuild any count lost chunks */
+    for (uint32_t count = 1; count <= parity_count && count <= members;
+         count++) {
+        for (uint64_t row_set = (1ull << count) - 1; row_set;
+             row_set = next_subset(row_set, parity_count)) {
+            uint32_t rows[FEC_MAX_PARITY];
+            uint32_t n = 0;
+            for (uint32_t row = 0; row < parity_count; row++) {
+                if (row_set & (1ull << row)) {
+                    rows[n++] = row;
+                }
+            }
+            /* Every loss pattern for small groups, a sample for large */
+            uint64_t lost = (1ull << count) - 1;
+            for (unsigned int tried = 0; lost && tried < 4096; tried++) {
+                check(data, members, parity, lost, rows, count);
+                lost = next_subset(lost, members);
+            }
+        }
+    }
+}
+
+static void test_groups(void) {
+    /* Members of all groups add up to the chunks, each chunk in one group */
+    for (uint32_t chunks = 1; chunks < 300; chunks++) {
+        for (uint32_t size = 1; size <= FEC_MAX_GROUP; size++) {
+            uint32_t groups = fec_group_count(chunks, size);
+            uint32_t total = 0;
+            for (uint32_t g = 0; g < groups; g++) {
+                uint32_t members = fec_group_members(chunks, groups, g);
+                if (members > size) {
+                    fprintf(stderr, "FAIL: %u chunks by %u: group %u has %u\n",
+                            chunks, size, g, members);
+                    failures++;
+                }
+                total += members;
+            }
+            cases++;
+            if (total != chunks) {
+                fprintf(stderr, "FAIL: %u chunks by %u: groups hold %u\n",
+                        chunks, size, total);
+                failures++;
+            }
+        }
+    }
+}
+
+int main(void) {
+    static const uint32_t sizes[] = {1, 2, 3, 5, 8, 16, 33, FEC_MAX_GROUP};
+
+    fec_init();
+    test_groups();
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (uint32_t parity_count = 1; parity_count <= FEC_MAX_PARITY;
+             parity_count++) {
+            test_group(sizes[i], parity_count);
+        }
+    }
+
+    if (failures) {
+        printf("FEC test FAILED: %u of %u cases\n", failures, cases);
+        return 1;
+    }
+    printf("FEC test PASSED (%u cases)\n", cases);
+    return 0;
+}
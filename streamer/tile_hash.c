@@ -0,0 +1,378 @@
+#include "tile_hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TILE_HASH_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#ifdef __SSE2__
+#define TILE_HASH_SSE2 1
+#endif
+#if defined(__GNUC__) && !defined(__AVX2__)
+#define TILE_HASH_AVX2_DISPATCH 1
+#endif
+#endif
+
+/*
+ * The hash is an XXH3-style accumulator: each 32-byte stripe is mixed into
+ * four 64-bit lanes with a 32x32->64 multiply, which every SIMD flavour we
+ * care about has (pmuludq, vpmuludq, umull). Keys vary with the stripe's
+ * position in the row and the lanes are scrambled after every row, so moving
+ * pixels around inside a tile changes the hash. All implementations compute
+ * the same value.
+ */
+
+#define STRIPE_BYTES 32u
+#define KEY_STRIPES 8u
+#define PRIME32 0x9E3779B1u
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define PRIME64_3 0x165667B19E3779F9ull
+
+#define K(i) ((uint64_t)((i) + 1) * 0x9E3779B97F4A7C15ull ^ PRIME64_3)
+static const uint64_t stripe_keys[KEY_STRIPES * 4] = {
+    K(0),  K(1),  K(2),  K(3),  K(4),  K(5),  K(6),  K(7),
+    K(8),  K(9),  K(10), K(11), K(12), K(13), K(14), K(15),
+    K(16), K(17), K(18), K(19), K(20), K(21), K(22), K(23),
+    K(24), K(25), K(26), K(27), K(28), K(29), K(30), K(31),
+};
+static const uint64_t scramble_keys[4] = {K(32), K(33), K(34), K(35)};
+#undef K
+
+static const uint64_t initial_acc[4] = {
+    PRIME64_2, PRIME64_3, 0x27D4EB2F165667C5ull, 0x85EBCA77C2B2AE63ull,
+};
+
+typedef void (*hash_tile_fn)(const uint8_t *data, size_t stride,
+                             size_t row_bytes, uint32_t rows, uint64_t acc[4]);
+
+/* Copy a partial stripe at the end of a row into a zero-padded buffer */
+static const uint8_t *pad_tail(uint8_t buf[STRIPE_BYTES], const uint8_t *p,
+                               size_t len) {
+  memset(buf, 0, STRIPE_BYTES);
+  memcpy(buf, p, len);
+  return buf;
+}
+
+/* === Scalar === */
+
+static void stripe_scalar(uint64_t acc[4], const uint8_t *p,
+                          const uint64_t *key) {
+  uint64_t d[4];
+  memcpy(d, p, sizeof(d));
+  for (int i = 0; i < 4; ++i) {
+    uint64_t dk = d[i] ^ key[i];
+    acc[i] += d[i ^ 1] + (dk & 0xffffffffu) * (dk >> 32);
+  }
+}
+
+static void hash_tile_scalar(const uint8_t *data, size_t stride,
+                             size_t row_bytes, uint32_t rows,
+                             uint64_t acc[4]) {
+  uint8_t tail[STRIPE_BYTES];
+
+  for (uint32_t y = 0; y < rows; ++y) {
+    const uint8_t *p = data + (size_t)y * stride;
+    size_t n = row_bytes;
+    unsigned s = 0;
+    for (; n >= STRIPE_BYTES; n -= STRIPE_BYTES, p += STRIPE_BYTES, ++s) {
+      stripe_scalar(acc, p, &stripe_keys[(s % KEY_STRIPES) * 4]);
+    }
+    if (n > 0) {
+      stripe_scalar(acc, pad_tail(tail, p, n),
+                    &stripe_keys[(s % KEY_STRIPES) * 4]);
+    }
+    for (int i = 0; i < 4; ++i) {
+      acc[i] ^= acc[i] >> 47;
+      acc[i] ^= scramble_keys[i];
+      acc[i] *= PRIME32;
+    }
+  }
+}
+
+/* === NEON === */
+
+#ifdef TILE_HASH_NEON
+static inline uint64x2_t stripe_neon(uint64x2_t acc, const uint8_t *p,
+                                     const uint64_t *key) {
+  uint64x2_t d = vreinterpretq_u64_u8(vld1q_u8(p));
+  uint64x2_t dk = veorq_u64(d, vld1q_u64(key));
+  uint64x2_t prod = vmull_u32(vmovn_u64(dk), vshrn_n_u64(dk, 32));
+  return vaddq_u64(acc, vaddq_u64(vextq_u64(d, d, 1), prod));
+}
+
+static inline uint64x2_t scramble_neon(uint64x2_t acc, uint64x2_t key) {
+  uint32x2_t prime = vdup_n_u32(PRIME32);
+  acc = veorq_u64(acc, vshrq_n_u64(acc, 47));
+  acc = veorq_u64(acc, key);
+  uint64x2_t lo = vmull_u32(vmovn_u64(acc), prime);
+  uint64x2_t hi = vmull_u32(vshrn_n_u64(acc, 32), prime);
+  return vaddq_u64(lo, vshlq_n_u64(hi, 32));
+}
+
+static void hash_tile_neon(const uint8_t *data, size_t stride,
+                           size_t row_bytes, uint32_t rows, uint64_t acc[4]) {
+  uint8_t tail[STRIPE_BYTES];
+  uint64x2_t a0 = vld1q_u64(&acc[0]);
+  uint64x2_t a1 = vld1q_u64(&acc[2]);
+  uint64x2_t sk0 = vld1q_u64(&scramble_keys[0]);
+  uint64x2_t sk1 = vld1q_u64(&scramble_keys[2]);
+
+  for (uint32_t y = 0; y < rows; ++y) {
+    const uint8_t *p = data + (size_t)y * stride;
+    size_t n = row_bytes;
+    unsigned s = 0;
+    for (; n >= STRIPE_BYTES; n -= STRIPE_BYTES, p += STRIPE_BYTES, ++s) {
+      const uint64_t *key = &stripe_keys[(s % KEY_STRIPES) * 4];
+      a0 = stripe_neon(a0, p, key);
+      a1 = stripe_neon(a1, p + 16, key + 2);
+    }
+    if (n > 0) {
+      const uint64_t *key = &stripe_keys[(s % KEY_STRIPES) * 4];
+      const uint8_t *t = pad_tail(tail, p, n);
+      a0 = stripe_neon(a0, t, key);
+      a1 = stripe_neon(a1, t + 16, key + 2);
+    }
+    a0 = scramble_neon(a0, sk0);
+    a1 = scramble_neon(a1, sk1);
+  }
+
+  vst1q_u64(&acc[0], a0);
+  vst1q_u64(&acc[2], a1);
+}
+#endif
+
+/* === SSE2 === */
+
+#ifdef TILE_HASH_SSE2
+static inline __m128i stripe_sse2(__m128i acc, const uint8_t *p,
+                                  const uint64_t *key) {
+  __m128i d = _mm_loadu_si128((const __m128i *)p);
+  __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)key));
+  __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+  __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+  return _mm_add_epi64(acc, _mm_add_epi64(swapped, prod));
+}
+
+static inline __m128i scramble_sse2(__m128i acc, __m128i key) {
+  __m128i prime = _mm_set1_epi32((int)PRIME32);
+  acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+  acc = _mm_xor_si128(acc, key);
+  __m128i lo = _mm_mul_epu32(acc, prime);
+  __m128i hi = _mm_mul_epu32(_mm_srli_epi64(acc, 32), prime);
+  return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+static void hash_tile_sse2(const uint8_t *data, size_t stride,
+                           size_t row_bytes, uint32_t rows, uint64_t acc[4]) {
+  uint8_t tail[STRIPE_BYTES];
+  __m128i a0 = _mm_loadu_si128((const __m128i *)&acc[0]);
+  __m128i a1 = _mm_loadu_si128((const __m128i *)&acc[2]);
+  __m128i sk0 = _mm_loadu_si128((const __m128i *)&scramble_keys[0]);
+  __m128i sk1 = _mm_loadu_si128((const __m128i *)&scramble_keys[2]);
+
+  for (uint32_t y = 0; y < rows; ++y) {
+    const uint8_t *p = data + (size_t)y * stride;
+    size_t n = row_bytes;
+    unsigned s = 0;
+    for (; n >= STRIPE_BYTES; n -= STRIPE_BYTES, p += STRIPE_BYTES, ++s) {
+      const uint64_t *key = &stripe_keys[(s % KEY_STRIPES) * 4];
+      a0 = stripe_sse2(a0, p, key);
+      a1 = stripe_sse2(a1, p + 16, key + 2);
+    }
+    if (n > 0) {
+      const uint64_t *key = &stripe_keys[(s % KEY_STRIPES) * 4];
+      const uint8_t *t = pad_tail(tail, p, n);
+      a0 = stripe_sse2(a0, t, key);
+      a1 = stripe_sse2(a1, t + 16, key + 2);
+    }
+    a0 = scramble_sse2(a0, sk0);
+    a1 = scramble_sse2(a1, sk1);
+  }
+
+  _mm_storeu_si128((__m128i *)&acc[0], a0);
+  _mm_storeu_si128((__m128i *)&acc[2], a1);
+}
+#endif
+
+/* === AVX2 (runtime-selected on x86 builds without -mavx2) === */
+
+#ifdef TILE_HASH_AVX2_DISPATCH
+__attribute__((target("avx2"))) static void hash_tile_avx2(
+    const uint8_t *data, size_t stride, size_t row_bytes, uint32_t rows,
+    uint64_t acc[4]) {
+  uint8_t tail[STRIPE_BYTES];
+  __m256i a = _mm256_loadu_si256((const __m256i *)acc);
+  __m256i sk = _mm256_loadu_si256((const __m256i *)scramble_keys);
+  __m256i prime = _mm256_set1_epi32((int)PRIME32);
+
+  for (uint32_t y = 0; y < rows; ++y) {
+    const uint8_t *p = data + (size_t)y * stride;
+    size_t n = row_bytes;
+    unsigned s = 0;
+    while (n > 0) {
+      const uint8_t *src = p;
+      if (n < STRIPE_BYTES) {
+        src = pad_tail(tail, p, n);
+        n = STRIPE_BYTES;
+      }
+      __m256i d = _mm256_loadu_si256((const __m256i *)src);
+      __m256i k = _mm256_loadu_si256(
+          (const __m256i *)&stripe_keys[(s % KEY_STRIPES) * 4]);
+      __m256i dk = _mm256_xor_si256(d, k);
+      __m256i prod = _mm256_mul_epu32(
+          dk, _mm256_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+      __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+      a = _mm256_add_epi64(a, _mm256_add_epi64(swapped, prod));
+      n -= STRIPE_BYTES;
+      p += STRIPE_BYTES;
+      ++s;
+    }
+    a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+    a = _mm256_xor_si256(a, sk);
+    __m256i lo = _mm256_mul_epu32(a, prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+    a = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+  }
+
+  _mm256_storeu_si256((__m256i *)acc, a);
+}
+#endif
+
+static hash_tile_fn hash_tile = hash_tile_scalar;
+static const char *hash_impl = "scalar";
+
+static void select_impl(void) {
+#if defined(TILE_HASH_NEON)
+  hash_tile = hash_tile_neon;
+  hash_impl = "neon";
+#else
+#ifdef TILE_HASH_SSE2
+  hash_tile = hash_tile_sse2;
+  hash_impl = "sse2";
+#endif
+#ifdef TILE_HASH_AVX2_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    hash_tile = hash_tile_avx2;
+    hash_impl = "avx2";
+  }
+#endif
+#endif
+}
+
+static inline uint64_t rotl64(uint64_t v, int r) {
+  return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t finalize(const uint64_t acc[4]) {
+  uint64_t h = acc[0] ^ rotl64(acc[1], 17) ^ rotl64(acc[2], 31) ^
+               rotl64(acc[3], 47);
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+int tile_hasher_init(struct tile_hasher *h, int tile_size) {
+  memset(h, 0, sizeof(*h));
+  if (tile_size <= 0) {
+    return -1;
+  }
+  h->tile_size = tile_size;
+  select_impl();
+  return 0;
+}
+
+static int resize_grid(struct tile_hasher *h, uint32_t width, uint32_t height,
+                       uint32_t bpp) {
+  uint32_t ts = (uint32_t)h->tile_size;
+  uint32_t cols = (width + ts - 1) / ts;
+  uint32_t rows = (height + ts - 1) / ts;
+  size_t count = (size_t)cols * rows;
+
+  uint64_t *hashes = calloc(count, sizeof(*hashes));
+  uint8_t *changed = calloc(count, 1);
+  if (!hashes || !changed) {
+    fprintf(stderr, "tile_hash: alloc failed\n");
+    free(hashes);
+    free(changed);
+    return -1;
+  }
+  free(h->hashes);
+  free(h->changed);
+  h->hashes = hashes;
+  h->changed = changed;
+  h->width = width;
+  h->height = height;
+  h->bpp = bpp;
+  h->cols = cols;
+  h->rows = rows;
+  h->valid = 0;
+  return 0;
+}
+
+int tile_hasher_update(struct tile_hasher *h, const void *data,
+                       uint32_t stride, uint32_t width, uint32_t height,
+                       uint32_t bpp, int force) {
+  if (!data || width == 0 || height == 0 || bpp == 0) {
+    return -1;
+  }
+  if (!h->hashes || h->width != width || h->height != height ||
+      h->bpp != bpp) {
+    if (resize_grid(h, width, height, bpp) != 0) {
+      return -1;
+    }
+  }
+
+  uint32_t ts = (uint32_t)h->tile_size;
+  int compare = h->valid && !force;
+  int changed = 0;
+
+  for (uint32_t row = 0; row < h->rows; ++row) {
+    uint32_t y = row * ts;
+    uint32_t th = height - y < ts ? height - y : ts;
+    for (uint32_t col = 0; col < h->cols; ++col) {
+      uint32_t x = col * ts;
+      uint32_t tw = width - x < ts ? width - x : ts;
+      const uint8_t *p = (const uint8_t *)data + (size_t)y * stride +
+                         (size_t)x * bpp;
+
+      uint64_t acc[4];
+      memcpy(acc, initial_acc, sizeof(acc));
+      hash_tile(p, stride, (size_t)tw * bpp, th, acc);
+      uint64_t hash = finalize(acc);
+
+      size_t idx = (size_t)row * h->cols + col;
+      int differs = !compare || h->hashes[idx] != hash;
+      h->changed[idx] = (uint8_t)differs;
+      h->hashes[idx] = hash;
+      changed += differs;
+    }
+  }
+
+  h->valid = 1;
+  return changed;
+}
+
+void tile_hasher_invalidate(struct tile_hasher *h) {
+  h->valid = 0;
+}
+
+void tile_hasher_destroy(struct tile_hasher *h) {
+  if (!h) {
+    return;
+  }
+  free(h->hashes);
+  free(h->changed);
+  memset(h, 0, sizeof(*h));
+}
+
+const char *tile_hasher_impl(void) {
+  return hash_impl;
+}
@@ -0,0 +1,47 @@
+#ifndef WLCAST_TILE_HASH_H
+#define WLCAST_TILE_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Grid used for change detection when not streaming tiles */
+#define TILE_HASH_DEFAULT_SIZE 64
+
+/**
+ * Per-tile content hashing.
+ *
+ * Keeps a 64-bit hash for every tile of the previous frame. Hashing uses
+ * NEON, AVX2 or SSE2 where available and is roughly memory-bandwidth bound,
+ * which is far cheaper than encoding a frame that did not change.
+ */
+struct tile_hasher {
+  int tile_size; /* In pixels */
+  uint32_t width;
+  uint32_t height;
+  uint32_t bpp;
+  uint32_t cols;
+  uint32_t rows;
+  uint64_t *hashes; /* Previous frame, cols * rows */
+  uint8_t *changed; /* Result of the last update, cols * rows */
+  int valid;        /* hashes describe a previous frame */
+};
+
+int tile_hasher_init(struct tile_hasher *h, int tile_size);
+
+/* Hash every tile of a width x height image with bpp bytes per pixel and
+ * compare with the previous call. Fills h->changed and returns the number
+ * of changed tiles (all of them on the first call, after a size change or
+ * when force is set), or -1 on failure. */
+int tile_hasher_update(struct tile_hasher *h, const void *data,
+                       uint32_t stride, uint32_t width, uint32_t height,
+                       uint32_t bpp, int force);
+
+/* Forget the previous frame so the next update reports every tile. */
+void tile_hasher_invalidate(struct tile_hasher *h);
+
+void tile_hasher_destroy(struct tile_hasher *h);
+
+/* Name of the hashing implementation in use, for logging */
+const char *tile_hasher_impl(void);
+
+#endif
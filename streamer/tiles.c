@@ -0,0 +1,229 @@
+#include "tiles.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wayland-client.h>
+
+#include "../common/protocol.h"
+#include "v4l2_common.h"
+
+uint32_t tile_bytes_per_pixel(uint32_t format) {
+  switch (format) {
+    case WL_SHM_FORMAT_RGB888:
+    case WL_SHM_FORMAT_BGR888:
+      return 3;
+    case FOURCC_YUYV:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+int tile_encoder_init(struct tile_encoder *enc, int tile_size, int quality) {
+  memset(enc, 0, sizeof(*enc));
+  if (tile_size < TILE_SIZE_MIN || tile_size > TILE_SIZE_MAX ||
+      tile_size % 16 != 0) {
+    fprintf(stderr, "Invalid tile size %d (multiple of 16, %d-%d)\n",
+            tile_size, TILE_SIZE_MIN, TILE_SIZE_MAX);
+    return -1;
+  }
+  if (jpeg_encoder_init(&enc->jpeg, quality) != 0) {
+    return -1;
+  }
+  enc->tile_size = tile_size;
+  return 0;
+}
+
+static int resize_grid(struct tile_encoder *enc, uint32_t width,
+                       uint32_t height) {
+  uint32_t ts = (uint32_t)enc->tile_size;
+  uint32_t cols = (width + ts - 1) / ts;
+  uint32_t rows = (height + ts - 1) / ts;
+
+  uint8_t *dirty = calloc((size_t)cols * rows, 1);
+  if (!dirty) {
+    fprintf(stderr, "tiles: alloc failed\n");
+    return -1;
+  }
+  free(enc->dirty);
+  enc->dirty = dirty;
+  enc->width = width;
+  enc->height = height;
+  enc->cols = cols;
+  enc->rows = rows;
+  return 0;
+}
+
+/* Flag every tile overlapping a damage rect. Damage is in buffer
+ * coordinates, tiles are in output (upright) coordinates. */
+static void mark_damage(struct tile_encoder *enc,
+                        const struct capture_frame *frame) {
+  uint32_t ts = (uint32_t)enc->tile_size;
+
+  for (int i = 0; i < frame->damage_count; ++i) {
+    const struct capture_rect *r = &frame->damage[i];
+    if (r->x >= enc->width || r->y >= enc->height) {
+      continue;
+    }
+    uint32_t x1 = r->x + r->width;
+    uint32_t y1 = r->y + r->height;
+    if (x1 > enc->width) x1 = enc->width;
+    if (y1 > enc->height) y1 = enc->height;
+
+    uint32_t y0 = r->y;
+    if (frame->y_invert) {
+      uint32_t flipped = enc->height - y1;
+      y1 = enc->height - y0;
+      y0 = flipped;
+    }
+
+    for (uint32_t row = y0 / ts; row <= (y1 - 1) / ts; ++row) {
+      for (uint32_t col = r->x / ts; col <= (x1 - 1) / ts; ++col) {
+        enc->dirty[row * enc->cols + col] = 1;
+      }
+    }
+  }
+}
+
+static int reserve_output(struct tile_encoder *enc, size_t needed) {
+  if (needed <= enc->out_capacity) {
+    return 0;
+  }
+  size_t capacity = enc->out_capacity ? enc->out_capacity : 64 * 1024;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+  unsigned char *out = realloc(enc->out, capacity);
+  if (!out) {
+    fprintf(stderr, "tiles: output alloc failed\n");
+    return -1;
+  }
+  enc->out = out;
+  enc->out_capacity = capacity;
+  return 0;
+}
+
+int tile_encode_frame(struct tile_encoder *enc,
+                      const struct capture_frame *frame, int keyframe,
+                      const uint8_t *changed, unsigned char **out_buf,
+                      unsigned long *out_size) {
+  if (frame->width > 0xffffu || frame->height > 0xffffu) {
+    fprintf(stderr, "tiles: frame too large (%ux%u)\n", frame->width,
+            frame->height);
+    return -1;
+  }
+
+  if (enc->width != frame->width || enc->height != frame->height ||
+      !enc->dirty) {
+    if (resize_grid(enc, frame->width, frame->height) != 0) {
+      return -1;
+    }
+    keyframe = 1;
+  }
+
+  size_t tile_total = (size_t)enc->cols * enc->rows;
+  if (keyframe) {
+    memset(enc->dirty, 1, tile_total);
+  } else if (changed) {
+    memcpy(enc->dirty, changed, tile_total);
+  } else {
+    memset(enc->dirty, 0, tile_total);
+    mark_damage(enc, frame);
+  }
+
+  if (reserve_output(enc, WLCAST_TILE_FRAME_HEADER_SIZE) != 0) {
+    return -1;
+  }
+  size_t used = WLCAST_TILE_FRAME_HEADER_SIZE;
+  uint32_t ts = (uint32_t)enc->tile_size;
+  uint32_t bpp = tile_bytes_per_pixel(frame->format);
+  uint16_t count = 0;
+
+  for (uint32_t row = 0; row < enc->rows; ++row) {
+    for (uint32_t col = 0; col < enc->cols; ++col) {
+      if (!enc->dirty[row * enc->cols + col]) {
+        continue;
+      }
+
+      uint32_t x = col * ts;
+      uint32_t y = row * ts;
+      uint32_t w = enc->width - x < ts ? enc->width - x : ts;
+      uint32_t h = enc->height - y < ts ? enc->height - y : ts;
+
+      /* View of the tile within the capture buffer. With y_invert the
+       * upright tile at y comes from the rows counted from the bottom. */
+      struct capture_frame view = *frame;
+      uint32_t src_y = frame->y_invert ? enc->height - y - h : y;
+      view.data = (unsigned char *)frame->data + (size_t)src_y * frame->stride +
+                  (size_t)x * bpp;
+      view.width = w;
+      view.height = h;
+
+      unsigned char *jpeg = NULL;
+      unsigned long jpeg_size = 0;
+      if (jpeg_encode_frame(&enc->jpeg, &view, &jpeg, &jpeg_size) != 0) {
+        return -1;
+      }
+
+      size_t needed = used + WLCAST_TILE_HEADER_SIZE + jpeg_size;
+      if (needed > WLCAST_MAX_FRAME_SIZE) {
+        fprintf(stderr, "tiles: frame exceeds %u bytes\n",
+                WLCAST_MAX_FRAME_SIZE);
+        return -1;
+      }
+      if (reserve_output(enc, needed) != 0) {
+        return -1;
+      }
+
+      struct wlcast_tile_header th;
+      th.x = htons((uint16_t)x);
+      th.y = htons((uint16_t)y);
+      th.width = htons((uint16_t)w);
+      th.height = htons((uint16_t)h);
+      th.jpeg_size = htonl((uint32_t)jpeg_size);
+      memcpy(enc->out + used, &th, sizeof(th));
+      memcpy(enc->out + used + sizeof(th), jpeg, jpeg_size);
+      used = needed;
+      count++;
+    }
+  }
+
+  if (count == 0) {
+    *out_buf = enc->out;
+    *out_size = 0;
+    return 0;
+  }
+
+  struct wlcast_tile_frame_header fh;
+  fh.magic = htonl(WLCAST_TILE_MAGIC);
+  fh.frame_width = htons((uint16_t)enc->width);
+  fh.frame_height = htons((uint16_t)enc->height);
+  fh.tile_size = htons((uint16_t)enc->tile_size);
+  fh.tile_count = htons(count);
+  fh.flags = htons(keyframe ? WLCAST_TILE_FLAG_KEYFRAME : 0);
+  fh.reserved = 0;
+  memcpy(enc->out, &fh, sizeof(fh));
+
+  *out_buf = enc->out;
+  *out_size = used;
+  return 0;
+}
+
+void tile_encoder_set_quality(struct tile_encoder *enc, int quality) {
+  if (enc) {
+    jpeg_encoder_set_quality(&enc->jpeg, quality);
+  }
+}
+
+void tile_encoder_destroy(struct tile_encoder *enc) {
+  if (!enc) {
+    return;
+  }
+  jpeg_encoder_destroy(&enc->jpeg);
+  free(enc->dirty);
+  free(enc->out);
+  memset(enc, 0, sizeof(*enc));
+}
@@ -0,0 +1,51 @@
+#ifndef WLCAST_TILES_H
+#define WLCAST_TILES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capture.h"
+#include "compress.h"
+
+/* Tile edge lengths accepted by --tiles (multiples of the 16x16 MCU) */
+#define TILE_SIZE_MIN 16
+#define TILE_SIZE_MAX 256
+
+/**
+ * Partial-update encoder.
+ *
+ * Splits the frame into a fixed grid of tile_size x tile_size tiles, encodes
+ * only the tiles touched by the frame's damage rectangles and packs them
+ * into a WLCAST_TILE_MAGIC payload (see common/protocol.h).
+ */
+struct tile_encoder {
+  struct jpeg_encoder jpeg;
+  int tile_size;
+  uint32_t width;
+  uint32_t height;
+  uint32_t cols;
+  uint32_t rows;
+  uint8_t *dirty; /* cols * rows flags for the frame being encoded */
+  unsigned char *out;
+  size_t out_capacity;
+};
+
+int tile_encoder_init(struct tile_encoder *enc, int tile_size, int quality);
+
+/* Encode the changed tiles of frame: all of them if keyframe is set or the
+ * frame size changed, else those flagged in changed (cols * rows, from a
+ * tile_hasher with the same tile size) or, if changed is NULL, those
+ * touched by the frame's damage. *out_size is 0 if no tile changed. The
+ * output buffer is owned by the encoder and valid until the next call. */
+int tile_encode_frame(struct tile_encoder *enc,
+                      const struct capture_frame *frame, int keyframe,
+                      const uint8_t *changed, unsigned char **out_buf,
+                      unsigned long *out_size);
+
+/* Bytes per pixel of a capture_frame format (wl_shm or YUYV) */
+uint32_t tile_bytes_per_pixel(uint32_t format);
+
+void tile_encoder_set_quality(struct tile_encoder *enc, int quality);
+void tile_encoder_destroy(struct tile_encoder *enc);
+
+#endif
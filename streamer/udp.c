@@ -1,15 +1,39 @@
+#define _GNU_SOURCE
+
 #include "udp.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../common/fec.h"
 #include "../common/protocol.h"
+#include "../common/trace.h"
+#include "congestion.h"
+
+/* Chunks per GSO send: one datagram is limited to 64 KB (and 64 segments) */
+#define GSO_MAX_SEGMENTS                                                       \
+  (65507u / (WLCAST_UDP_HEADER_SIZE + WLCAST_UDP_MTU_CHUNK_SIZE))
+
+/* Frame spacing the pacer plans for is kept within these bounds, so a
+ * static screen (frames far apart) doesn't stretch one frame over seconds */
+#define PACING_MIN_INTERVAL_US 4000.0
+#define PACING_MAX_INTERVAL_US 100000.0
+
+/* How long a send waits for room in a full socket buffer before giving up on
+ * the message. A GSO message carries a whole burst of chunks, so dropping it
+ * on the first EAGAIN would lose far more than one datagram. */
+#define SEND_WAIT_MS 20
 
 static uint64_t now_ms(void) {
   struct timespec ts;
@@ -17,6 +41,12 @@ static uint64_t now_ms(void) {
   return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
 }
 
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
 int udp_sender_init(struct udp_sender *sender, const char *ip, uint16_t port) {
   memset(sender, 0, sizeof(*sender));
   sender->fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -54,71 +84,754 @@ int udp_sender_init(struct udp_sender *sender, const char *ip, uint16_t port) {
 
   sender->frame_id = 1;
   sender->history_idx = 0;
+  sender->chunk_size = WLCAST_UDP_CHUNK_SIZE;
+  sender->retransmit = 1;
   return 0;
 }
 
-int udp_sender_send_frame(struct udp_sender *sender, const uint8_t *data,
-                          size_t size) {
+void udp_sender_set_retransmit(struct udp_sender *sender, int enable) {
+  sender->retransmit = enable;
+}
+
+void udp_sender_set_frame_interval(struct udp_sender *sender,
+                                   uint64_t interval_ms) {
+  sender->frame_interval_ms = interval_ms;
+}
+
+int udp_sender_set_pacing(struct udp_sender *sender, double fraction) {
+  if (!(fraction >= 0.0 && fraction <= 1.0)) {
+    fprintf(stderr, "Pacing fraction must be between 0 and 1\n");
+    return -1;
+  }
+  sender->pace_fraction = fraction;
+  return 0;
+}
+
+void udp_sender_set_bandwidth(struct udp_sender *sender, double bps) {
+  sender->bandwidth_bps = bps > 0 ? bps : 0;
+}
+
+void udp_sender_set_congestion(struct udp_sender *sender,
+                               struct congestion *cc) {
+  sender->congestion = cc;
+}
+
+/* UDP_SEGMENT control message attached to every multi-chunk GSO send. The
+ * gso_size is the same for all senders, so one copy is shared. */
+static union {
+  char buf[CMSG_SPACE(sizeof(uint16_t))];
+  struct cmsghdr align;
+} gso_control;
+
+int udp_sender_set_mtu_mode(struct udp_sender *sender) {
+  sender->chunk_size = WLCAST_UDP_MTU_CHUNK_SIZE;
+
+  /* Probe for GSO support; sends enable it per message through a control
+   * message so that parity packets, whose header is larger, are never
+   * segmented. */
+  int gso_size = (int)(WLCAST_UDP_HEADER_SIZE + WLCAST_UDP_MTU_CHUNK_SIZE);
+  if (setsockopt(sender->fd, SOL_UDP, UDP_SEGMENT, &gso_size,
+                 sizeof(gso_size)) < 0) {
+    perror("setsockopt UDP_SEGMENT");
+    sender->use_gso = 0;
+    return 0;
+  }
+  int off = 0;
+  setsockopt(sender->fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off));
+
+  struct cmsghdr *cm = &gso_control.align;
+  cm->cmsg_level = SOL_UDP;
+  cm->cmsg_type = UDP_SEGMENT;
+  cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  uint16_t segment = (uint16_t)gso_size;
+  memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+
+  sender->use_gso = 1;
+  return 1;
+}
+
+int udp_sender_set_fec(struct udp_sender *sender, int group_size,
+                       int parity_count) {
+  if (group_size == 0) {
+    sender->fec_group = 0;
+    sender->fec_parity = 0;
+    return 0;
+  }
+  if (group_size < 1 || group_size > FEC_MAX_GROUP || parity_count < 1 ||
+      parity_count > FEC_MAX_PARITY) {
+    fprintf(stderr, "FEC: group must be 1-%d chunks with 1-%d parity\n",
+            FEC_MAX_GROUP, FEC_MAX_PARITY);
+    return -1;
+  }
+  fec_init();
+  sender->fec_group = group_size;
+  sender->fec_parity = parity_count;
+  return 0;
+}
+
+static int reserve_batch(struct udp_sender *sender, size_t packets,
+                         size_t parity_bytes) {
+  if (parity_bytes > sender->parity_capacity) {
+    uint8_t *parity = realloc(sender->parity, parity_bytes);
+    if (!parity) {
+      fprintf(stderr, "udp: parity alloc failed\n");
+      return -1;
+    }
+    sender->parity = parity;
+    sender->parity_capacity = parity_bytes;
+  }
+
+  if (packets <= sender->batch_capacity) {
+    return 0;
+  }
+
+  struct wlcast_udp_header *headers = realloc(sender->headers,
+                                              packets * sizeof(*headers));
+  if (!headers) {
+    fprintf(stderr, "udp: header alloc failed\n");
+    return -1;
+  }
+  sender->headers = headers;
+
+  struct wlcast_fec_header *fec_headers =
+      realloc(sender->fec_headers, packets * sizeof(*fec_headers));
+  if (!fec_headers) {
+    fprintf(stderr, "udp: header alloc failed\n");
+    return -1;
+  }
+  sender->fec_headers = fec_headers;
+
+  struct iovec *iov = realloc(sender->iov, packets * 2 * sizeof(*iov));
+  if (!iov) {
+    fprintf(stderr, "udp: iovec alloc failed\n");
+    return -1;
+  }
+  sender->iov = iov;
+
+  struct mmsghdr *msgs = realloc(sender->msgs, packets * sizeof(*msgs));
+  if (!msgs) {
+    fprintf(stderr, "udp: mmsghdr alloc failed\n");
+    return -1;
+  }
+  sender->msgs = msgs;
+
+  sender->batch_capacity = packets;
+  return 0;
+}
+
+/* Compute the parity packets of a frame into sender->parity and queue them
+ * in the iovec array after the data chunks */
+static void build_parity(struct udp_sender *sender, uint32_t frame_id,
+                         const uint8_t *data, size_t size, size_t chunk_size,
+                         uint32_t chunk_count, uint32_t group_count) {
+  uint32_t parity_count = (uint32_t)sender->fec_parity;
+  size_t last_len = size - (size_t)(chunk_count - 1) * chunk_size;
+
+  memset(sender->parity, 0, (size_t)group_count * parity_count * chunk_size);
+  for (uint32_t i = 0; i < chunk_count; ++i) {
+    uint32_t group = i % group_count;
+    uint32_t pos = i / group_count;
+    size_t len = i + 1 == chunk_count ? last_len : chunk_size;
+    uint8_t *parity = sender->parity + (size_t)group * parity_count * chunk_size;
+    for (uint32_t j = 0; j < parity_count; ++j) {
+      fec_accumulate(parity + j * chunk_size, data + (size_t)i * chunk_size,
+                     len, fec_coef(j, pos));
+    }
+  }
+
+  for (uint32_t group = 0; group < group_count; ++group) {
+    /* Parity is as long as the longest chunk it covers */
+    size_t len = chunk_size;
+    if (fec_group_members(chunk_count, group_count, group) == 1 &&
+        group == (chunk_count - 1) % group_count) {
+      len = last_len;
+    }
+
+    for (uint32_t j = 0; j < parity_count; ++j) {
+      size_t k = (size_t)group * parity_count + j;
+      struct wlcast_fec_header *header = &sender->fec_headers[k];
+      header->magic = htonl(WLCAST_FEC_MAGIC);
+      header->frame_id = htonl(frame_id);
+      header->total_size = htonl((uint32_t)size);
+      header->chunk_count = htons((uint16_t)chunk_count);
+      header->chunk_size = htons((uint16_t)chunk_size);
+      header->group_count = htons((uint16_t)group_count);
+      header->group = htons((uint16_t)group);
+      header->payload_size = htons((uint16_t)len);
+      header->parity_index = (uint8_t)j;
+      header->parity_count = (uint8_t)parity_count;
+
+      struct iovec *iov = &sender->iov[(chunk_count + k) * 2];
+      iov[0].iov_base = header;
+      iov[0].iov_len = sizeof(*header);
+      iov[1].iov_base = sender->parity + k * chunk_size;
+      iov[1].iov_len = len;
+    }
+  }
+}
+
+static void init_message(struct udp_sender *sender, struct msghdr *msg,
+                         size_t first_packet, size_t packets) {
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_name = &sender->addr;
+  msg->msg_namelen = sizeof(sender->addr);
+  msg->msg_iov = &sender->iov[first_packet * 2];
+  msg->msg_iovlen = packets * 2;
+}
+
+/* Point one message at each run of data chunks, then one at each parity
+ * packet. With GSO a message carries up to max_segments (at most
+ * GSO_MAX_SEGMENTS) chunks back to back and the kernel splits it at
+ * gso_size; otherwise every chunk is its own message. */
+static unsigned int build_messages(struct udp_sender *sender,
+                                   unsigned int chunk_count,
+                                   unsigned int parity_packets,
+                                   unsigned int max_segments) {
+  unsigned int per_msg = 1u;
+  if (sender->use_gso) {
+    per_msg = max_segments < GSO_MAX_SEGMENTS ? max_segments : GSO_MAX_SEGMENTS;
+    if (per_msg == 0) {
+      per_msg = 1u;
+    }
+  }
+  unsigned int msg_count = 0;
+
+  for (unsigned int first = 0; first < chunk_count; first += per_msg) {
+    unsigned int n = chunk_count - first;
+    if (n > per_msg) {
+      n = per_msg;
+    }
+    struct msghdr *msg = &sender->msgs[msg_count++].msg_hdr;
+    init_message(sender, msg, first, n);
+    if (n > 1) {
+      msg->msg_control = gso_control.buf;
+      msg->msg_controllen = sizeof(gso_control.buf);
+    }
+  }
+  for (unsigned int k = 0; k < parity_packets; ++k) {
+    init_message(sender, &sender->msgs[msg_count++].msg_hdr,
+                 (size_t)chunk_count + k, 1);
+  }
+  return msg_count;
+}
+
+/* Build the header and iovec pair for data chunk index of a frame in
+ * batch slot */
+static void fill_chunk(struct udp_sender *sender, size_t slot,
+                       uint32_t frame_id, const uint8_t *data, size_t size,
+                       size_t chunk_size, uint16_t chunk_count,
+                       uint16_t index) {
+  size_t offset = (size_t)index * chunk_size;
+  size_t payload = size - offset;
+  if (payload > chunk_size) {
+    payload = chunk_size;
+  }
+
+  struct wlcast_udp_header *header = &sender->headers[slot];
+  header->magic = htonl(WLCAST_UDP_MAGIC);
+  header->frame_id = htonl(frame_id);
+  header->total_size = htonl((uint32_t)size);
+  header->chunk_index = htons(index);
+  header->chunk_count = htons(chunk_count);
+  header->payload_size = htons((uint16_t)payload);
+  header->chunk_size = htons((uint16_t)chunk_size);
+
+  struct iovec *iov = &sender->iov[slot * 2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(*header);
+  iov[1].iov_base = (void *)(data + offset);
+  iov[1].iov_len = payload;
+}
+
+static size_t message_bytes(const struct msghdr *msg) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < msg->msg_iovlen; ++i) {
+    bytes += msg->msg_iov[i].iov_len;
+  }
+  return bytes;
+}
+
+/* Messages a send gave up on because the socket buffer stayed full */
+struct send_drops {
+  unsigned int messages;
+  size_t bytes;
+};
+
+/* Send msgs[*done, count). The kernel may send fewer than requested
+ * (UIO_MAXIOV cap, full socket buffer), so keep going from where it
+ * stopped. Returns -1 with errno set on a hard error; *done is the number
+ * of messages handled, of which those given up are added to drops. */
+static int send_messages(struct udp_sender *sender, unsigned int count,
+                         unsigned int *done, struct send_drops *drops) {
+  while (*done < count) {
+    int sent = sendmmsg(sender->fd, &sender->msgs[*done], count - *done, 0);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* Socket buffer is full - wait for it to drain, and only skip the
+         * message if it stays full */
+        struct pollfd pfd = {.fd = sender->fd, .events = POLLOUT};
+        int ready;
+        do {
+          ready = poll(&pfd, 1, SEND_WAIT_MS);
+        } while (ready < 0 && errno == EINTR);
+        if (ready <= 0) {
+          drops->messages++;
+          drops->bytes += message_bytes(&sender->msgs[*done].msg_hdr);
+          (*done)++;
+        }
+        continue;
+      }
+      return -1;
+    }
+    *done += (unsigned int)sent;
+  }
+  return 0;
+}
+
+static void sleep_us(uint64_t us) {
+  struct timespec ts = {(time_t)(us / 1000000u), (long)(us % 1000000u) * 1000};
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+}
+
+/* Rate to send a frame of bytes at: fast enough to finish within
+ * pace_fraction of the frame interval, and never below PACING_RATE_GAIN
+ * times the bandwidth estimate. In bits per second. */
+static double pacing_rate(const struct udp_sender *sender, size_t bytes) {
+  double interval_us = sender->frame_interval_ms > 0
+                           ? (double)sender->frame_interval_ms * 1000.0
+                           : sender->frame_gap_us;
+  if (interval_us <= 0) {
+    interval_us = RETRANSMIT_DEFAULT_INTERVAL_MS * 1000.0;
+  }
+  interval_us = fmin(fmax(interval_us, PACING_MIN_INTERVAL_US),
+                     PACING_MAX_INTERVAL_US);
+  double rate = (double)bytes * 8e6 / (interval_us * sender->pace_fraction);
+  return fmax(rate, PACING_RATE_GAIN * sender->bandwidth_bps);
+}
+
+/* Send msgs[*done, count) at no more than rate_bps: a token bucket refilled
+ * at that rate releases up to burst_bytes at once and the thread sleeps
+ * while it is empty. Whole messages are sent, so the bucket can go into
+ * debt that the next refill pays off. Same contract as send_messages. */
+static int send_paced(struct udp_sender *sender, unsigned int count,
+                      unsigned int *done, struct send_drops *drops,
+                      double rate_bps, double burst_bytes) {
+  double bytes_per_us = rate_bps / 8e6;
+  while (*done < count) {
+    uint64_t now = now_us();
+    sender->pace_tokens = fmin(
+        burst_bytes,
+        sender->pace_tokens + (double)(now - sender->pace_refill_us) *
+                                  bytes_per_us);
+    sender->pace_refill_us = now;
+    if (sender->pace_tokens <= 0) {
+      sleep_us((uint64_t)(-sender->pace_tokens / bytes_per_us) + 1);
+      continue;
+    }
+
+    unsigned int end = *done;
+    while (end < count && sender->pace_tokens > 0) {
+      sender->pace_tokens -= (double)message_bytes(&sender->msgs[end].msg_hdr);
+      end++;
+    }
+    if (send_messages(sender, end, done, drops) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void evict_entry(struct retransmit_entry *entry) {
+  if (entry->hold) {
+    atomic_store(entry->hold, 0);
+    entry->hold = NULL;
+  }
+  entry->frame_id = 0;
+  entry->data = NULL;
+  entry->size = 0;
+}
+
+/* Keep the frame for NACK retransmission: the caller's buffer itself if
+ * hold pins it, otherwise a copy, as the buffer is reused as soon as
+ * send_frame returns */
+static void cache_frame(struct udp_sender *sender, uint32_t frame_id,
+                        const uint8_t *data, size_t size, atomic_int *hold,
+                        size_t chunk_size, uint16_t chunk_count) {
+  struct retransmit_entry *entry = &sender->retransmit_cache[
+      sender->retransmit_idx];
+  sender->retransmit_idx = (sender->retransmit_idx + 1) % RETRANSMIT_CACHE_SIZE;
+
+  evict_entry(entry);
+  if (hold) {
+    entry->hold = hold;
+    entry->data = data;
+  } else {
+    if (size > entry->capacity) {
+      uint8_t *buf = realloc(entry->copy, size);
+      if (!buf) {
+        return; /* Frame just can't be retransmitted */
+      }
+      entry->copy = buf;
+      entry->capacity = size;
+    }
+    memcpy(entry->copy, data, size);
+    entry->data = entry->copy;
+  }
+  entry->frame_id = frame_id;
+  entry->size = size;
+  entry->chunk_size = (uint16_t)chunk_size;
+  entry->chunk_count = chunk_count;
+  entry->sent_time_ms = now_ms();
+}
+
+static int send_frame(struct udp_sender *sender, const uint8_t *data,
+                      size_t size, atomic_int *hold) {
   if (size == 0 || size > WLCAST_MAX_FRAME_SIZE) {
     fprintf(stderr, "Invalid frame size: %zu\n", size);
     return -1;
   }
 
+  uint64_t start_us = now_us();
   uint32_t frame_id = sender->frame_id++;
-  uint16_t chunk_count = (uint16_t)((size + WLCAST_UDP_CHUNK_SIZE - 1) /
-                                    WLCAST_UDP_CHUNK_SIZE);
+  size_t chunk_size = sender->chunk_size;
+  if (chunk_size == 0) {
+    chunk_size = WLCAST_UDP_CHUNK_SIZE;
+  }
+  size_t chunks = (size + chunk_size - 1) / chunk_size;
+  if (chunks > UINT16_MAX) {
+    fprintf(stderr, "Frame too large for %zu-byte chunks: %zu\n", chunk_size,
+            size);
+    return -1;
+  }
+  uint16_t chunk_count = (uint16_t)chunks;
+  uint32_t group_count = fec_group_count(chunk_count,
+                                         (uint32_t)sender->fec_group);
+  uint32_t parity_packets = group_count * (uint32_t)sender->fec_parity;
 
   /* Record this frame for RTT tracking */
   int idx = sender->history_idx;
-  sender->history[idx].frame_id = frame_id;
-  sender->history[idx].sent_time_ms = now_ms();
-  sender->history[idx].acked = 0;
+  struct frame_record *record = &sender->history[idx];
+  record->frame_id = frame_id;
+  record->sent_time_ms = now_ms();
+  record->acked = 0;
+  record->chunk_count = chunk_count;
+  record->reported = 0;
+  record->first_send_us = start_us;
+  record->last_send_us = start_us;
   sender->history_idx = (idx + 1) % FRAME_HISTORY_SIZE;
   sender->stats.frames_sent++;
 
+  if (reserve_batch(sender, (size_t)chunk_count + parity_packets,
+                    (size_t)parity_packets * chunk_size) != 0) {
+    return -1;
+  }
+
+  /* Headers are built up front; payload iovecs point straight into data */
+  trace_begin("packetize");
   for (uint16_t i = 0; i < chunk_count; ++i) {
-    size_t offset = (size_t)i * WLCAST_UDP_CHUNK_SIZE;
-    size_t payload = size - offset;
-    if (payload > WLCAST_UDP_CHUNK_SIZE) {
-      payload = WLCAST_UDP_CHUNK_SIZE;
-    }
-
-    struct wlcast_udp_header header;
-    header.magic = htonl(WLCAST_UDP_MAGIC);
-    header.frame_id = htonl(frame_id);
-    header.total_size = htonl((uint32_t)size);
-    header.chunk_index = htons(i);
-    header.chunk_count = htons(chunk_count);
-    header.payload_size = htons((uint16_t)payload);
-    header.reserved = 0;
-
-    uint8_t packet[sizeof(header) + WLCAST_UDP_CHUNK_SIZE];
-    memcpy(packet, &header, sizeof(header));
-    memcpy(packet + sizeof(header), data + offset, payload);
-
-    ssize_t sent = sendto(sender->fd, packet, sizeof(header) + payload, 0,
-                          (struct sockaddr *)&sender->addr,
-                          sizeof(sender->addr));
-    if (sent < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        /* Non-blocking socket would block - skip this chunk */
-        continue;
-      }
-      perror("sendto");
+    fill_chunk(sender, i, frame_id, data, size, chunk_size, chunk_count, i);
+  }
+
+  if (parity_packets > 0) {
+    build_parity(sender, frame_id, data, size, chunk_size, chunk_count,
+                 group_count);
+  }
+
+  /* Datagram bytes, headers and parity included */
+  size_t wire_bytes = size + (size_t)chunk_count * WLCAST_UDP_HEADER_SIZE +
+                      parity_packets * (WLCAST_FEC_HEADER_SIZE + chunk_size);
+
+  /* When pacing, GSO messages are cut to what one burst may release */
+  double rate_bps = 0;
+  double burst_bytes = 0;
+  unsigned int max_segments = GSO_MAX_SEGMENTS;
+  if (sender->last_frame_us != 0) {
+    double gap = fmin((double)(start_us - sender->last_frame_us),
+                      PACING_MAX_INTERVAL_US);
+    sender->frame_gap_us = sender->frame_gap_us > 0
+                               ? 0.9 * sender->frame_gap_us + 0.1 * gap
+                               : gap;
+  }
+  sender->last_frame_us = start_us;
+  /* Only frames are paced, and only here. SO_MAX_PACING_RATE would cap the
+   * whole socket, holding NACK retransmits and clock probe replies back
+   * behind the frame; on a UDP socket it also never rises again once
+   * lowered. A second, unpaced socket is no way out: the viewer takes a new
+   * source port for a restarted streamer. */
+  if (sender->pace_fraction > 0) {
+    rate_bps = pacing_rate(sender, wire_bytes);
+    size_t datagram = WLCAST_UDP_HEADER_SIZE + chunk_size;
+    burst_bytes = fmax(rate_bps / 8e6 * PACING_BURST_US, (double)datagram);
+    max_segments = (unsigned int)(burst_bytes / (double)datagram);
+  }
+
+  unsigned int msg_count = build_messages(sender, chunk_count, parity_packets,
+                                          max_segments);
+  trace_end("packetize");
+  uint64_t send_start_us = now_us();
+  sender->last_packetize_us = send_start_us - start_us;
+
+  trace_begin("sendmmsg");
+  unsigned int done = 0;
+  struct send_drops drops = {0, 0};
+  int rc = rate_bps > 0 ? send_paced(sender, msg_count, &done, &drops,
+                                     rate_bps, burst_bytes)
+                        : send_messages(sender, msg_count, &done, &drops);
+  if (rc != 0) {
+    /* Fall back only if the kernel refused GSO before anything went out */
+    if (!sender->use_gso || done != drops.messages ||
+        (errno != EINVAL && errno != EIO && errno != ENOPROTOOPT)) {
+      perror("sendmmsg");
+      trace_end("sendmmsg");
       return -1;
     }
+    /* Route or device cannot segment; resend as plain datagrams */
+    perror("sendmmsg (GSO), falling back to per-chunk sends");
+    sender->use_gso = 0;
+    msg_count = build_messages(sender, chunk_count, parity_packets,
+                                max_segments);
+    done = 0;
+    drops = (struct send_drops){0, 0};
+    rc = rate_bps > 0 ? send_paced(sender, msg_count, &done, &drops,
+                                   rate_bps, burst_bytes)
+                      : send_messages(sender, msg_count, &done, &drops);
+    if (rc != 0) {
+      perror("sendmmsg");
+      trace_end("sendmmsg");
+      return -1;
+    }
+  }
+
+  trace_end("sendmmsg");
+  uint64_t send_end_us = now_us();
+  sender->last_send_us = send_end_us - send_start_us;
+  record->first_send_us = send_start_us;
+  record->last_send_us = send_end_us;
+  if (sender->congestion) {
+    congestion_on_sent(sender->congestion, wire_bytes - drops.bytes,
+                       send_end_us);
   }
 
+  if (sender->retransmit) {
+    cache_frame(sender, frame_id, data, size, hold, chunk_size, chunk_count);
+  } else if (hold) {
+    atomic_store(hold, 0);
+  }
   return 0;
 }
 
+static int send_traced(struct udp_sender *sender, const uint8_t *data,
+                       size_t size, atomic_int *hold) {
+  trace_begin("udp_sender_send_frame");
+  trace_counter("frame_bytes", (int64_t)size);
+  int rc = send_frame(sender, data, size, hold);
+  if (rc != 0 && hold) {
+    atomic_store(hold, 0);
+  }
+  trace_end("udp_sender_send_frame");
+  return rc;
+}
+
+int udp_sender_send_frame(struct udp_sender *sender, const uint8_t *data,
+                          size_t size) {
+  return send_traced(sender, data, size, NULL);
+}
+
+static uint32_t clamp_u32(uint64_t value) {
+  return value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+}
+
+int udp_sender_send_timed_frame(struct udp_sender *sender, uint8_t *data,
+                                size_t size, const struct frame_times *times,
+                                atomic_int *hold) {
+  if (!sender->send_timing) {
+    return send_traced(sender, data, size, hold);
+  }
+
+  /* Whatever the stages didn't account for was spent queued */
+  uint64_t elapsed = now_us() - times->capture_time_us;
+  uint64_t accounted = times->capture_us + times->convert_us + times->encode_us;
+  struct wlcast_frame_timing timing;
+  timing.magic = htonl(WLCAST_TIMING_MAGIC);
+  timing.capture_time_hi = htonl((uint32_t)(times->capture_time_us >> 32));
+  timing.capture_time_lo = htonl((uint32_t)times->capture_time_us);
+  timing.capture_us = htonl(clamp_u32(times->capture_us));
+  timing.convert_us = htonl(clamp_u32(times->convert_us));
+  timing.encode_us = htonl(clamp_u32(times->encode_us));
+  timing.queue_us = htonl(clamp_u32(elapsed > accounted ? elapsed - accounted : 0));
+
+  uint8_t *start = data - sizeof(timing);
+  memcpy(start, &timing, sizeof(timing));
+  return send_traced(sender, start, size + sizeof(timing), hold);
+}
+
+void udp_sender_drop_cache(struct udp_sender *sender) {
+  for (int i = 0; i < RETRANSMIT_CACHE_SIZE; i++) {
+    evict_entry(&sender->retransmit_cache[i]);
+  }
+}
+
 void udp_sender_close(struct udp_sender *sender) {
   if (sender->fd >= 0) {
     close(sender->fd);
   }
+  free(sender->headers);
+  free(sender->fec_headers);
+  free(sender->parity);
+  free(sender->iov);
+  free(sender->msgs);
+  udp_sender_drop_cache(sender);
+  for (int i = 0; i < RETRANSMIT_CACHE_SIZE; i++) {
+    free(sender->retransmit_cache[i].copy);
+  }
   memset(sender, 0, sizeof(*sender));
 }
 
+/* Resend the chunks a NACK names if the frame is still worth completing:
+ * within one RTT plus a frame interval of its first transmission. Later
+ * than that the viewer is better served by the next frame. */
+static void handle_nack(struct udp_sender *sender, const uint8_t *packet,
+                        size_t n, uint64_t now) {
+  struct wlcast_nack_header header;
+  if (!sender->retransmit || n < sizeof(header)) {
+    return;
+  }
+  memcpy(&header, packet, sizeof(header));
+  uint32_t frame_id = ntohl(header.frame_id);
+  uint32_t first = ntohs(header.first_chunk);
+  uint32_t bits = ntohs(header.bit_count);
+  if (bits > WLCAST_NACK_MAX_BITS || sizeof(header) + (bits + 7) / 8 > n) {
+    return;
+  }
+  const uint8_t *bitmap = packet + sizeof(header);
+  trace_instant("nack", (int64_t)frame_id);
+
+  struct retransmit_entry *entry = NULL;
+  for (int i = 0; i < RETRANSMIT_CACHE_SIZE; i++) {
+    if (sender->retransmit_cache[i].frame_id == frame_id &&
+        sender->retransmit_cache[i].size > 0) {
+      entry = &sender->retransmit_cache[i];
+      break;
+    }
+  }
+  if (!entry) {
+    sender->stats.nacks_expired++;
+    return;
+  }
+
+  double interval = sender->frame_interval_ms > 0
+                        ? (double)sender->frame_interval_ms
+                        : RETRANSMIT_DEFAULT_INTERVAL_MS;
+  double rtt = sender->stats.smoothed_rtt_ms > 0
+                   ? sender->stats.smoothed_rtt_ms
+                   : RETRANSMIT_DEFAULT_INTERVAL_MS;
+  if ((double)(now - entry->sent_time_ms) > rtt + interval) {
+    sender->stats.nacks_expired++;
+    return;
+  }
+
+  if (first + bits > entry->chunk_count) {
+    if (first >= entry->chunk_count) {
+      return;
+    }
+    bits = entry->chunk_count - first;
+  }
+  if (reserve_batch(sender, bits, 0) != 0) {
+    return;
+  }
+
+  unsigned int count = 0;
+  for (uint32_t k = 0; k < bits; ++k) {
+    if (!(bitmap[k / 8] & (1u << (k % 8)))) {
+      continue;
+    }
+    fill_chunk(sender, count, frame_id, entry->data, entry->size,
+               entry->chunk_size, entry->chunk_count, (uint16_t)(first + k));
+    init_message(sender, &sender->msgs[count].msg_hdr, count, 1);
+    count++;
+  }
+
+  unsigned int done = 0;
+  struct send_drops drops = {0, 0};
+  if (send_messages(sender, count, &done, &drops) != 0) {
+    perror("sendmmsg (retransmit)");
+  }
+  sender->stats.chunks_resent += (int)(done - drops.messages);
+}
+
+/* Echo a viewer's clock probe with our receive and send times */
+static void handle_clock_probe(struct udp_sender *sender, const uint8_t *packet,
+                               size_t n, uint64_t recv_us,
+                               const struct sockaddr_in *from) {
+  struct wlcast_clock_packet clock;
+  if (n != sizeof(clock)) {
+    return;
+  }
+  memcpy(&clock, packet, sizeof(clock));
+  clock.streamer_recv_hi = htonl((uint32_t)(recv_us >> 32));
+  clock.streamer_recv_lo = htonl((uint32_t)recv_us);
+  uint64_t send_us = now_us();
+  clock.streamer_send_hi = htonl((uint32_t)(send_us >> 32));
+  clock.streamer_send_lo = htonl((uint32_t)send_us);
+  sendto(sender->fd, &clock, sizeof(clock), 0, (const struct sockaddr *)from,
+         sizeof(*from));
+  sender->send_timing = 1;
+}
+
+/* Match a receive report to its frame for congestion control. Frames sent
+ * between the previous report and this one were lost or skipped. */
+static void handle_report(struct udp_sender *sender, const uint8_t *packet,
+                          size_t n, uint64_t recv_us) {
+  struct wlcast_receive_report report;
+  if (!sender->congestion || n != sizeof(report)) {
+    return;
+  }
+  memcpy(&report, packet, sizeof(report));
+  uint32_t frame_id = ntohl(report.frame_id);
+  if (sender->have_report &&
+      (int32_t)(frame_id - sender->last_report_id) <= 0) {
+    return;
+  }
+
+  struct frame_record *match = NULL;
+  for (int i = 0; i < FRAME_HISTORY_SIZE; i++) {
+    struct frame_record *r = &sender->history[i];
+    if (r->frame_id == 0 || r->reported) {
+      continue;
+    }
+    if (r->frame_id == frame_id) {
+      match = r;
+    } else if (sender->have_report &&
+               (int32_t)(r->frame_id - sender->last_report_id) > 0 &&
+               (int32_t)(r->frame_id - frame_id) < 0) {
+      r->reported = 1;
+      congestion_on_lost(sender->congestion, r->chunk_count);
+    }
+  }
+  if (!match) {
+    return; /* Too old to still be in the history */
+  }
+  match->reported = 1;
+  sender->have_report = 1;
+  sender->last_report_id = frame_id;
+
+  struct congestion_sample sample = {
+    .frame_id = frame_id,
+    .first_send_us = match->first_send_us,
+    .last_send_us = match->last_send_us,
+    .first_arrival_us = ntohl(report.first_arrival_us),
+    .last_arrival_us = ntohl(report.last_arrival_us),
+    .bytes_received = ntohl(report.bytes),
+    .chunks_received = ntohs(report.chunks_received),
+    .chunk_count = match->chunk_count,
+  };
+  congestion_on_report(sender->congestion, &sample, recv_us);
+}
+
 void udp_sender_poll_acks(struct udp_sender *sender) {
   uint64_t now = now_ms();
 
@@ -126,12 +839,18 @@ void udp_sender_poll_acks(struct udp_sender *sender) {
   if (sender->stats.viewer_connected &&
       now - sender->stats.last_ack_time_ms > 2000) {
     sender->stats.viewer_connected = 0;
+    /* The next viewer may be an older one */
+    sender->send_timing = 0;
+    sender->have_report = 0;
   }
 
-  /* Read all pending ACK packets */
+  /* Read all pending ACK and NACK packets */
   while (1) {
-    struct wlcast_ack_packet ack;
-    ssize_t n = recvfrom(sender->fd, &ack, sizeof(ack), 0, NULL, NULL);
+    uint8_t packet[WLCAST_NACK_HEADER_SIZE + WLCAST_NACK_MAX_BITS / 8];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t n = recvfrom(sender->fd, packet, sizeof(packet), 0,
+                         (struct sockaddr *)&from, &from_len);
     if (n < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         break; /* No more packets */
@@ -140,14 +859,30 @@ void udp_sender_poll_acks(struct udp_sender *sender) {
       break;
     }
 
-    if (n != sizeof(ack)) {
-      continue; /* Wrong size */
+    uint32_t magic = 0;
+    if (n >= (ssize_t)sizeof(magic)) {
+      memcpy(&magic, packet, sizeof(magic));
+      magic = ntohl(magic);
+    }
+
+    if (magic == WLCAST_NACK_MAGIC) {
+      handle_nack(sender, packet, (size_t)n, now);
+      continue;
+    }
+    if (magic == WLCAST_CLOCK_MAGIC) {
+      handle_clock_probe(sender, packet, (size_t)n, now_us(), &from);
+      continue;
+    }
+    if (magic == WLCAST_REPORT_MAGIC) {
+      handle_report(sender, packet, (size_t)n, now_us());
+      continue;
     }
 
-    uint32_t magic = ntohl(ack.magic);
-    if (magic != WLCAST_ACK_MAGIC) {
+    struct wlcast_ack_packet ack;
+    if (n != sizeof(ack) || magic != WLCAST_ACK_MAGIC) {
       continue; /* Not an ACK */
     }
+    memcpy(&ack, packet, sizeof(ack));
 
     uint32_t frame_id = ntohl(ack.frame_id);
     uint32_t viewer_fps = ntohl(ack.viewer_fps);
@@ -220,4 +955,6 @@ void udp_sender_reset_stats(struct udp_sender *sender) {
   sender->stats.frames_sent = 0;
   sender->stats.frames_acked = 0;
   sender->stats.frames_lost = 0;
+  sender->stats.chunks_resent = 0;
+  sender->stats.nacks_expired = 0;
 }
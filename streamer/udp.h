@@ -1,6 +1,7 @@
 #ifndef WLCAST_UDP_H
 #define WLCAST_UDP_H
 
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,6 +14,41 @@ struct frame_record {
   uint32_t frame_id;
   uint64_t sent_time_ms;
   int acked;
+  /* For congestion control */
+  uint64_t first_send_us;
+  uint64_t last_send_us;
+  uint16_t chunk_count;
+  int reported; /* Receive report seen, or given up on */
+};
+
+/* Recent frames kept for NACK retransmission */
+#define RETRANSMIT_CACHE_SIZE 4
+/* Frame interval assumed for the retransmit budget when fps is unlimited */
+#define RETRANSMIT_DEFAULT_INTERVAL_MS 16.0
+
+/* Pacer: how far above the bandwidth estimate it may send (as WebRTC's
+ * pacing factor), and the burst one refill may release */
+#define PACING_RATE_GAIN 2.5
+#define PACING_BURST_US 2000u
+
+struct retransmit_entry {
+  uint32_t frame_id; /* 0 = empty */
+  uint64_t sent_time_ms;
+  const uint8_t *data; /* The frame payload: pinned by hold, or copy */
+  size_t size;
+  atomic_int *hold;    /* Caller's buffer flag, cleared on eviction */
+  uint8_t *copy;       /* Own copy, for frames sent without a hold */
+  size_t capacity;
+  uint16_t chunk_size;
+  uint16_t chunk_count;
+};
+
+/* Where a frame's time went before it reached the send stage */
+struct frame_times {
+  uint64_t capture_time_us; /* Presentation time, CLOCK_MONOTONIC */
+  uint64_t capture_us;      /* Presentation until the pixels were ours */
+  uint64_t convert_us;
+  uint64_t encode_us;
 };
 
 /* Network quality metrics from ACKs */
@@ -25,24 +61,122 @@ struct network_stats {
   int frames_sent;           /* Frames sent in current window */
   int frames_acked;          /* Frames ACKed in current window */
   int frames_lost;           /* Frames presumed lost (timeout) */
+  int chunks_resent;         /* Chunks retransmitted on NACK */
+  int nacks_expired;         /* NACKs for frames past the latency budget */
 };
 
+struct congestion;
+struct wlcast_udp_header;
+struct wlcast_fec_header;
+struct iovec;
+struct mmsghdr;
+
 struct udp_sender {
   int fd;
   uint32_t frame_id;
   struct sockaddr_in addr;
+  uint16_t chunk_size; /* Payload bytes per chunk */
+  int use_gso;         /* Kernel segments batches of chunks (UDP_SEGMENT) */
+  int fec_group;       /* Data chunks per FEC group, 0 = no FEC */
+  int fec_parity;      /* Parity chunks per group */
+  /* sendmmsg batch: one header + iovec pair per chunk, grown on demand */
+  struct wlcast_udp_header *headers;
+  struct wlcast_fec_header *fec_headers;
+  uint8_t *parity;
+  size_t parity_capacity;
+  struct iovec *iov;
+  struct mmsghdr *msgs;
+  size_t batch_capacity;
+  /* NACK retransmission */
+  int retransmit;
+  uint64_t frame_interval_ms;
+  struct retransmit_entry retransmit_cache[RETRANSMIT_CACHE_SIZE];
+  int retransmit_idx;
   /* Frame tracking for RTT/loss detection */
   struct frame_record history[FRAME_HISTORY_SIZE];
   int history_idx;
   struct network_stats stats;
+  /* Fed with every frame sent and every receive report, if set */
+  struct congestion *congestion;
+  int have_report;
+  uint32_t last_report_id;
+  /* The viewer probes our clock, so it understands frame timing headers */
+  int send_timing;
+  /* Pacing: each frame is spread over pace_fraction of the frame interval
+   * by a token bucket, 0 = send it as one burst */
+  double pace_fraction;
+  double bandwidth_bps;   /* Estimated path bandwidth, 0 = unknown */
+  double frame_gap_us;    /* Measured frame spacing when fps is unlimited */
+  uint64_t last_frame_us;
+  double pace_tokens;     /* Bytes; may go negative after a large message */
+  uint64_t pace_refill_us;
+  /* Time the last udp_sender_send_frame spent building headers and parity,
+   * and handing the datagrams to the kernel, in microseconds */
+  uint64_t last_packetize_us;
+  uint64_t last_send_us;
 };
 
 int udp_sender_init(struct udp_sender *sender, const char *ip, uint16_t port);
 int udp_sender_send_frame(struct udp_sender *sender, const uint8_t *data,
                           size_t size);
+
+/* Like udp_sender_send_frame, but once the viewer has probed the clock the
+ * frame goes out behind a struct wlcast_frame_timing, written into the
+ * WLCAST_FRAME_TIMING_SIZE bytes before data.
+ *
+ * hold (may be NULL) is the in-use flag of the buffer holding data, and
+ * passes to the sender whatever the result: the buffer is kept for NACK
+ * retransmission instead of being copied, and the flag cleared once the
+ * frame leaves the retransmit cache. Up to RETRANSMIT_CACHE_SIZE buffers
+ * stay pinned this way. */
+int udp_sender_send_timed_frame(struct udp_sender *sender, uint8_t *data,
+                                size_t size, const struct frame_times *times,
+                                atomic_int *hold);
+
+/* Empty the retransmit cache, clearing the holds it still has. Call before
+ * freeing the buffers those holds belong to. */
+void udp_sender_drop_cache(struct udp_sender *sender);
 void udp_sender_close(struct udp_sender *sender);
 
-/* Check for incoming ACKs (non-blocking) and update stats */
+/* Switch to WLCAST_UDP_MTU_CHUNK_SIZE chunks so no chunk relies on IP
+ * fragmentation. Uses UDP GSO when the kernel supports it, so a frame still
+ * costs about one syscall. Returns 1 if GSO is active, 0 if chunks are sent
+ * as individual datagrams. */
+int udp_sender_set_mtu_mode(struct udp_sender *sender);
+
+/* Send parity_count parity chunks for every group_size data chunks of a
+ * frame (see common/fec.h). One parity is XOR, more use Reed-Solomon; the
+ * viewer can rebuild up to parity_count lost chunks per group. group_size 0
+ * disables FEC. Returns 0 or -1 for out-of-range values. */
+int udp_sender_set_fec(struct udp_sender *sender, int group_size,
+                       int parity_count);
+
+/* Resend chunks named in viewer NACKs (on by default) */
+void udp_sender_set_retransmit(struct udp_sender *sender, int enable);
+
+/* Current frame interval, part of the retransmit latency budget */
+void udp_sender_set_frame_interval(struct udp_sender *sender,
+                                   uint64_t interval_ms);
+
+/* Spread every frame's chunks over fraction (0-1] of the frame interval
+ * instead of sending them back to back, so a shallow bottleneck queue
+ * doesn't overflow on keyframe-sized bursts. 0 disables pacing. NACK
+ * retransmits and clock probe replies are never paced. Returns 0 or -1 for
+ * an out-of-range fraction. */
+int udp_sender_set_pacing(struct udp_sender *sender, double fraction);
+
+/* Bandwidth estimate from congestion control, in bits per second (0 =
+ * unknown). The pacer never runs slower than PACING_RATE_GAIN times this,
+ * so a frame that fits the estimate goes out faster than it would at the
+ * per-frame rate. */
+void udp_sender_set_bandwidth(struct udp_sender *sender, double bps);
+
+/* Pass sent frames and the viewer's receive reports to cc (NULL: none) */
+void udp_sender_set_congestion(struct udp_sender *sender,
+                               struct congestion *cc);
+
+/* Check for incoming ACKs, NACKs and receive reports (non-blocking), update
+ * stats and retransmit requested chunks */
 void udp_sender_poll_acks(struct udp_sender *sender);
 
 /* Get current network stats (call after poll_acks) */
@@ -10,8 +10,9 @@
 #define DRM_FORMAT_XRGB8888 0x34325258 /* XR24 */
 #define DRM_FORMAT_ARGB8888 0x34325241 /* AR24 */
 
-/* V4L2 pixel format fourcc (matches V4L2_PIX_FMT_YUYV) */
+/* V4L2 pixel format fourccs (match V4L2_PIX_FMT_YUYV / V4L2_PIX_FMT_NV12) */
 #define FOURCC_YUYV 0x56595559 /* YUYV */
+#define FOURCC_NV12 0x3231564e /* NV12 */
 
 /* Convert fourcc to printable string (uses static buffer) */
 static inline const char *fourcc_to_str(uint32_t fmt) {
@@ -54,7 +54,7 @@ static void dump_qbuf_planes(const struct v4l2_jpeg_encoder *enc,
             enc->out_bytesperline[i], enc->out_plane_size[i],
             enc->out_map_size[i]);
     if (enc->out_memory == V4L2_MEMORY_DMABUF) {
-      fprintf(stderr, " fd=%d\n", enc->out_dmabuf_fd[i]);
+      fprintf(stderr, " fd=%d\n", planes[i].m.fd);
     } else if (enc->out_memory == V4L2_MEMORY_USERPTR) {
       fprintf(stderr, " userptr=%p\n", (void *)(uintptr_t)planes[i].m.userptr);
     } else {
@@ -778,6 +778,9 @@ static int set_output_format(struct v4l2_jpeg_encoder *enc, int width,
     fmt.fmt.pix_mp.plane_fmt[0].bytesperline = (unsigned int)width;
     fmt.fmt.pix_mp.plane_fmt[1].bytesperline = (unsigned int)width / 2u;
     fmt.fmt.pix_mp.plane_fmt[2].bytesperline = (unsigned int)width / 2u;
+  } else if (pixfmt == V4L2_PIX_FMT_NV12) {
+    fmt.fmt.pix_mp.num_planes = 1;
+    fmt.fmt.pix_mp.plane_fmt[0].bytesperline = (unsigned int)width;
   } else {
     fmt.fmt.pix_mp.num_planes = 1;
     fmt.fmt.pix_mp.plane_fmt[0].bytesperline = (unsigned int)width * 2u;
@@ -848,6 +851,135 @@ static int find_jpeg_encoder(void) {
   return -1;
 }
 
+/* Map the capture (JPEG) buffer, queue it and start both queues once the
+ * output side is set up. Destroys the encoder on failure. */
+static int start_streaming(struct v4l2_jpeg_encoder *enc) {
+  struct v4l2_requestbuffers req;
+  memset(&req, 0, sizeof(req));
+  req.count = 1;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  req.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(enc->fd, VIDIOC_REQBUFS, &req) != 0 || req.count < 1) {
+    perror("VIDIOC_REQBUFS capture");
+    v4l2_jpeg_destroy(enc);
+    return -1;
+  }
+
+  struct v4l2_buffer cap_buf;
+  struct v4l2_plane cap_plane[3];
+  memset(&cap_buf, 0, sizeof(cap_buf));
+  memset(&cap_plane, 0, sizeof(cap_plane));
+  cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  cap_buf.memory = V4L2_MEMORY_MMAP;
+  cap_buf.index = 0;
+  cap_buf.length = enc->cap_num_planes;
+  cap_buf.m.planes = cap_plane;
+
+  if (xioctl(enc->fd, VIDIOC_QUERYBUF, &cap_buf) != 0) {
+    perror("VIDIOC_QUERYBUF capture");
+    v4l2_jpeg_destroy(enc);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < enc->cap_num_planes; ++i) {
+    enc->cap_map_size[i] = cap_buf.m.planes[i].length;
+    enc->cap_map[i] =
+        mmap(NULL, enc->cap_map_size[i], PROT_READ | PROT_WRITE, MAP_SHARED,
+             enc->fd, cap_buf.m.planes[i].m.mem_offset);
+    if (enc->cap_map[i] == MAP_FAILED) {
+      perror("mmap capture");
+      v4l2_jpeg_destroy(enc);
+      return -1;
+    }
+  }
+
+  if (queue_capture(enc) != 0) {
+    v4l2_jpeg_destroy(enc);
+    return -1;
+  }
+
+  enum v4l2_buf_type out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  enum v4l2_buf_type cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  if (xioctl(enc->fd, VIDIOC_STREAMON, &out_type) != 0) {
+    perror("VIDIOC_STREAMON output");
+    v4l2_jpeg_destroy(enc);
+    return -1;
+  }
+  if (xioctl(enc->fd, VIDIOC_STREAMON, &cap_type) != 0) {
+    perror("VIDIOC_STREAMON capture");
+    v4l2_jpeg_destroy(enc);
+    return -1;
+  }
+  return 0;
+}
+
+/* Stop and restart both queues, which hands every queued buffer back, so
+ * the next frame starts from a clean state after one was never finished */
+static void reset_streams(struct v4l2_jpeg_encoder *enc) {
+  enum v4l2_buf_type out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  enum v4l2_buf_type cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  xioctl(enc->fd, VIDIOC_STREAMOFF, &out_type);
+  xioctl(enc->fd, VIDIOC_STREAMOFF, &cap_type);
+  enc->cap_queued = 0;
+  if (xioctl(enc->fd, VIDIOC_STREAMON, &out_type) != 0 ||
+      xioctl(enc->fd, VIDIOC_STREAMON, &cap_type) != 0) {
+    perror("VIDIOC_STREAMON after reset");
+  }
+}
+
+/* Wait for the frame just queued on the output side, dequeue both buffers
+ * and return the JPEG in the capture mapping */
+static int finish_encode(struct v4l2_jpeg_encoder *enc,
+                         unsigned char **out_buf, unsigned long *out_size) {
+  struct pollfd pfd;
+  memset(&pfd, 0, sizeof(pfd));
+  pfd.fd = enc->fd;
+  pfd.events = POLLIN;
+
+  int poll_rc = poll(&pfd, 1, 2000);
+  if (poll_rc <= 0) {
+    fprintf(stderr, "poll timeout or error\n");
+    /* The output buffer is still queued; the next QBUF would fail */
+    reset_streams(enc);
+    return -1;
+  }
+
+  struct v4l2_buffer cap_buf_desc;
+  struct v4l2_plane cap_plane[3];
+  memset(&cap_buf_desc, 0, sizeof(cap_buf_desc));
+  memset(&cap_plane, 0, sizeof(cap_plane));
+  cap_buf_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  cap_buf_desc.memory = V4L2_MEMORY_MMAP;
+  cap_buf_desc.index = 0;
+  cap_buf_desc.length = enc->cap_num_planes;
+  cap_buf_desc.m.planes = cap_plane;
+
+  if (xioctl(enc->fd, VIDIOC_DQBUF, &cap_buf_desc) != 0) {
+    perror("VIDIOC_DQBUF capture");
+    reset_streams(enc);
+    return -1;
+  }
+  enc->cap_queued = 0;
+
+  struct v4l2_buffer out_done;
+  struct v4l2_plane out_done_plane[3];
+  memset(&out_done, 0, sizeof(out_done));
+  memset(&out_done_plane, 0, sizeof(out_done_plane));
+  out_done.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  out_done.memory = enc->out_memory;
+  out_done.length = enc->out_num_planes;
+  out_done.m.planes = out_done_plane;
+  if (xioctl(enc->fd, VIDIOC_DQBUF, &out_done) != 0) {
+    perror("VIDIOC_DQBUF output");
+    reset_streams(enc);
+    return -1;
+  }
+
+  *out_buf = (unsigned char *)enc->cap_map[0];
+  *out_size = cap_buf_desc.m.planes[0].bytesused;
+  return 0;
+}
+
 int v4l2_jpeg_init(struct v4l2_jpeg_encoder *enc, int width, int height,
                    int quality) {
   memset(enc, 0, sizeof(*enc));
@@ -1001,63 +1133,7 @@ int v4l2_jpeg_init(struct v4l2_jpeg_encoder *enc, int width, int height,
     }
   }
 
-  memset(&req, 0, sizeof(req));
-  req.count = 1;
-  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  req.memory = V4L2_MEMORY_MMAP;
-  if (xioctl(enc->fd, VIDIOC_REQBUFS, &req) != 0 || req.count < 1) {
-    perror("VIDIOC_REQBUFS capture");
-    v4l2_jpeg_destroy(enc);
-    return -1;
-  }
-
-  struct v4l2_buffer cap_buf;
-  struct v4l2_plane cap_plane[3];
-  memset(&cap_buf, 0, sizeof(cap_buf));
-  memset(&cap_plane, 0, sizeof(cap_plane));
-  cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  cap_buf.memory = V4L2_MEMORY_MMAP;
-  cap_buf.index = 0;
-  cap_buf.length = enc->cap_num_planes;
-  cap_buf.m.planes = cap_plane;
-
-  if (xioctl(enc->fd, VIDIOC_QUERYBUF, &cap_buf) != 0) {
-    perror("VIDIOC_QUERYBUF capture");
-    v4l2_jpeg_destroy(enc);
-    return -1;
-  }
-
-  for (unsigned int i = 0; i < enc->cap_num_planes; ++i) {
-    enc->cap_map_size[i] = cap_buf.m.planes[i].length;
-    enc->cap_map[i] =
-        mmap(NULL, enc->cap_map_size[i], PROT_READ | PROT_WRITE, MAP_SHARED,
-             enc->fd, cap_buf.m.planes[i].m.mem_offset);
-    if (enc->cap_map[i] == MAP_FAILED) {
-      perror("mmap capture");
-      v4l2_jpeg_destroy(enc);
-      return -1;
-    }
-  }
-
-  if (queue_capture(enc) != 0) {
-    v4l2_jpeg_destroy(enc);
-    return -1;
-  }
-
-  enum v4l2_buf_type out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-  enum v4l2_buf_type cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  if (xioctl(enc->fd, VIDIOC_STREAMON, &out_type) != 0) {
-    perror("VIDIOC_STREAMON output");
-    v4l2_jpeg_destroy(enc);
-    return -1;
-  }
-  if (xioctl(enc->fd, VIDIOC_STREAMON, &cap_type) != 0) {
-    perror("VIDIOC_STREAMON capture");
-    v4l2_jpeg_destroy(enc);
-    return -1;
-  }
-
-  return 0;
+  return start_streaming(enc);
 }
 
 int v4l2_jpeg_init_nv12(struct v4l2_jpeg_encoder *enc, int width, int height,
@@ -1206,64 +1282,114 @@ int v4l2_jpeg_init_nv12(struct v4l2_jpeg_encoder *enc, int width, int height,
     }
   }
 
-  /* Capture buffer setup */
-  memset(&req, 0, sizeof(req));
-  req.count = 1;
-  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  req.memory = V4L2_MEMORY_MMAP;
-  if (xioctl(enc->fd, VIDIOC_REQBUFS, &req) != 0 || req.count < 1) {
-    perror("VIDIOC_REQBUFS capture (NV12)");
-    v4l2_jpeg_destroy(enc);
+  return start_streaming(enc);
+}
+
+int v4l2_jpeg_init_dmabuf(struct v4l2_jpeg_encoder *enc, int width, int height,
+                          int quality, uint32_t format, unsigned int buffers,
+                          size_t buffer_size) {
+  memset(enc, 0, sizeof(*enc));
+  for (unsigned int i = 0; i < 3; ++i) {
+    enc->out_dmabuf_fd[i] = -1;
+  }
+  if (buffers < 1 || buffer_size > UINT32_MAX) {
+    enc->fd = -1;
+    return -1;
+  }
+  enc->fd = find_jpeg_encoder();
+  if (enc->fd < 0) {
     return -1;
   }
 
-  struct v4l2_buffer cap_buf;
-  struct v4l2_plane cap_plane[3];
-  memset(&cap_buf, 0, sizeof(cap_buf));
-  memset(&cap_plane, 0, sizeof(cap_plane));
-  cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  cap_buf.memory = V4L2_MEMORY_MMAP;
-  cap_buf.index = 0;
-  cap_buf.length = enc->cap_num_planes;
-  cap_buf.m.planes = cap_plane;
+  enc->width = width;
+  enc->height = height;
+  enc->quality = quality;
 
-  if (xioctl(enc->fd, VIDIOC_QUERYBUF, &cap_buf) != 0) {
-    perror("VIDIOC_QUERYBUF capture (NV12)");
-    v4l2_jpeg_destroy(enc);
+  /* The caller's buffers can't be restrided, so the encoder has to take
+   * them exactly as they are: one plane (drivers differ in whether they
+   * honour data_offset for a second plane in the same dmabuf), the natural
+   * row pitch, and no more than the buffer holds. */
+  unsigned int pitch = format == V4L2_PIX_FMT_YUYV ? (unsigned int)width * 2u
+                                                   : (unsigned int)width;
+  unsigned int frame_size = format == V4L2_PIX_FMT_YUYV
+                                ? pitch * (unsigned int)height
+                                : pitch * (unsigned int)height * 3u / 2u;
+  if (set_output_format(enc, width, height, format) != 0 ||
+      enc->out_format != format || enc->out_num_planes != 1 ||
+      enc->out_bytesperline[0] != pitch ||
+      enc->out_plane_size[0] > buffer_size || frame_size > buffer_size) {
+    if (debug_enabled()) {
+      fprintf(stderr, "JPEG encoder can't import %s dmabufs as they are\n",
+              fourcc_to_str(format));
+    }
+    close(enc->fd);
+    enc->fd = -1;
+    return -1;
+  }
+
+  /* Set JPEG output format */
+  struct v4l2_format cap_fmt;
+  memset(&cap_fmt, 0, sizeof(cap_fmt));
+  cap_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  cap_fmt.fmt.pix_mp.width = (unsigned int)width;
+  cap_fmt.fmt.pix_mp.height = (unsigned int)height;
+  cap_fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_JPEG;
+  cap_fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+  cap_fmt.fmt.pix_mp.num_planes = 1;
+  cap_fmt.fmt.pix_mp.plane_fmt[0].sizeimage = (unsigned int)width * (unsigned int)height * 2u;
+
+  if (xioctl(enc->fd, VIDIOC_S_FMT, &cap_fmt) != 0) {
+    perror("VIDIOC_S_FMT capture");
+    close(enc->fd);
+    enc->fd = -1;
     return -1;
   }
+  if (xioctl(enc->fd, VIDIOC_G_FMT, &cap_fmt) == 0) {
+    dump_pix_mp("v4l2 capture (dmabuf init)", &cap_fmt);
+  }
 
+  enc->cap_format = cap_fmt.fmt.pix_mp.pixelformat;
+  enc->cap_num_planes = cap_fmt.fmt.pix_mp.num_planes;
   for (unsigned int i = 0; i < enc->cap_num_planes; ++i) {
-    enc->cap_map_size[i] = cap_buf.m.planes[i].length;
-    enc->cap_map[i] =
-        mmap(NULL, enc->cap_map_size[i], PROT_READ | PROT_WRITE, MAP_SHARED,
-             enc->fd, cap_buf.m.planes[i].m.mem_offset);
-    if (enc->cap_map[i] == MAP_FAILED) {
-      perror("mmap capture (NV12)");
-      v4l2_jpeg_destroy(enc);
-      return -1;
-    }
+    enc->cap_plane_size[i] = cap_fmt.fmt.pix_mp.plane_fmt[i].sizeimage;
   }
 
-  /* Queue capture buffer and start streaming */
-  if (queue_capture(enc) != 0) {
-    v4l2_jpeg_destroy(enc);
-    return -1;
+  /* Set quality */
+  struct v4l2_control ctrl;
+  memset(&ctrl, 0, sizeof(ctrl));
+  ctrl.id = V4L2_CID_JPEG_COMPRESSION_QUALITY;
+  ctrl.value = quality;
+  if (xioctl(enc->fd, VIDIOC_S_CTRL, &ctrl) != 0) {
+    fprintf(stderr, "Warning: JPEG quality control not supported\n");
   }
 
-  enum v4l2_buf_type out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-  enum v4l2_buf_type cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  if (xioctl(enc->fd, VIDIOC_STREAMON, &out_type) != 0) {
-    perror("VIDIOC_STREAMON output (NV12)");
-    v4l2_jpeg_destroy(enc);
+  /* One V4L2 buffer per caller dmabuf: vb2 keeps a buffer's dmabuf
+   * attached while the same one is queued again, so the converter's
+   * buffers are mapped for the device once rather than every frame */
+  struct v4l2_requestbuffers req;
+  memset(&req, 0, sizeof(req));
+  req.count = buffers;
+  req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  req.memory = V4L2_MEMORY_DMABUF;
+  if (xioctl(enc->fd, VIDIOC_REQBUFS, &req) != 0 || req.count < 1) {
+    if (debug_enabled()) {
+      perror("VIDIOC_REQBUFS output DMABUF (import)");
+    }
+    close(enc->fd);
+    enc->fd = -1;
     return -1;
   }
-  if (xioctl(enc->fd, VIDIOC_STREAMON, &cap_type) != 0) {
-    perror("VIDIOC_STREAMON capture (NV12)");
-    v4l2_jpeg_destroy(enc);
+  enc->out_memory = V4L2_MEMORY_DMABUF;
+  enc->out_import = 1;
+  enc->out_buffer_count = req.count;
+  enc->out_import_size = (unsigned int)buffer_size;
+
+  if (start_streaming(enc) != 0) {
     return -1;
   }
 
+  fprintf(stderr, "JPEG encoder importing %s dmabufs (%u buffers)\n",
+          fourcc_to_str(enc->out_format), enc->out_buffer_count);
   return 0;
 }
 
@@ -1271,7 +1397,7 @@ int v4l2_jpeg_encode_frame(struct v4l2_jpeg_encoder *enc,
                            const struct capture_frame *frame,
                            unsigned char **out_buf,
                            unsigned long *out_size) {
-  if (!enc || enc->fd < 0) {
+  if (!enc || enc->fd < 0 || enc->out_import) {
     return -1;
   }
   if (frame->width != (uint32_t)enc->width ||
@@ -1375,57 +1501,14 @@ int v4l2_jpeg_encode_frame(struct v4l2_jpeg_encoder *enc,
     return -1;
   }
 
-  struct pollfd pfd;
-  memset(&pfd, 0, sizeof(pfd));
-  pfd.fd = enc->fd;
-  pfd.events = POLLIN;
-
-  int poll_rc = poll(&pfd, 1, 2000);
-  if (poll_rc <= 0) {
-    fprintf(stderr, "poll timeout or error\n");
-    return -1;
-  }
-
-  struct v4l2_buffer cap_buf_desc;
-  struct v4l2_plane cap_plane[3];
-  memset(&cap_buf_desc, 0, sizeof(cap_buf_desc));
-  memset(&cap_plane, 0, sizeof(cap_plane));
-  cap_buf_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  cap_buf_desc.memory = V4L2_MEMORY_MMAP;
-  cap_buf_desc.index = 0;
-  cap_buf_desc.length = enc->cap_num_planes;
-  cap_buf_desc.m.planes = cap_plane;
-
-  if (xioctl(enc->fd, VIDIOC_DQBUF, &cap_buf_desc) != 0) {
-    perror("VIDIOC_DQBUF capture");
-    return -1;
-  }
-  enc->cap_queued = 0;
-
-  struct v4l2_buffer out_done;
-  struct v4l2_plane out_done_plane[3];
-  memset(&out_done, 0, sizeof(out_done));
-  memset(&out_done_plane, 0, sizeof(out_done_plane));
-  out_done.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-  out_done.memory = enc->out_memory;
-  out_done.index = 0;
-  out_done.length = enc->out_num_planes;
-  out_done.m.planes = out_done_plane;
-  if (xioctl(enc->fd, VIDIOC_DQBUF, &out_done) != 0) {
-    perror("VIDIOC_DQBUF output");
-    return -1;
-  }
-
-  *out_buf = (unsigned char *)enc->cap_map[0];
-  *out_size = cap_buf_desc.m.planes[0].bytesused;
-  return 0;
+  return finish_encode(enc, out_buf, out_size);
 }
 
 int v4l2_jpeg_encode_nv12(struct v4l2_jpeg_encoder *enc,
                           const void *y_plane, unsigned int y_stride,
                           const void *uv_plane, unsigned int uv_stride,
                           unsigned char **out_buf, unsigned long *out_size) {
-  if (!enc || enc->fd < 0) {
+  if (!enc || enc->fd < 0 || enc->out_import) {
     return -1;
   }
 
@@ -1502,50 +1585,50 @@ int v4l2_jpeg_encode_nv12(struct v4l2_jpeg_encoder *enc,
     return -1;
   }
 
-  struct pollfd pfd;
-  memset(&pfd, 0, sizeof(pfd));
-  pfd.fd = enc->fd;
-  pfd.events = POLLIN;
+  return finish_encode(enc, out_buf, out_size);
+}
 
-  int poll_rc = poll(&pfd, 1, 2000);
-  if (poll_rc <= 0) {
-    fprintf(stderr, "poll timeout or error (NV12)\n");
+int v4l2_jpeg_encode_dmabuf(struct v4l2_jpeg_encoder *enc, unsigned int index,
+                            int dmabuf_fd, unsigned char **out_buf,
+                            unsigned long *out_size) {
+  if (!enc || enc->fd < 0 || !enc->out_import || dmabuf_fd < 0) {
     return -1;
   }
 
-  struct v4l2_buffer cap_buf_desc;
-  struct v4l2_plane cap_plane[3];
-  memset(&cap_buf_desc, 0, sizeof(cap_buf_desc));
-  memset(&cap_plane, 0, sizeof(cap_plane));
-  cap_buf_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  cap_buf_desc.memory = V4L2_MEMORY_MMAP;
-  cap_buf_desc.index = 0;
-  cap_buf_desc.length = enc->cap_num_planes;
-  cap_buf_desc.m.planes = cap_plane;
+  if (!enc->cap_queued) {
+    if (queue_capture(enc) != 0) {
+      return -1;
+    }
+  }
 
-  if (xioctl(enc->fd, VIDIOC_DQBUF, &cap_buf_desc) != 0) {
-    perror("VIDIOC_DQBUF capture (NV12)");
-    return -1;
+  /* bytesused counts the whole frame: for single-plane NV12 the CbCr rows
+   * follow the Y rows in the same plane */
+  unsigned int used = enc->out_bytesperline[0] * (unsigned int)enc->height;
+  if (enc->out_format == V4L2_PIX_FMT_NV12) {
+    used = used * 3u / 2u;
   }
-  enc->cap_queued = 0;
 
-  struct v4l2_buffer out_done;
-  struct v4l2_plane out_done_plane[3];
-  memset(&out_done, 0, sizeof(out_done));
-  memset(&out_done_plane, 0, sizeof(out_done_plane));
-  out_done.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-  out_done.memory = enc->out_memory;
-  out_done.index = 0;
-  out_done.length = enc->out_num_planes;
-  out_done.m.planes = out_done_plane;
-  if (xioctl(enc->fd, VIDIOC_DQBUF, &out_done) != 0) {
-    perror("VIDIOC_DQBUF output (NV12)");
+  struct v4l2_buffer out_buf_desc;
+  struct v4l2_plane out_plane[3];
+  memset(&out_buf_desc, 0, sizeof(out_buf_desc));
+  memset(&out_plane, 0, sizeof(out_plane));
+  out_buf_desc.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  out_buf_desc.memory = V4L2_MEMORY_DMABUF;
+  out_buf_desc.index = index % enc->out_buffer_count;
+  out_buf_desc.length = enc->out_num_planes;
+  out_buf_desc.m.planes = out_plane;
+  out_plane[0].m.fd = dmabuf_fd;
+  out_plane[0].length = enc->out_import_size;
+  out_plane[0].bytesused = used;
+
+  dump_qbuf_planes(enc, out_plane);
+
+  if (xioctl(enc->fd, VIDIOC_QBUF, &out_buf_desc) != 0) {
+    perror("VIDIOC_QBUF output (import)");
     return -1;
   }
 
-  *out_buf = (unsigned char *)enc->cap_map[0];
-  *out_size = cap_buf_desc.m.planes[0].bytesused;
-  return 0;
+  return finish_encode(enc, out_buf, out_size);
 }
 
 void v4l2_jpeg_destroy(struct v4l2_jpeg_encoder *enc) {
@@ -1,6 +1,7 @@
 #ifndef WLCAST_V4L2_JPEG_H
 #define WLCAST_V4L2_JPEG_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "capture.h"
@@ -22,6 +23,12 @@ struct v4l2_jpeg_encoder {
   unsigned int out_map_base_size;
   void *out_userptr[3];
   int out_dmabuf_fd[3];
+  /* Set by v4l2_jpeg_init_dmabuf: output buffers are the caller's dmabufs,
+   * out_buffer_count of them at out_import_size bytes each, and nothing is
+   * mapped here */
+  int out_import;
+  unsigned int out_buffer_count;
+  unsigned int out_import_size;
   uint32_t cap_format;
   unsigned int cap_num_planes;
   unsigned int cap_plane_size[3];
@@ -40,6 +47,21 @@ int v4l2_jpeg_init(struct v4l2_jpeg_encoder *enc, int width, int height,
 int v4l2_jpeg_init_nv12(struct v4l2_jpeg_encoder *enc, int width, int height,
                         int quality);
 
+/**
+ * Initialize encoder for input that already sits in dmabufs in its final
+ * layout, such as the OpenCL converter's output, so frames are queued with
+ * V4L2_MEMORY_DMABUF instead of being copied. format is V4L2_PIX_FMT_YUYV
+ * (width * 2 bytes per row) or V4L2_PIX_FMT_NV12 (width bytes per row, the
+ * CbCr plane right after the Y plane). Fails if the encoder wants any other
+ * layout, in which case the caller should copy through one of the other
+ * init functions instead. buffers is how many distinct dmabufs the caller
+ * cycles through, so each keeps its own V4L2 buffer and stays imported;
+ * buffer_size is their size, which may exceed the frame.
+ */
+int v4l2_jpeg_init_dmabuf(struct v4l2_jpeg_encoder *enc, int width, int height,
+                          int quality, uint32_t format, unsigned int buffers,
+                          size_t buffer_size);
+
 int v4l2_jpeg_encode_frame(struct v4l2_jpeg_encoder *enc,
                            const struct capture_frame *frame,
                            unsigned char **out_buf,
@@ -54,6 +76,15 @@ int v4l2_jpeg_encode_nv12(struct v4l2_jpeg_encoder *enc,
                           const void *uv_plane, unsigned int uv_stride,
                           unsigned char **out_buf, unsigned long *out_size);
 
+/**
+ * Encode the frame in dmabuf_fd without copying it. index (0 to buffers-1
+ * as passed to v4l2_jpeg_init_dmabuf) identifies the dmabuf. The encoder
+ * only reads it until this returns.
+ */
+int v4l2_jpeg_encode_dmabuf(struct v4l2_jpeg_encoder *enc, unsigned int index,
+                            int dmabuf_fd, unsigned char **out_buf,
+                            unsigned long *out_size);
+
 void v4l2_jpeg_destroy(struct v4l2_jpeg_encoder *enc);
 
 /**
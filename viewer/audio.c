@@ -8,6 +8,7 @@
 #include <SDL.h>
 #include <opus/opus.h>
 
+#include "../common/metrics.h"
 #include "../common/protocol.h"
 
 /* Ring buffer size (in samples, MUST be power of 2 for mask to work) */
@@ -29,6 +30,8 @@ struct audio_player {
   /* Stats */
   uint32_t packets_received;
   uint32_t underruns;
+  struct metric *packets_metric;
+  struct metric *underruns_metric;
 };
 
 static uint32_t g_audio_callbacks = 0;
@@ -51,6 +54,7 @@ static void audio_callback(void *userdata, Uint8 *stream, int len) {
     /* Underrun - fill with silence */
     memset(stream, 0, (size_t)len);
     ap->underruns++;
+    metric_inc(ap->underruns_metric);
     return;
   }
 
@@ -72,6 +76,12 @@ int audio_player_init(struct audio_player **out) {
     return -1;
   }
 
+  /* Before the device opens: the callback uses them */
+  ap->packets_metric = metrics_counter("wlcast_view_audio_packets_total",
+                                       "Audio packets decoded");
+  ap->underruns_metric = metrics_counter("wlcast_view_audio_underruns_total",
+                                         "Audio callbacks that found too few samples and played silence");
+
   /* Initialize Opus decoder */
   int error;
   ap->decoder = opus_decoder_create(WLCAST_AUDIO_SAMPLE_RATE,
@@ -165,6 +175,7 @@ void audio_player_process_packet(struct audio_player *ap, const uint8_t *packet,
   SDL_UnlockAudioDevice(ap->dev);
 
   ap->packets_received++;
+  metric_inc(ap->packets_metric);
 }
 
 void audio_player_destroy(struct audio_player *ap) {
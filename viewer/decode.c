@@ -16,16 +16,53 @@ int jpeg_decoder_init(struct jpeg_decoder *dec) {
   return 0;
 }
 
+int jpeg_decode_header(struct jpeg_decoder *dec, const uint8_t *data,
+                       size_t size, struct jpeg_info *info) {
+  int subsamp = 0;
+  int colorspace = 0;
+  if (tjDecompressHeader3(dec->handle, data, (unsigned long)size, &info->width,
+                          &info->height, &subsamp, &colorspace) != 0) {
+    fprintf(stderr, "tjDecompressHeader3 failed: %s\n", tjGetErrorStr());
+    return -1;
+  }
+  info->yuv420 = subsamp == TJSAMP_420;
+  return 0;
+}
+
+int jpeg_decode_into(struct jpeg_decoder *dec, const uint8_t *data,
+                     size_t size, uint8_t *dst, int width, int pitch,
+                     int height) {
+  int flags = TJFLAG_FASTDCT;
+  int pixfmt = TJPF_BGRX;
+  if (tjDecompress2(dec->handle, data, (unsigned long)size, dst, width, pitch,
+                    height, pixfmt, flags) != 0) {
+    fprintf(stderr, "tjDecompress2 failed: %s\n", tjGetErrorStr());
+    return -1;
+  }
+  return 0;
+}
+
+int jpeg_decode_yuv_into(struct jpeg_decoder *dec, const uint8_t *data,
+                         size_t size, uint8_t *const planes[3],
+                         const int strides[3], int width, int height) {
+  unsigned char *dst[3] = {planes[0], planes[1], planes[2]};
+  int pitches[3] = {strides[0], strides[1], strides[2]};
+  if (tjDecompressToYUVPlanes(dec->handle, data, (unsigned long)size, dst,
+                              width, pitches, height, TJFLAG_FASTDCT) != 0) {
+    fprintf(stderr, "tjDecompressToYUVPlanes failed: %s\n", tjGetErrorStr());
+    return -1;
+  }
+  return 0;
+}
+
 int jpeg_decode_frame(struct jpeg_decoder *dec, const uint8_t *data,
                       size_t size, struct decoded_frame *out) {
-  int width = 0;
-  int height = 0;
-
-  if (tjDecompressHeader(dec->handle, (unsigned char *)data, (unsigned long)size,
-                         &width, &height) != 0) {
-    fprintf(stderr, "tjDecompressHeader failed: %s\n", tjGetErrorStr());
+  struct jpeg_info info;
+  if (jpeg_decode_header(dec, data, size, &info) != 0) {
     return -1;
   }
+  int width = info.width;
+  int height = info.height;
 
   size_t needed = (size_t)width * height * 4u;
   if (needed > dec->capacity) {
@@ -39,11 +76,8 @@ int jpeg_decode_frame(struct jpeg_decoder *dec, const uint8_t *data,
   }
 
   int pitch = width * 4;
-  int flags = TJFLAG_FASTDCT;
-  int pixfmt = TJPF_BGRX;
-  if (tjDecompress2(dec->handle, data, (unsigned long)size, dec->pixels,
-                    width, pitch, height, pixfmt, flags) != 0) {
-    fprintf(stderr, "tjDecompress2 failed: %s\n", tjGetErrorStr());
+  if (jpeg_decode_into(dec, data, size, dec->pixels, width, pitch, height) !=
+      0) {
     return -1;
   }
 
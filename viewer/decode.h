@@ -22,6 +22,29 @@ struct decoded_frame {
 int jpeg_decoder_init(struct jpeg_decoder *dec);
 int jpeg_decode_frame(struct jpeg_decoder *dec, const uint8_t *data,
                       size_t size, struct decoded_frame *out);
+
+struct jpeg_info {
+  int width;
+  int height;
+  int yuv420; /* 4:2:0 chroma, so jpeg_decode_yuv_into can take it */
+};
+
+/* Read the dimensions and subsampling of a JPEG. Returns 0 or -1. */
+int jpeg_decode_header(struct jpeg_decoder *dec, const uint8_t *data,
+                       size_t size, struct jpeg_info *info);
+
+/* Decode a width x height JPEG as BGRX into caller memory with the given
+ * pitch, e.g. straight into a region of a larger image. Returns 0 or -1. */
+int jpeg_decode_into(struct jpeg_decoder *dec, const uint8_t *data,
+                     size_t size, uint8_t *dst, int width, int pitch,
+                     int height);
+
+/* Decode a 4:2:0 JPEG to I420 planes (Y, U, V; chroma at half resolution,
+ * rounded up) without colour conversion. Returns 0 or -1. */
+int jpeg_decode_yuv_into(struct jpeg_decoder *dec, const uint8_t *data,
+                         size_t size, uint8_t *const planes[3],
+                         const int strides[3], int width, int height);
+
 void jpeg_decoder_destroy(struct jpeg_decoder *dec);
 
 #endif
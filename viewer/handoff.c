@@ -0,0 +1,112 @@
+#include "handoff.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+int handoff_init(struct handoff *h, size_t entry_size) {
+  memset(h, 0, sizeof(*h));
+  h->event_fd = -1;
+
+  if (entry_size == 0) {
+    return -1;
+  }
+
+  h->entry = calloc(1, entry_size);
+  if (!h->entry) {
+    fprintf(stderr, "handoff: alloc failed\n");
+    return -1;
+  }
+
+  h->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (h->event_fd < 0) {
+    perror("eventfd");
+    free(h->entry);
+    h->entry = NULL;
+    return -1;
+  }
+
+  pthread_mutex_init(&h->lock, NULL);
+  h->entry_size = entry_size;
+  return 0;
+}
+
+void handoff_destroy(struct handoff *h) {
+  if (!h || !h->entry) {
+    return;
+  }
+  pthread_mutex_destroy(&h->lock);
+  if (h->event_fd >= 0) {
+    close(h->event_fd);
+  }
+  free(h->entry);
+  memset(h, 0, sizeof(*h));
+  h->event_fd = -1;
+}
+
+int handoff_put(struct handoff *h, const void *entry, void *replaced) {
+  pthread_mutex_lock(&h->lock);
+  int had_entry = h->full;
+  if (had_entry) {
+    memcpy(replaced, h->entry, h->entry_size);
+  }
+  memcpy(h->entry, entry, h->entry_size);
+  h->full = 1;
+  pthread_mutex_unlock(&h->lock);
+
+  if (!had_entry) {
+    handoff_wake(h);
+  }
+  return had_entry;
+}
+
+int handoff_take(struct handoff *h, void *out) {
+  pthread_mutex_lock(&h->lock);
+  int had_entry = h->full;
+  if (had_entry) {
+    memcpy(out, h->entry, h->entry_size);
+    h->full = 0;
+  }
+  pthread_mutex_unlock(&h->lock);
+  return had_entry;
+}
+
+static int handoff_full(struct handoff *h) {
+  pthread_mutex_lock(&h->lock);
+  int full = h->full;
+  pthread_mutex_unlock(&h->lock);
+  return full;
+}
+
+int handoff_wait(struct handoff *h, int timeout_ms) {
+  if (handoff_full(h)) {
+    return 1;
+  }
+
+  /* The eventfd counter survives until read, so a put that lands between
+   * the check above and poll() still wakes us */
+  struct pollfd pfd = {h->event_fd, POLLIN, 0};
+  int rc;
+  do {
+    rc = poll(&pfd, 1, timeout_ms);
+  } while (rc < 0 && errno == EINTR);
+
+  if (rc > 0) {
+    uint64_t value;
+    ssize_t n = read(h->event_fd, &value, sizeof(value));
+    (void)n;
+  }
+
+  return handoff_full(h);
+}
+
+void handoff_wake(struct handoff *h) {
+  uint64_t one = 1;
+  ssize_t n = write(h->event_fd, &one, sizeof(one));
+  (void)n;
+}
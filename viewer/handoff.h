@@ -0,0 +1,39 @@
+#ifndef WLCAST_VIEWER_HANDOFF_H
+#define WLCAST_VIEWER_HANDOFF_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* Single-entry mailbox between two threads where only the newest entry
+ * matters. A put replaces whatever the consumer has not taken yet and hands
+ * the replaced entry back to the producer, which still owns what it points
+ * to. Entries are copied by value, so they should be small descriptors. An
+ * eventfd lets the consumer sleep until something is put. */
+struct handoff {
+  pthread_mutex_t lock;
+  unsigned char *entry;
+  size_t entry_size;
+  int full;
+  int event_fd;
+};
+
+/* Returns 0 on success, -1 on failure */
+int handoff_init(struct handoff *h, size_t entry_size);
+
+void handoff_destroy(struct handoff *h);
+
+/* Producer side. Returns 1 if an untaken entry was replaced and copied to
+ * replaced, 0 otherwise. */
+int handoff_put(struct handoff *h, const void *entry, void *replaced);
+
+/* Consumer side. Returns 1 if an entry was copied to out, 0 if empty. */
+int handoff_take(struct handoff *h, void *out);
+
+/* Consumer side: block until an entry is available, the timeout expires or
+ * handoff_wake is called. Returns 1 if an entry is available. */
+int handoff_wait(struct handoff *h, int timeout_ms);
+
+/* Wake a consumer blocked in handoff_wait (e.g. on shutdown) */
+void handoff_wake(struct handoff *h);
+
+#endif
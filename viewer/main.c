@@ -1,27 +1,996 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <SDL.h>
 
+#include "../common/metrics.h"
+#include "../common/protocol.h"
+#include "../common/trace.h"
 #include "decode.h"
+#include "handoff.h"
 #include "network.h"
 
 #ifdef HAVE_AUDIO
 #include "audio.h"
 #endif
 
+/* The network thread wakes at least this often to send NACKs and ACKs */
+#define NETWORK_WAIT_MS 2
+/* How long the decode thread blocks before re-checking for shutdown */
+#define DECODE_WAIT_MS 100
+/* How long the render loop waits for events or a new image */
+#define RENDER_WAIT_MS 100
+
+/* One being decoded, one waiting for the renderer, one being uploaded */
+#define IMAGE_COUNT 3
+/* Locked textures decoded into directly, used like the images above */
+#define DIRECT_COUNT 3
+/* Sanity limit for tiled frame dimensions */
+#define MAX_FRAME_DIM 16384
+/* One being decoded, one waiting for the decoder, one being merged into */
+#define MERGE_COUNT 3
+
+static const double decode_buckets_ms[] = {1, 2, 5, 10, 16, 33, 50, 100, 200};
+static const double latency_buckets_ms[] = {10, 20, 33, 50, 75, 100, 150, 200, 300, 500, 1000};
+
+enum image_format {
+  IMAGE_BGRX, /* Packed, matches SDL_PIXELFORMAT_XRGB8888 */
+  IMAGE_I420, /* Y, U, V planes, matches SDL_PIXELFORMAT_IYUV */
+};
+
+/* A fully composed frame, ready to upload */
+struct image {
+  uint8_t *pixels; /* Backing store for all planes */
+  size_t capacity;
+  enum image_format format;
+  int width;
+  int height;
+  uint8_t *planes[3]; /* Only planes[0] for BGRX */
+  int strides[3];
+  /* Region changed since the image the renderer took last */
+  SDL_Rect dirty;
+  uint32_t seq;
+  int whole; /* Decoded as one JPEG, not composed from tiles */
+  /* Latency: streamer stages, then reassembled and decoded here */
+  struct frame_timing timing;
+  uint64_t complete_us;
+  uint64_t decoded_us;
+  /* Direct images: the planes point into this texture while it is locked */
+  SDL_Texture *texture;
+  atomic_int in_use; /* Cleared by the renderer once uploaded */
+};
+
+/* Exported with --metrics */
+struct viewer_metrics {
+  struct metric *frames_received;
+  struct metric *bytes_received;
+  struct metric *fec_recovered;
+  struct metric *decode_ms;
+  struct metric *decode_failures;
+  struct metric *frames_shown;
+  struct metric *fps;
+  struct metric *latency_ms;
+};
+
+/* Tiled frames merged by the network thread. Owned by the frame_buffer
+ * pointing at data until release_frame, like the receiver's pool. */
+struct merge_buffer {
+  uint8_t *data;
+  size_t capacity;
+  atomic_int in_use;
+};
+
+/* Capture-to-present latency, split by where the time went */
+enum latency_part {
+  LATENCY_CAPTURE,
+  LATENCY_CONVERT,
+  LATENCY_ENCODE,
+  LATENCY_QUEUE,
+  LATENCY_NETWORK, /* Send until reassembled */
+  LATENCY_DECODE,  /* Including the wait for the decode thread */
+  LATENCY_DISPLAY, /* Waiting for the renderer, upload and present */
+  LATENCY_PARTS,
+};
+
+static const char *const latency_part_names[LATENCY_PARTS] = {
+    "capture", "convert", "encode", "queue", "network", "decode", "display",
+};
+
+/* Sums over the current one-second window, in microseconds */
+struct latency_window {
+  unsigned int count;
+  int64_t parts[LATENCY_PARTS];
+  int64_t total;
+  int64_t max;
+};
+
+/* State shared by the three threads.
+ *
+ * network -> frames -> decode -> images -> render (main thread)
+ *
+ * Both handoffs keep only the newest entry, so the renderer always shows the
+ * latest decoded frame and neither a slow decode nor a vsync-blocked present
+ * holds up the socket. A tiled frame only patches the previous one, so
+ * rather than being replaced it is merged into the next. The network thread
+ * ACKs every frame as soon as it is reassembled. */
+struct viewer {
+  struct udp_receiver *receiver;
+  atomic_int running;
+  atomic_int failed;
+  Uint32 image_event; /* SDL user event: a new image is waiting */
+  int yuv;            /* Decode 4:2:0 JPEGs to I420, converted by the GPU */
+  atomic_int direct_mode; /* Decode full frames into locked textures */
+
+  struct handoff frames; /* struct frame_buffer */
+  struct handoff images; /* struct image * */
+
+  /* Network thread */
+  struct merge_buffer merged[MERGE_COUNT];
+  uint8_t *covered;         /* Tile cells a newer frame replaces */
+  size_t covered_capacity;
+
+  /* Decode thread */
+  struct jpeg_decoder decoder;
+  struct image pool[IMAGE_COUNT];
+  /* Locked by the renderer; free to decode into while in_use is 0 */
+  struct image direct[DIRECT_COUNT];
+  struct image *latest;  /* Last composed image, base for tile updates */
+  uint32_t put_seq;      /* seq of the last image handed to the renderer */
+  SDL_Rect unshown;      /* Union of dirty regions since the last take */
+  atomic_uint taken_seq; /* seq of the last image the renderer took */
+
+  /* Render -> network: frames shown this second, reported in ACKs */
+  atomic_uint shown;
+  atomic_uint recovered;
+  /* Network -> render: streamer clock minus ours */
+  _Atomic int64_t clock_offset_us;
+  atomic_int clock_synced;
+
+  struct viewer_metrics metrics;
+
+#ifdef HAVE_AUDIO
+  struct audio_player *audio_player;
+#endif
+};
+
+static void register_metrics(struct viewer_metrics *m) {
+  m->frames_received = metrics_counter("wlcast_view_frames_received_total",
+                                       "Frames fully reassembled");
+  m->bytes_received = metrics_counter("wlcast_view_bytes_received_total",
+                                      "Payload bytes of reassembled frames");
+  m->fec_recovered = metrics_counter("wlcast_view_fec_recovered_total",
+                                     "Frames completed with FEC-rebuilt chunks");
+  m->decode_ms = metrics_histogram("wlcast_view_decode_ms", "JPEG decode time per frame",
+                                   decode_buckets_ms,
+                                   (int)(sizeof(decode_buckets_ms) / sizeof(decode_buckets_ms[0])));
+  m->decode_failures = metrics_counter("wlcast_view_decode_failures_total",
+                                       "Frames that failed to decode");
+  m->frames_shown = metrics_counter("wlcast_view_frames_shown_total", "Frames presented");
+  m->fps = metrics_gauge("wlcast_view_fps", "Frames presented in the last second");
+  m->latency_ms = metrics_histogram("wlcast_view_latency_ms",
+                                    "Capture on the streamer until presented here",
+                                    latency_buckets_ms,
+                                    (int)(sizeof(latency_buckets_ms) /
+                                          sizeof(latency_buckets_ms[0])));
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void stop_viewer(struct viewer *v, int failed) {
+  if (failed) {
+    atomic_store(&v->failed, 1);
+  }
+  atomic_store(&v->running, 0);
+  SDL_Event quit = {.type = SDL_QUIT};
+  SDL_PushEvent(&quit);
+}
+
+/* Hand a frame from the frames handoff back, to the merge buffers or the
+ * receiver. Safe from any thread. */
+static void release_frame(struct viewer *v, const struct frame_buffer *frame) {
+  for (int i = 0; i < MERGE_COUNT; ++i) {
+    if (frame->data && frame->data == v->merged[i].data) {
+      atomic_store_explicit(&v->merged[i].in_use, 0, memory_order_release);
+      return;
+    }
+  }
+  udp_receiver_release(v->receiver, frame);
+}
+
+static int read_tile_header(const struct frame_buffer *frame,
+                            struct wlcast_tile_frame_header *fh) {
+  if (frame->size < sizeof(*fh)) {
+    return -1;
+  }
+  memcpy(fh, frame->data, sizeof(*fh));
+  return ntohl(fh->magic) == WLCAST_TILE_MAGIC ? 0 : -1;
+}
+
+/* Walk a tiled payload: returns the tile at *offset and advances past it,
+ * or NULL at the end or on a malformed tile */
+static const uint8_t *next_tile(const struct frame_buffer *frame,
+                                size_t *offset, struct wlcast_tile_header *th) {
+  if (frame->size - *offset < sizeof(*th)) {
+    return NULL;
+  }
+  const uint8_t *tile = frame->data + *offset;
+  memcpy(th, tile, sizeof(*th));
+  size_t jpeg_size = ntohl(th->jpeg_size);
+  if (jpeg_size > frame->size - *offset - sizeof(*th)) {
+    return NULL;
+  }
+  *offset += sizeof(*th) + jpeg_size;
+  return tile;
+}
+
+/* Merge tiled frame older, which the decoder has not taken, into newer:
+ * older's tiles that newer does not replace go in front of newer's, so no
+ * tile update is lost. Returns 1 with *out set to the merged frame (both
+ * inputs are left to the caller), 0 if newer replaces older anyway (not
+ * tiled, a keyframe, another grid), -1 if merging failed. */
+static int merge_tiles(struct viewer *v, const struct frame_buffer *older,
+                       const struct frame_buffer *newer,
+                       struct frame_buffer *out) {
+  struct wlcast_tile_frame_header ofh;
+  struct wlcast_tile_frame_header nfh;
+  if (read_tile_header(older, &ofh) != 0 ||
+      read_tile_header(newer, &nfh) != 0 ||
+      (ntohs(nfh.flags) & WLCAST_TILE_FLAG_KEYFRAME) ||
+      ofh.frame_width != nfh.frame_width ||
+      ofh.frame_height != nfh.frame_height ||
+      ofh.tile_size != nfh.tile_size || nfh.tile_size == 0) {
+    return 0;
+  }
+
+  size_t tile_size = ntohs(nfh.tile_size);
+  size_t cols = (ntohs(nfh.frame_width) + tile_size - 1) / tile_size;
+  size_t rows = (ntohs(nfh.frame_height) + tile_size - 1) / tile_size;
+  if (cols * rows > v->covered_capacity) {
+    uint8_t *covered = realloc(v->covered, cols * rows);
+    if (!covered) {
+      return -1;
+    }
+    v->covered = covered;
+    v->covered_capacity = cols * rows;
+  }
+  memset(v->covered, 0, cols * rows);
+
+  struct wlcast_tile_header th;
+  size_t offset = sizeof(nfh);
+  for (uint16_t i = 0; i < ntohs(nfh.tile_count); ++i) {
+    if (!next_tile(newer, &offset, &th)) {
+      break;
+    }
+    size_t col = ntohs(th.x) / tile_size;
+    size_t row = ntohs(th.y) / tile_size;
+    if (col < cols && row < rows) {
+      v->covered[row * cols + col] = 1;
+    }
+  }
+
+  /* Older tiles newer keeps; both cover at most every cell once, so the
+   * count still fits */
+  size_t size = newer->size;
+  unsigned int count = ntohs(nfh.tile_count);
+  offset = sizeof(ofh);
+  for (uint16_t i = 0; i < ntohs(ofh.tile_count); ++i) {
+    size_t start = offset;
+    if (!next_tile(older, &offset, &th)) {
+      break;
+    }
+    size_t col = ntohs(th.x) / tile_size;
+    size_t row = ntohs(th.y) / tile_size;
+    if (col < cols && row < rows && !v->covered[row * cols + col]) {
+      size += offset - start;
+      count++;
+    }
+  }
+  if (count > UINT16_MAX) {
+    return -1;
+  }
+
+  /* At most one merge buffer is being decoded and one is waiting (older),
+   * so one is always free */
+  struct merge_buffer *buf = NULL;
+  for (int i = 0; i < MERGE_COUNT && !buf; ++i) {
+    if (!atomic_load_explicit(&v->merged[i].in_use, memory_order_acquire)) {
+      buf = &v->merged[i];
+    }
+  }
+  if (!buf) {
+    return -1;
+  }
+  if (size > buf->capacity) {
+    uint8_t *data = realloc(buf->data, size);
+    if (!data) {
+      return -1;
+    }
+    buf->data = data;
+    buf->capacity = size;
+  }
+
+  nfh.tile_count = htons((uint16_t)count);
+  memcpy(buf->data, &nfh, sizeof(nfh));
+  size_t pos = sizeof(nfh);
+  offset = sizeof(ofh);
+  for (uint16_t i = 0; i < ntohs(ofh.tile_count); ++i) {
+    size_t start = offset;
+    const uint8_t *tile = next_tile(older, &offset, &th);
+    if (!tile) {
+      break;
+    }
+    size_t col = ntohs(th.x) / tile_size;
+    size_t row = ntohs(th.y) / tile_size;
+    if (col < cols && row < rows && !v->covered[row * cols + col]) {
+      memcpy(buf->data + pos, tile, offset - start);
+      pos += offset - start;
+    }
+  }
+  memcpy(buf->data + pos, newer->data + sizeof(nfh),
+         newer->size - sizeof(nfh));
+
+  atomic_store(&buf->in_use, 1);
+  *out = *newer;
+  out->data = buf->data;
+  out->size = size;
+  return 1;
+}
+
+/* Queue a reassembled frame for the decoder. A frame it has not taken yet
+ * is replaced, or merged with the new one if that is a tile update. */
+static void queue_frame(struct viewer *v, const struct frame_buffer *frame) {
+  struct frame_buffer pending;
+  struct frame_buffer merged;
+  const struct frame_buffer *put = frame;
+  int merge = 0;
+  if (handoff_take(&v->frames, &pending)) {
+    merge = merge_tiles(v, &pending, frame, &merged);
+    if (merge < 0) {
+      fprintf(stderr, "Failed to merge tiled frames, dropping %u\n",
+              pending.frame_id);
+    }
+    if (merge > 0) {
+      put = &merged;
+    }
+    release_frame(v, &pending);
+  }
+
+  struct frame_buffer replaced;
+  if (handoff_put(&v->frames, put, &replaced)) {
+    release_frame(v, &replaced);
+  }
+  if (merge > 0) {
+    release_frame(v, frame);
+  }
+}
+
+static void *network_thread(void *arg) {
+  struct viewer *v = arg;
+
+  while (atomic_load(&v->running)) {
+    if (udp_receiver_wait(v->receiver, NETWORK_WAIT_MS) < 0) {
+      fprintf(stderr, "UDP receive error\n");
+      stop_viewer(v, 1);
+      break;
+    }
+
+    struct frame_buffer frame;
+    int got;
+    trace_begin("receive");
+    while ((got = udp_receiver_poll(v->receiver, &frame)) > 0) {
+      trace_instant("frame_complete", (int64_t)frame.frame_id);
+      metric_inc(v->metrics.frames_received);
+      metric_add(v->metrics.bytes_received, frame.size);
+      /* ACK on arrival: every frame is decoded, merged or superseded, and
+       * the RTT should not include decoding or vsync */
+      udp_receiver_send_ack(v->receiver, frame.frame_id,
+                            atomic_load(&v->shown));
+      queue_frame(v, &frame);
+    }
+    trace_end("receive");
+    if (got < 0) {
+      fprintf(stderr, "UDP receive error\n");
+      stop_viewer(v, 1);
+      break;
+    }
+
+#ifdef HAVE_AUDIO
+    /* Process any pending audio packets */
+    if (v->audio_player) {
+      struct audio_packet audio;
+      while (udp_receiver_poll_audio(v->receiver, &audio)) {
+        audio_player_process_packet(v->audio_player, audio.data, audio.size);
+      }
+    }
+#endif
+
+    int64_t offset;
+    if (udp_receiver_clock_offset(v->receiver, &offset)) {
+      atomic_store(&v->clock_offset_us, offset);
+      atomic_store(&v->clock_synced, 1);
+    }
+
+    uint32_t recovered = udp_receiver_take_recovered(v->receiver);
+    atomic_fetch_add(&v->recovered, recovered);
+    metric_add(v->metrics.fec_recovered, recovered);
+  }
+  return NULL;
+}
+
+static void rect_union(SDL_Rect *acc, const SDL_Rect *r) {
+  if (r->w <= 0 || r->h <= 0) {
+    return;
+  }
+  if (acc->w <= 0 || acc->h <= 0) {
+    *acc = *r;
+    return;
+  }
+  SDL_UnionRect(acc, r, acc);
+}
+
+/* Pick a free image to compose into. Tile updates prefer the latest image
+ * so they can patch it in place; full frames avoid it so a failed decode
+ * leaves it intact. */
+static struct image *acquire_image(struct viewer *v, int patch) {
+  struct image *found = NULL;
+  for (int i = 0; i < IMAGE_COUNT; ++i) {
+    struct image *img = &v->pool[i];
+    if (atomic_load_explicit(&img->in_use, memory_order_acquire)) {
+      continue;
+    }
+    if (img == v->latest) {
+      if (patch) {
+        found = img;
+        break;
+      }
+      continue;
+    }
+    if (!found) {
+      found = img;
+    }
+  }
+  if (found) {
+    atomic_store_explicit(&found->in_use, 1, memory_order_relaxed);
+  }
+  return found;
+}
+
+/* Take a free locked texture of the given size and format */
+static struct image *acquire_direct(struct viewer *v, enum image_format format,
+                                    int width, int height) {
+  for (int i = 0; i < DIRECT_COUNT; ++i) {
+    struct image *img = &v->direct[i];
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&img->in_use, &expected, 1)) {
+      continue;
+    }
+    if (img->format == format && img->width == width &&
+        img->height == height) {
+      return img;
+    }
+    atomic_store_explicit(&img->in_use, 0, memory_order_release);
+  }
+  return NULL;
+}
+
+static int ensure_image(struct image *img, enum image_format format,
+                        int width, int height) {
+  size_t w = (size_t)width;
+  size_t h = (size_t)height;
+  size_t cw = (w + 1) / 2;
+  size_t ch = (h + 1) / 2;
+  size_t needed = format == IMAGE_I420 ? w * h + 2 * cw * ch : w * h * 4u;
+  if (needed > img->capacity) {
+    uint8_t *pixels = realloc(img->pixels, needed);
+    if (!pixels) {
+      fprintf(stderr, "realloc image failed\n");
+      return -1;
+    }
+    img->pixels = pixels;
+    img->capacity = needed;
+  }
+  img->format = format;
+  img->width = width;
+  img->height = height;
+  img->planes[0] = img->pixels;
+  if (format == IMAGE_I420) {
+    img->strides[0] = width;
+    img->strides[1] = (int)cw;
+    img->strides[2] = (int)cw;
+    img->planes[1] = img->pixels + w * h;
+    img->planes[2] = img->planes[1] + cw * ch;
+  } else {
+    img->strides[0] = width * 4;
+    img->strides[1] = 0;
+    img->strides[2] = 0;
+    img->planes[1] = NULL;
+    img->planes[2] = NULL;
+  }
+  return 0;
+}
+
+static size_t image_size(const struct image *img) {
+  size_t h = (size_t)img->height;
+  if (img->format == IMAGE_I420) {
+    return (size_t)img->strides[0] * h +
+           2 * (size_t)img->strides[1] * ((h + 1) / 2);
+  }
+  return (size_t)img->strides[0] * h;
+}
+
+/* Address of pixel (x, y) in plane; x and y must be even for chroma */
+static uint8_t *image_at(const struct image *img, int plane, int x, int y) {
+  if (img->format == IMAGE_BGRX) {
+    return img->planes[0] + (size_t)y * (size_t)img->strides[0] +
+           (size_t)x * 4u;
+  }
+  int shift = plane > 0;
+  return img->planes[plane] +
+         (size_t)(y >> shift) * (size_t)img->strides[plane] +
+         (size_t)(x >> shift);
+}
+
+static enum image_format format_for(const struct viewer *v,
+                                    const struct jpeg_info *info) {
+  return v->yuv && info->yuv420 ? IMAGE_I420 : IMAGE_BGRX;
+}
+
+/* Decode a JPEG into (x, y) of img in the image's format */
+static int decode_into_image(struct viewer *v, struct image *img,
+                             const uint8_t *data, size_t size, int x, int y,
+                             int width, int height) {
+  if (img->format == IMAGE_BGRX) {
+    return jpeg_decode_into(&v->decoder, data, size, image_at(img, 0, x, y),
+                            width, img->strides[0], height);
+  }
+  uint8_t *const planes[3] = {image_at(img, 0, x, y), image_at(img, 1, x, y),
+                              image_at(img, 2, x, y)};
+  return jpeg_decode_yuv_into(&v->decoder, data, size, planes, img->strides,
+                              width, height);
+}
+
+static struct image *decode_jpeg(struct viewer *v, const uint8_t *data,
+                                 size_t size) {
+  struct jpeg_info info;
+  if (jpeg_decode_header(&v->decoder, data, size, &info) != 0) {
+    return NULL;
+  }
+
+  enum image_format format = format_for(v, &info);
+  struct image *img = NULL;
+  if (atomic_load(&v->direct_mode)) {
+    img = acquire_direct(v, format, info.width, info.height);
+  }
+  if (!img) {
+    img = acquire_image(v, 0);
+    if (img && ensure_image(img, format, info.width, info.height) != 0) {
+      atomic_store(&img->in_use, 0);
+      img = NULL;
+    }
+  }
+  if (!img) {
+    return NULL;
+  }
+  if (decode_into_image(v, img, data, size, 0, 0, info.width, info.height) !=
+          0) {
+    atomic_store(&img->in_use, 0);
+    return NULL;
+  }
+  img->dirty = (SDL_Rect){0, 0, info.width, info.height};
+  img->whole = 1;
+  return img;
+}
+
+/* Format for a new tile canvas, going by its first tile. The streamer
+ * encodes every tile alike, so the rest follow. */
+static enum image_format tile_canvas_format(struct viewer *v,
+                                            const uint8_t *data, size_t size) {
+  struct wlcast_tile_header th;
+  struct jpeg_info info;
+  size_t offset = sizeof(struct wlcast_tile_frame_header);
+  if (!v->yuv || size - offset < sizeof(th)) {
+    return IMAGE_BGRX;
+  }
+  memcpy(&th, data + offset, sizeof(th));
+  offset += sizeof(th);
+  uint32_t jpeg_size = ntohl(th.jpeg_size);
+  if (jpeg_size > size - offset ||
+      jpeg_decode_header(&v->decoder, data + offset, jpeg_size, &info) != 0) {
+    return IMAGE_BGRX;
+  }
+  return format_for(v, &info);
+}
+
+/* Compose a WLCAST_TILE_MAGIC payload on top of the latest image. Tiles
+ * decode straight into place; only the changed tiles end up dirty. */
+static struct image *decode_tiles(struct viewer *v, const uint8_t *data,
+                                  size_t size) {
+  struct wlcast_tile_frame_header fh;
+  if (size < sizeof(fh)) {
+    return NULL;
+  }
+  memcpy(&fh, data, sizeof(fh));
+  int frame_w = ntohs(fh.frame_width);
+  int frame_h = ntohs(fh.frame_height);
+  uint16_t count = ntohs(fh.tile_count);
+  if (frame_w <= 0 || frame_h <= 0 || frame_w > MAX_FRAME_DIM ||
+      frame_h > MAX_FRAME_DIM) {
+    return NULL;
+  }
+
+  struct image *img = acquire_image(v, 1);
+  if (!img) {
+    return NULL;
+  }
+  struct image *base = v->latest;
+  int same_size = base && base->width == frame_w && base->height == frame_h;
+  enum image_format format =
+      same_size ? base->format : tile_canvas_format(v, data, size);
+  if (ensure_image(img, format, frame_w, frame_h) != 0) {
+    atomic_store(&img->in_use, 0);
+    return NULL;
+  }
+  if (!same_size) {
+    memset(img->pixels, 0, image_size(img));
+    if (format == IMAGE_I420) {
+      /* Black, not green */
+      memset(img->planes[1], 128, image_size(img) - (size_t)(img->planes[1] -
+                                                               img->pixels));
+    }
+    img->dirty = (SDL_Rect){0, 0, frame_w, frame_h};
+  } else {
+    if (base != img) {
+      memcpy(img->pixels, base->pixels, image_size(img));
+    }
+    img->dirty = (SDL_Rect){0, 0, 0, 0};
+  }
+  img->whole = 0;
+
+  size_t offset = sizeof(fh);
+  for (uint16_t i = 0; i < count; ++i) {
+    struct wlcast_tile_header th;
+    if (size - offset < sizeof(th)) {
+      break;
+    }
+    memcpy(&th, data + offset, sizeof(th));
+    offset += sizeof(th);
+
+    uint32_t jpeg_size = ntohl(th.jpeg_size);
+    if (jpeg_size > size - offset) {
+      break;
+    }
+
+    SDL_Rect rect = {ntohs(th.x), ntohs(th.y), ntohs(th.width),
+                     ntohs(th.height)};
+    struct jpeg_info info;
+    /* I420 tiles must be 4:2:0 and start on a chroma sample */
+    if (jpeg_decode_header(&v->decoder, data + offset, jpeg_size, &info) == 0 &&
+        info.width == rect.w && info.height == rect.h &&
+        rect.x + rect.w <= frame_w && rect.y + rect.h <= frame_h &&
+        (format == IMAGE_BGRX ||
+         (info.yuv420 && !(rect.x & 1) && !(rect.y & 1))) &&
+        decode_into_image(v, img, data + offset, jpeg_size, rect.x, rect.y,
+                          rect.w, rect.h) == 0) {
+      rect_union(&img->dirty, &rect);
+    }
+    offset += jpeg_size;
+  }
+
+  return img;
+}
+
+/* Hand an image to the renderer, replacing one it has not taken yet */
+static void publish_image(struct viewer *v, struct image *img) {
+  /* A replaced image was never shown, so its changes carry over */
+  if (atomic_load(&v->taken_seq) == v->put_seq) {
+    v->unshown = (SDL_Rect){0, 0, 0, 0};
+  }
+  rect_union(&v->unshown, &img->dirty);
+  SDL_Rect bounds = {0, 0, img->width, img->height};
+  SDL_IntersectRect(&v->unshown, &bounds, &img->dirty);
+
+  img->seq = ++v->put_seq;
+  /* Locked texture memory is write-only, so tiles cannot build on it */
+  v->latest = img->texture ? NULL : img;
+
+  struct image *replaced;
+  if (handoff_put(&v->images, &img, &replaced)) {
+    atomic_store_explicit(&replaced->in_use, 0, memory_order_release);
+  }
+
+  SDL_Event event = {.type = v->image_event};
+  SDL_PushEvent(&event);
+}
+
+static void *decode_thread(void *arg) {
+  struct viewer *v = arg;
+
+  while (atomic_load(&v->running)) {
+    struct frame_buffer frame;
+    if (!handoff_wait(&v->frames, DECODE_WAIT_MS) ||
+        !handoff_take(&v->frames, &frame)) {
+      continue;
+    }
+
+    uint32_t magic = 0;
+    if (frame.size >= sizeof(magic)) {
+      memcpy(&magic, frame.data, sizeof(magic));
+    }
+
+    struct image *img;
+    uint64_t decode_start_us = now_us();
+    trace_begin("decode");
+    if (ntohl(magic) == WLCAST_TILE_MAGIC) {
+      /* Partial update: only changed tiles, the rest stays as it was */
+      img = decode_tiles(v, frame.data, frame.size);
+    } else {
+      img = decode_jpeg(v, frame.data, frame.size);
+    }
+    trace_end("decode");
+    metric_observe(v->metrics.decode_ms,
+                   (double)(now_us() - decode_start_us) / 1000.0);
+    release_frame(v, &frame);
+
+    if (img) {
+      img->timing = frame.timing;
+      img->complete_us = frame.complete_us;
+      img->decoded_us = now_us();
+      publish_image(v, img);
+    } else {
+      metric_inc(v->metrics.decode_failures);
+    }
+  }
+  return NULL;
+}
+
+static SDL_Texture *create_texture(SDL_Renderer *renderer,
+                                   enum image_format format, int width,
+                                   int height) {
+  /* TJPF_BGRX = B,G,R,X in memory (bytes 0,1,2,3)
+   * SDL_PIXELFORMAT_XRGB8888 on little-endian = B,G,R,X in memory
+   * These match! (SDL names are bit-position, not byte order) */
+  Uint32 sdl_format = format == IMAGE_I420 ? SDL_PIXELFORMAT_IYUV
+                                           : SDL_PIXELFORMAT_XRGB8888;
+  SDL_Texture *texture = SDL_CreateTexture(
+      renderer, sdl_format, SDL_TEXTUREACCESS_STREAMING, width, height);
+  if (!texture) {
+    fprintf(stderr, "SDL_CreateTexture failed: %s\n", SDL_GetError());
+  }
+  return texture;
+}
+
+struct texture_state {
+  SDL_Texture *texture;
+  enum image_format format;
+  int width;
+  int height;
+};
+
+/* (Re)create the streaming texture when the frame size or format changes.
+ * Returns 1 if it was recreated and needs a full upload. */
+static int ensure_texture(SDL_Renderer *renderer, struct texture_state *tex,
+                          const struct image *img) {
+  if (tex->texture && img->width == tex->width &&
+      img->height == tex->height && img->format == tex->format) {
+    return 0;
+  }
+  if (tex->texture) {
+    SDL_DestroyTexture(tex->texture);
+  }
+  tex->texture = create_texture(renderer, img->format, img->width, img->height);
+  tex->format = img->format;
+  tex->width = img->width;
+  tex->height = img->height;
+  return 1;
+}
+
+/* Renderer side of the direct images */
+struct direct_state {
+  enum image_format format; /* What the stream currently decodes to */
+  int width;
+  int height;
+  int owned[DIRECT_COUNT]; /* Held by the renderer, not lent to decode */
+};
+
+/* Lock a direct image's texture and point its planes into it */
+static int lock_direct(struct image *img) {
+  void *pixels;
+  int pitch;
+  if (SDL_LockTexture(img->texture, NULL, &pixels, &pitch) != 0) {
+    fprintf(stderr, "SDL_LockTexture failed: %s\n", SDL_GetError());
+    return -1;
+  }
+  img->planes[0] = pixels;
+  img->strides[0] = pitch;
+  if (img->format == IMAGE_I420) {
+    /* SDL puts U and V right after Y, at half the pitch */
+    size_t h = (size_t)img->height;
+    img->strides[1] = (pitch + 1) / 2;
+    img->strides[2] = img->strides[1];
+    img->planes[1] = img->planes[0] + (size_t)pitch * h;
+    img->planes[2] = img->planes[1] + (size_t)img->strides[1] * ((h + 1) / 2);
+  }
+  return 0;
+}
+
+/* Lend every direct image the renderer holds back to the decoder, locked
+ * and matching the stream. Free ones of a stale size are reclaimed and
+ * recreated first. */
+static void recycle_direct(SDL_Renderer *renderer, struct viewer *v,
+                           struct direct_state *ds) {
+  if (ds->width == 0) {
+    return;
+  }
+  for (int i = 0; i < DIRECT_COUNT; ++i) {
+    struct image *img = &v->direct[i];
+    int matches = img->texture && img->format == ds->format &&
+                  img->width == ds->width && img->height == ds->height;
+    if (!ds->owned[i]) {
+      int expected = 0;
+      if (matches ||
+          !atomic_compare_exchange_strong(&img->in_use, &expected, 1)) {
+        continue;
+      }
+      ds->owned[i] = 1;
+    }
+
+    if (!matches) {
+      if (img->texture) {
+        SDL_DestroyTexture(img->texture);
+      }
+      img->texture = create_texture(renderer, ds->format, ds->width,
+                                    ds->height);
+      img->format = ds->format;
+      img->width = ds->width;
+      img->height = ds->height;
+      img->whole = 1;
+    }
+    if (!img->texture || lock_direct(img) != 0) {
+      fprintf(stderr, "Falling back to texture uploads\n");
+      atomic_store(&v->direct_mode, 0);
+      return;
+    }
+    ds->owned[i] = 0;
+    atomic_store_explicit(&img->in_use, 0, memory_order_release);
+  }
+}
+
+/* Copy the rect of img into the texture */
+static void upload_image(struct texture_state *tex, const struct image *img,
+                         SDL_Rect rect) {
+  if (img->format == IMAGE_BGRX) {
+    SDL_UpdateTexture(tex->texture, &rect, image_at(img, 0, rect.x, rect.y),
+                      img->strides[0]);
+    return;
+  }
+
+  /* Chroma covers 2x2 pixels, so widen the rect to even edges */
+  int x1 = rect.x + rect.w;
+  int y1 = rect.y + rect.h;
+  rect.x &= ~1;
+  rect.y &= ~1;
+  rect.w = SDL_min(x1 + (x1 & 1), img->width) - rect.x;
+  rect.h = SDL_min(y1 + (y1 & 1), img->height) - rect.y;
+  SDL_UpdateYUVTexture(tex->texture, &rect, image_at(img, 0, rect.x, rect.y),
+                       img->strides[0], image_at(img, 1, rect.x, rect.y),
+                       img->strides[1], image_at(img, 2, rect.x, rect.y),
+                       img->strides[2]);
+}
+
+/* Streaming textures of the OpenGL renderers lock a CPU shadow copy that is
+ * uploaded on unlock, no better than SDL_UpdateTexture from our own image.
+ * The software renderer hands out the surface itself, the Direct3D and
+ * Metal ones mapped staging memory. */
+static int renderer_locks_directly(SDL_Renderer *renderer) {
+  SDL_RendererInfo info;
+  if (SDL_GetRendererInfo(renderer, &info) != 0) {
+    return 0;
+  }
+  return strncmp(info.name, "opengl", 6) != 0;
+}
+
+/* Whether the renderer takes IYUV textures natively */
+static int renderer_has_iyuv(SDL_Renderer *renderer) {
+  SDL_RendererInfo info;
+  if (SDL_GetRendererInfo(renderer, &info) != 0) {
+    return 0;
+  }
+  for (Uint32 i = 0; i < info.num_texture_formats; ++i) {
+    if (info.texture_formats[i] == SDL_PIXELFORMAT_IYUV) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Account for a frame presented at present_us, once the streamer's clock
+ * is known. The parts add up to the total by construction; an offset
+ * error shows up in network. */
+static void record_latency(struct viewer *v, struct latency_window *win,
+                           const struct frame_timing *t, uint64_t complete_us,
+                           uint64_t decoded_us, uint64_t present_us) {
+  if (!t->valid || !atomic_load(&v->clock_synced)) {
+    return;
+  }
+  int64_t offset = atomic_load(&v->clock_offset_us);
+  int64_t parts[LATENCY_PARTS];
+  parts[LATENCY_CAPTURE] = t->capture_us;
+  parts[LATENCY_CONVERT] = t->convert_us;
+  parts[LATENCY_ENCODE] = t->encode_us;
+  parts[LATENCY_QUEUE] = t->queue_us;
+  int64_t sent = (int64_t)t->capture_time_us - offset + t->capture_us +
+                 t->convert_us + t->encode_us + t->queue_us;
+  parts[LATENCY_NETWORK] = (int64_t)complete_us - sent;
+  parts[LATENCY_DECODE] = (int64_t)(decoded_us - complete_us);
+  parts[LATENCY_DISPLAY] = (int64_t)(present_us - decoded_us);
+  int64_t total = (int64_t)present_us - ((int64_t)t->capture_time_us - offset);
+
+  for (int i = 0; i < LATENCY_PARTS; ++i) {
+    win->parts[i] += parts[i];
+  }
+  win->total += total;
+  if (win->count == 0 || total > win->max) {
+    win->max = total;
+  }
+  win->count++;
+  metric_observe(v->metrics.latency_ms, (double)total / 1000.0);
+  trace_counter("latency_ms", total / 1000);
+}
+
+static void print_latency(const struct latency_window *win) {
+  fprintf(stderr, "latency=%.1fms max=%.1fms [", (double)win->total / win->count / 1000.0,
+          (double)win->max / 1000.0);
+  for (int i = 0; i < LATENCY_PARTS; ++i) {
+    fprintf(stderr, "%s%s=%.1f", i ? " " : "", latency_part_names[i],
+            (double)win->parts[i] / win->count / 1000.0);
+  }
+  fprintf(stderr, "]\n");
+}
+
 static void print_usage(const char *prog) {
-  fprintf(stderr, "Usage: %s [--port <port>]\n", prog);
+  fprintf(stderr,
+          "Usage: %s [--port <port>] [--yuv] [--trace <file>] "
+          "[--metrics <file>] [--latency]\n",
+          prog);
+  fprintf(stderr, "  --yuv           Decode to YUV planes and let the GPU convert colour\n");
+  fprintf(stderr, "  --trace <file>  Record timing spans (Chrome trace JSON if <file> ends\n"
+                  "                  in .json, else binary)\n");
+  fprintf(stderr, "  --latency       Print capture-to-present latency and its breakdown\n"
+                  "                  every second\n");
+  fprintf(stderr, "  --metrics <file>  Export Prometheus metrics: rewrite <file> every second,\n"
+                  "                  or serve them on a UNIX socket if it ends in .sock\n");
 }
 
 int main(int argc, char **argv) {
   uint16_t port = 7723;
+  int yuv = 0;
+  const char *trace_path = NULL;
+  const char *metrics_path = NULL;
+  int print_latency_stats = 0;
 
   for (int i = 1; i < argc; ++i) {
     if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
       port = (uint16_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--yuv") == 0) {
+      yuv = 1;
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_path = argv[++i];
+    } else if (strcmp(argv[i], "--latency") == 0) {
+      print_latency_stats = 1;
     } else if (strcmp(argv[i], "--help") == 0) {
       print_usage(argv[0]);
       return 0;
@@ -31,15 +1000,35 @@ int main(int argc, char **argv) {
     }
   }
 
-  struct udp_receiver *receiver = NULL;
-  if (udp_receiver_init(&receiver, port) != 0) {
+  static struct viewer viewer;
+  struct viewer *v = &viewer;
+  atomic_init(&v->running, 1);
+  atomic_init(&v->failed, 0);
+  atomic_init(&v->taken_seq, 0u);
+  atomic_init(&v->shown, 0u);
+  atomic_init(&v->recovered, 0u);
+  atomic_init(&v->clock_offset_us, 0);
+  atomic_init(&v->clock_synced, 0);
+  register_metrics(&v->metrics);
+  for (int i = 0; i < IMAGE_COUNT; ++i) {
+    atomic_init(&v->pool[i].in_use, 0);
+  }
+  for (int i = 0; i < MERGE_COUNT; ++i) {
+    atomic_init(&v->merged[i].in_use, 0);
+  }
+  /* Direct images start out held by the renderer, without a texture */
+  for (int i = 0; i < DIRECT_COUNT; ++i) {
+    atomic_init(&v->direct[i].in_use, 1);
+  }
+
+  if (udp_receiver_init(&v->receiver, port) != 0) {
     fprintf(stderr, "Failed to bind UDP receiver\n");
     return 1;
   }
 
   if (SDL_Init(SDL_INIT_VIDEO) != 0) {
     fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
-    udp_receiver_destroy(receiver);
+    udp_receiver_destroy(v->receiver);
     return 1;
   }
 
@@ -49,7 +1038,7 @@ int main(int argc, char **argv) {
   if (!window) {
     fprintf(stderr, "SDL_CreateWindow failed: %s\n", SDL_GetError());
     SDL_Quit();
-    udp_receiver_destroy(receiver);
+    udp_receiver_destroy(v->receiver);
     return 1;
   }
   SDL_RaiseWindow(window);
@@ -61,124 +1050,221 @@ int main(int argc, char **argv) {
     fprintf(stderr, "SDL_CreateRenderer failed: %s\n", SDL_GetError());
     SDL_DestroyWindow(window);
     SDL_Quit();
-    udp_receiver_destroy(receiver);
+    udp_receiver_destroy(v->receiver);
     return 1;
   }
 
-  struct jpeg_decoder decoder;
-  if (jpeg_decoder_init(&decoder) != 0) {
+  if (jpeg_decoder_init(&v->decoder) != 0) {
     fprintf(stderr, "Failed to init JPEG decoder\n");
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
-    udp_receiver_destroy(receiver);
+    udp_receiver_destroy(v->receiver);
+    return 1;
+  }
+
+  if (yuv && !renderer_has_iyuv(renderer)) {
+    fprintf(stderr, "Renderer has no IYUV textures, decoding to RGB\n");
+    yuv = 0;
+  }
+  v->yuv = yuv;
+  atomic_init(&v->direct_mode, renderer_locks_directly(renderer));
+
+  v->image_event = SDL_RegisterEvents(1);
+  if (v->image_event == (Uint32)-1 ||
+      handoff_init(&v->frames, sizeof(struct frame_buffer)) != 0 ||
+      handoff_init(&v->images, sizeof(struct image *)) != 0) {
+    fprintf(stderr, "Failed to set up viewer threads\n");
+    handoff_destroy(&v->frames);
+    jpeg_decoder_destroy(&v->decoder);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    udp_receiver_destroy(v->receiver);
     return 1;
   }
 
 #ifdef HAVE_AUDIO
-  struct audio_player *audio_player = NULL;
-  if (audio_player_init(&audio_player) != 0) {
+  if (audio_player_init(&v->audio_player) != 0) {
     fprintf(stderr, "Warning: Failed to init audio player, continuing without audio\n");
   }
 #endif
 
-  SDL_Texture *texture = NULL;
-  int tex_w = 0;
-  int tex_h = 0;
+  if (trace_path && trace_start(trace_path) == 0) {
+    fprintf(stderr, "Tracing to %s\n", trace_path);
+  }
+  if (metrics_path && metrics_start(metrics_path) == 0) {
+    fprintf(stderr, "Exporting metrics to %s\n", metrics_path);
+  }
+
+  pthread_t net_thread;
+  pthread_t dec_thread;
+  int net_started = pthread_create(&net_thread, NULL, network_thread, v) == 0;
+  int dec_started = pthread_create(&dec_thread, NULL, decode_thread, v) == 0;
+  if (net_started) {
+    pthread_setname_np(net_thread, "network");
+  }
+  if (dec_started) {
+    pthread_setname_np(dec_thread, "decode");
+  }
+  if (!net_started || !dec_started) {
+    fprintf(stderr, "Failed to start viewer threads\n");
+    stop_viewer(v, 1);
+  }
+
+  struct texture_state tex = {0};
+  struct direct_state direct = {0};
+  for (int i = 0; i < DIRECT_COUNT; ++i) {
+    direct.owned[i] = 1;
+  }
+  /* What is on screen */
+  enum image_format view_format = IMAGE_BGRX;
+  int view_w = 0;
+  int view_h = 0;
 
   uint32_t last_fps_tick = SDL_GetTicks();
   unsigned int fps_counter = 0;
+  struct latency_window latency = {0};
 
-  int running = 1;
-  while (running) {
+  while (atomic_load(&v->running)) {
     SDL_Event event;
-    while (SDL_PollEvent(&event)) {
-      if (event.type == SDL_QUIT) {
-        running = 0;
-      }
+    if (SDL_WaitEventTimeout(&event, RENDER_WAIT_MS)) {
+      do {
+        if (event.type == SDL_QUIT) {
+          atomic_store(&v->running, 0);
+        }
+      } while (SDL_PollEvent(&event));
     }
 
-    struct frame_buffer frame;
-    int got = udp_receiver_poll(receiver, &frame);
-    if (got < 0) {
-      fprintf(stderr, "UDP receive error\n");
-      running = 0;
-      break;
-    }
+    struct image *img;
+    if (atomic_load(&v->running) && handoff_take(&v->images, &img)) {
+      atomic_store(&v->taken_seq, img->seq);
 
-    if (got > 0) {
-      struct decoded_frame decoded;
-      if (jpeg_decode_frame(&decoder, frame.data, frame.size, &decoded) == 0) {
-        if (!texture || decoded.width != tex_w || decoded.height != tex_h) {
-          if (texture) {
-            SDL_DestroyTexture(texture);
-          }
-          /* TJPF_BGRX = B,G,R,X in memory (bytes 0,1,2,3)
-           * SDL_PIXELFORMAT_XRGB8888 on little-endian = B,G,R,X in memory
-           * These match! (SDL names are bit-position, not byte order) */
-          texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_XRGB8888,
-                                      SDL_TEXTUREACCESS_STREAMING,
-                                      decoded.width, decoded.height);
-          tex_w = decoded.width;
-          tex_h = decoded.height;
-          SDL_RenderSetLogicalSize(renderer, tex_w, tex_h);
+      SDL_Texture *texture;
+      if (img->texture) {
+        /* Decoded straight into the locked texture */
+        SDL_UnlockTexture(img->texture);
+        texture = img->texture;
+        direct.owned[img - v->direct] = 1;
+      } else {
+        SDL_Rect dirty = img->dirty;
+        if (ensure_texture(renderer, &tex, img)) {
+          dirty = (SDL_Rect){0, 0, img->width, img->height};
         }
-
-        if (texture) {
-          SDL_UpdateTexture(texture, NULL, decoded.pixels, decoded.pitch);
-          SDL_RenderClear(renderer);
-          SDL_RenderCopy(renderer, texture, NULL, NULL);
-          SDL_RenderPresent(renderer);
+        if (tex.texture && dirty.w > 0 && dirty.h > 0) {
+          trace_begin("upload");
+          upload_image(&tex, img, dirty);
+          trace_end("upload");
         }
-        fps_counter++;
+        texture = tex.texture;
+      }
+      struct frame_timing timing = img->timing;
+      uint64_t complete_us = img->complete_us;
+      uint64_t decoded_us = img->decoded_us;
 
-        /* Send ACK back to streamer for network-based quality adaptation */
-        udp_receiver_send_ack(receiver, frame.frame_id, fps_counter);
+      if (img->whole &&
+          (img->format != direct.format || img->width != direct.width ||
+           img->height != direct.height)) {
+        /* Stream changed size or format, direct images follow */
+        direct.format = img->format;
+        direct.width = img->width;
+        direct.height = img->height;
+      }
+      if (img->width != view_w || img->height != view_h) {
+        SDL_RenderSetLogicalSize(renderer, img->width, img->height);
+        view_w = img->width;
+        view_h = img->height;
+      }
+      view_format = img->format;
+      if (!img->texture) {
+        atomic_store_explicit(&img->in_use, 0, memory_order_release);
       }
-    }
 
-#ifdef HAVE_AUDIO
-    /* Process any pending audio packets */
-    if (audio_player) {
-      struct audio_packet audio;
-      while (udp_receiver_poll_audio(receiver, &audio)) {
-        audio_player_process_packet(audio_player, audio.data, audio.size);
+      if (texture) {
+        trace_begin("present");
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
+        trace_end("present");
+        record_latency(v, &latency, &timing, complete_us, decoded_us, now_us());
       }
+      fps_counter++;
+      metric_inc(v->metrics.frames_shown);
+      atomic_store(&v->shown, fps_counter);
+    }
+
+    if (atomic_load(&v->direct_mode)) {
+      recycle_direct(renderer, v, &direct);
     }
-#endif
 
     uint32_t now = SDL_GetTicks();
     if (now - last_fps_tick >= 1000u) {
       char title[128];
-      if (tex_w > 0 && tex_h > 0) {
-        snprintf(title, sizeof(title), "wlcast - %dx%d @ %u fps", tex_w,
-                 tex_h, fps_counter);
+      int len;
+      if (view_w > 0 && view_h > 0) {
+        len = snprintf(title, sizeof(title), "wlcast - %dx%d @ %u fps%s",
+                       view_w, view_h, fps_counter,
+                       view_format == IMAGE_I420 ? " YUV" : "");
       } else {
-        snprintf(title, sizeof(title), "wlcast - %u fps", fps_counter);
+        len = snprintf(title, sizeof(title), "wlcast - %u fps", fps_counter);
+      }
+      uint32_t recovered = atomic_exchange(&v->recovered, 0u);
+      if (recovered > 0 && len > 0 && (size_t)len < sizeof(title)) {
+        len += snprintf(title + len, sizeof(title) - (size_t)len, " (%u FEC)",
+                        recovered);
+      }
+      if (latency.count > 0 && len > 0 && (size_t)len < sizeof(title)) {
+        snprintf(title + len, sizeof(title) - (size_t)len, " - %.0f ms",
+                 (double)latency.total / latency.count / 1000.0);
+        if (print_latency_stats) {
+          print_latency(&latency);
+        }
       }
+      memset(&latency, 0, sizeof(latency));
       SDL_SetWindowTitle(window, title);
+      metric_set(v->metrics.fps, fps_counter);
       fps_counter = 0;
       last_fps_tick = now;
     }
+  }
 
-    if (got == 0) {
-      SDL_Delay(1);  /* Only sleep when no frame received */
-    }
+  handoff_wake(&v->frames);
+  if (net_started) {
+    pthread_join(net_thread, NULL);
   }
+  if (dec_started) {
+    pthread_join(dec_thread, NULL);
+  }
+  trace_stop();
+  metrics_stop();
 
-  if (texture) {
-    SDL_DestroyTexture(texture);
+  if (tex.texture) {
+    SDL_DestroyTexture(tex.texture);
+  }
+  for (int i = 0; i < DIRECT_COUNT; ++i) {
+    if (v->direct[i].texture) {
+      SDL_DestroyTexture(v->direct[i].texture);
+    }
   }
 #ifdef HAVE_AUDIO
-  if (audio_player) {
-    audio_player_destroy(audio_player);
+  if (v->audio_player) {
+    audio_player_destroy(v->audio_player);
   }
 #endif
-  jpeg_decoder_destroy(&decoder);
+  for (int i = 0; i < IMAGE_COUNT; ++i) {
+    free(v->pool[i].pixels);
+  }
+  for (int i = 0; i < MERGE_COUNT; ++i) {
+    free(v->merged[i].data);
+  }
+  free(v->covered);
+  handoff_destroy(&v->images);
+  handoff_destroy(&v->frames);
+  jpeg_decoder_destroy(&v->decoder);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
-  udp_receiver_destroy(receiver);
+  udp_receiver_destroy(v->receiver);
 
-  return 0;
+  return atomic_load(&v->failed) ? 1 : 0;
 }
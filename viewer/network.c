@@ -1,17 +1,53 @@
+#define _GNU_SOURCE
+
 #include "network.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../common/fec.h"
+#include "../common/metrics.h"
 #include "../common/protocol.h"
 
+/* Frames assembled concurrently. Chunks of the next frame often arrive
+ * while the previous one still waits for a retransmission. */
+#define REASSEMBLY_SLOTS 4
+#define ASSEMBLY_TIMEOUT_MS 200u
+/* A frame_id this far behind the newest shown one means the streamer
+ * restarted rather than a late packet */
+#define FRAME_ID_RESTART_GAP 1024u
+/* Clock probes: how often, and how many recent answers to pick the
+ * fastest round trip from */
+#define CLOCK_PROBE_INTERVAL_MS 250u
+#define CLOCK_SAMPLES 8
+/* Reassembly buffers: one per slot plus two delivered frames (one waiting
+ * for the decoder, one being decoded) */
+#define FRAME_POOL_SIZE (REASSEMBLY_SLOTS + 2)
+
+/* Datagrams per recvmmsg call */
+#define RECV_BATCH 32
+/* Bytes following the wlcast_udp_header of the largest packet (parity) */
+#define RECV_PAYLOAD_MAX                                                       \
+  (WLCAST_FEC_HEADER_SIZE - WLCAST_UDP_HEADER_SIZE + WLCAST_UDP_CHUNK_SIZE)
+
+/* NACK timing: ask for missing chunks once the frame has stalled for
+ * NACK_IDLE_MS (or its parity or a newer frame arrived), then retry a few
+ * times */
+#define NACK_IDLE_MS 2u
+#define NACK_RETRY_MS 10u
+#define NACK_MAX_ROUNDS 3
+#define NACK_MAX_PACKETS 4 /* Per round, each naming up to 1024 chunks */
+
 /* Audio packet queue */
 #define AUDIO_QUEUE_SIZE 32
 struct audio_queue_entry {
@@ -19,22 +55,99 @@ struct audio_queue_entry {
   size_t size;
 };
 
-struct udp_receiver {
-  int fd;
+/* Frame reassembly buffer */
+struct pool_buffer {
+  uint8_t *data;
+  size_t capacity;
+  atomic_int in_use; /* Cleared by udp_receiver_release on any thread */
+};
+
+/* One frame being reassembled */
+struct reassembly_slot {
+  int active;
   uint32_t frame_id;
   uint32_t total_size;
   uint16_t chunk_count;
+  uint16_t chunk_size;
   uint16_t received_count;
-  uint8_t *data;
-  size_t data_capacity;
+  struct pool_buffer *buffer;
+  uint8_t *data;          /* buffer->data */
   uint8_t *chunk_received;
   size_t chunk_capacity;
-  int assembling;
-  int frame_ready;
   uint64_t last_update_ms;
+  /* FEC parity */
+  uint16_t fec_groups;    /* 0 until a parity packet arrives */
+  uint8_t fec_parity;
+  uint8_t *parity;        /* fec_groups * fec_parity rows of chunk_size */
+  size_t parity_capacity;
+  uint8_t *parity_received;
+  size_t parity_map_capacity;
+  int fec_used;           /* Needed recovery */
+  /* NACKs sent for this frame */
+  int nack_rounds;
+  uint64_t last_nack_ms;
+  /* Receive report */
+  uint16_t chunks_arrived; /* Excludes FEC-rebuilt chunks */
+  uint32_t bytes_arrived;  /* Every datagram of the frame, headers included */
+  uint32_t first_arrival_us;
+  uint32_t last_arrival_us;
+};
+
+/* One answered clock probe */
+struct clock_sample {
+  int64_t offset_us; /* Streamer clock minus ours */
+  uint64_t rtt_us;
+};
+
+/* Where one datagram of a recvmmsg batch was steered */
+struct recv_entry {
+  struct reassembly_slot *slot; /* Predicted frame, NULL if none */
+  uint32_t frame_id;
+  uint16_t index;               /* Predicted chunk */
+  size_t len;                   /* Payload bytes placed in the frame */
+  int hit;                      /* The datagram was the predicted chunk */
+};
+
+struct udp_receiver {
+  int fd;
+  struct reassembly_slot slots[REASSEMBLY_SLOTS];
+  struct pool_buffer pool[FRAME_POOL_SIZE];
+  /* recvmmsg batch: headers land in their own array and payloads, where
+   * the next chunk can be predicted, straight at their final offset */
+  struct wlcast_udp_header headers[RECV_BATCH];
+  struct sockaddr_in addrs[RECV_BATCH];
+  struct iovec iov[RECV_BATCH][3];
+  struct mmsghdr msgs[RECV_BATCH];
+  struct recv_entry entries[RECV_BATCH];
+  /* Kernel receive timestamps (SO_TIMESTAMPNS) and where they land */
+  union {
+    char buf[CMSG_SPACE(sizeof(struct timespec))];
+    struct cmsghdr align;
+  } control[RECV_BATCH];
+  uint32_t arrival_us[RECV_BATCH];
+  uint8_t *bounce;        /* RECV_BATCH * RECV_PAYLOAD_MAX */
+  int batch_count;
+  int batch_pos;
+  /* Last chunk stored, the basis for predicting the next ones */
+  struct reassembly_slot *last_slot;
+  uint32_t last_frame_id;
+  uint32_t last_index;
+  /* Contiguous copy of a mispredicted non-chunk packet */
+  uint8_t packet[WLCAST_FEC_HEADER_SIZE + WLCAST_UDP_CHUNK_SIZE];
+  uint32_t newest_id;     /* Newest frame delivered; older ones are dropped */
+  int have_newest;
+  uint8_t *fec_scratch;   /* FEC_MAX_PARITY rebuilt chunks */
+  uint32_t fec_recovered; /* Frames completed by FEC since last take */
+  struct metric *timeouts; /* Frames abandoned incomplete */
+  struct metric *skipped;  /* Incomplete frames overtaken by newer ones */
   /* Streamer address for sending ACKs */
   struct sockaddr_in streamer_addr;
   int streamer_known;
+  /* Clock offset estimation */
+  uint64_t last_probe_ms;
+  struct clock_sample clock_samples[CLOCK_SAMPLES];
+  int clock_sample_count;
+  int clock_sample_next;
   /* Audio packet queue */
   struct audio_queue_entry audio_queue[AUDIO_QUEUE_SIZE];
   int audio_queue_head;
@@ -47,57 +160,621 @@ static uint64_t now_ms(void) {
   return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
 }
 
-static void reset_assembly(struct udp_receiver *rx) {
-  rx->frame_id = 0;
-  rx->total_size = 0;
-  rx->chunk_count = 0;
-  rx->received_count = 0;
-  rx->assembling = 0;
-  rx->frame_ready = 0;
-  rx->last_update_ms = 0;
-  if (rx->chunk_received) {
-    memset(rx->chunk_received, 0, rx->chunk_capacity);
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static uint64_t join_u64(uint32_t hi, uint32_t lo) {
+  return (uint64_t)ntohl(hi) << 32 | ntohl(lo);
+}
+
+/* Frame ids wrap; compare them as serial numbers */
+static int frame_newer(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) > 0;
+}
+
+static void reset_slot(struct reassembly_slot *slot) {
+  if (slot->buffer) {
+    atomic_store_explicit(&slot->buffer->in_use, 0, memory_order_release);
+    slot->buffer = NULL;
+    slot->data = NULL;
   }
+  slot->active = 0;
+  slot->frame_id = 0;
+  slot->total_size = 0;
+  slot->chunk_count = 0;
+  slot->chunk_size = 0;
+  slot->received_count = 0;
+  slot->last_update_ms = 0;
+  slot->fec_groups = 0;
+  slot->fec_parity = 0;
+  slot->fec_used = 0;
+  slot->nack_rounds = 0;
+  slot->last_nack_ms = 0;
+  slot->chunks_arrived = 0;
+  slot->bytes_arrived = 0;
+  slot->first_arrival_us = 0;
+  slot->last_arrival_us = 0;
 }
 
-static int ensure_capacity(struct udp_receiver *rx, uint32_t total_size,
-                           uint16_t chunk_count) {
-  if (total_size > rx->data_capacity) {
-    uint8_t *new_data = realloc(rx->data, total_size);
-    if (!new_data) {
+/* Take a free pool buffer of at least size bytes, preferring one that is
+ * already big enough */
+static struct pool_buffer *acquire_buffer(struct udp_receiver *rx,
+                                          size_t size) {
+  struct pool_buffer *buf = NULL;
+  for (int i = 0; i < FRAME_POOL_SIZE; ++i) {
+    struct pool_buffer *b = &rx->pool[i];
+    if (atomic_load_explicit(&b->in_use, memory_order_acquire)) {
+      continue;
+    }
+    if (b->capacity >= size) {
+      buf = b;
+      break;
+    }
+    if (!buf) {
+      buf = b;
+    }
+  }
+  if (!buf) {
+    return NULL;
+  }
+
+  if (buf->capacity < size) {
+    uint8_t *data = realloc(buf->data, size);
+    if (!data) {
       fprintf(stderr, "realloc frame buffer failed\n");
-      return -1;
+      return NULL;
     }
-    rx->data = new_data;
-    rx->data_capacity = total_size;
+    buf->data = data;
+    buf->capacity = size;
   }
+  atomic_store_explicit(&buf->in_use, 1, memory_order_relaxed);
+  return buf;
+}
 
-  if (chunk_count > rx->chunk_capacity) {
-    uint8_t *new_map = realloc(rx->chunk_received, chunk_count);
+static int ensure_capacity(struct reassembly_slot *slot, uint16_t chunk_count) {
+  if (chunk_count > slot->chunk_capacity) {
+    uint8_t *new_map = realloc(slot->chunk_received, chunk_count);
     if (!new_map) {
       fprintf(stderr, "realloc chunk map failed\n");
       return -1;
     }
-    rx->chunk_received = new_map;
-    rx->chunk_capacity = chunk_count;
+    slot->chunk_received = new_map;
+    slot->chunk_capacity = chunk_count;
   }
-  memset(rx->chunk_received, 0, rx->chunk_capacity);
+  memset(slot->chunk_received, 0, slot->chunk_capacity);
   return 0;
 }
 
+static int ensure_parity_capacity(struct reassembly_slot *slot, size_t rows,
+                                  size_t chunk_size) {
+  if (rows * chunk_size > slot->parity_capacity) {
+    uint8_t *parity = realloc(slot->parity, rows * chunk_size);
+    if (!parity) {
+      fprintf(stderr, "realloc parity buffer failed\n");
+      return -1;
+    }
+    slot->parity = parity;
+    slot->parity_capacity = rows * chunk_size;
+  }
+
+  if (rows > slot->parity_map_capacity) {
+    uint8_t *map = realloc(slot->parity_received, rows);
+    if (!map) {
+      fprintf(stderr, "realloc parity map failed\n");
+      return -1;
+    }
+    slot->parity_received = map;
+    slot->parity_map_capacity = rows;
+  }
+  memset(slot->parity_received, 0, slot->parity_map_capacity);
+  return 0;
+}
+
+/* Find the slot assembling frame_id, or claim one for it. Returns NULL if
+ * the frame is already superseded or cannot be stored. */
+static struct reassembly_slot *find_slot(struct udp_receiver *rx,
+                                         uint32_t frame_id,
+                                         uint32_t total_size,
+                                         uint16_t chunk_count,
+                                         uint16_t chunk_size) {
+  if (rx->have_newest && !frame_newer(frame_id, rx->newest_id)) {
+    if (rx->newest_id - frame_id < FRAME_ID_RESTART_GAP) {
+      return NULL; /* Leftover of a frame already shown or skipped */
+    }
+    /* Streamer restarted with fresh frame ids */
+    for (int i = 0; i < REASSEMBLY_SLOTS; ++i) {
+      reset_slot(&rx->slots[i]);
+    }
+    rx->have_newest = 0;
+  }
+
+  struct reassembly_slot *slot = NULL;
+  for (int i = 0; i < REASSEMBLY_SLOTS; ++i) {
+    struct reassembly_slot *s = &rx->slots[i];
+    if (s->active && s->frame_id == frame_id) {
+      if (s->total_size == total_size && s->chunk_count == chunk_count &&
+          s->chunk_size == chunk_size) {
+        return s;
+      }
+      slot = s; /* Inconsistent geometry: start over */
+      break;
+    }
+  }
+
+  if (!slot) {
+    /* A free slot, else evict the oldest frame if this one is newer */
+    for (int i = 0; i < REASSEMBLY_SLOTS; ++i) {
+      struct reassembly_slot *s = &rx->slots[i];
+      if (!s->active) {
+        slot = s;
+        break;
+      }
+      if (!slot || frame_newer(slot->frame_id, s->frame_id)) {
+        slot = s;
+      }
+    }
+    if (slot->active && !frame_newer(frame_id, slot->frame_id)) {
+      return NULL;
+    }
+  }
+
+  if (slot->active && slot->frame_id != frame_id) {
+    metric_inc(rx->skipped);
+  }
+  reset_slot(slot);
+  if (ensure_capacity(slot, chunk_count) != 0) {
+    return NULL;
+  }
+  slot->buffer = acquire_buffer(rx, total_size);
+  if (!slot->buffer) {
+    return NULL;
+  }
+  slot->data = slot->buffer->data;
+  slot->frame_id = frame_id;
+  slot->total_size = total_size;
+  slot->chunk_count = chunk_count;
+  slot->chunk_size = chunk_size;
+  slot->active = 1;
+  return slot;
+}
+
+/* Frame geometry from a packet header, checked before it sizes anything:
+ * the chunks must exactly hold the frame, so every chunk but the last is
+ * chunk_size bytes and the last is 1 to chunk_size bytes */
+static int geometry_valid(uint32_t total_size, uint16_t chunk_count,
+                          uint16_t chunk_size) {
+  return total_size > 0 && total_size <= WLCAST_MAX_FRAME_SIZE &&
+         chunk_size > 0 && chunk_size <= WLCAST_UDP_CHUNK_SIZE &&
+         chunk_count == (total_size + chunk_size - 1u) / chunk_size;
+}
+
+static size_t chunk_length(const struct reassembly_slot *slot,
+                           uint32_t index) {
+  if (index + 1u == slot->chunk_count) {
+    return slot->total_size - (size_t)index * slot->chunk_size;
+  }
+  return slot->chunk_size;
+}
+
+/* Rebuild the missing chunks of group if enough of its parity arrived */
+static void recover_group(struct udp_receiver *rx,
+                          struct reassembly_slot *slot, uint32_t group) {
+  uint32_t groups = slot->fec_groups;
+  uint32_t members = fec_group_members(slot->chunk_count, groups, group);
+  uint32_t positions[FEC_MAX_PARITY];
+  uint32_t rows[FEC_MAX_PARITY];
+  uint32_t missing = 0;
+
+  for (uint32_t pos = 0; pos < members; ++pos) {
+    if (!slot->chunk_received[group + pos * groups]) {
+      if (missing == slot->fec_parity) {
+        return; /* More lost than parity can cover */
+      }
+      positions[missing++] = pos;
+    }
+  }
+  if (missing == 0) {
+    return;
+  }
+
+  uint8_t *parity =
+      slot->parity + (size_t)group * slot->fec_parity * slot->chunk_size;
+  uint32_t have = 0;
+  for (uint32_t j = 0; j < slot->fec_parity && have < missing; ++j) {
+    if (slot->parity_received[group * slot->fec_parity + j]) {
+      rows[have++] = j;
+    }
+  }
+  if (have < missing) {
+    return;
+  }
+
+  /* Remove the received chunks from the parity rows, leaving only the
+   * contribution of the lost ones. The group is complete afterwards, so
+   * the parity buffers can be used in place. */
+  uint8_t *syndromes[FEC_MAX_PARITY];
+  uint8_t *rebuilt[FEC_MAX_PARITY];
+  for (uint32_t k = 0; k < missing; ++k) {
+    syndromes[k] = parity + (size_t)rows[k] * slot->chunk_size;
+    rebuilt[k] = rx->fec_scratch + (size_t)k * slot->chunk_size;
+  }
+  for (uint32_t pos = 0; pos < members; ++pos) {
+    uint32_t index = group + pos * groups;
+    if (!slot->chunk_received[index]) {
+      continue;
+    }
+    const uint8_t *chunk = slot->data + (size_t)index * slot->chunk_size;
+    for (uint32_t k = 0; k < missing; ++k) {
+      fec_accumulate(syndromes[k], chunk, chunk_length(slot, index),
+                     fec_coef(rows[k], pos));
+    }
+  }
+
+  if (fec_solve(syndromes, rows, positions, missing, slot->chunk_size,
+                rebuilt) != 0) {
+    return;
+  }
+  for (uint32_t k = 0; k < missing; ++k) {
+    uint32_t index = group + positions[k] * groups;
+    memcpy(slot->data + (size_t)index * slot->chunk_size, rebuilt[k],
+           chunk_length(slot, index));
+    slot->chunk_received[index] = 1;
+    slot->received_count++;
+  }
+  slot->fec_used = 1;
+}
+
+static void mark_received(struct udp_receiver *rx,
+                          struct reassembly_slot *slot, uint16_t index,
+                          uint64_t now) {
+  if (slot->chunk_received[index]) {
+    return;
+  }
+  slot->chunk_received[index] = 1;
+  slot->received_count++;
+  slot->chunks_arrived++;
+  slot->last_update_ms = now;
+  rx->last_slot = slot;
+  rx->last_frame_id = slot->frame_id;
+  rx->last_index = index;
+  if (slot->fec_groups) {
+    recover_group(rx, slot, index % slot->fec_groups);
+  }
+}
+
+static struct reassembly_slot *handle_chunk(
+    struct udp_receiver *rx, const struct wlcast_udp_header *header,
+    const uint8_t *payload, size_t payload_len, uint64_t now) {
+  uint32_t frame_id = ntohl(header->frame_id);
+  uint32_t total_size = ntohl(header->total_size);
+  uint16_t chunk_index = ntohs(header->chunk_index);
+  uint16_t chunk_count = ntohs(header->chunk_count);
+  uint16_t payload_size = ntohs(header->payload_size);
+  uint16_t chunk_size = ntohs(header->chunk_size);
+  if (chunk_size == 0) {
+    chunk_size = WLCAST_UDP_CHUNK_SIZE;
+  }
+
+  if (!geometry_valid(total_size, chunk_count, chunk_size) ||
+      chunk_index >= chunk_count) {
+    return NULL;
+  }
+  if (payload_size == 0 || payload_size > chunk_size) {
+    return NULL;
+  }
+
+  if (payload_size > payload_len) {
+    return NULL;
+  }
+
+  size_t offset = (size_t)chunk_index * chunk_size;
+  if (offset + payload_size > total_size) {
+    return NULL;
+  }
+
+  struct reassembly_slot *slot =
+      find_slot(rx, frame_id, total_size, chunk_count, chunk_size);
+  if (!slot) {
+    return NULL;
+  }
+
+  if (!slot->chunk_received[chunk_index]) {
+    memcpy(slot->data + offset, payload, payload_size);
+    mark_received(rx, slot, chunk_index, now);
+  }
+  return slot;
+}
+
+/* An answered clock probe. With t1..t4 the probe's send, the streamer's
+ * receive and send, and our receive time, the streamer is ahead of us by
+ * ((t2 - t1) + (t3 - t4)) / 2, assuming the path is equally fast both
+ * ways. */
+static void handle_clock_reply(struct udp_receiver *rx, const uint8_t *packet,
+                               size_t n) {
+  struct wlcast_clock_packet clock;
+  if (n != sizeof(clock)) {
+    return;
+  }
+  memcpy(&clock, packet, sizeof(clock));
+  int64_t t1 = (int64_t)join_u64(clock.viewer_send_hi, clock.viewer_send_lo);
+  int64_t t2 = (int64_t)join_u64(clock.streamer_recv_hi, clock.streamer_recv_lo);
+  int64_t t3 = (int64_t)join_u64(clock.streamer_send_hi, clock.streamer_send_lo);
+  int64_t t4 = (int64_t)now_us();
+  int64_t rtt = (t4 - t1) - (t3 - t2);
+  if (t1 > t4 || rtt < 0) {
+    return;
+  }
+
+  struct clock_sample *sample = &rx->clock_samples[rx->clock_sample_next];
+  sample->offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+  sample->rtt_us = (uint64_t)rtt;
+  rx->clock_sample_next = (rx->clock_sample_next + 1) % CLOCK_SAMPLES;
+  if (rx->clock_sample_count < CLOCK_SAMPLES) {
+    rx->clock_sample_count++;
+  }
+}
+
+static struct reassembly_slot *handle_parity(struct udp_receiver *rx,
+                                             const uint8_t *packet, size_t n,
+                                             uint64_t now) {
+  if (n < sizeof(struct wlcast_fec_header)) {
+    return NULL;
+  }
+  struct wlcast_fec_header header;
+  memcpy(&header, packet, sizeof(header));
+
+  uint32_t frame_id = ntohl(header.frame_id);
+  uint32_t total_size = ntohl(header.total_size);
+  uint16_t chunk_count = ntohs(header.chunk_count);
+  uint16_t chunk_size = ntohs(header.chunk_size);
+  uint16_t group_count = ntohs(header.group_count);
+  uint16_t group = ntohs(header.group);
+  uint16_t payload_size = ntohs(header.payload_size);
+  uint8_t parity_index = header.parity_index;
+  uint8_t parity_count = header.parity_count;
+  if (chunk_size == 0) {
+    chunk_size = WLCAST_UDP_CHUNK_SIZE;
+  }
+
+  if (!geometry_valid(total_size, chunk_count, chunk_size)) {
+    return NULL;
+  }
+  if (group_count == 0 || group_count > chunk_count || group >= group_count ||
+      fec_group_members(chunk_count, group_count, 0) > FEC_MAX_GROUP) {
+    return NULL;
+  }
+  if (parity_count == 0 || parity_count > FEC_MAX_PARITY ||
+      parity_index >= parity_count) {
+    return NULL;
+  }
+  if (payload_size == 0 || payload_size > chunk_size ||
+      sizeof(header) + payload_size > n) {
+    return NULL;
+  }
+
+  struct reassembly_slot *slot =
+      find_slot(rx, frame_id, total_size, chunk_count, chunk_size);
+  if (!slot) {
+    return NULL;
+  }
+  if (slot->fec_groups == 0) {
+    if (ensure_parity_capacity(slot, (size_t)group_count * parity_count,
+                               chunk_size) != 0) {
+      return NULL;
+    }
+    slot->fec_groups = group_count;
+    slot->fec_parity = parity_count;
+  } else if (group_count != slot->fec_groups ||
+             parity_count != slot->fec_parity) {
+    return NULL;
+  }
+
+  size_t row = (size_t)group * parity_count + parity_index;
+  if (slot->parity_received[row]) {
+    return slot;
+  }
+  uint8_t *dst = slot->parity + row * chunk_size;
+  memcpy(dst, packet + sizeof(header), payload_size);
+  memset(dst + payload_size, 0, chunk_size - payload_size);
+  slot->parity_received[row] = 1;
+  slot->last_update_ms = now;
+  recover_group(rx, slot, group);
+  return slot;
+}
+
+/* Tell the streamer how the frame's packets arrived, for its congestion
+ * control. Streamers without it ignore the report. */
+static void send_report(struct udp_receiver *rx,
+                        const struct reassembly_slot *slot) {
+  struct wlcast_receive_report report;
+  report.magic = htonl(WLCAST_REPORT_MAGIC);
+  report.frame_id = htonl(slot->frame_id);
+  report.first_arrival_us = htonl(slot->first_arrival_us);
+  report.last_arrival_us = htonl(slot->last_arrival_us);
+  report.bytes = htonl(slot->bytes_arrived);
+  report.chunks_received = htons(slot->chunks_arrived);
+  report.chunk_count = htons(slot->chunk_count);
+  sendto(rx->fd, &report, sizeof(report), 0,
+         (struct sockaddr *)&rx->streamer_addr, sizeof(rx->streamer_addr));
+}
+
+/* Hand a complete frame to the caller and drop every older frame still in
+ * progress: showing it now would go backwards. */
+static void deliver(struct udp_receiver *rx, struct reassembly_slot *slot,
+                    struct frame_buffer *out) {
+  send_report(rx, slot);
+  out->data = slot->data;
+  out->size = slot->total_size;
+  out->frame_id = slot->frame_id;
+  out->complete_us = now_us();
+  memset(&out->timing, 0, sizeof(out->timing));
+
+  /* Streamers that have seen our clock probes put timing in front */
+  struct wlcast_frame_timing timing;
+  if (out->size > sizeof(timing)) {
+    memcpy(&timing, out->data, sizeof(timing));
+    if (ntohl(timing.magic) == WLCAST_TIMING_MAGIC) {
+      out->timing.valid = 1;
+      out->timing.capture_time_us =
+          join_u64(timing.capture_time_hi, timing.capture_time_lo);
+      out->timing.capture_us = ntohl(timing.capture_us);
+      out->timing.convert_us = ntohl(timing.convert_us);
+      out->timing.encode_us = ntohl(timing.encode_us);
+      out->timing.queue_us = ntohl(timing.queue_us);
+      out->data += sizeof(timing);
+      out->size -= sizeof(timing);
+    }
+  }
+
+  /* The caller owns the buffer until udp_receiver_release */
+  slot->buffer = NULL;
+  slot->data = NULL;
+
+  rx->newest_id = slot->frame_id;
+  rx->have_newest = 1;
+  if (slot->fec_used) {
+    rx->fec_recovered++;
+  }
+  slot->active = 0;
+
+  for (int i = 0; i < REASSEMBLY_SLOTS; ++i) {
+    struct reassembly_slot *s = &rx->slots[i];
+    if (s->active && !frame_newer(s->frame_id, rx->newest_id)) {
+      reset_slot(s);
+      metric_inc(rx->skipped);
+    }
+  }
+}
+
+/* Ask the streamer to resend the chunks still missing from a frame. Chunks
+ * are sent in one burst, so a frame that has gone quiet, or whose trailing
+ * parity or successor already arrived, has lost the rest. */
+static void send_nack(struct udp_receiver *rx, struct reassembly_slot *slot,
+                      int superseded, uint64_t now) {
+  if (slot->nack_rounds >= NACK_MAX_ROUNDS) {
+    return;
+  }
+  if (slot->nack_rounds == 0) {
+    if (!superseded && slot->fec_groups == 0 &&
+        now - slot->last_update_ms < NACK_IDLE_MS) {
+      return;
+    }
+  } else if (now - slot->last_nack_ms < NACK_RETRY_MS) {
+    return;
+  }
+
+  uint8_t packet[WLCAST_NACK_HEADER_SIZE + WLCAST_NACK_MAX_BITS / 8];
+  uint32_t index = 0;
+  for (int sent = 0; sent < NACK_MAX_PACKETS; ++sent) {
+    while (index < slot->chunk_count && slot->chunk_received[index]) {
+      index++;
+    }
+    if (index >= slot->chunk_count) {
+      break;
+    }
+
+    uint32_t first = index;
+    uint32_t bits = slot->chunk_count - first;
+    if (bits > WLCAST_NACK_MAX_BITS) {
+      bits = WLCAST_NACK_MAX_BITS;
+    }
+    uint8_t *bitmap = packet + WLCAST_NACK_HEADER_SIZE;
+    memset(bitmap, 0, (bits + 7) / 8);
+    uint32_t used = 0;
+    for (uint32_t k = 0; k < bits; ++k) {
+      if (!slot->chunk_received[first + k]) {
+        bitmap[k / 8] |= (uint8_t)(1u << (k % 8));
+        used = k + 1;
+      }
+    }
+    index = first + bits;
+
+    struct wlcast_nack_header header;
+    header.magic = htonl(WLCAST_NACK_MAGIC);
+    header.frame_id = htonl(slot->frame_id);
+    header.first_chunk = htons((uint16_t)first);
+    header.bit_count = htons((uint16_t)used);
+    memcpy(packet, &header, sizeof(header));
+
+    sendto(rx->fd, packet, sizeof(header) + (used + 7) / 8, 0,
+           (struct sockaddr *)&rx->streamer_addr, sizeof(rx->streamer_addr));
+  }
+
+  slot->nack_rounds++;
+  slot->last_nack_ms = now;
+}
+
+static void send_nacks(struct udp_receiver *rx, uint64_t now) {
+  if (!rx->streamer_known) {
+    return;
+  }
+
+  for (int i = 0; i < REASSEMBLY_SLOTS; ++i) {
+    struct reassembly_slot *slot = &rx->slots[i];
+    if (!slot->active || slot->received_count == slot->chunk_count) {
+      continue;
+    }
+    int superseded = 0;
+    for (int j = 0; j < REASSEMBLY_SLOTS; ++j) {
+      if (rx->slots[j].active &&
+          frame_newer(rx->slots[j].frame_id, slot->frame_id)) {
+        superseded = 1;
+        break;
+      }
+    }
+    send_nack(rx, slot, superseded, now);
+  }
+}
+
 int udp_receiver_init(struct udp_receiver **out, uint16_t port) {
   struct udp_receiver *rx = calloc(1, sizeof(*rx));
   if (!rx) {
     return -1;
   }
 
+  for (int i = 0; i < FRAME_POOL_SIZE; ++i) {
+    atomic_init(&rx->pool[i].in_use, 0);
+  }
+  fec_init();
+  rx->timeouts = metrics_counter("wlcast_view_reassembly_timeouts_total",
+                                 "Frames dropped because chunks stopped arriving");
+  rx->skipped = metrics_counter("wlcast_view_frames_skipped_total",
+                                "Incomplete frames dropped for a newer one");
+  rx->fec_scratch = malloc((size_t)FEC_MAX_PARITY * WLCAST_UDP_CHUNK_SIZE);
+  rx->bounce = malloc((size_t)RECV_BATCH * RECV_PAYLOAD_MAX);
+  if (!rx->fec_scratch || !rx->bounce) {
+    free(rx->fec_scratch);
+    free(rx->bounce);
+    free(rx);
+    return -1;
+  }
+
   rx->fd = socket(AF_INET, SOCK_DGRAM, 0);
   if (rx->fd < 0) {
     perror("socket");
+    free(rx->fec_scratch);
+    free(rx->bounce);
     free(rx);
     return -1;
   }
 
+  /* A whole frame arrives as one burst; room for a few large ones (capped
+   * by net.core.rmem_max) */
+  int rcvbuf = 4 * 1024 * 1024;
+  if (setsockopt(rx->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+    perror("setsockopt SO_RCVBUF");
+  }
+
+  /* Arrival times for receive reports, unaffected by when we get to read */
+  int enable = 1;
+  if (setsockopt(rx->fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+                 sizeof(enable)) < 0) {
+    perror("setsockopt SO_TIMESTAMPNS");
+  }
+
   struct sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
@@ -107,6 +784,8 @@ int udp_receiver_init(struct udp_receiver **out, uint16_t port) {
   if (bind(rx->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
     perror("bind");
     close(rx->fd);
+    free(rx->fec_scratch);
+    free(rx->bounce);
     free(rx);
     return -1;
   }
@@ -116,126 +795,241 @@ int udp_receiver_init(struct udp_receiver **out, uint16_t port) {
     fcntl(rx->fd, F_SETFL, flags | O_NONBLOCK);
   }
 
-  reset_assembly(rx);
   *out = rx;
   return 0;
 }
 
-int udp_receiver_poll(struct udp_receiver *rx, struct frame_buffer *out) {
-  if (rx->frame_ready) {
-    out->data = rx->data;
-    out->size = rx->total_size;
-    rx->frame_ready = 0;
-    return 1;
-  }
+/* Receive up to RECV_BATCH datagrams with one recvmmsg. Chunks mostly
+ * arrive in order, so the payload of datagram k is steered straight into
+ * the frame buffer at the k-th missing chunk after the last one stored. A
+ * datagram that turns out to be something else is moved to its bounce
+ * buffer before anything is processed, since its predicted region may be
+ * another datagram's real destination. Returns the batch size, 0 if
+ * nothing was pending, -1 on error. */
+static int receive_batch(struct udp_receiver *rx) {
+  struct reassembly_slot *slot = rx->last_slot;
+  int predicting = slot && slot->active && slot->frame_id == rx->last_frame_id;
+  uint32_t next = rx->last_index + 1;
 
-  uint64_t now = now_ms();
-  if (rx->assembling && now - rx->last_update_ms > 200u) {
-    reset_assembly(rx);
-  }
+  for (int k = 0; k < RECV_BATCH; ++k) {
+    struct recv_entry *e = &rx->entries[k];
+    uint8_t *bounce = rx->bounce + (size_t)k * RECV_PAYLOAD_MAX;
+    struct iovec *iov = rx->iov[k];
+    size_t iovlen;
 
-  uint8_t packet[sizeof(struct wlcast_udp_header) + WLCAST_UDP_CHUNK_SIZE];
-  while (1) {
-    struct sockaddr_in sender_addr;
-    socklen_t sender_len = sizeof(sender_addr);
-    ssize_t n = recvfrom(rx->fd, packet, sizeof(packet), 0,
-                         (struct sockaddr *)&sender_addr, &sender_len);
-    if (n < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        break;
+    if (predicting) {
+      while (next < slot->chunk_count && slot->chunk_received[next]) {
+        next++;
       }
-      perror("recvfrom");
-      return -1;
+      predicting = next < slot->chunk_count;
     }
 
-    /* Always update streamer address for ACKs (handles streamer restart) */
-    rx->streamer_addr = sender_addr;
-    rx->streamer_known = 1;
-
-    if (n < (ssize_t)sizeof(struct wlcast_udp_header)) {
-      continue;
+    iov[0].iov_base = &rx->headers[k];
+    iov[0].iov_len = sizeof(rx->headers[k]);
+    if (predicting) {
+      e->slot = slot;
+      e->frame_id = slot->frame_id;
+      e->index = (uint16_t)next;
+      e->len = chunk_length(slot, next);
+      iov[1].iov_base = slot->data + (size_t)next * slot->chunk_size;
+      iov[1].iov_len = e->len;
+      iov[2].iov_base = bounce + e->len;
+      iov[2].iov_len = RECV_PAYLOAD_MAX - e->len;
+      iovlen = 3;
+      next++;
+    } else {
+      e->slot = NULL;
+      e->len = 0;
+      iov[1].iov_base = bounce;
+      iov[1].iov_len = RECV_PAYLOAD_MAX;
+      iovlen = 2;
     }
+    e->hit = 0;
 
-    struct wlcast_udp_header header;
-    memcpy(&header, packet, sizeof(header));
+    struct msghdr *msg = &rx->msgs[k].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &rx->addrs[k];
+    msg->msg_namelen = sizeof(rx->addrs[k]);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = iovlen;
+    msg->msg_control = rx->control[k].buf;
+    msg->msg_controllen = sizeof(rx->control[k].buf);
+  }
 
-    uint32_t magic = ntohl(header.magic);
+  int n;
+  do {
+    n = recvmmsg(rx->fd, rx->msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+    perror("recvmmsg");
+    return -1;
+  }
 
-    /* Check for audio packet */
-    if (magic == WLCAST_AUDIO_MAGIC) {
-      /* Queue audio packet for later polling */
-      int next_tail = (rx->audio_queue_tail + 1) % AUDIO_QUEUE_SIZE;
-      if (next_tail != rx->audio_queue_head) {
-        /* Queue not full */
-        struct audio_queue_entry *entry = &rx->audio_queue[rx->audio_queue_tail];
-        size_t copy_size = (size_t)n < sizeof(entry->data) ? (size_t)n : sizeof(entry->data);
-        memcpy(entry->data, packet, copy_size);
-        entry->size = copy_size;
-        rx->audio_queue_tail = next_tail;
+  /* Without a kernel timestamp, the batch's receive time will do; it is
+   * on the same clock */
+  struct timespec batch_ts;
+  clock_gettime(CLOCK_REALTIME, &batch_ts);
+  for (int k = 0; k < n; ++k) {
+    const struct timespec *ts = &batch_ts;
+    struct msghdr *msg = &rx->msgs[k].msg_hdr;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+        ts = (const struct timespec *)CMSG_DATA(c);
       }
-      continue;
     }
+    rx->arrival_us[k] = (uint32_t)((uint64_t)ts->tv_sec * 1000000u +
+                                   (uint64_t)ts->tv_nsec / 1000u);
+  }
 
-    if (magic != WLCAST_UDP_MAGIC) {
+  for (int k = 0; k < n; ++k) {
+    struct recv_entry *e = &rx->entries[k];
+    if (!e->slot) {
       continue;
     }
+    const struct wlcast_udp_header *h = &rx->headers[k];
+    size_t len = rx->msgs[k].msg_len;
+    e->hit = len == sizeof(*h) + e->len &&
+             !(rx->msgs[k].msg_hdr.msg_flags & MSG_TRUNC) &&
+             ntohl(h->magic) == WLCAST_UDP_MAGIC &&
+             ntohl(h->frame_id) == e->frame_id &&
+             ntohs(h->chunk_index) == e->index &&
+             ntohs(h->payload_size) == e->len &&
+             ntohl(h->total_size) == e->slot->total_size &&
+             ntohs(h->chunk_count) == e->slot->chunk_count;
+    if (!e->hit && len > sizeof(*h)) {
+      size_t placed = len - sizeof(*h);
+      if (placed > e->len) {
+        placed = e->len;
+      }
+      memcpy(rx->bounce + (size_t)k * RECV_PAYLOAD_MAX,
+             e->slot->data + (size_t)e->index * e->slot->chunk_size, placed);
+    }
+  }
 
-    uint32_t frame_id = ntohl(header.frame_id);
-    uint32_t total_size = ntohl(header.total_size);
-    uint16_t chunk_index = ntohs(header.chunk_index);
-    uint16_t chunk_count = ntohs(header.chunk_count);
-    uint16_t payload_size = ntohs(header.payload_size);
+  rx->batch_count = n;
+  rx->batch_pos = 0;
+  return n;
+}
 
-    if (total_size == 0 || total_size > WLCAST_MAX_FRAME_SIZE) {
-      continue;
-    }
-    if (chunk_count == 0 || chunk_index >= chunk_count) {
-      continue;
-    }
-    if (payload_size == 0 || payload_size > WLCAST_UDP_CHUNK_SIZE) {
-      continue;
+/* Process datagram k of the current batch. Returns the frame it
+ * contributed to, if any. */
+static struct reassembly_slot *process_message(struct udp_receiver *rx, int k,
+                                               uint64_t now) {
+  const struct sockaddr_in *sender_addr = &rx->addrs[k];
+  struct recv_entry *e = &rx->entries[k];
+
+  /* A new source port means the streamer restarted with fresh frame ids */
+  if (rx->streamer_known &&
+      (sender_addr->sin_port != rx->streamer_addr.sin_port ||
+       sender_addr->sin_addr.s_addr != rx->streamer_addr.sin_addr.s_addr)) {
+    for (int i = 0; i < REASSEMBLY_SLOTS; ++i) {
+      reset_slot(&rx->slots[i]);
     }
+    rx->have_newest = 0;
+    rx->clock_sample_count = 0;
+  }
 
-    if (sizeof(header) + payload_size > (size_t)n) {
-      continue;
+  /* Always update streamer address for ACKs (handles streamer restart) */
+  rx->streamer_addr = *sender_addr;
+  rx->streamer_known = 1;
+
+  size_t n = rx->msgs[k].msg_len;
+  if (n < sizeof(struct wlcast_udp_header) ||
+      (rx->msgs[k].msg_hdr.msg_flags & MSG_TRUNC)) {
+    return NULL;
+  }
+
+  if (e->hit) {
+    /* Payload is already in place, unless the frame was dropped meanwhile */
+    struct reassembly_slot *slot = e->slot;
+    if (!slot->active || slot->frame_id != e->frame_id) {
+      return NULL;
     }
+    mark_received(rx, slot, e->index, now);
+    return slot;
+  }
 
-    if (!rx->assembling || frame_id != rx->frame_id ||
-        total_size != rx->total_size || chunk_count != rx->chunk_count) {
-      reset_assembly(rx);
-      if (ensure_capacity(rx, total_size, chunk_count) != 0) {
-        reset_assembly(rx);
-        continue;
-      }
-      rx->frame_id = frame_id;
-      rx->total_size = total_size;
-      rx->chunk_count = chunk_count;
-      rx->assembling = 1;
+  const struct wlcast_udp_header *header = &rx->headers[k];
+  const uint8_t *payload = rx->bounce + (size_t)k * RECV_PAYLOAD_MAX;
+  size_t payload_len = n - sizeof(*header);
+  uint32_t magic = ntohl(header->magic);
+
+  if (magic == WLCAST_UDP_MAGIC) {
+    return handle_chunk(rx, header, payload, payload_len, now);
+  }
+
+  /* Other packets are parsed from one contiguous buffer */
+  memcpy(rx->packet, header, sizeof(*header));
+  memcpy(rx->packet + sizeof(*header), payload, payload_len);
+
+  /* Check for audio packet */
+  if (magic == WLCAST_AUDIO_MAGIC) {
+    /* Queue audio packet for later polling */
+    int next_tail = (rx->audio_queue_tail + 1) % AUDIO_QUEUE_SIZE;
+    if (next_tail != rx->audio_queue_head) {
+      /* Queue not full */
+      struct audio_queue_entry *entry = &rx->audio_queue[rx->audio_queue_tail];
+      size_t copy_size = n < sizeof(entry->data) ? n : sizeof(entry->data);
+      memcpy(entry->data, rx->packet, copy_size);
+      entry->size = copy_size;
+      rx->audio_queue_tail = next_tail;
     }
+    return NULL;
+  }
 
-    size_t offset = (size_t)chunk_index * WLCAST_UDP_CHUNK_SIZE;
-    if (offset + payload_size > total_size) {
-      continue;
+  if (magic == WLCAST_FEC_MAGIC) {
+    return handle_parity(rx, rx->packet, n, now);
+  }
+  if (magic == WLCAST_CLOCK_MAGIC) {
+    handle_clock_reply(rx, rx->packet, n);
+  }
+  return NULL;
+}
+
+int udp_receiver_poll(struct udp_receiver *rx, struct frame_buffer *out) {
+  uint64_t now = now_ms();
+  for (int i = 0; i < REASSEMBLY_SLOTS; ++i) {
+    struct reassembly_slot *slot = &rx->slots[i];
+    if (slot->active && now - slot->last_update_ms > ASSEMBLY_TIMEOUT_MS) {
+      reset_slot(slot);
+      metric_inc(rx->timeouts);
     }
+  }
 
-    if (!rx->chunk_received[chunk_index]) {
-      memcpy(rx->data + offset, packet + sizeof(header), payload_size);
-      rx->chunk_received[chunk_index] = 1;
-      rx->received_count++;
-      rx->last_update_ms = now;
+  while (1) {
+    if (rx->batch_pos == rx->batch_count) {
+      int n = receive_batch(rx);
+      if (n < 0) {
+        return -1;
+      }
+      if (n == 0) {
+        break;
+      }
     }
 
-    if (rx->received_count == rx->chunk_count) {
-      rx->frame_ready = 1;
-      rx->assembling = 0;
-      out->data = rx->data;
-      out->size = rx->total_size;
-      out->frame_id = rx->frame_id;
-      rx->frame_ready = 0;
-      return 1;
+    /* A frame may complete mid-batch; the rest is kept for the next poll */
+    while (rx->batch_pos < rx->batch_count) {
+      int k = rx->batch_pos++;
+      struct reassembly_slot *slot = process_message(rx, k, now);
+      if (!slot) {
+        continue;
+      }
+      if (slot->bytes_arrived == 0) {
+        slot->first_arrival_us = rx->arrival_us[k];
+      }
+      slot->last_arrival_us = rx->arrival_us[k];
+      slot->bytes_arrived += rx->msgs[k].msg_len;
+      if (slot->received_count == slot->chunk_count) {
+        deliver(rx, slot, out);
+        return 1;
+      }
     }
   }
 
+  send_nacks(rx, now);
   return 0;
 }
 
@@ -251,6 +1045,38 @@ int udp_receiver_poll_audio(struct udp_receiver *rx, struct audio_packet *out) {
   return 1;
 }
 
+int udp_receiver_wait(struct udp_receiver *rx, int timeout_ms) {
+  if (rx->batch_pos < rx->batch_count) {
+    return 1;
+  }
+  struct pollfd pfd = {.fd = rx->fd, .events = POLLIN};
+  int ret = poll(&pfd, 1, timeout_ms);
+  if (ret < 0 && errno != EINTR) {
+    perror("poll");
+    return -1;
+  }
+  return ret > 0;
+}
+
+void udp_receiver_release(struct udp_receiver *rx,
+                          const struct frame_buffer *frame) {
+  for (int i = 0; i < FRAME_POOL_SIZE; ++i) {
+    struct pool_buffer *b = &rx->pool[i];
+    /* data may start past a timing header */
+    if (b->data && frame->data >= b->data &&
+        frame->data < b->data + b->capacity) {
+      atomic_store_explicit(&b->in_use, 0, memory_order_release);
+      return;
+    }
+  }
+}
+
+uint32_t udp_receiver_take_recovered(struct udp_receiver *rx) {
+  uint32_t recovered = rx->fec_recovered;
+  rx->fec_recovered = 0;
+  return recovered;
+}
+
 void udp_receiver_send_ack(struct udp_receiver *rx, uint32_t frame_id,
                            uint32_t viewer_fps) {
   if (!rx || !rx->streamer_known) {
@@ -264,6 +1090,35 @@ void udp_receiver_send_ack(struct udp_receiver *rx, uint32_t frame_id,
 
   sendto(rx->fd, &ack, sizeof(ack), 0, (struct sockaddr *)&rx->streamer_addr,
          sizeof(rx->streamer_addr));
+
+  uint64_t now = now_ms();
+  if (now - rx->last_probe_ms >= CLOCK_PROBE_INTERVAL_MS) {
+    struct wlcast_clock_packet probe;
+    memset(&probe, 0, sizeof(probe));
+    uint64_t t1 = now_us();
+    probe.magic = htonl(WLCAST_CLOCK_MAGIC);
+    probe.viewer_send_hi = htonl((uint32_t)(t1 >> 32));
+    probe.viewer_send_lo = htonl((uint32_t)t1);
+    sendto(rx->fd, &probe, sizeof(probe), 0,
+           (struct sockaddr *)&rx->streamer_addr, sizeof(rx->streamer_addr));
+    rx->last_probe_ms = now;
+  }
+}
+
+int udp_receiver_clock_offset(struct udp_receiver *rx, int64_t *offset_us) {
+  if (rx->clock_sample_count == 0) {
+    return 0;
+  }
+  /* The answer with the shortest round trip was least delayed by queues,
+   * so its midpoint estimate is the most accurate */
+  const struct clock_sample *best = &rx->clock_samples[0];
+  for (int i = 1; i < rx->clock_sample_count; ++i) {
+    if (rx->clock_samples[i].rtt_us < best->rtt_us) {
+      best = &rx->clock_samples[i];
+    }
+  }
+  *offset_us = best->offset_us;
+  return 1;
 }
 
 void udp_receiver_destroy(struct udp_receiver *rx) {
@@ -273,7 +1128,15 @@ void udp_receiver_destroy(struct udp_receiver *rx) {
   if (rx->fd >= 0) {
     close(rx->fd);
   }
-  free(rx->data);
-  free(rx->chunk_received);
+  for (int i = 0; i < FRAME_POOL_SIZE; ++i) {
+    free(rx->pool[i].data);
+  }
+  for (int i = 0; i < REASSEMBLY_SLOTS; ++i) {
+    free(rx->slots[i].chunk_received);
+    free(rx->slots[i].parity);
+    free(rx->slots[i].parity_received);
+  }
+  free(rx->fec_scratch);
+  free(rx->bounce);
   free(rx);
 }
@@ -6,10 +6,22 @@
 
 struct udp_receiver;
 
+/* Streamer-side timing sent with a frame (struct wlcast_frame_timing) */
+struct frame_timing {
+  int valid;
+  uint64_t capture_time_us; /* Streamer clock */
+  uint32_t capture_us;
+  uint32_t convert_us;
+  uint32_t encode_us;
+  uint32_t queue_us;
+};
+
 struct frame_buffer {
   uint8_t *data;
   size_t size;
   uint32_t frame_id;  /* Frame ID for ACK */
+  uint64_t complete_us; /* Reassembled, CLOCK_MONOTONIC */
+  struct frame_timing timing;
 };
 
 /* Audio packet buffer */
@@ -20,9 +32,22 @@ struct audio_packet {
 
 int udp_receiver_init(struct udp_receiver **out, uint16_t port);
 
-/* Poll for video frames. Returns 1 if frame ready, 0 if not, -1 on error */
+/* Poll for video frames. Returns 1 if frame ready, 0 if not, -1 on error.
+ * The frame's data belongs to the caller until udp_receiver_release. All
+ * other functions must be called from one thread. Every completed frame is
+ * also reported back to the streamer for its congestion control. */
 int udp_receiver_poll(struct udp_receiver *rx, struct frame_buffer *out);
 
+/* Hand a polled frame's buffer back for reuse. Safe from any thread. Only
+ * a couple of frames can be held at once; while they are, new frames are
+ * dropped. */
+void udp_receiver_release(struct udp_receiver *rx,
+                          const struct frame_buffer *frame);
+
+/* Block until packets are pending or timeout_ms passes. Returns 1 if there
+ * is something to poll, 0 on timeout, -1 on error. */
+int udp_receiver_wait(struct udp_receiver *rx, int timeout_ms);
+
 /* Poll for audio packets. Returns 1 if packet ready, 0 if not.
  * Audio packets are returned directly without assembly (single packet per frame).
  * Call this after udp_receiver_poll to process any pending audio packets. */
@@ -30,8 +55,16 @@ int udp_receiver_poll_audio(struct udp_receiver *rx, struct audio_packet *out);
 
 void udp_receiver_destroy(struct udp_receiver *rx);
 
-/* Send ACK for a received frame (call after displaying) */
+/* Frames completed with FEC-rebuilt chunks since the last call */
+uint32_t udp_receiver_take_recovered(struct udp_receiver *rx);
+
+/* Send ACK for a received frame (call once it is reassembled). A few times
+ * a second this also probes the streamer's clock. */
 void udp_receiver_send_ack(struct udp_receiver *rx, uint32_t frame_id,
                            uint32_t viewer_fps);
 
+/* Streamer clock minus ours, in microseconds, from the clock probes.
+ * Returns 1 with *offset_us set once a probe has been answered, else 0. */
+int udp_receiver_clock_offset(struct udp_receiver *rx, int64_t *offset_us);
+
 #endif
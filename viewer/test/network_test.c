@@ -0,0 +1,162 @@
+/* Self-check of the viewer's frame reassembly in viewer/network.c: feed it
+ * datagrams over loopback, including packets whose frame geometry does not
+ * add up, and check that only well-formed frames come out, intact.
+ *
+ * Build and run: make -C viewer check */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "network.h"
+#include "protocol.h"
+
+#define CHUNK 1400u
+#define FIRST_PORT 47900
+#define DRAIN_MS 100
+
+static unsigned int failures;
+static int tx_fd = -1;
+static struct sockaddr_in rx_addr;
+
+static void send_chunk(uint32_t frame_id, uint32_t total_size, uint16_t index,
+                       uint16_t chunk_count, const uint8_t *payload,
+                       uint16_t len) {
+    uint8_t packet[sizeof(struct wlcast_udp_header) + CHUNK];
+    struct wlcast_udp_header h = {
+        .magic = htonl(WLCAST_UDP_MAGIC),
+        .frame_id = htonl(frame_id),
+        .total_size = htonl(total_size),
+        .chunk_index = htons(index),
+        .chunk_count = htons(chunk_count),
+        .payload_size = htons(len),
+        .chunk_size = htons(CHUNK),
+    };
+    memcpy(packet, &h, sizeof(h));
+    memcpy(packet + sizeof(h), payload, len);
+    sendto(tx_fd, packet, sizeof(h) + len, 0, (struct sockaddr *)&rx_addr,
+           sizeof(rx_addr));
+}
+
+/* XOR parity (row 0) over every chunk of the frame, as one group */
+static void send_parity(uint32_t frame_id, uint32_t total_size,
+                        uint16_t chunk_count, const uint8_t *parity,
+                        uint16_t len) {
+    uint8_t packet[sizeof(struct wlcast_fec_header) + CHUNK];
+    struct wlcast_fec_header h = {
+        .magic = htonl(WLCAST_FEC_MAGIC),
+        .frame_id = htonl(frame_id),
+        .total_size = htonl(total_size),
+        .chunk_count = htons(chunk_count),
+        .chunk_size = htons(CHUNK),
+        .group_count = htons(1),
+        .group = htons(0),
+        .payload_size = htons(len),
+        .parity_index = 0,
+        .parity_count = 1,
+    };
+    memcpy(packet, &h, sizeof(h));
+    memcpy(packet + sizeof(h), parity, len);
+    sendto(tx_fd, packet, sizeof(h) + len, 0, (struct sockaddr *)&rx_addr,
+           sizeof(rx_addr));
+}
+
+/* Receive until the socket stays quiet. Returns the frames completed; the
+ * last one is copied to last (at most last_size bytes). */
+static int drain(struct udp_receiver *rx, uint32_t *last_id, uint8_t *last,
+                 size_t last_size, size_t *last_len) {
+    int frames = 0;
+    while (udp_receiver_wait(rx, DRAIN_MS) > 0) {
+        struct frame_buffer frame;
+        int got;
+        while ((got = udp_receiver_poll(rx, &frame)) > 0) {
+            frames++;
+            *last_id = frame.frame_id;
+            *last_len = frame.size;
+            memcpy(last, frame.data,
+                   frame.size < last_size ? frame.size : last_size);
+            udp_receiver_release(rx, &frame);
+        }
+        if (got < 0) {
+            break;
+        }
+    }
+    return frames;
+}
+
+static void expect(int ok, const char *what) {
+    printf("  %-56s %s\n", what, ok ? "ok" : "FAIL");
+    if (!ok) {
+        failures++;
+    }
+}
+
+int main(void) {
+    struct udp_receiver *rx = NULL;
+    uint16_t port = FIRST_PORT;
+    for (; port < FIRST_PORT + 20; port++) {
+        if (udp_receiver_init(&rx, port) == 0) {
+            break;
+        }
+    }
+    tx_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!rx || tx_fd < 0) {
+        fprintf(stderr, "Failed to set up loopback sockets\n");
+        return 1;
+    }
+    rx_addr.sin_family = AF_INET;
+    rx_addr.sin_port = htons(port);
+    rx_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    uint8_t frame[3 * CHUNK];
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)(i * 7 + 1);
+    }
+    uint8_t out[3 * CHUNK];
+    uint32_t out_id = 0;
+    size_t out_len = 0;
+
+    /* 100 bytes claiming two chunks: rebuilding "chunk 1" would have a
+     * negative length */
+    send_chunk(1, 100, 0, 2, frame, 100);
+    send_parity(1, 100, 2, frame, 100);
+    expect(drain(rx, &out_id, out, sizeof(out), &out_len) == 0,
+           "more chunks than the frame holds: rejected");
+
+    /* 3000 bytes claiming two chunks: the last would exceed a chunk */
+    uint8_t parity[CHUNK];
+    for (size_t i = 0; i < CHUNK; i++) {
+        parity[i] = frame[i] ^ frame[CHUNK + i];
+    }
+    send_chunk(2, 3000, 0, 2, frame, CHUNK);
+    send_parity(2, 3000, 2, parity, CHUNK);
+    expect(drain(rx, &out_id, out, sizeof(out), &out_len) == 0,
+           "fewer chunks than the frame needs: rejected");
+
+    /* Well-formed frame, middle chunk rebuilt from parity */
+    uint32_t total = 2 * CHUNK + 200;
+    memset(parity, 0, sizeof(parity));
+    for (size_t i = 0; i < total; i++) {
+        parity[i % CHUNK] ^= frame[i];
+    }
+    send_chunk(3, total, 0, 3, frame, CHUNK);
+    send_chunk(3, total, 2, 3, frame + 2 * CHUNK, 200);
+    send_parity(3, total, 3, parity, CHUNK);
+    int frames = drain(rx, &out_id, out, sizeof(out), &out_len);
+    expect(frames == 1 && out_id == 3 && out_len == total &&
+               memcmp(out, frame, total) == 0,
+           "valid frame with a lost chunk: rebuilt intact");
+
+    close(tx_fd);
+    udp_receiver_destroy(rx);
+    if (failures) {
+        printf("Network test FAILED: %u checks\n", failures);
+        return 1;
+    }
+    printf("Network test PASSED\n");
+    return 0;
+}